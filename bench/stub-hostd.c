@@ -0,0 +1,441 @@
+// stub-hostd.c - minimal hostd stand-in for benchmarking vim-cmd
+// Build: cc -Wall -Wextra -O2 -o stub-hostd stub-hostd.c   (POSIX only)
+//
+// Answers every command line with a framed reply of a configurable size
+// after a configurable delay. Replies on one connection go out in request
+// order, like hostd; connections are independent of each other.
+//
+//   stub-hostd [-p port] [-u socket] [-s bytes] [-d ms] [-l] [-b] [-m]
+//
+//   -p port     listen on 127.0.0.1:port
+//   -u socket   listen on a UNIX socket (both may be given)
+//   -s bytes    reply payload size (default 64)
+//   -d ms       per-request service delay (default 0)
+//   -l          legacy mode: bare, unframed replies
+//   -b          accept "hello proto=bin1" and switch to binary frames
+//   -m          accept "shm-offer" rings on UNIX sockets and reply through them
+//
+// A command of the form "size N" overrides the payload size for that reply.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_CLIENTS   1024
+#define RX_MAX        (64 * 1024)
+#define CHUNK_MAX     (64 * 1024)
+#define MAX_PENDING   256
+
+typedef struct {
+    uint64_t due;       /* when the reply may be sent */
+    size_t   size;      /* payload bytes */
+    uint16_t tag;       /* binary: request tag to echo */
+    int      hello;     /* protocol handshake reply */
+    int      shm;       /* ring offer reply: 1 accepted, -1 declined */
+} job_t;
+
+/* Shared-memory ring, laid out as in vim-cmd. */
+typedef struct {
+    uint32_t magic, version;
+    uint64_t size, head, tail;
+} ring_hdr_t;
+#define RING_MAGIC     0x31676e72u
+#define RING_HDR_SIZE  4096
+
+typedef struct {
+    int      fd;
+    char     rx[RX_MAX];
+    size_t   rx_len;
+    int      bin;       /* binary frames negotiated */
+    int      passed_fd; /* descriptor received with the last read, or -1 */
+    ring_hdr_t *ring;
+    size_t   ring_len;
+    uint64_t head;
+    job_t    jobs[MAX_PENDING];
+    int      jhead, jcount;
+    char    *tx;        /* encoded replies waiting to be written */
+    size_t   tx_off, tx_len, tx_cap;
+} client_t;
+
+static size_t   g_size = 64;
+static int      g_delay_ms = 0;
+static int      g_legacy = 0;
+static int      g_binary = 0;
+static int      g_shm = 0;
+static char     g_pattern[CHUNK_MAX];
+static client_t *g_clients[MAX_CLIENTS];
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_signal(int sig) { (void)sig; g_stop = 1; }
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void set_nonblock(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static int tx_append(client_t *c, const void *p, size_t n) {
+    if (c->tx_off == c->tx_len) c->tx_off = c->tx_len = 0;
+    if (c->tx_len + n > c->tx_cap) {
+        size_t ncap = c->tx_cap ? c->tx_cap : 65536;
+        while (ncap < c->tx_len + n) ncap *= 2;
+        char *nb = realloc(c->tx, ncap);
+        if (!nb) return -1;
+        c->tx = nb; c->tx_cap = ncap;
+    }
+    memcpy(c->tx + c->tx_len, p, n);
+    c->tx_len += n;
+    return 0;
+}
+
+static void bin_header(unsigned char *h, uint32_t len, int type, uint16_t tag) {
+    h[0] = (unsigned char)len; h[1] = (unsigned char)(len >> 8);
+    h[2] = (unsigned char)(len >> 16); h[3] = (unsigned char)(len >> 24);
+    h[4] = (unsigned char)type; h[5] = 0;
+    h[6] = (unsigned char)tag; h[7] = (unsigned char)(tag >> 8);
+}
+
+/* Place n pattern bytes in the client's ring; returns the stream position or
+ * -1 if the ring is too full (the chunk then goes inline). */
+static int64_t ring_put(client_t *c, size_t n) {
+    ring_hdr_t *h = c->ring;
+    unsigned char *data = (unsigned char*)h + RING_HDR_SIZE;
+    if (!h || n > h->size) return -1;
+    uint64_t tail = __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE);
+    uint64_t pos = c->head, off = pos % h->size;
+    if (off + n > h->size) pos += h->size - off;   /* never wrap inside a chunk */
+    if (pos + n - tail > h->size) return -1;
+    memcpy(data + pos % h->size, g_pattern, n);
+    c->head = pos + n;
+    __atomic_store_n(&h->head, c->head, __ATOMIC_RELEASE);
+    return (int64_t)pos;
+}
+
+static void encode_reply(client_t *c, const job_t *j) {
+    char hdr[48];
+    size_t size = j->size;
+    if (j->hello) {
+        tx_append(c, ".proto=bin1\n", 12);
+        return;
+    }
+    if (j->shm) {
+        unsigned char h[8];
+        const char *t = j->shm > 0 ? "shm=ok" : "err shm not available";
+        if (!c->bin) {
+            tx_append(c, ".", 1); tx_append(c, t, strlen(t)); tx_append(c, "\n", 1);
+            return;
+        }
+        bin_header(h, (uint32_t)strlen(t), 3, j->tag);
+        tx_append(c, h, sizeof h);
+        tx_append(c, t, strlen(t));
+        return;
+    }
+    if (c->bin) {
+        unsigned char h[8];
+        while (size) {
+            size_t n = size > CHUNK_MAX ? CHUNK_MAX : size;
+            int64_t pos = ring_put(c, n);
+            if (pos >= 0) {
+                unsigned char ref[16];
+                for (int k = 0; k < 8; k++) {
+                    ref[k] = (unsigned char)((uint64_t)pos >> (8 * k));
+                    ref[8 + k] = (unsigned char)((uint64_t)n >> (8 * k));
+                }
+                bin_header(h, sizeof ref, 6, j->tag);
+                tx_append(c, h, sizeof h);
+                tx_append(c, ref, sizeof ref);
+            } else {
+                bin_header(h, (uint32_t)n, 2, j->tag);
+                tx_append(c, h, sizeof h);
+                tx_append(c, g_pattern, n);
+            }
+            size -= n;
+        }
+        bin_header(h, 0, 3, j->tag);
+        tx_append(c, h, sizeof h);
+        return;
+    }
+    if (g_legacy) {
+        while (size) {
+            size_t n = size > CHUNK_MAX ? CHUNK_MAX : size;
+            tx_append(c, g_pattern, n);
+            size -= n;
+        }
+        return;
+    }
+    while (size) {
+        size_t n = size > CHUNK_MAX ? CHUNK_MAX : size;
+        int64_t pos = ring_put(c, n);
+        if (pos >= 0) {
+            int h = snprintf(hdr, sizeof hdr, "&%lld %zu\n", (long long)pos, n);
+            tx_append(c, hdr, (size_t)h);
+        } else {
+            int h = snprintf(hdr, sizeof hdr, "$%zu\n", n);
+            tx_append(c, hdr, (size_t)h);
+            tx_append(c, g_pattern, n);
+        }
+        size -= n;
+    }
+    tx_append(c, ".\n", 2);
+}
+
+static void close_client(int slot) {
+    client_t *c = g_clients[slot];
+    if (c->ring) munmap(c->ring, c->ring_len);
+    if (c->passed_fd >= 0) close(c->passed_fd);
+    close(c->fd);
+    free(c->tx);
+    free(c);
+    g_clients[slot] = NULL;
+}
+
+/* Map a ring passed with "shm-offer"; returns 1 if accepted, -1 if not. */
+static int accept_ring(client_t *c) {
+    int fd = c->passed_fd;
+    c->passed_fd = -1;
+    if (fd < 0 || !g_shm || c->ring) { if (fd >= 0) close(fd); return -1; }
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > RING_HDR_SIZE)
+        p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+    ring_hdr_t *h = (ring_hdr_t*)p;
+    if (h->magic != RING_MAGIC || h->size + RING_HDR_SIZE > (uint64_t)st.st_size) {
+        munmap(p, (size_t)st.st_size);
+        return -1;
+    }
+    c->ring = h;
+    c->ring_len = (size_t)st.st_size;
+    return 1;
+}
+
+static void queue_line(client_t *c, const char *line, size_t len, uint16_t tag) {
+    size_t size = g_size;
+    int hello = 0, shm = 0;
+    char num[24];
+    if (len > 5 && !strncmp(line, "size ", 5)) {
+        size_t k = len - 5 < sizeof num - 1 ? len - 5 : sizeof num - 1;
+        memcpy(num, line + 5, k);
+        num[k] = 0;
+        size = (size_t)strtoull(num, NULL, 10);
+    }
+    if (g_binary && !c->bin && len >= 16 && !strncmp(line, "hello proto=bin1", 16)) {
+        hello = 1;
+        c->bin = 1;   /* the client waits for the answer before sending frames */
+    }
+    if (len >= 9 && !strncmp(line, "shm-offer", 9)) shm = accept_ring(c);
+    uint64_t due = now_ns() + (uint64_t)g_delay_ms * 1000000ull;
+    if (c->jcount) {
+        const job_t *last = &c->jobs[(c->jhead + c->jcount - 1) % MAX_PENDING];
+        if (due < last->due) due = last->due;
+    }
+    job_t *j = &c->jobs[(c->jhead + c->jcount) % MAX_PENDING];
+    j->due = due;
+    j->size = size;
+    j->tag = tag;
+    j->hello = hello;
+    j->shm = shm;
+    c->jcount++;
+}
+
+static int parse_rx(client_t *c);
+
+static int on_readable(client_t *c) {
+    struct msghdr msg;
+    struct iovec iov;
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+    memset(&msg, 0, sizeof msg);
+    iov.iov_base = c->rx + c->rx_len;
+    iov.iov_len = sizeof c->rx - c->rx_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof ctl.buf;
+    ssize_t n = recvmsg(c->fd, &msg, 0);
+    if (n < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (n == 0) return -1;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        if (c->passed_fd >= 0) close(c->passed_fd);
+        memcpy(&c->passed_fd, CMSG_DATA(cm), sizeof(int));
+    }
+    c->rx_len += (size_t)n;
+    return parse_rx(c);
+}
+
+/* Queue the complete requests in rx. With MAX_PENDING replies owed the
+ * rest waits in rx, and the socket is not read, until the queue drains. */
+static int parse_rx(client_t *c) {
+    size_t start = 0;
+    while (c->bin && c->jcount < MAX_PENDING && c->rx_len - start >= 8) {
+        /* request frame: header, then one "cmd" string field */
+        const unsigned char *h = (const unsigned char*)c->rx + start;
+        size_t flen = (size_t)h[0] | (size_t)h[1] << 8 | (size_t)h[2] << 16 | (size_t)h[3] << 24;
+        if (flen > sizeof c->rx - 8) return -1;
+        if (c->rx_len - start < 8 + flen) break;
+        if (flen < 9) return -1;
+        queue_line(c, (const char*)h + 8 + 9, flen - 9, (uint16_t)(h[6] | h[7] << 8));
+        start += 8 + flen;
+    }
+    for (size_t i = start; !c->bin && c->jcount < MAX_PENDING && i < c->rx_len; i++) {
+        if (c->rx[i] != '\n') continue;
+        queue_line(c, c->rx + start, i - start, 0);
+        start = i + 1;
+    }
+    memmove(c->rx, c->rx + start, c->rx_len - start);
+    c->rx_len -= start;
+    if (c->rx_len == sizeof c->rx && c->jcount < MAX_PENDING) return -1;   /* line too long */
+    return 0;
+}
+
+static int listen_tcp(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    struct sockaddr_in a;
+    memset(&a, 0, sizeof a);
+    a.sin_family = AF_INET;
+    a.sin_port = htons((uint16_t)port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*)&a, sizeof a) != 0 || listen(fd, 1024) != 0) {
+        perror("stub-hostd: tcp listen");
+        exit(1);
+    }
+    set_nonblock(fd);
+    return fd;
+}
+
+static int listen_unix(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un a;
+    memset(&a, 0, sizeof a);
+    a.sun_family = AF_UNIX;
+    snprintf(a.sun_path, sizeof a.sun_path, "%s", path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&a, sizeof a) != 0 || listen(fd, 1024) != 0) {
+        perror("stub-hostd: unix listen");
+        exit(1);
+    }
+    set_nonblock(fd);
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    int port = 0;
+    const char *upath = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:u:s:d:lbm")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'u': upath = optarg; break;
+        case 's': g_size = (size_t)strtoull(optarg, NULL, 10); break;
+        case 'd': g_delay_ms = atoi(optarg); break;
+        case 'l': g_legacy = 1; break;
+        case 'b': g_binary = 1; break;
+        case 'm': g_shm = 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-u socket] [-s bytes] [-d ms] [-l] [-b] [-m]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!port && !upath) port = 9000;
+    for (size_t i = 0; i < sizeof g_pattern; i++)
+        g_pattern[i] = (i % 64 == 63) ? '\n' : (char)('a' + i % 26);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+
+    int lfd[2], nl = 0;
+    if (port) lfd[nl++] = listen_tcp(port);
+    if (upath) lfd[nl++] = listen_unix(upath);
+
+    static struct pollfd pfd[2 + MAX_CLIENTS];
+    static int slot_of[2 + MAX_CLIENTS];
+
+    while (!g_stop) {
+        nfds_t n = 0;
+        uint64_t now = now_ns();
+        int timeout = -1;
+        for (int i = 0; i < nl; i++) { pfd[n].fd = lfd[i]; pfd[n].events = POLLIN; slot_of[n++] = -1; }
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            client_t *c = g_clients[i];
+            if (!c) continue;
+            /* release replies whose service delay has elapsed */
+            int full = c->jcount == MAX_PENDING;
+            while (c->jcount && c->jobs[c->jhead].due <= now) {
+                encode_reply(c, &c->jobs[c->jhead]);
+                c->jhead = (c->jhead + 1) % MAX_PENDING;
+                c->jcount--;
+            }
+            if (full && c->jcount < MAX_PENDING && parse_rx(c) != 0) { close_client(i); continue; }
+            if (c->jcount) {
+                int ms = (int)((c->jobs[c->jhead].due - now) / 1000000ull) + 1;
+                if (timeout < 0 || ms < timeout) timeout = ms;
+            }
+            pfd[n].fd = c->fd;
+            pfd[n].events = (short)((c->jcount < MAX_PENDING ? POLLIN : 0) |
+                                    (c->tx_off < c->tx_len ? POLLOUT : 0));
+            slot_of[n++] = i;
+        }
+        if (poll(pfd, n, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        for (nfds_t k = 0; k < n; k++) {
+            if (!pfd[k].revents) continue;
+            if (slot_of[k] < 0) {
+                int cfd;
+                while ((cfd = accept(pfd[k].fd, NULL, NULL)) >= 0) {
+                    int slot = -1;
+                    for (int i = 0; i < MAX_CLIENTS; i++) if (!g_clients[i]) { slot = i; break; }
+                    client_t *c = slot >= 0 ? calloc(1, sizeof *c) : NULL;
+                    if (!c) { close(cfd); continue; }
+                    int one = 1;
+                    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+                    set_nonblock(cfd);
+                    c->fd = cfd;
+                    c->passed_fd = -1;
+                    g_clients[slot] = c;
+                }
+                continue;
+            }
+            client_t *c = g_clients[slot_of[k]];
+            if ((pfd[k].revents & (POLLIN | POLLHUP | POLLERR)) && c->jcount < MAX_PENDING &&
+                on_readable(c) != 0) {
+                close_client(slot_of[k]);
+                continue;
+            }
+            if ((pfd[k].revents & POLLOUT) && c->tx_off < c->tx_len) {
+                ssize_t w = send(c->fd, c->tx + c->tx_off, c->tx_len - c->tx_off, MSG_NOSIGNAL);
+                if (w < 0 && errno != EAGAIN && errno != EINTR) { close_client(slot_of[k]); continue; }
+                if (w > 0) c->tx_off += (size_t)w;
+            }
+        }
+    }
+    for (int i = 0; i < MAX_CLIENTS; i++) if (g_clients[i]) close_client(i);
+    if (upath) unlink(upath);
+    return 0;
+}
@@ -0,0 +1,406 @@
+// vc-load.c - load driver for vim-cmd against stub-hostd
+// Build: cc -Wall -Wextra -O2 -o vc-load vc-load.c   (POSIX only)
+//
+// Starts a stub-hostd, drives vim-cmd through its one-shot, agent, REPL,
+// batch and fan-out paths, and prints one JSON object per scenario:
+//
+//   {"bench":"oneshot","transport":"tcp","size":64,"delay_ms":0,"n":500,
+//    "concurrency":1,"cmds_per_sec":1834.2,"p50_us":512,"p99_us":901,
+//    "p999_us":1320,"max_us":1502}
+//
+// Latency is measured per command where the path allows it (one-shot,
+// agent, REPL) and per run for batch and fan-out, where "n" counts runs
+// and cmds_per_sec counts commands. p999_us is null below 1000 samples.
+// Commands whose vim-cmd exits nonzero are left out of the latencies and
+// counted in "failed"; vc-load then exits 1.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct {
+    const char *vim_cmd;
+    const char *stub;
+    const char *mode;        /* scenario name or "all" */
+    const char *transport;   /* tcp | unix */
+    const char *extra;       /* extra vim-cmd arguments (space separated) */
+    int         n;
+    int         concurrency;
+    int         size;
+    int         delay_ms;
+    int         window;
+    int         hosts;
+    int         port;
+    char        sock[108];
+    char        tmpdir[64];
+} opts_t;
+
+static int g_failed;   /* runs of the current scenario that exited nonzero */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t pct(const uint64_t *v, size_t n, double p) {
+    if (!n) return 0;
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return v[i < n ? i : n - 1];
+}
+
+static int g_any_failed;
+
+static void report(const opts_t *o, const char *bench, uint64_t *lat, size_t n,
+                   double secs, uint64_t cmds) {
+    char p999[24] = "null";   /* fewer than 1000 samples cannot give one */
+    qsort(lat, n, sizeof *lat, cmp_u64);
+    if (n >= 1000) snprintf(p999, sizeof p999, "%llu", (unsigned long long)(pct(lat, n, 0.999) / 1000));
+    printf("{\"bench\":\"%s\",\"transport\":\"%s\",\"size\":%d,\"delay_ms\":%d,"
+           "\"n\":%zu,\"failed\":%d,\"concurrency\":%d,\"cmds_per_sec\":%.1f,"
+           "\"p50_us\":%llu,\"p99_us\":%llu,\"p999_us\":%s,\"max_us\":%llu}\n",
+           bench, o->transport, o->size, o->delay_ms, n, g_failed, o->concurrency,
+           secs > 0 ? (double)cmds / secs : 0.0,
+           (unsigned long long)(pct(lat, n, 0.50) / 1000),
+           (unsigned long long)(pct(lat, n, 0.99) / 1000),
+           p999,
+           (unsigned long long)(n ? lat[n-1] / 1000 : 0));
+    fflush(stdout);
+    if (g_failed) g_any_failed = 1;
+    g_failed = 0;
+}
+
+static int exited_ok(int status) {
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Reap a child; nonzero exits count against the current scenario. */
+static int reap(pid_t pid) {
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !exited_ok(status)) { g_failed++; return 0; }
+    return 1;
+}
+
+/* argv for vim-cmd: target selection, extra args, then the given tail */
+static int build_argv(const opts_t *o, char **argv, int max, char **tail, int ntail, int agent) {
+    static char tcp[64];
+    static char extra[512];
+    int k = 0;
+    argv[k++] = (char*)o->vim_cmd;
+    if (!agent) argv[k++] = "--no-agent";
+    if (!strcmp(o->transport, "unix")) { argv[k++] = "-S"; argv[k++] = (char*)o->sock; }
+    else { snprintf(tcp, sizeof tcp, "127.0.0.1:%d", o->port); argv[k++] = "-T"; argv[k++] = tcp; }
+    if (o->extra) {
+        snprintf(extra, sizeof extra, "%s", o->extra);
+        for (char *t = strtok(extra, " "); t && k < max - ntail - 1; t = strtok(NULL, " ")) argv[k++] = t;
+    }
+    for (int i = 0; i < ntail && k < max - 1; i++) argv[k++] = tail[i];
+    argv[k] = NULL;
+    return k;
+}
+
+static pid_t spawn(char **argv, int in_fd, int out_fd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int nul = open("/dev/null", O_RDWR);
+        dup2(in_fd >= 0 ? in_fd : nul, 0);
+        dup2(out_fd >= 0 ? out_fd : nul, 1);
+        dup2(nul, 2);
+        for (int fd = 3; fd < 1024; fd++) close(fd);   /* e.g. our ends of the pipes */
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+static pid_t start_stub(opts_t *o) {
+    char size[32], delay[32], port[16];
+    snprintf(size, sizeof size, "%d", o->size);
+    snprintf(delay, sizeof delay, "%d", o->delay_ms);
+    snprintf(port, sizeof port, "%d", o->port);
+    char *argv[] = { (char*)o->stub, "-p", port, "-u", o->sock, "-s", size, "-d", delay, NULL };
+    pid_t pid = spawn(argv, -1, -1);
+    /* wait until the UNIX socket accepts connections */
+    for (int i = 0; i < 200; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un a;
+        memset(&a, 0, sizeof a);
+        a.sun_family = AF_UNIX;
+        snprintf(a.sun_path, sizeof a.sun_path, "%s", o->sock);
+        int ok = connect(fd, (struct sockaddr*)&a, sizeof a) == 0;
+        close(fd);
+        if (ok) return pid;
+        sleep_ms(10);
+    }
+    fprintf(stderr, "vc-load: stub-hostd did not start\n");
+    kill(pid, SIGTERM);
+    return -1;
+}
+
+/* One-shot: a fresh vim-cmd process per command, `concurrency` at a time. */
+static void bench_oneshot(const opts_t *o, const char *name) {
+    uint64_t *lat = calloc((size_t)o->n, sizeof *lat);
+    pid_t *pids = calloc((size_t)o->concurrency, sizeof *pids);
+    uint64_t *started = calloc((size_t)o->concurrency, sizeof *started);
+    char *tail[] = { "bench", "ping" };
+    char *argv[64];
+    build_argv(o, argv, 64, tail, 2, 0);
+    int launched = 0, done = 0;
+    uint64_t t0 = now_ns();
+    while (done + g_failed < o->n) {
+        for (int s = 0; s < o->concurrency && launched < o->n; s++) {
+            if (pids[s]) continue;
+            started[s] = now_ns();
+            pids[s] = spawn(argv, -1, -1);
+            launched++;
+        }
+        int status;
+        pid_t p = wait(&status);
+        if (p < 0) break;
+        for (int s = 0; s < o->concurrency; s++) {
+            if (pids[s] != p) continue;
+            if (exited_ok(status)) lat[done++] = now_ns() - started[s];
+            else g_failed++;
+            pids[s] = 0;
+        }
+    }
+    report(o, name, lat, (size_t)done, (double)(now_ns() - t0) / 1e9, (uint64_t)done);
+    free(lat); free(pids); free(started);
+}
+
+/* Agent: one-shot processes that reach hostd through a running agent. */
+static void bench_agent(const opts_t *o) {
+    char rt[128];
+    snprintf(rt, sizeof rt, "%s/rt", o->tmpdir);
+    mkdir(rt, 0700);
+    setenv("XDG_RUNTIME_DIR", rt, 1);
+    char *tail[] = { "--agent", "--foreground" };
+    char *argv[64];
+    build_argv(o, argv, 64, tail, 2, 0);
+    pid_t agent = spawn(argv, -1, -1);
+    sleep_ms(200);
+
+    uint64_t *lat = calloc((size_t)o->n, sizeof *lat);
+    char *tail2[] = { "bench", "ping" };
+    build_argv(o, argv, 64, tail2, 2, 1);
+    uint64_t t0 = now_ns();
+    int done = 0;
+    for (int i = 0; i < o->n; i++) {
+        uint64_t s = now_ns();
+        if (reap(spawn(argv, -1, -1))) lat[done++] = now_ns() - s;
+    }
+    report(o, "agent", lat, (size_t)done, (double)(now_ns() - t0) / 1e9, (uint64_t)done);
+    free(lat);
+    kill(agent, SIGTERM);
+    waitpid(agent, NULL, 0);
+    unsetenv("XDG_RUNTIME_DIR");
+}
+
+/* REPL: one vim-cmd process, commands written to its stdin; each reply is
+ * exactly `size` bytes on stdout. An empty reply prints nothing, so with
+ * -s 0 each command asks for a one-byte reply instead, to have something
+ * to wait for. */
+static void bench_repl(const opts_t *o) {
+    int in[2], out[2];
+    if (pipe(in) != 0 || pipe(out) != 0) { perror("pipe"); return; }
+    char *argv[64];
+    build_argv(o, argv, 64, NULL, 0, 0);
+    pid_t pid = spawn(argv, in[0], out[1]);
+    close(in[0]); close(out[1]);
+    char cmd[160];
+    if (!strcmp(o->transport, "unix")) snprintf(cmd, sizeof cmd, "/connect unix %s\n", o->sock);
+    else snprintf(cmd, sizeof cmd, "/connect tcp 127.0.0.1 %d\n", o->port);
+    if (write(in[1], cmd, strlen(cmd)) < 0) return;
+
+    const char *line = o->size ? "bench ping\n" : "size 1\n";
+    size_t want = o->size ? (size_t)o->size : 1;
+    uint64_t *lat = calloc((size_t)o->n, sizeof *lat);
+    char *buf = malloc(65536);
+    uint64_t t0 = now_ns();
+    int done = 0;
+    for (; done < o->n; done++) {
+        uint64_t s = now_ns();
+        if (write(in[1], line, strlen(line)) != (ssize_t)strlen(line)) break;
+        size_t got = 0;
+        while (got < want) {
+            ssize_t r = read(out[0], buf, 65536);
+            if (r <= 0) break;
+            got += (size_t)r;
+        }
+        if (got < want) break;
+        lat[done] = now_ns() - s;
+    }
+    if (done < o->n) g_failed++;   /* the REPL died or stopped answering */
+    close(in[1]);
+    reap(pid);
+    report(o, "repl", lat, (size_t)done, (double)(now_ns() - t0) / 1e9, (uint64_t)done);
+    close(out[0]);
+    free(lat); free(buf);
+}
+
+/* Batch and fan-out: latency is per run, throughput per command. */
+static void bench_runs(const opts_t *o, const char *name, char **tail, int ntail, int cmds_per_run) {
+    int runs = o->n / cmds_per_run;
+    if (runs < 3) runs = 3;
+    if (runs > 50) runs = 50;
+    uint64_t *lat = calloc((size_t)runs, sizeof *lat);
+    char *argv[64];
+    build_argv(o, argv, 64, tail, ntail, 0);
+    if (!strcmp(name, "fanout")) {   /* targets come from the hosts file */
+        int k = 2;
+        while (argv[k] && strcmp(argv[k], "-T") && strcmp(argv[k], "-S")) k++;
+        if (argv[k]) { memmove(&argv[k], &argv[k+2], sizeof(char*) * 60); }
+    }
+    uint64_t t0 = now_ns();
+    size_t done = 0;
+    for (int r = 0; r < runs; r++) {
+        uint64_t s = now_ns();
+        if (reap(spawn(argv, -1, -1))) lat[done++] = now_ns() - s;
+    }
+    report(o, name, lat, done, (double)(now_ns() - t0) / 1e9,
+           (uint64_t)done * (uint64_t)cmds_per_run);
+    free(lat);
+}
+
+static void bench_batch(const opts_t *o) {
+    char path[128], wstr[16];
+    snprintf(path, sizeof path, "%s/script.txt", o->tmpdir);
+    FILE *fp = fopen(path, "w");
+    int per_run = o->n < 100 ? 100 : o->n;
+    for (int i = 0; i < per_run; i++) fprintf(fp, "bench ping %d\n", i);
+    fclose(fp);
+    snprintf(wstr, sizeof wstr, "%d", o->window);
+    char *tail[] = { "-f", path, "-w", wstr };
+    opts_t bo = *o;
+    bo.n = per_run * 10;
+    bench_runs(&bo, "batch", tail, 4, per_run);
+}
+
+static void bench_fanout(const opts_t *o) {
+    char path[128], at[140];
+    snprintf(path, sizeof path, "%s/hosts.txt", o->tmpdir);
+    FILE *fp = fopen(path, "w");
+    for (int i = 0; i < o->hosts; i++) {
+        if (!strcmp(o->transport, "unix")) fprintf(fp, "unix:%s\n", o->sock);
+        else fprintf(fp, "127.0.0.1:%d\n", o->port);
+    }
+    fclose(fp);
+    snprintf(at, sizeof at, "@%s", path);
+    char *tail[] = { "-T", at, "bench", "ping" };
+    opts_t fo = *o;
+    fo.n = o->hosts * 10;
+    bench_runs(&fo, "fanout", tail, 4, o->hosts);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --vim-cmd PATH     vim-cmd binary (default ./vim-cmd)\n"
+        "  --stub PATH        stub-hostd binary (default bench/stub-hostd)\n"
+        "  --mode M           oneshot|agent|repl|batch|fanout|all (default all)\n"
+        "  --transport T      tcp|unix|both (default both)\n"
+        "  --extra ARGS       extra vim-cmd arguments, space separated\n"
+        "  -n N               commands per scenario (default 500)\n"
+        "  -c N               one-shot concurrency (default 1)\n"
+        "  -s BYTES           reply size (default 64)\n"
+        "  -d MS              stub service delay (default 0)\n"
+        "  -w N               batch window (default 32)\n"
+        "  --hosts N          fan-out targets (default 100)\n"
+        "  --port N           stub TCP port (default 19000)\n",
+        prog);
+}
+
+static int want(const opts_t *o, const char *m) {
+    return !strcmp(o->mode, "all") || !strcmp(o->mode, m);
+}
+
+int main(int argc, char **argv) {
+    opts_t o;
+    memset(&o, 0, sizeof o);
+    o.vim_cmd = "./vim-cmd";
+    o.stub = "bench/stub-hostd";
+    o.mode = "all";
+    o.transport = "both";
+    o.n = 500;
+    o.concurrency = 1;
+    o.size = 64;
+    o.window = 32;
+    o.hosts = 100;
+    o.port = 19000;
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = i + 1 < argc ? argv[i+1] : NULL;
+        if (!strcmp(a, "-h") || !strcmp(a, "--help")) { usage(argv[0]); return 0; }
+        if (!v) { usage(argv[0]); return 1; }
+        if      (!strcmp(a, "--vim-cmd"))   o.vim_cmd = v;
+        else if (!strcmp(a, "--stub"))      o.stub = v;
+        else if (!strcmp(a, "--mode"))      o.mode = v;
+        else if (!strcmp(a, "--transport")) o.transport = v;
+        else if (!strcmp(a, "--extra"))     o.extra = v;
+        else if (!strcmp(a, "-n"))          o.n = atoi(v);
+        else if (!strcmp(a, "-c"))          o.concurrency = atoi(v);
+        else if (!strcmp(a, "-s"))          o.size = atoi(v);
+        else if (!strcmp(a, "-d"))          o.delay_ms = atoi(v);
+        else if (!strcmp(a, "-w"))          o.window = atoi(v);
+        else if (!strcmp(a, "--hosts"))     o.hosts = atoi(v);
+        else if (!strcmp(a, "--port"))      o.port = atoi(v);
+        else { usage(argv[0]); return 1; }
+        i++;
+    }
+    if (o.n < 1 || o.concurrency < 1 || o.size < 0 || o.hosts < 1) { usage(argv[0]); return 1; }
+
+    snprintf(o.tmpdir, sizeof o.tmpdir, "/tmp/vc-load.XXXXXX");
+    if (!mkdtemp(o.tmpdir)) { perror("mkdtemp"); return 1; }
+    snprintf(o.sock, sizeof o.sock, "%s/hostd.sock", o.tmpdir);
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t stub = start_stub(&o);
+    if (stub < 0) return 1;
+
+    const char *both[] = { "tcp", "unix" };
+    const char *transport = o.transport;
+    for (int t = 0; t < 2; t++) {
+        if (strcmp(transport, "both") && strcmp(transport, both[t])) continue;
+        o.transport = both[t];
+        if (want(&o, "oneshot")) bench_oneshot(&o, "oneshot");
+        if (want(&o, "agent"))   bench_agent(&o);
+        if (want(&o, "repl"))    bench_repl(&o);
+        if (want(&o, "batch"))   bench_batch(&o);
+        if (want(&o, "fanout"))  bench_fanout(&o);
+    }
+
+    kill(stub, SIGTERM);
+    waitpid(stub, NULL, 0);
+    char path[160];
+    const char *files[] = { "script.txt", "hosts.txt", "hostd.sock", "rt/vim-cmd-agent.sock", "rt" };
+    for (size_t i = 0; i < sizeof files / sizeof *files; i++) {
+        snprintf(path, sizeof path, "%s/%s", o.tmpdir, files[i]);
+        remove(path);
+    }
+    rmdir(o.tmpdir);
+    return g_any_failed;
+}
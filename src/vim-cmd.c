@@ -1,9 +1,14 @@
 // vim-cmd.c - cross-platform client for hostd with config + REPL + set
 // Standalone build:
-//   Unix:   cc -Wall -Wextra -O2 -g -o vim-cmd vim-cmd.c
+//   Unix:   cc -Wall -Wextra -O2 -g -o vim-cmd vim-cmd.c -pthread
+//           (Linux io_uring engine: add -DVC_URING)
 //   MinGW:  x86_64-w64-mingw32-gcc -O2 -g -o vim-cmd.exe vim-cmd.c -lws2_32
 
 #define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+#ifdef __linux__
+  #define _GNU_SOURCE          /* memfd_create */
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,14 +16,29 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
 
 #ifdef _WIN32
   #define WIN32_LEAN_AND_MEAN
+  #ifndef _WIN32_WINNT
+    #define _WIN32_WINNT 0x0600   /* WSAPoll */
+  #endif
   #include <winsock2.h>
   #include <ws2tcpip.h>
   #include <windows.h>
+  #include <io.h>
+  #include <fcntl.h>
+  #include <sys/stat.h>
+  #ifdef _MSC_VER
+    #include <intrin.h>         /* _BitScanReverse64 */
+  #endif
   typedef SOCKET socket_t;
+  #define poll WSAPoll
   #define CLOSESOCK closesocket
+  #define CLOSEFILE _close
   #define SOCKERR() WSAGetLastError()
   #define PATH_SEP '\\'
 #else
@@ -30,10 +50,31 @@
   #include <pwd.h>
   #include <sys/stat.h>
   #include <sys/types.h>
+  #include <sys/mman.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+  #include <termios.h>
+  #include <sys/ioctl.h>
+  #include <poll.h>
+  #include <fcntl.h>
+  #include <pthread.h>
   typedef int socket_t;
   #define CLOSESOCK close
+  #define CLOSEFILE close
   #define SOCKERR() errno
   #define PATH_SEP '/'
+  #ifdef __linux__
+    #include <sys/sendfile.h>
+    #ifdef VC_URING
+      #define VC_HAVE_URING 1
+      #include <linux/io_uring.h>
+      #include <sys/syscall.h>
+      #include <sys/uio.h>
+    #endif
+  #endif
+  #ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0      /* macOS: SIGPIPE is ignored in main instead */
+  #endif
 #endif
 
 #if defined(_WIN32)
@@ -55,6 +96,7 @@
 
 static void print_version(void) {
     printf("vim-cmd version %s\n", VIM_CMD_VERSION);
+    fflush(stdout);
 }
 
 /* Global CLI verbosity flag (currently only used for cfg_show after /connect) */
@@ -62,16 +104,57 @@ static int g_verbose = 0;
 
 // ----- Modes -----
 typedef enum { VC_MODE_UNSET=0, VC_MODE_UNIX=1, VC_MODE_TCP=2 } vc_mode_t;
+typedef enum { VC_PROTO_AUTO=0, VC_PROTO_TEXT=1, VC_PROTO_BINARY=2 } vc_proto_t;
+
+static const char *proto_name(vc_proto_t p) {
+    return p == VC_PROTO_TEXT ? "text" : (p == VC_PROTO_BINARY ? "binary" : "auto");
+}
+
+static int parse_proto(const char *v, vc_proto_t *out) {
+    if (!strcasecmp(v, "auto"))   { *out = VC_PROTO_AUTO;   return 0; }
+    if (!strcasecmp(v, "text"))   { *out = VC_PROTO_TEXT;   return 0; }
+    if (!strcasecmp(v, "binary")) { *out = VC_PROTO_BINARY; return 0; }
+    return -1;
+}
 
 // ----- Config -----
+#define CACHE_MAX_RULES  32
+#define CACHE_CMD_MAX    64
+
+typedef struct {
+    char cmd[CACHE_CMD_MAX];     /* command prefix, e.g. "vm list" */
+    int  ttl_ms;
+} cache_rule_t;
+
+#define EXPORT_MAX_RULES  32
+#define EXPORT_NAME_MAX   32
+#define EXPORT_CMD_MAX    128
+
+typedef struct {
+    char name[EXPORT_NAME_MAX];  /* metric name part, [A-Za-z0-9_] */
+    char cmd[EXPORT_CMD_MAX];    /* command polled by the exporter */
+} export_rule_t;
+
 typedef struct {
     vc_mode_t mode;
     char   socket_path[256];
     char   host[128];
     int    port;
+    int    connect_timeout_ms;   /* 0 = no deadline */
+    int    timeout_ms;           /* whole-request deadline, 0 = none */
+    vc_proto_t proto;            /* wire protocol: auto-negotiate by default */
+    size_t shm_bytes;            /* shared-memory ring for UNIX mode, 0 = off */
+    cache_rule_t cache[CACHE_MAX_RULES];   /* "cache.<command>=<ttl>" */
+    int    ncache;
+    export_rule_t exports[EXPORT_MAX_RULES];   /* "export.<name>=<command>" */
+    int    nexport;
+    char   inventory[512];       /* named, tagged targets; "" = next to the config */
     char   cfg_path[512];
 } cfg_t;
 
+#define SHM_DEFAULT_SIZE  (16ll << 20)
+#define SHM_MAX_SIZE      (1ll << 30)
+
 #ifndef _WIN32
 static const char *DEFAULT_UNIX_SOCK = "/tmp/hostd.sock";
 #endif
@@ -88,6 +171,70 @@ static void rstrip(char *s) {
 }
 static char *trim(char *s) { rstrip(s); return ltrim(s); }
 
+/* Parse a duration such as "250", "250ms", "2s" or "1.5s" into milliseconds.
+ * A bare number is milliseconds. Returns -1 if malformed. */
+static long parse_duration_ms(const char *v) {
+    char *end = NULL;
+    double d = strtod(v, &end);
+    if (!*v || end == v || d < 0) return -1;
+    if (!*end || !strcasecmp(end, "ms")) return (long)d;
+    if (!strcasecmp(end, "s")) return (long)(d * 1000.0);
+    if (!strcasecmp(end, "m")) return (long)(d * 60000.0);
+    return -1;
+}
+
+/* Parse a byte count such as "65536", "64K", "16M" or "1G". Returns -1 if
+ * malformed. */
+static long long parse_size(const char *v) {
+    char *end = NULL;
+    long long n = strtoll(v, &end, 10);
+    if (!*v || end == v || n < 0) return -1;
+    if (!*end) return n;
+    if (end[1]) return -1;
+    switch (toupper((unsigned char)*end)) {
+    case 'K': return n << 10;
+    case 'M': return n << 20;
+    case 'G': return n << 30;
+    }
+    return -1;
+}
+
+/* Monotonic clock in nanoseconds, for timing only. */
+static uint64_t mono_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000ull +
+           (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000ull / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* Read one line of any length into *buf (grown as needed); newline is kept.
+ * Returns the line length or -1 at EOF. Portable stand-in for getline(). */
+static long read_line(FILE *fp, char **buf, size_t *cap) {
+    size_t len = 0;
+    if (!*buf || *cap < 256) {
+        char *nb = (char*)realloc(*buf, 256);
+        if (!nb) return -1;
+        *buf = nb; *cap = 256;
+    }
+    while (fgets(*buf + len, (int)(*cap - len), fp)) {
+        len += strlen(*buf + len);
+        if (len && (*buf)[len-1] == '\n') break;
+        if (len + 1 < *cap) continue;   /* short read without newline: EOF next */
+        char *nb = (char*)realloc(*buf, *cap * 2);
+        if (!nb) return -1;
+        *buf = nb; *cap *= 2;
+    }
+    return len ? (long)len : -1;
+}
+
 static void default_cfg_path(char *out, size_t outsz) {
 #ifdef _WIN32
     const char *appdata = getenv("APPDATA");
@@ -112,6 +259,238 @@ static void default_cfg_path(char *out, size_t outsz) {
 #endif
 }
 
+// ----- tracing -----
+/*
+ * Phase tracing (--trace=file.json, REPL /trace on) records connect and
+ * request phases as Chrome trace events ("ph":"X" complete events, times in
+ * microseconds) that load in chrome://tracing or Perfetto. Events are kept
+ * in a small in-memory buffer and written in batches, so an enabled trace
+ * costs a clock read per phase; a disabled trace costs one branch.
+ */
+#define TRACE_BUF_EVENTS  256
+#define TRACE_ARG_MAX     96
+
+typedef struct {
+    const char *name;
+    uint64_t    t0, t1;
+    char        arg[TRACE_ARG_MAX];   /* preformatted JSON args body */
+} trace_ev_t;
+
+static struct {
+    FILE      *fp;
+    int        first;                 /* no event written yet */
+    long       pid;
+    size_t     n;
+    trace_ev_t ev[TRACE_BUF_EVENTS];
+} g_trace;
+
+#define TRACE_ON() (g_trace.fp != NULL)
+
+static void trace_flush(void) {
+    for (size_t i = 0; i < g_trace.n; i++) {
+        const trace_ev_t *e = &g_trace.ev[i];
+        fprintf(g_trace.fp, "%s{\"name\":\"%s\",\"cat\":\"vim-cmd\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%ld,\"tid\":1,\"args\":{%s}}",
+                g_trace.first ? "" : ",\n", e->name,
+                (double)e->t0 / 1000.0, (double)(e->t1 - e->t0) / 1000.0,
+                g_trace.pid, e->arg);
+        g_trace.first = 0;
+    }
+    g_trace.n = 0;
+    fflush(g_trace.fp);
+}
+
+/* Record a completed phase. key/val become a single string argument. */
+static void trace_span(const char *name, uint64_t t0, uint64_t t1, const char *key, const char *val) {
+    if (!TRACE_ON()) return;
+    trace_ev_t *e = &g_trace.ev[g_trace.n];
+    e->name = name;
+    e->t0 = t0;
+    e->t1 = t1;
+    e->arg[0] = 0;
+    if (key && val) {
+        size_t o = (size_t)snprintf(e->arg, sizeof e->arg, "\"%s\":\"", key);
+        for (const char *p = val; *p && o + 8 < sizeof e->arg; p++) {
+            unsigned char ch = (unsigned char)*p;
+            if (ch == '"' || ch == '\\') { e->arg[o++] = '\\'; e->arg[o++] = (char)ch; }
+            else if (ch < 0x20) o += (size_t)snprintf(e->arg + o, sizeof e->arg - o, "\\u%04x", ch);
+            else e->arg[o++] = (char)ch;
+        }
+        e->arg[o++] = '"';
+        e->arg[o] = 0;
+    }
+    if (++g_trace.n == TRACE_BUF_EVENTS) trace_flush();
+}
+
+static void trace_close(void) {
+    if (!TRACE_ON()) return;
+    trace_flush();
+    fprintf(g_trace.fp, "\n]\n");
+    fclose(g_trace.fp);
+    g_trace.fp = NULL;
+}
+
+static int trace_open(const char *path) {
+    static int registered = 0;
+    trace_close();
+    if (!registered) { atexit(trace_close); registered = 1; }
+    FILE *fp = fopen(path, "w");
+    if (!fp) { perror(path); return -1; }
+    fputs("[\n", fp);
+    g_trace.fp = fp;
+    g_trace.first = 1;
+    g_trace.n = 0;
+#ifdef _WIN32
+    g_trace.pid = (long)GetCurrentProcessId();
+#else
+    g_trace.pid = (long)getpid();
+#endif
+    fprintf(stderr, "[trace] writing %s\n", path);
+    return 0;
+}
+
+// ----- stats -----
+/*
+ * Latency statistics for /stats and --stats-on-exit. Each command verb (the
+ * first word of the line) gets a fixed-size log-linear histogram in the
+ * style of HdrHistogram: values in microseconds are bucketed by power of two
+ * with STATS_SUB_BUCKETS linear steps inside each, giving ~6% precision from
+ * 1 us to hours in a few KB. The table has a fixed number of verb slots
+ * (overflow goes to "(other)"), so memory never grows; it is only touched
+ * from the main loop, so no locking is needed.
+ */
+#define STATS_SUB_BITS     4
+#define STATS_SUB_BUCKETS  (1 << STATS_SUB_BITS)
+#define STATS_MAGNITUDES   40
+#define STATS_BUCKETS      (STATS_MAGNITUDES * STATS_SUB_BUCKETS)
+#define STATS_VERBS        32
+#define STATS_VERB_MAX     24
+
+typedef struct {
+    char     verb[STATS_VERB_MAX];
+    uint64_t count, errors, sum_us, max_us;
+    uint32_t buckets[STATS_BUCKETS];
+} verb_stats_t;
+
+static struct {
+    verb_stats_t verbs[STATS_VERBS + 1];  /* last slot is "(other)" */
+    uint64_t     bytes_sent, bytes_recv;
+    uint64_t     connects, reconnects;
+} g_stats;
+
+/* Index of the highest set bit; v != 0. */
+static unsigned stats_msb(uint64_t v) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+    unsigned long i;
+    _BitScanReverse64(&i, v);
+    return (unsigned)i;
+#elif defined(_MSC_VER)
+    unsigned long i;
+    if (_BitScanReverse(&i, (unsigned long)(v >> 32))) return (unsigned)i + 32;
+    _BitScanReverse(&i, (unsigned long)v);
+    return (unsigned)i;
+#else
+    return 63u - (unsigned)__builtin_clzll(v);
+#endif
+}
+
+static unsigned stats_bucket(uint64_t us) {
+    if (us < STATS_SUB_BUCKETS) return (unsigned)us;
+    unsigned msb = stats_msb(us);
+    unsigned mag = msb - STATS_SUB_BITS + 1;
+    if (mag >= STATS_MAGNITUDES) return STATS_BUCKETS - 1;
+    unsigned sub = (unsigned)(us >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1);
+    return mag * STATS_SUB_BUCKETS + sub;
+}
+
+/* Upper bound (in us) of the values that land in bucket b. */
+static uint64_t stats_bucket_value(unsigned b) {
+    unsigned mag = b / STATS_SUB_BUCKETS, sub = b % STATS_SUB_BUCKETS;
+    if (mag == 0) return sub;
+    return ((uint64_t)(STATS_SUB_BUCKETS + sub + 1) << (mag - 1)) - 1;
+}
+
+static verb_stats_t *stats_verb(const char *line) {
+    char verb[STATS_VERB_MAX];
+    size_t n = 0;
+    while (*line && isspace((unsigned char)*line)) line++;
+    while (line[n] && !isspace((unsigned char)line[n]) && n < sizeof verb - 1) {
+        verb[n] = (char)tolower((unsigned char)line[n]);
+        n++;
+    }
+    verb[n] = 0;
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) h = (h ^ (unsigned char)verb[i]) * 16777619u;
+    for (unsigned probe = 0; probe < STATS_VERBS; probe++) {
+        verb_stats_t *v = &g_stats.verbs[(h + probe) % STATS_VERBS];
+        if (!v->verb[0]) { memcpy(v->verb, verb, n + 1); if (!n) strcpy(v->verb, "(empty)"); return v; }
+        if (!strcmp(v->verb, n ? verb : "(empty)")) return v;
+    }
+    verb_stats_t *other = &g_stats.verbs[STATS_VERBS];
+    if (!other->verb[0]) strcpy(other->verb, "(other)");
+    return other;
+}
+
+static void stats_record(verb_stats_t *v, uint64_t ns, uint64_t sent, uint64_t recv, int failed) {
+    uint64_t us = ns / 1000;
+    v->count++;
+    v->sum_us += us;
+    if (us > v->max_us) v->max_us = us;
+    if (failed) v->errors++;
+    v->buckets[stats_bucket(us)]++;
+    g_stats.bytes_sent += sent;
+    g_stats.bytes_recv += recv;
+}
+
+static uint64_t stats_percentile(const verb_stats_t *v, double p) {
+    uint64_t want = (uint64_t)(p * (double)v->count + 0.5), seen = 0;
+    if (want == 0) want = 1;
+    for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+        seen += v->buckets[b];
+        if (seen >= want) {
+            uint64_t val = stats_bucket_value(b);
+            return val < v->max_us ? val : v->max_us;
+        }
+    }
+    return v->max_us;
+}
+
+static int g_connected_once;   /* survives stats_reset: later connects are reconnects */
+
+static void stats_note_connect(void) {
+    g_stats.connects++;
+    if (g_connected_once) g_stats.reconnects++;
+    g_connected_once = 1;
+}
+
+static void stats_reset(void) {
+    memset(g_stats.verbs, 0, sizeof g_stats.verbs);
+    g_stats.bytes_sent = g_stats.bytes_recv = 0;
+    g_stats.connects = g_stats.reconnects = 0;
+}
+
+static void stats_print(FILE *out);
+static void stats_at_exit(void) { stats_print(stderr); }
+
+static void stats_print(FILE *out) {
+    fprintf(out, "%-16s %8s %6s %10s %10s %10s %10s %10s\n",
+            "verb", "count", "errors", "mean_ms", "p50_ms", "p99_ms", "p999_ms", "max_ms");
+    for (unsigned i = 0; i <= STATS_VERBS; i++) {
+        const verb_stats_t *v = &g_stats.verbs[i];
+        if (!v->count) continue;
+        fprintf(out, "%-16s %8llu %6llu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                v->verb, (unsigned long long)v->count, (unsigned long long)v->errors,
+                (double)v->sum_us / (double)v->count / 1000.0,
+                (double)stats_percentile(v, 0.50) / 1000.0,
+                (double)stats_percentile(v, 0.99) / 1000.0,
+                (double)stats_percentile(v, 0.999) / 1000.0,
+                (double)v->max_us / 1000.0);
+    }
+    fprintf(out, "bytes sent %llu, received %llu, reconnects %llu\n",
+            (unsigned long long)g_stats.bytes_sent, (unsigned long long)g_stats.bytes_recv,
+            (unsigned long long)g_stats.reconnects);
+}
+
 #ifndef _WIN32
 /* mkdir -p style parent creation for POSIX paths */
 static int ensure_parent_dir(const char *path) {
@@ -195,15 +574,69 @@ static void cfg_init_defaults(cfg_t *c) {
     default_cfg_path(c->cfg_path, sizeof(c->cfg_path));
 }
 
+/* Target spec in hosts-file syntax for the configured hostd. */
+static int cfg_target_spec(const cfg_t *c, char *out, size_t outsz) {
+    if (c->mode == VC_MODE_TCP) {
+        if (strchr(c->host, ':')) return snprintf(out, outsz, "[%s]:%d", c->host, c->port) < (int)outsz ? 0 : -1;
+        return snprintf(out, outsz, "%s:%d", c->host, c->port) < (int)outsz ? 0 : -1;
+    }
+    return snprintf(out, outsz, "unix:%s", c->socket_path) < (int)outsz ? 0 : -1;
+}
+
 static void cfg_show(const cfg_t *c) {
-    fprintf(stderr, "[cfg] mode=%s socket=%s host=%s port=%d cfg=%s\n",
+    fprintf(stderr, "[cfg] mode=%s socket=%s host=%s port=%d connect_timeout=%dms timeout=%dms proto=%s shm=%zu cfg=%s\n",
         c->mode==VC_MODE_TCP?"tcp":(c->mode==VC_MODE_UNIX?"unix":"unset"),
         c->socket_path[0]?c->socket_path:"(n/a)",
         c->host[0]?c->host:"(n/a)",
         c->port,
+        c->connect_timeout_ms,
+        c->timeout_ms,
+        proto_name(c->proto),
+        c->shm_bytes,
         c->cfg_path[0]?c->cfg_path:"(none)");
 }
 
+/* Add or replace the TTL for a cacheable command; ttl 0 removes it. */
+static int cfg_set_cache_rule(cfg_t *c, const char *cmd, const char *v) {
+    long ms = parse_duration_ms(v);
+    if (!*cmd || strlen(cmd) >= CACHE_CMD_MAX || ms < 0 || ms > INT_MAX) return -1;
+    int i;
+    for (i = 0; i < c->ncache && strcasecmp(c->cache[i].cmd, cmd); i++) {}
+    if (ms == 0) {
+        if (i < c->ncache) c->cache[i] = c->cache[--c->ncache];
+        return 0;
+    }
+    if (i == c->ncache) {
+        if (c->ncache == CACHE_MAX_RULES) return -1;
+        snprintf(c->cache[c->ncache++].cmd, CACHE_CMD_MAX, "%s", cmd);
+    }
+    c->cache[i].ttl_ms = (int)ms;
+    return 0;
+}
+
+/* Add or replace an exporter query; an empty command removes it. */
+static int cfg_set_export_rule(cfg_t *c, const char *name, const char *cmd) {
+    size_t nl = strlen(name);
+    if (!nl || nl >= EXPORT_NAME_MAX || strlen(cmd) >= EXPORT_CMD_MAX) return -1;
+    for (const char *p = name; *p; p++)
+        if (!isalnum((unsigned char)*p) && *p != '_') return -1;
+    int i;
+    for (i = 0; i < c->nexport && strcmp(c->exports[i].name, name); i++) {}
+    if (!*cmd) {
+        if (i < c->nexport) {
+            memmove(&c->exports[i], &c->exports[i+1], (size_t)(c->nexport - i - 1) * sizeof c->exports[0]);
+            c->nexport--;
+        }
+        return 0;
+    }
+    if (i == c->nexport) {
+        if (c->nexport == EXPORT_MAX_RULES) return -1;
+        snprintf(c->exports[c->nexport++].name, EXPORT_NAME_MAX, "%s", name);
+    }
+    snprintf(c->exports[i].cmd, EXPORT_CMD_MAX, "%s", cmd);
+    return 0;
+}
+
 static void cfg_load_file(cfg_t *c, const char *path) {
     FILE *fp = fopen(path, "r");
     if (!fp) return; // optional
@@ -238,6 +671,27 @@ static void cfg_load_file(cfg_t *c, const char *path) {
             }
         } else if (!strcasecmp(k,"port")) {
             c->port = atoi(v);
+        } else if (!strcasecmp(k,"connect_timeout")) {
+            long ms = parse_duration_ms(v);
+            if (ms < 0 || ms > INT_MAX) fprintf(stderr, "config: invalid connect_timeout '%s'\n", v);
+            else c->connect_timeout_ms = (int)ms;
+        } else if (!strcasecmp(k,"timeout")) {
+            long ms = parse_duration_ms(v);
+            if (ms < 0 || ms > INT_MAX) fprintf(stderr, "config: invalid timeout '%s'\n", v);
+            else c->timeout_ms = (int)ms;
+        } else if (!strcasecmp(k,"inventory")) {
+            if (snprintf(c->inventory, sizeof(c->inventory), "%s", v) >= (int)sizeof(c->inventory))
+                fprintf(stderr, "config: inventory path truncated to %zu bytes\n", sizeof(c->inventory)-1);
+        } else if (!strcasecmp(k,"proto")) {
+            if (parse_proto(v, &c->proto) != 0) fprintf(stderr, "config: invalid proto '%s'\n", v);
+        } else if (!strcasecmp(k,"shm")) {
+            long long n = !strcasecmp(v, "off") ? 0 : (!strcasecmp(v, "on") ? SHM_DEFAULT_SIZE : parse_size(v));
+            if (n < 0 || n > SHM_MAX_SIZE) fprintf(stderr, "config: invalid shm '%s'\n", v);
+            else c->shm_bytes = (size_t)n;
+        } else if (!strncasecmp(k,"cache.",6)) {
+            if (cfg_set_cache_rule(c, k+6, v) != 0) fprintf(stderr, "config: invalid cache rule '%s'\n", k);
+        } else if (!strncasecmp(k,"export.",7)) {
+            if (cfg_set_export_rule(c, k+7, v) != 0) fprintf(stderr, "config: invalid export rule '%s'\n", k);
         }
     }
     fclose(fp);
@@ -277,6 +731,20 @@ static int cfg_write_file(const cfg_t *c, const char *path) {
     fprintf(fp, "host=%s\n", c->host[0] ? c->host : "127.0.0.1");
     fprintf(fp, "port=%d\n", c->port > 0 ? c->port : 9000);
 #endif
+    if (c->connect_timeout_ms > 0)
+        fprintf(fp, "connect_timeout=%dms\n", c->connect_timeout_ms);
+    if (c->timeout_ms > 0)
+        fprintf(fp, "timeout=%dms\n", c->timeout_ms);
+    if (c->inventory[0])
+        fprintf(fp, "inventory=%s\n", c->inventory);
+    if (c->proto != VC_PROTO_AUTO)
+        fprintf(fp, "proto=%s\n", proto_name(c->proto));
+    if (c->shm_bytes)
+        fprintf(fp, "shm=%zu\n", c->shm_bytes);
+    for (int i = 0; i < c->ncache; i++)
+        fprintf(fp, "cache.%s=%dms\n", c->cache[i].cmd, c->cache[i].ttl_ms);
+    for (int i = 0; i < c->nexport; i++)
+        fprintf(fp, "export.%s=%s\n", c->exports[i].name, c->exports[i].cmd);
 
     fclose(fp);
     fprintf(stderr, "[cfg] wrote %s\n", path);
@@ -284,10 +752,82 @@ static int cfg_write_file(const cfg_t *c, const char *path) {
 }
 
 // ----- connections -----
+/*
+ * Request deadlines and cancellation. --deadline=500ms (or timeout= in the
+ * config) arms g_deadline_ns for the whole life of a request: name
+ * resolution, connect, send and the reply all clip their waits to it. In
+ * the REPL, Ctrl-C sets g_cancel, which every wait treats the same way as
+ * an expired deadline. A request that runs out of time leaves its
+ * connection either drained or closed, never half-read.
+ */
+static int g_timeout_ms = 0;                  /* per-request budget, 0 = none */
+static uint64_t g_deadline_ns = 0;            /* armed deadline, 0 = none */
+static volatile sig_atomic_t g_cancel = 0;    /* set by SIGINT in the REPL */
+static int g_sigint_cancels = 0;              /* REPL handler installed: waits must poll */
+static int g_expired = 0;                     /* last request expired or was cancelled */
+static int g_drain_ms = 0;                    /* REPL: budget to drain an abandoned reply */
+static int g_abandoned = 0;                   /* conn_abandon already drained or closed */
+
+static void deadline_arm(void) {
+    g_deadline_ns = g_timeout_ms > 0 ? mono_ns() + (uint64_t)g_timeout_ms * 1000000ull : 0;
+    g_expired = 0;
+    g_cancel = 0;
+}
+static void deadline_disarm(void) { g_deadline_ns = 0; }
+
+/* True once the armed deadline has passed or the request was cancelled. */
+static int deadline_expired(void) {
+    if (g_cancel || (g_deadline_ns && mono_ns() >= g_deadline_ns)) { g_expired = 1; return 1; }
+    return 0;
+}
+
+/* Clip a wait in ms (-1 = forever) to what is left of the armed deadline. */
+static int deadline_clip(int wait_ms) {
+    if (!g_deadline_ns) return wait_ms;
+    uint64_t now = mono_ns();
+    uint64_t left = now >= g_deadline_ns ? 0 : (g_deadline_ns - now + 999999) / 1000000;
+    if (left > INT_MAX) left = INT_MAX;
+    return (wait_ms < 0 || (uint64_t)wait_ms > left) ? (int)left : wait_ms;
+}
+
+static const char *deadline_what(void) { return g_cancel ? "cancelled" : "deadline expired"; }
+
+static int sock_set_nonblock(int fd, int on) {
+#ifdef _WIN32
+    u_long mode = on ? 1 : 0;
+    return ioctlsocket(fd, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int fl = fcntl(fd, F_GETFL, 0);
+    if (fl < 0) return -1;
+    fl = on ? (fl | O_NONBLOCK) : (fl & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, fl);
+#endif
+}
+
+/* Outcome of a non-blocking connect once the socket polls writable:
+ * 0 if connected, otherwise the socket error code. */
+static int sock_connect_result(int fd) {
+    int err = 0;
+    socklen_t len = sizeof err;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (char*)&err, &len) != 0) return SOCKERR();
+    return err;
+}
+
+static int sock_in_progress(int e) {
+#ifdef _WIN32
+    return e == WSAEWOULDBLOCK || e == WSAEINPROGRESS;
+#else
+    return e == EINPROGRESS || e == EINTR;
+#endif
+}
+
 #ifndef _WIN32
-static int connect_unix_path(const char *sock) {
+/* With nonblock set the socket is returned in non-blocking mode and the
+ * connect may still be in progress; errors are then left in errno for the
+ * caller to report. */
+static int connect_unix_path(const char *sock, int nonblock) {
     int fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) { perror("socket(AF_UNIX)"); return -1; }
+    if (fd < 0) { if (!nonblock) perror("socket(AF_UNIX)"); return -1; }
     struct sockaddr_un addr; memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
 
@@ -296,90 +836,7377 @@ static int connect_unix_path(const char *sock) {
         fprintf(stderr, "unix socket path too long (max %zu): %s\n",
                 sizeof(addr.sun_path) - 1, sock);
         CLOSESOCK(fd);
+        errno = ENAMETOOLONG;
         return -1;
     }
     memcpy(addr.sun_path, sock, slen + 1);
 
-    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("connect(unix)"); CLOSESOCK(fd); return -1;
+    if (nonblock && sock_set_nonblock(fd, 1) != 0) { CLOSESOCK(fd); return -1; }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 &&
+        !(nonblock && sock_in_progress(errno))) {
+        int e = errno;
+        if (!nonblock) perror("connect(unix)");
+        CLOSESOCK(fd);
+        errno = e;
+        return -1;
+    }
+    return fd;
+}
+#endif
+
+#ifndef _WIN32
+/* getaddrinfo cannot be interrupted, so under a deadline (or off the
+ * exporter's poll loop) it runs on a detached thread. If the caller gives up first the job is abandoned and
+ * the thread frees it (and any late result) when the lookup returns. */
+typedef struct {
+    pthread_mutex_t  mu;
+    pthread_cond_t   cv;
+    int              done, abandoned, err;
+    struct addrinfo *res;
+    char             host[256], port[16];
+} resolve_job_t;
+
+static void resolve_job_free(resolve_job_t *j) {
+    if (j->res) freeaddrinfo(j->res);
+    pthread_cond_destroy(&j->cv);
+    pthread_mutex_destroy(&j->mu);
+    free(j);
+}
+
+static void *resolve_thread(void *arg) {
+    resolve_job_t *j = (resolve_job_t*)arg;
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(j->host, j->port, &hints, &res);
+    pthread_mutex_lock(&j->mu);
+    j->err = err; j->res = res; j->done = 1;
+    int gone = j->abandoned;
+    pthread_cond_signal(&j->cv);
+    pthread_mutex_unlock(&j->mu);
+    if (gone) resolve_job_free(j);
+    return NULL;
+}
+
+/* Start a lookup on its own thread; NULL with *err set if that fails. */
+static resolve_job_t *resolve_job_start(const char *host, const char *portstr, int *err) {
+    resolve_job_t *j = (resolve_job_t*)calloc(1, sizeof *j);
+    if (!j) { *err = EAI_MEMORY; return NULL; }
+    snprintf(j->host, sizeof j->host, "%s", host);
+    snprintf(j->port, sizeof j->port, "%s", portstr);
+    pthread_mutex_init(&j->mu, NULL);
+    pthread_cond_init(&j->cv, NULL);
+    pthread_t th;
+    if (pthread_create(&th, NULL, resolve_thread, j) != 0) {
+        resolve_job_free(j);
+        *err = EAI_SYSTEM;
+        return NULL;
+    }
+    pthread_detach(th);
+    return j;
+}
+
+/* Without waiting: 1 once the lookup finished (*err and *res are set and the
+ * job is freed), 0 while it is still running. */
+static int resolve_job_poll(resolve_job_t *j, int *err, struct addrinfo **res) {
+    pthread_mutex_lock(&j->mu);
+    int done = j->done;
+    pthread_mutex_unlock(&j->mu);
+    if (!done) return 0;
+    *err = j->err;
+    *res = j->res; j->res = NULL;
+    resolve_job_free(j);
+    return 1;
+}
+
+/* Give up on a lookup; the thread frees the job when getaddrinfo returns. */
+static void resolve_job_abandon(resolve_job_t *j) {
+    pthread_mutex_lock(&j->mu);
+    int done = j->done;
+    j->abandoned = 1;
+    pthread_mutex_unlock(&j->mu);
+    if (done) resolve_job_free(j);
+}
+
+/* Returns 0 or a getaddrinfo error; EAI_AGAIN with g_expired set when the
+ * deadline passed or the request was cancelled first. */
+static int tcp_resolve_bounded(const char *host, const char *portstr, struct addrinfo **res) {
+    int err;
+    resolve_job_t *j = resolve_job_start(host, portstr, &err);
+    if (!j) return err;
+
+    pthread_mutex_lock(&j->mu);
+    while (!j->done && !deadline_expired()) {
+        /* short slices so Ctrl-C is noticed without a signal on this cond */
+        int slice = deadline_clip(50);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long)slice * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&j->cv, &j->mu, &ts);
+    }
+    pthread_mutex_unlock(&j->mu);
+    if (!resolve_job_poll(j, &err, res)) {
+        resolve_job_abandon(j);
+        return EAI_AGAIN;
+    }
+    return err;
+}
+#endif
+
+static int tcp_resolve(const char *host, int port, struct addrinfo **res) {
+    char portstr[16]; snprintf(portstr, sizeof portstr, "%d", port);
+    *res = NULL;
+#ifndef _WIN32
+    if (g_deadline_ns || g_sigint_cancels) return tcp_resolve_bounded(host, portstr, res);
+#endif
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    return getaddrinfo(host, portstr, &hints, res);
+}
+
+/* Open a socket for one resolved address and start connecting. With nonblock
+ * the connect may still be in progress when this returns. */
+static int connect_addr(const struct addrinfo *ai, int nonblock) {
+    socket_t fd = (socket_t)socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if ((int)fd < 0) return -1;
+    if (nonblock && sock_set_nonblock((int)fd, 1) != 0) { CLOSESOCK(fd); return -1; }
+    if (connect(fd, ai->ai_addr, (int)ai->ai_addrlen) != 0 &&
+        !(nonblock && sock_in_progress(SOCKERR()))) {
+        int e = SOCKERR();
+        CLOSESOCK(fd);
+#ifdef _WIN32
+        WSASetLastError(e);
+#else
+        errno = e;
+#endif
+        return -1;
+    }
+    return (int)fd;
+}
+
+/*
+ * Happy eyeballs (RFC 8305): addresses are tried in interleaved family order
+ * (v6, v4, v6, ...), starting a new non-blocking attempt every
+ * HE_STAGGER_MS or as soon as the previous one fails. The first socket to
+ * connect wins and the rest are closed, so a dead route for one family no
+ * longer costs the kernel's full TCP timeout. timeout_ms bounds the whole
+ * connect (0 = no deadline).
+ */
+#define HE_STAGGER_MS   250
+#define HE_MAX_ADDRS    16
+
+static size_t he_order(struct addrinfo *res, struct addrinfo **out, size_t max) {
+    struct addrinfo *fam1[HE_MAX_ADDRS], *fam2[HE_MAX_ADDRS];
+    size_t n1 = 0, n2 = 0, n = 0;
+    int first = res ? res->ai_family : AF_UNSPEC;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family == first) { if (n1 < HE_MAX_ADDRS) fam1[n1++] = ai; }
+        else if (n2 < HE_MAX_ADDRS) fam2[n2++] = ai;
+    }
+    for (size_t i = 0; (i < n1 || i < n2) && n < max; i++) {
+        if (i < n1 && n < max) out[n++] = fam1[i];
+        if (i < n2 && n < max) out[n++] = fam2[i];
+    }
+    return n;
+}
+
+static int connect_tcp_host(const char *host, int port, int timeout_ms) {
+    struct addrinfo *res = NULL;
+    uint64_t t_res = mono_ns();
+    int err = tcp_resolve(host, port, &res);
+    trace_span("resolve", t_res, mono_ns(), "host", host);
+    if (err) {
+        fprintf(stderr, "getaddrinfo: %s\n", g_expired ? deadline_what() : gai_strerror(err));
+        return -1;
+    }
+
+    struct addrinfo *order[HE_MAX_ADDRS];
+    struct pollfd pfd[HE_MAX_ADDRS];
+    size_t naddr = he_order(res, order, HE_MAX_ADDRS);
+    size_t next = 0, live = 0;
+    int winner = -1, last_err = 0;
+    uint64_t start = mono_ns();
+    uint64_t deadline = timeout_ms > 0 ? start + (uint64_t)timeout_ms * 1000000ull : 0;
+    if (g_deadline_ns && (!deadline || g_deadline_ns < deadline)) deadline = g_deadline_ns;
+    uint64_t next_start = start;
+
+    while (winner < 0) {
+        uint64_t now = mono_ns();
+        if (deadline_expired()) break;
+        if (deadline && now >= deadline) { last_err = ETIMEDOUT; break; }
+
+        /* launch the next attempt when its slot comes up or nothing is pending */
+        while (next < naddr && (now >= next_start || live == 0)) {
+            int fd = connect_addr(order[next++], 1);
+            if (fd < 0) { last_err = SOCKERR(); continue; }
+            pfd[live].fd = fd; pfd[live].events = POLLOUT; pfd[live].revents = 0;
+            live++;
+            next_start = now + (uint64_t)HE_STAGGER_MS * 1000000ull;
+            break;
+        }
+        if (live == 0) break;   /* every address failed outright */
+
+        int wait_ms = -1;
+        if (next < naddr) wait_ms = (int)((next_start - now) / 1000000ull) + 1;
+        if (deadline) {
+            int left = (int)((deadline - now) / 1000000ull) + 1;
+            if (wait_ms < 0 || left < wait_ms) wait_ms = left;
+        }
+        int n = poll(pfd, (unsigned)live, wait_ms);
+        if (n < 0) {
+            if (SOCKERR() == EINTR) continue;
+            last_err = SOCKERR();
+            break;
+        }
+        for (size_t i = 0; i < live && n > 0; ) {
+            if (!pfd[i].revents) { i++; continue; }
+            int e = sock_connect_result(pfd[i].fd);
+            if (e == 0) { winner = pfd[i].fd; pfd[i] = pfd[--live]; break; }
+            last_err = e;
+            CLOSESOCK(pfd[i].fd);
+            pfd[i] = pfd[--live];
+            next_start = now;   /* failed: start the next one right away */
+        }
+    }
+    for (size_t i = 0; i < live; i++) CLOSESOCK(pfd[i].fd);
+    freeaddrinfo(res);
+    if (TRACE_ON()) {
+        char info[48];
+        snprintf(info, sizeof info, "%zu of %zu addresses tried", next, naddr);
+        trace_span("tcp_connect", start, mono_ns(), "attempts", info);
+    }
+
+    if (winner >= 0) {
+        sock_set_nonblock(winner, 0);
+        return winner;
+    }
+    if (g_expired) {
+        fprintf(stderr, "connect(tcp): %s\n", deadline_what());
+        return -1;
+    }
+    if (last_err == ETIMEDOUT) {
+        fprintf(stderr, "connect(tcp): timed out after %d ms\n", timeout_ms);
+        return -1;
+    }
+#ifdef _WIN32
+    fprintf(stderr, "connect(tcp) failed, WSAErr=%d\n", last_err);
+#else
+    fprintf(stderr, "connect(tcp): %s\n", strerror(last_err));
+#endif
+    return -1;
+}
+
+static int connect_from_cfg_inner(const cfg_t *c) {
+    if (c->mode == VC_MODE_TCP) {
+        if (!c->host[0] || c->port<=0) { fprintf(stderr, "tcp config incomplete\n"); return -1; }
+        return connect_tcp_host(c->host, c->port, c->connect_timeout_ms);
+    }
+#ifndef _WIN32
+    if (c->mode == VC_MODE_UNIX) {
+        if (!c->socket_path[0]) { fprintf(stderr, "unix socket path missing\n"); return -1; }
+        return connect_unix_path(c->socket_path, 0);
+    }
+#endif
+    fprintf(stderr, "no valid mode\n");
+    return -1;
+}
+
+static int connect_from_cfg(const cfg_t *c) {
+    uint64_t t0 = mono_ns();
+    int fd = connect_from_cfg_inner(c);
+    if (fd >= 0) stats_note_connect();
+    if (TRACE_ON()) {
+        char target[300];
+        if (c->mode == VC_MODE_TCP) snprintf(target, sizeof target, "%s:%d", c->host, c->port);
+        else snprintf(target, sizeof target, "unix:%s", c->socket_path);
+        trace_span(fd >= 0 ? "connect" : "connect_failed", t0, mono_ns(), "target", target);
+    }
+    return fd;
+}
+
+// ----- response framing -----
+/*
+ * hostd frames every reply so the client always knows where it ends:
+ *
+ *   $<len>\n<len bytes>   data chunk; payload is opaque (NULs allowed)
+ *   .[trailer]\n          end of response, optional one-line status
+ *
+ * A reply may carry any number of chunks, so hostd can stream output of
+ * unknown size. A reply that does not open with a chunk header or end
+ * marker comes from an older hostd that writes bare text; it is passed
+ * through unchanged and considered complete once the socket has been idle
+ * for LEGACY_IDLE_MS. A reply whose first line starts with '.' is only an
+ * end marker if the rest looks like a trailer (empty, or a letter followed
+ * by printable text); "./disk.img" or ".5" is bare text.
+ *
+ * After a successful "hello proto=bin1" exchange (see conn_negotiate) both
+ * directions switch to binary frames with an 8-byte little-endian header:
+ *
+ *   u32 length | u8 type | u8 flags | u16 tag     then `length` payload bytes
+ *
+ * Requests are BIN_REQ frames holding typed fields (a "cmd" string). Every
+ * reply frame echoes the request's tag: BIN_DATA carries raw output,
+ * BIN_FIELDS typed name/value fields (rendered here as name=value lines)
+ * and BIN_END the status trailer. Unknown frame types are skipped.
+ *
+ * On a UNIX socket with a shared-memory ring (see conn_shm_offer), hostd may
+ * also send chunks by reference, "&<pos> <len>\n" in text or a BIN_SHM
+ * frame: the payload is already in the ring at pos and the client only
+ * copies it out and releases it.
+ *
+ * hostd may push events at any time, between replies or between the chunks
+ * of one: "!<len>\n<bytes>" in text, BIN_EVENT frames (tag 0) in binary.
+ * They are only recognised where a handler is installed (the REPL) and are
+ * delivered separately from the reply payload.
+ */
+#define RX_BUF_SIZE     (64 * 1024)
+#define LEGACY_IDLE_MS  50
+#define RESP_LINE_MAX   128
+#define IO_TIMEOUT      (-3)
+#define EVENT_MAX       1024   /* longer events are truncated */
+
+#define BIN_HDR_SIZE    8
+enum { BIN_REQ = 1, BIN_DATA = 2, BIN_END = 3, BIN_EVENT = 4, BIN_FIELDS = 5, BIN_SHM = 6 };
+enum { FIELD_STR = 1, FIELD_U64 = 2, FIELD_I64 = 3, FIELD_BYTES = 4 };
+#define FIELD_HDR_SIZE  6   /* u8 kind | u8 name_len | u32 value_len */
+
+/*
+ * Shared-memory ring: a header page followed by `size` data bytes. hostd
+ * produces at `head`, the client releases at `tail`; both count bytes
+ * monotonically, so data for position pos lives at data[pos % size]. A chunk
+ * never wraps; hostd skips to the start of the data area instead.
+ */
+#define SHM_MAGIC     0x31676e72u   /* "rng1" */
+#define SHM_HDR_SIZE  4096
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;          /* bytes in the data area */
+    uint64_t head;          /* written by hostd */
+    uint64_t tail;          /* written by vim-cmd */
+} shm_ring_hdr_t;
+
+typedef struct {
+    shm_ring_hdr_t *hdr;
+    unsigned char  *data;
+    size_t          map_len;
+    uint64_t        size;   /* data area, kept privately: hdr is peer-writable */
+} shm_map_t;
+
+static uint32_t get_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+static uint64_t get_le64(const unsigned char *p) {
+    return (uint64_t)get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+static void put_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16); p[3] = (unsigned char)(v >> 24);
+}
+static void put_le16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)v; p[1] = (unsigned char)(v >> 8);
+}
+
+typedef int (*resp_sink_fn)(void *ctx, const void *data, size_t len);
+typedef void (*resp_event_fn)(void *ctx, const char *text, size_t len);
+
+typedef enum {
+    RESP_START = 0,   /* nothing received yet */
+    RESP_NEXT,        /* between chunks: expect '$' or '.' */
+    RESP_HDR,         /* inside "$<len>" */
+    RESP_DATA,        /* inside chunk payload */
+    RESP_TRAILER,     /* inside ".<trailer>" */
+    RESP_LEGACY,      /* unframed reply, passthrough */
+    RESP_BHDR,        /* binary: inside a frame header */
+    RESP_BEND,        /* binary: inside the END frame's trailer */
+    RESP_BFIELDS,     /* binary: inside a typed-fields frame */
+    RESP_BSKIP,       /* binary: skipping a frame of unknown type */
+    RESP_SHM,         /* "&<pos> <len>" reference to ring data */
+    RESP_BSHM,        /* binary: inside a BIN_SHM frame */
+    RESP_EVHDR,       /* inside "!<len>" */
+    RESP_EVDATA,      /* inside an event's payload */
+    RESP_DONE,
+    RESP_ERROR
+} resp_state_t;
+
+typedef struct {
+    resp_state_t st;
+    uint64_t     remain;              /* payload bytes left in current chunk */
+    uint64_t     bytes;               /* payload bytes delivered so far */
+    size_t       llen;
+    char         line[RESP_LINE_MAX]; /* header being parsed; trailer once done */
+    resp_sink_fn sink;
+    void        *ctx;
+    int          sink_err;            /* sink failed; rest of reply discarded */
+    uint64_t     first_ns;            /* first reply byte seen (tracing only) */
+    int          bin;                 /* binary framing negotiated */
+    uint16_t     tag;                 /* binary: tag every frame must carry */
+    uint8_t      fstate;              /* fields: 0 header, 1 name, 2 value */
+    uint8_t      fkind;
+    uint32_t     fleft;               /* fields: bytes left in name/value */
+    unsigned char fbuf[8];            /* fields: header or number being read */
+    size_t       fblen;
+    const shm_map_t *shm;             /* ring for by-reference chunks */
+    int          legacy;              /* reply turned out to be unframed */
+    int          lead_dot;            /* trailer opened the reply: may be bare text */
+    resp_event_fn on_event;           /* pushed events; NULL = not expected */
+    void        *event_ctx;
+    resp_state_t ev_ret;              /* state to resume after the event */
+    size_t       ev_len;
+    char         ev[EVENT_MAX];
+} resp_t;
+
+static void resp_init(resp_t *r, resp_sink_fn sink, void *ctx) {
+    memset(r, 0, sizeof(*r));
+    r->sink = sink;
+    r->ctx = ctx;
+}
+
+static void resp_emit(resp_t *r, const void *p, size_t n) {
+    r->bytes += n;
+    if (r->sink_err || !r->sink || n == 0) return;
+    if (r->sink(r->ctx, p, n) != 0) r->sink_err = 1;
+}
+
+/* Deliver a by-reference chunk from the ring and hand the space back. */
+static void resp_shm_chunk(resp_t *r, uint64_t pos, uint64_t len) {
+    const shm_map_t *m = r->shm;
+    if (!m || !m->size || len > m->size || pos % m->size + len > m->size) {
+        r->st = RESP_ERROR;
+        return;
+    }
+    resp_emit(r, m->data + pos % m->size, (size_t)len);
+#ifndef _WIN32
+    __atomic_store_n(&m->hdr->tail, pos + len, __ATOMIC_RELEASE);
+#endif
+}
+
+static void resp_event_begin(resp_t *r, resp_state_t ret) {
+    r->ev_ret = ret;
+    r->ev_len = 0;
+    r->st = RESP_EVDATA;
+    if (r->remain == 0) { r->on_event(r->event_ctx, r->ev, 0); r->st = ret; }
+}
+
+static void resp_bin_header(resp_t *r) {
+    const unsigned char *h = (const unsigned char*)r->line;
+    uint32_t len = get_le32(h);
+    uint16_t tag = (uint16_t)(h[6] | h[7] << 8);
+    r->llen = 0;
+    r->remain = len;
+    if (h[4] == BIN_EVENT && r->on_event) { resp_event_begin(r, RESP_BHDR); return; }
+    if (h[4] == BIN_EVENT || h[4] < BIN_DATA || h[4] > BIN_SHM) {
+        r->st = len ? RESP_BSKIP : RESP_BHDR;
+        return;
+    }
+    if (tag != r->tag) { r->st = RESP_ERROR; return; }
+    switch (h[4]) {
+    case BIN_DATA:   r->st = len ? RESP_DATA : RESP_BHDR; break;
+    case BIN_FIELDS: r->st = len ? RESP_BFIELDS : RESP_BHDR; r->fstate = 0; r->fblen = 0; break;
+    case BIN_END:
+        r->st = len ? RESP_BEND : RESP_DONE;
+        r->line[0] = 0;
+        break;
+    case BIN_SHM:   /* u64 pos | u64 len */
+        r->st = len == 16 ? RESP_BSHM : RESP_ERROR;
+        break;
+    }
+}
+
+/* Render typed fields as "name=value\n" lines while they stream in. */
+static size_t resp_feed_fields(resp_t *r, const unsigned char *p, size_t n) {
+    size_t i = 0;
+    if ((uint64_t)n > r->remain) n = (size_t)r->remain;
+    while (i < n && r->st == RESP_BFIELDS) {
+        if (r->fstate == 0) {
+            r->fbuf[r->fblen++] = p[i++];
+            if (r->fblen < FIELD_HDR_SIZE) continue;
+            r->fkind = r->fbuf[0];
+            r->fleft = r->fbuf[1];
+            uint32_t vlen = get_le32(r->fbuf + 2);
+            if ((r->fkind == FIELD_U64 || r->fkind == FIELD_I64) && vlen != 8) { r->st = RESP_ERROR; break; }
+            r->fblen = vlen;   /* parked until the name is done */
+            r->fstate = 1;
+        }
+        if (r->fstate == 1) {
+            size_t take = n - i < r->fleft ? n - i : r->fleft;
+            resp_emit(r, p + i, take);
+            i += take;
+            r->fleft -= (uint32_t)take;
+            if (r->fleft) continue;
+            resp_emit(r, "=", 1);
+            r->fleft = (uint32_t)r->fblen;
+            r->fblen = 0;
+            r->fstate = 2;
+        }
+        if (r->fstate == 2) {
+            size_t take = n - i < r->fleft ? n - i : r->fleft;
+            if (r->fkind == FIELD_U64 || r->fkind == FIELD_I64) {
+                memcpy(r->fbuf + r->fblen, p + i, take);
+                r->fblen += take;
+            } else if (r->fkind == FIELD_BYTES) {
+                static const char hex[] = "0123456789abcdef";
+                char out[128];
+                for (size_t k = 0; k < take; ) {
+                    size_t o = 0;
+                    for (; k < take && o < sizeof out; k++) {
+                        out[o++] = hex[p[i + k] >> 4];
+                        out[o++] = hex[p[i + k] & 15];
+                    }
+                    resp_emit(r, out, o);
+                }
+            } else {
+                resp_emit(r, p + i, take);
+            }
+            i += take;
+            r->fleft -= (uint32_t)take;
+            if (r->fleft) continue;
+            if (r->fkind == FIELD_U64 || r->fkind == FIELD_I64) {
+                uint64_t v = get_le64(r->fbuf);
+                char num[24];
+                int m = r->fkind == FIELD_U64 ? snprintf(num, sizeof num, "%llu", (unsigned long long)v)
+                                              : snprintf(num, sizeof num, "%lld", (long long)(int64_t)v);
+                resp_emit(r, num, (size_t)m);
+            }
+            resp_emit(r, "\n", 1);
+            r->fstate = 0;
+            r->fblen = 0;
+        }
+    }
+    r->remain -= i;
+    if (r->st == RESP_BFIELDS && r->remain == 0) {
+        if (r->fstate != 0 || r->fblen) r->st = RESP_ERROR;
+        else { r->st = RESP_BHDR; r->llen = 0; }
+    }
+    return i;
+}
+
+/* Feed received bytes to the parser. Returns how many were consumed; anything
+ * left over belongs to the next reply. */
+static size_t resp_feed(resp_t *r, const unsigned char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && r->st != RESP_DONE && r->st != RESP_ERROR) {
+        switch (r->st) {
+        case RESP_START:
+        case RESP_NEXT:
+            if (r->bin) { r->st = RESP_BHDR; r->llen = 0; break; }
+            if (p[i] == '!' && r->on_event) {
+                r->ev_ret = r->st;
+                r->st = RESP_EVHDR; r->llen = 0; r->remain = 0; i++;
+            } else if (p[i] == '$') {
+                r->st = RESP_HDR; r->llen = 0; r->remain = 0; i++;
+            } else if (p[i] == '.') {
+                r->lead_dot = r->st == RESP_START;
+                r->st = RESP_TRAILER; r->llen = 0; i++;
+            } else if (p[i] == '&' && r->shm) {
+                r->st = RESP_SHM; r->llen = 0; i++;
+            } else if (r->st == RESP_START) {
+                r->st = RESP_LEGACY;
+            } else {
+                r->st = RESP_ERROR;
+            }
+            break;
+        case RESP_HDR:
+            if (p[i] >= '0' && p[i] <= '9' && r->llen < 19) {
+                r->remain = r->remain * 10 + (uint64_t)(p[i] - '0');
+                r->line[r->llen++] = (char)p[i++];
+            } else if (p[i] == '\n' && r->llen > 0) {
+                i++;
+                r->st = r->remain ? RESP_DATA : RESP_NEXT;
+            } else if (r->bytes == 0 && r->st == RESP_HDR && !r->sink_err) {
+                /* not a header after all: an unframed reply starting with '$' */
+                resp_emit(r, "$", 1);
+                resp_emit(r, r->line, r->llen);
+                r->st = RESP_LEGACY;
+            } else {
+                r->st = RESP_ERROR;
+            }
+            break;
+        case RESP_DATA: {
+            size_t take = n - i;
+            if ((uint64_t)take > r->remain) take = (size_t)r->remain;
+            resp_emit(r, p + i, take);
+            i += take;
+            r->remain -= take;
+            if (r->remain == 0) { r->st = r->bin ? RESP_BHDR : RESP_NEXT; r->llen = 0; }
+            break;
+        }
+        case RESP_TRAILER:
+            if (r->lead_dot && p[i] != '\n' && p[i] != '\r' &&
+                ((r->llen == 0 && !isalpha(p[i])) || (p[i] < 0x20 && p[i] != '\t') || p[i] == 0x7f ||
+                 r->llen == sizeof(r->line) - 1)) {
+                /* not a trailer after all: an unframed reply starting with '.' */
+                resp_emit(r, ".", 1);
+                resp_emit(r, r->line, r->llen);
+                r->st = RESP_LEGACY;
+                break;
+            }
+            if (p[i] == '\n') {
+                while (r->llen && r->line[r->llen-1] == '\r') r->llen--;
+                r->line[r->llen] = 0;
+                r->st = RESP_DONE;
+            } else if (r->llen < sizeof(r->line) - 1) {
+                r->line[r->llen++] = (char)p[i];
+            }
+            i++;
+            break;
+        case RESP_LEGACY:
+            resp_emit(r, p + i, n - i);
+            i = n;
+            break;
+        case RESP_BHDR:
+            r->line[r->llen++] = (char)p[i++];
+            if (r->llen == BIN_HDR_SIZE) resp_bin_header(r);
+            break;
+        case RESP_BEND:
+        case RESP_BSKIP: {
+            size_t take = n - i;
+            if ((uint64_t)take > r->remain) take = (size_t)r->remain;
+            for (size_t k = 0; r->st == RESP_BEND && k < take; k++)
+                if (r->llen < sizeof(r->line) - 1) r->line[r->llen++] = (char)p[i + k];
+            i += take;
+            r->remain -= take;
+            if (r->remain) break;
+            if (r->st == RESP_BEND) { r->line[r->llen] = 0; r->st = RESP_DONE; }
+            else { r->st = RESP_BHDR; r->llen = 0; }
+            break;
+        }
+        case RESP_BFIELDS:
+            i += resp_feed_fields(r, p + i, n - i);
+            break;
+        case RESP_SHM:
+            if (p[i] == '\n') {
+                char *end;
+                r->line[r->llen] = 0;
+                unsigned long long pos = strtoull(r->line, &end, 10);
+                unsigned long long len = *end == ' ' ? strtoull(end + 1, &end, 10) : 0;
+                if (*end || r->llen == 0) { r->st = RESP_ERROR; break; }
+                i++;
+                r->st = RESP_NEXT;
+                resp_shm_chunk(r, pos, len);
+            } else if ((isdigit(p[i]) || p[i] == ' ') && r->llen < 40) {
+                r->line[r->llen++] = (char)p[i++];
+            } else {
+                r->st = RESP_ERROR;
+            }
+            break;
+        case RESP_EVHDR:
+            if (p[i] >= '0' && p[i] <= '9' && r->llen < 19) {
+                r->remain = r->remain * 10 + (uint64_t)(p[i] - '0');
+                r->line[r->llen++] = (char)p[i++];
+            } else if (p[i] == '\n' && r->llen > 0) {
+                i++;
+                resp_event_begin(r, r->ev_ret);
+            } else if (r->ev_ret == RESP_START && r->bytes == 0 && !r->sink_err) {
+                /* an unframed reply that happens to start with '!' */
+                resp_emit(r, "!", 1);
+                resp_emit(r, r->line, r->llen);
+                r->st = RESP_LEGACY;
+            } else {
+                r->st = RESP_ERROR;
+            }
+            break;
+        case RESP_EVDATA: {
+            size_t take = n - i;
+            if ((uint64_t)take > r->remain) take = (size_t)r->remain;
+            size_t keep = take < EVENT_MAX - r->ev_len ? take : EVENT_MAX - r->ev_len;
+            memcpy(r->ev + r->ev_len, p + i, keep);
+            r->ev_len += keep;
+            i += take;
+            r->remain -= take;
+            if (r->remain) break;
+            r->on_event(r->event_ctx, r->ev, r->ev_len);
+            r->st = r->ev_ret;
+            r->llen = 0;
+            break;
+        }
+        case RESP_BSHM:
+            r->line[r->llen++] = (char)p[i++];
+            if (r->llen < 16) break;
+            r->st = RESP_BHDR;
+            resp_shm_chunk(r, get_le64((const unsigned char*)r->line),
+                           get_le64((const unsigned char*)r->line + 8));
+            r->llen = 0;
+            break;
+        default:
+            return i;
+        }
+    }
+    return i;
+}
+
+// ----- session recording -----
+/*
+ * --record=session.log appends every command sent with send_command_to()
+ * or from a batch to a compact binary log that `vim-cmd replay` re-drives:
+ *
+ *   header   "VCRL" u32 version          (only when the file is created)
+ *   record   u8 flags (bit 0: failed)
+ *            varint start   wall clock, microseconds since the epoch
+ *            varint latency microseconds until the reply was complete
+ *            varint bytes   reply payload size
+ *            varint len, then len bytes of command line (no newline)
+ *
+ * Varints are LEB128. Records are gathered in memory and appended with one
+ * write() per REC_BUF_SIZE, so concurrent vim-cmd processes recording to the
+ * same file interleave whole buffers, never partial records. The header is
+ * written as soon as the file is created, ahead of anyone's records, and
+ * the REPL writes after every command so an idle session loses nothing.
+ */
+#define REC_MAGIC      "VCRL"
+#define REC_VERSION    1
+#define REC_BUF_SIZE   (64 * 1024)
+#define REC_CMD_MAX    4096
+
+static struct {
+    int           fd;
+    int           each;       /* flush after every record (REPL) */
+    size_t        len;
+    unsigned char buf[REC_BUF_SIZE];
+} g_rec = { .fd = -1 };
+
+#define REC_ON() (g_rec.fd >= 0)
+
+static uint64_t wall_us(void) {
+#ifdef _WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return t / 10 - 11644473600000000ull;   /* 100 ns since 1601 -> us since 1970 */
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+#endif
+}
+
+static size_t put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) { p[n++] = (unsigned char)(v | 0x80); v >>= 7; }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+/* Decode a varint from p[0..n); returns bytes used, 0 if truncated. */
+static size_t get_varint(const unsigned char *p, size_t n, uint64_t *v) {
+    uint64_t x = 0;
+    for (size_t i = 0; i < n && i < 10; i++) {
+        x |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) { *v = x; return i + 1; }
+    }
+    return 0;
+}
+
+static void rec_flush(void) {
+    if (!REC_ON() || !g_rec.len) return;
+    const unsigned char *p = g_rec.buf;
+    size_t n = g_rec.len;
+    while (n) {
+#ifdef _WIN32
+        int w = _write(g_rec.fd, p, (unsigned)n);
+#else
+        ssize_t w = write(g_rec.fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+#endif
+        if (w <= 0) { perror("record"); break; }
+        p += w; n -= (size_t)w;
+    }
+    g_rec.len = 0;
+}
+
+/* Note one finished command. t0_ns is its mono_ns() start. */
+static void rec_command(const char *line, uint64_t t0_ns, uint64_t t1_ns, uint64_t bytes, int failed) {
+    if (!REC_ON()) return;
+    size_t len = strlen(line);
+    if (len > REC_CMD_MAX) len = REC_CMD_MAX;
+    if (g_rec.len + 1 + 4 * 10 + len > REC_BUF_SIZE) rec_flush();
+    uint64_t now_us = wall_us();
+    uint64_t ago_us = (mono_ns() - t0_ns) / 1000;
+    unsigned char *p = g_rec.buf + g_rec.len;
+    size_t o = 0;
+    p[o++] = failed ? 1 : 0;
+    o += put_varint(p + o, now_us > ago_us ? now_us - ago_us : 0);
+    o += put_varint(p + o, (t1_ns - t0_ns) / 1000);
+    o += put_varint(p + o, bytes);
+    o += put_varint(p + o, len);
+    memcpy(p + o, line, len);
+    g_rec.len += o + len;
+    if (g_rec.each) rec_flush();
+}
+
+static void rec_close(void) {
+    if (!REC_ON()) return;
+    rec_flush();
+    CLOSEFILE(g_rec.fd);
+    g_rec.fd = -1;
+}
+
+static int rec_open(const char *path) {
+    static int registered = 0;
+    if (!registered) { atexit(rec_close); registered = 1; }
+#ifdef _WIN32
+    int fd = _open(path, _O_WRONLY | _O_CREAT | _O_EXCL | _O_APPEND | _O_BINARY, 0644);
+    int created = fd >= 0;
+    if (fd < 0 && errno == EEXIST) fd = _open(path, _O_WRONLY | _O_APPEND | _O_BINARY);
+#else
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0644);
+    int created = fd >= 0;
+    if (fd < 0 && errno == EEXIST) fd = open(path, O_WRONLY | O_APPEND);
+#endif
+    if (fd < 0) { perror(path); return -1; }
+    rec_close();
+    g_rec.fd = fd;
+    if (created) {
+        memcpy(g_rec.buf, REC_MAGIC, 4);
+        put_le32(g_rec.buf + 4, REC_VERSION);
+        g_rec.len = 8;
+        rec_flush();
+    }
+    return 0;
+}
+
+// ----- connection -----
+typedef struct {
+    int            fd;
+    unsigned char *rx;        /* receive buffer, RX_BUF_SIZE bytes */
+    size_t         rx_off;    /* unread data is rx[rx_off .. rx_len) */
+    size_t         rx_len;
+    int            bin;       /* binary framing negotiated */
+    uint16_t       tag;       /* binary: tag of the last request sent */
+    shm_map_t     *shm;       /* shared-memory ring, if hostd accepted one */
+    resp_event_fn  on_event;  /* pushed events, see resp_t */
+    void          *event_ctx;
+} conn_t;
+
+static int conn_open(conn_t *c, int fd) {
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    c->rx = (unsigned char*)malloc(RX_BUF_SIZE);
+    if (!c->rx) { perror("malloc"); CLOSESOCK(fd); return -1; }
+    c->fd = fd;
+    return 0;
+}
+
+static void shm_unmap(shm_map_t *m);
+
+static void conn_close(conn_t *c) {
+    if (c->shm) shm_unmap(c->shm);
+    if (c->fd >= 0) CLOSESOCK(c->fd);
+    free(c->rx);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static int sock_wait(int fd, short events, int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = fd; pfd.events = events; pfd.revents = 0;
+    for (;;) {
+        int n = poll(&pfd, 1, timeout_ms);
+        if (n < 0 && SOCKERR() == EINTR) {
+            if (g_cancel) return 0;     /* Ctrl-C in the REPL: report as a timeout */
+            continue;
+        }
+        return n;
+    }
+}
+
+/* Write as much as the socket takes without blocking (socket must be in
+ * non-blocking mode). Returns bytes written, -1 on error, -2 if peer gone. */
+static long sock_send_some(int fd, const void *data, size_t len) {
+#ifdef _WIN32
+    int n = send(fd, (const char*)data, len > INT_MAX ? INT_MAX : (int)len, 0);
+    if (n == SOCKET_ERROR) {
+        int e = SOCKERR();
+        if (e == WSAEWOULDBLOCK) return 0;
+        if (e == WSAECONNRESET || e == WSAECONNABORTED) return -2;
+        fprintf(stderr, "send failed, WSAErr=%d\n", e);
+        return -1;
+    }
+    return n;
+#else
+    for (;;) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n >= 0) return (long)n;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        if (errno == EPIPE || errno == ECONNRESET) return -2;
+        perror("write");
+        return -1;
+    }
+#endif
+}
+
+/* Write the whole buffer. Returns 0, -1 on error, -2 if the peer closed, or IO_TIMEOUT when the
+ * request deadline passed or the request was cancelled mid-send. */
+static int sock_send_all(int fd, const void *data, size_t len) {
+    const char *p = (const char*)data;
+    int bounded = g_deadline_ns || g_sigint_cancels;
+    while (len) {
+        if (bounded) {
+            if (deadline_expired()) return IO_TIMEOUT;
+            int w = sock_wait(fd, POLLOUT, deadline_clip(-1));
+            if (w == 0) continue;
+            if (w < 0) { perror("poll"); return -1; }
+        }
+#ifdef _WIN32
+        int n = send(fd, p, len > INT_MAX ? INT_MAX : (int)len, 0);
+        if (n == SOCKET_ERROR) {
+            int e = SOCKERR();
+            if (e == WSAECONNRESET || e == WSAECONNABORTED) return -2;
+            fprintf(stderr, "send failed, WSAErr=%d\n", e);
+            return -1;
+        }
+#else
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL | (bounded ? MSG_DONTWAIT : 0));
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) continue;
+            if (errno == EPIPE || errno == ECONNRESET) return -2;
+            perror("write");
+            return -1;
+        }
+#endif
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Free space at the end of the receive buffer, after resetting a drained
+ * buffer or sliding unread data to the front once the tail runs short. 0
+ * only when RX_BUF_SIZE bytes are unread, which no reply or event needs. */
+static size_t conn_rx_room(conn_t *c) {
+    if (c->rx_off == c->rx_len) c->rx_off = c->rx_len = 0;
+    else if (c->rx_off && RX_BUF_SIZE - c->rx_len < RX_BUF_SIZE / 8) {
+        memmove(c->rx, c->rx + c->rx_off, c->rx_len - c->rx_off);
+        c->rx_len -= c->rx_off; c->rx_off = 0;
+    }
+    return RX_BUF_SIZE - c->rx_len;
+}
+
+/* Read more data into the receive buffer. Returns bytes read, 0 on EOF,
+ * -1 on error or IO_TIMEOUT if nothing arrived within timeout_ms (-1 = wait). */
+static int conn_fill(conn_t *c, int timeout_ms) {
+    if (!conn_rx_room(c)) { fprintf(stderr, "protocol error: receive buffer full\n"); return -1; }
+    if (timeout_ms >= 0 || g_sigint_cancels) {
+        int w = sock_wait(c->fd, POLLIN, timeout_ms);
+        if (w == 0) return IO_TIMEOUT;
+        if (w < 0) { perror("poll"); return -1; }
+    }
+    for (;;) {
+#ifdef _WIN32
+        int n = recv(c->fd, (char*)c->rx + c->rx_len, (int)(RX_BUF_SIZE - c->rx_len), 0);
+        if (n == SOCKET_ERROR) { fprintf(stderr, "recv failed, WSAErr=%d\n", SOCKERR()); return -1; }
+#else
+        ssize_t n = recv(c->fd, c->rx + c->rx_len, RX_BUF_SIZE - c->rx_len, 0);
+        if (n < 0) {
+            if (errno == EINTR && g_cancel) return IO_TIMEOUT;
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return IO_TIMEOUT;
+            perror("read");
+            return -1;
+        }
+#endif
+        c->rx_len += (size_t)n;
+        return (int)n;
+    }
+}
+
+/* Run one reply through r. Returns 0 when complete, -1 on I/O or protocol
+ * error, -2 if the server closed the connection, or IO_TIMEOUT if the reply
+ * is still incomplete at deadline_ns (0 = no deadline). */
+static int resp_read_until(conn_t *c, resp_t *r, uint64_t deadline_ns) {
+    for (;;) {
+        if (c->rx_off < c->rx_len) {
+            if (TRACE_ON() && !r->first_ns) r->first_ns = mono_ns();
+            c->rx_off += resp_feed(r, c->rx + c->rx_off, c->rx_len - c->rx_off);
+            if (r->st == RESP_DONE) return r->sink_err ? -1 : 0;
+            if (r->st == RESP_ERROR) {
+                fprintf(stderr, "protocol error: malformed response frame\n");
+                return -1;
+            }
+        }
+        if (g_cancel) return IO_TIMEOUT;
+        int legacy = (r->st == RESP_LEGACY);
+        int wait = legacy ? LEGACY_IDLE_MS : -1;
+        if (deadline_ns) {
+            uint64_t now = mono_ns();
+            if (now >= deadline_ns) return IO_TIMEOUT;
+            uint64_t left = (deadline_ns - now + 999999) / 1000000;
+            if (wait < 0 || left < (uint64_t)wait) wait = (int)(left > INT_MAX ? INT_MAX : left);
+        }
+        int n = conn_fill(c, wait);
+        if (n == IO_TIMEOUT && g_cancel) return IO_TIMEOUT;
+        if (n == IO_TIMEOUT && deadline_ns && (!legacy || wait < LEGACY_IDLE_MS)) continue;
+        if (n == IO_TIMEOUT || (n == 0 && legacy)) {
+            r->st = RESP_DONE;
+            r->legacy = legacy;
+            return r->sink_err ? -1 : 0;
+        }
+        if (n == 0) { fprintf(stderr, "server closed connection\n"); return -2; }
+        if (n < 0) return -1;
+    }
+}
+
+static int resp_read(conn_t *c, resp_t *r) {
+    return resp_read_until(c, r, g_deadline_ns);
+}
+
+/* A trailer of the form "err <message>" marks a failed command. */
+static const char *resp_error(const resp_t *r) {
+    if (strncmp(r->line, "err", 3) != 0 || (r->line[3] && r->line[3] != ' ')) return NULL;
+    return r->line[3] ? r->line + 4 : "command failed";
+}
+
+static int stdout_sink(void *ctx, const void *data, size_t len) {
+    return fwrite(data, 1, len, (FILE*)ctx) == len ? 0 : -1;
+}
+
+// ----- I/O -----
+/* Tags start at 1; 0 is left for unsolicited frames. */
+static uint16_t conn_next_tag(conn_t *c) {
+    if (++c->tag == 0) c->tag = 1;
+    return c->tag;
+}
+
+/* Bytes needed on the wire for a command of `len` bytes (no newline). */
+static size_t cmd_wire_size(const conn_t *c, size_t len) {
+    return c->bin ? BIN_HDR_SIZE + FIELD_HDR_SIZE + 3 + len : len + 1;
+}
+
+/* Encode one command for the connection's protocol: a text line, or a
+ * BIN_REQ frame with a single "cmd" string field. Returns bytes written. */
+static size_t cmd_wire_encode(const conn_t *c, uint16_t tag, const char *cmd, size_t len,
+                              unsigned char *out) {
+    if (!c->bin) {
+        memcpy(out, cmd, len);
+        out[len] = '\n';
+        return len + 1;
+    }
+    put_le32(out, (uint32_t)(FIELD_HDR_SIZE + 3 + len));
+    out[4] = BIN_REQ;
+    out[5] = 0;
+    put_le16(out + 6, tag);
+    unsigned char *f = out + BIN_HDR_SIZE;
+    f[0] = FIELD_STR;
+    f[1] = 3;
+    put_le32(f + 2, (uint32_t)len);
+    memcpy(f + FIELD_HDR_SIZE, "cmd", 3);
+    memcpy(f + FIELD_HDR_SIZE + 3, cmd, len);
+    return BIN_HDR_SIZE + FIELD_HDR_SIZE + 3 + len;
+}
+
+/* Prepare r for the reply to the request last sent on c. */
+static void conn_resp_init(const conn_t *c, resp_t *r, resp_sink_fn sink, void *ctx) {
+    resp_init(r, sink, ctx);
+    r->bin = c->bin;
+    r->tag = c->tag;
+    r->shm = c->shm;
+    r->on_event = c->on_event;
+    r->event_ctx = c->event_ctx;
+}
+
+/* Length of the complete event frame at the head of the receive buffer, 0 if
+ * it has not fully arrived yet, -1 if the data there is not an event. */
+static long conn_event_frame(const conn_t *c) {
+    const unsigned char *p = c->rx + c->rx_off;
+    size_t avail = c->rx_len - c->rx_off;
+    if (c->bin) {
+        if (avail < BIN_HDR_SIZE) return 0;
+        if (p[4] != BIN_EVENT || get_le32(p) > RX_BUF_SIZE - BIN_HDR_SIZE) return -1;
+        size_t total = BIN_HDR_SIZE + get_le32(p);
+        return avail < total ? 0 : (long)total;
+    }
+    if (p[0] != '!') return -1;
+    size_t len = 0, k = 1;
+    for (; k < avail && p[k] >= '0' && p[k] <= '9' && k < 8; k++) len = len * 10 + (size_t)(p[k] - '0');
+    if (k == avail) return 0;
+    if (k == 1 || p[k] != '\n' || len > RX_BUF_SIZE - 16) return -1;
+    return avail < k + 1 + len ? 0 : (long)(k + 1 + len);
+}
+
+/* Read whatever hostd sent while no command is outstanding and deliver the
+ * complete events in it. Returns 0, -1 on error or -2 if the peer closed. */
+static int conn_take_events(conn_t *c) {
+    int n = conn_fill(c, 0);
+    if (n == IO_TIMEOUT) return 0;
+    if (n == 0) return -2;
+    if (n < 0) return -1;
+    long len;
+    while (c->rx_off < c->rx_len && c->on_event && (len = conn_event_frame(c)) > 0) {
+        resp_t r;
+        conn_resp_init(c, &r, NULL, NULL);
+        c->rx_off += resp_feed(&r, c->rx + c->rx_off, (size_t)len);
+    }
+    if (c->rx_off < c->rx_len && (!c->on_event || conn_event_frame(c) < 0)) {
+        fprintf(stderr, "[info] discarded %zu unexpected bytes from hostd\n", c->rx_len - c->rx_off);
+        c->rx_off = c->rx_len;
+    }
+    return 0;
+}
+
+/* Send one command (trailing newline optional) in a single write. */
+static int conn_send_line(conn_t *c, const char *line) {
+    size_t len = strlen(line);
+    if (len && line[len-1] == '\n') len--;
+    if (c->bin && len > UINT32_MAX - FIELD_HDR_SIZE - 3) { fprintf(stderr, "command too long\n"); return -1; }
+    unsigned char stackbuf[1024];
+    unsigned char *buf = stackbuf;
+    size_t need = cmd_wire_size(c, len);
+    if (need > sizeof stackbuf) {
+        buf = (unsigned char*)malloc(need);
+        if (!buf) { perror("malloc"); return -1; }
+    }
+    size_t n = cmd_wire_encode(c, c->bin ? conn_next_tag(c) : 0, line, len, buf);
+    int rc = sock_send_all(c->fd, buf, n);
+    if (buf != stackbuf) free(buf);
+    return rc;
+}
+
+/*
+ * Protocol negotiation: offer the binary framing with
+ *     hello proto=bin1 client=vim-cmd/<version>
+ * A hostd that supports it answers with a framed reply whose trailer
+ * contains "proto=bin1"; from then on both sides use binary frames. Anything
+ * else (an error trailer, an unframed reply, silence) keeps the text protocol,
+ * unless proto=binary demands otherwise. After silence the connection is
+ * closed and opened again without a hello, since a late answer would be
+ * taken for the reply to the next command.
+ *
+ * With proto=auto the outcome is remembered per target for
+ * PROTO_CACHE_TTL_S in "proto" next to the config file, one
+ * "<target> text|bin1 <expires>" line each. A target known to speak only
+ * text gets no hello at all; a bin1 target still needs one, because hostd
+ * switches framing per connection when it answers it.
+ */
+#define HELLO_TIMEOUT_MS   1000
+#define PROTO_CACHE_TTL_S  600
+#define PROTO_CACHE_MAX    64      /* targets remembered */
+
+static void proto_cache_path(const cfg_t *cfg, char *out, size_t outsz) {
+    char dir[512];
+    snprintf(dir, sizeof dir, "%s", cfg->cfg_path);
+    char *p = strrchr(dir, PATH_SEP);
+    if (p) *p = 0; else snprintf(dir, sizeof dir, ".");
+    snprintf(out, outsz, "%s%cproto", dir, PATH_SEP);
+}
+
+/* 1 if target is known to speak bin1, 0 if only text, -1 if unknown. */
+static int proto_cache_get(const cfg_t *cfg, const char *target) {
+    char path[600], line[400], t[320], p[8];
+    long long exp;
+    int found = -1;
+    proto_cache_path(cfg, path, sizeof path);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    long long now = (long long)time(NULL);
+    while (found < 0 && fgets(line, sizeof line, fp))
+        if (sscanf(line, "%319s %7s %lld", t, p, &exp) == 3 && exp > now && !strcmp(t, target))
+            found = !strcmp(p, "bin1");
+    fclose(fp);
+    return found;
+}
+
+static void proto_cache_put(const cfg_t *cfg, const char *target, int bin) {
+    char path[600], tmp[640], line[400], t[320], p[8];
+    long long exp, now = (long long)time(NULL);
+    proto_cache_path(cfg, path, sizeof path);
+#ifdef _WIN32
+    snprintf(tmp, sizeof tmp, "%s.%ld", path, (long)GetCurrentProcessId());
+#else
+    snprintf(tmp, sizeof tmp, "%s.%ld", path, (long)getpid());
+#endif
+    FILE *out = fopen(tmp, "w");
+    if (!out) return;                   /* no config dir: just negotiate next time */
+    fprintf(out, "%s %s %lld\n", target, bin ? "bin1" : "text", now + PROTO_CACHE_TTL_S);
+    FILE *in = fopen(path, "r");
+    for (int kept = 1; in && kept < PROTO_CACHE_MAX && fgets(line, sizeof line, in); )
+        if (sscanf(line, "%319s %7s %lld", t, p, &exp) == 3 && exp > now && strcmp(t, target)) {
+            fprintf(out, "%s %s %lld\n", t, p, exp);
+            kept++;
+        }
+    if (in) fclose(in);
+    int ok = fclose(out) == 0;
+#ifdef _WIN32
+    if (ok) remove(path);               /* rename does not replace on Windows */
+#endif
+    if (!ok || rename(tmp, path) != 0) remove(tmp);
+}
+
+static int discard_sink(void *ctx, const void *data, size_t len) {
+    (void)ctx; (void)data; (void)len;
+    return 0;
+}
+
+/* 0 when settled (c->bin says which framing), -1 on failure, 1 if the hello
+ * went unanswered under proto=auto and the connection must be reopened. */
+static int conn_negotiate(conn_t *c, vc_proto_t proto) {
+    if (proto == VC_PROTO_TEXT) return 0;
+    uint64_t t0 = mono_ns();
+    int rc = conn_send_line(c, "hello proto=bin1 client=vim-cmd/" VIM_CMD_VERSION);
+    if (rc != 0) {
+        if (rc == -2) fprintf(stderr, "server closed connection\n");
+        return -1;
+    }
+    resp_t r;
+    resp_init(&r, discard_sink, NULL);
+    for (;;) {
+        if (c->rx_off < c->rx_len)
+            c->rx_off += resp_feed(&r, c->rx + c->rx_off, c->rx_len - c->rx_off);
+        if (r.st == RESP_DONE || r.st == RESP_ERROR) break;
+        int legacy = (r.st == RESP_LEGACY);
+        int n = conn_fill(c, legacy ? LEGACY_IDLE_MS : HELLO_TIMEOUT_MS);
+        if (n == IO_TIMEOUT && !legacy && proto == VC_PROTO_AUTO) {
+            /* a late answer would desync the connection: the caller starts over */
+            trace_span("negotiate", t0, mono_ns(), "proto", "timeout");
+            if (g_verbose) fprintf(stderr, "[proto] no answer to hello; reconnecting as text\n");
+            return 1;
+        }
+        if (n == IO_TIMEOUT) break;
+        if (n == 0) { fprintf(stderr, "server closed connection\n"); return -1; }
+        if (n < 0) return -1;
+    }
+    c->bin = (r.st == RESP_DONE && strstr(r.line, "proto=bin1") != NULL);
+    trace_span("negotiate", t0, mono_ns(), "proto", c->bin ? "bin1" : "text");
+    if (g_verbose) fprintf(stderr, "[proto] %s\n", c->bin ? "binary (bin1)" : "text");
+    if (!c->bin && proto == VC_PROTO_BINARY) {
+        fprintf(stderr, "hostd does not support the binary protocol (proto=binary)\n");
+        return -1;
+    }
+    return 0;
+}
+
+// ----- shared memory -----
+/*
+ * Same-host fast path for UNIX sockets. The client creates the ring (a
+ * memfd on Linux, an unlinked POSIX shm object elsewhere), maps it and
+ * passes the descriptor to hostd with SCM_RIGHTS on
+ *     shm-offer size=<bytes> version=1
+ * hostd answers "shm=ok" in the trailer if it mapped the ring; it may then
+ * send any chunk by reference (see resp_shm_chunk). It may still send
+ * inline chunks, e.g. when the ring is full. Requests stay on the socket.
+ */
+static void shm_unmap(shm_map_t *m) {
+#ifndef _WIN32
+    munmap(m->hdr, m->map_len);
+#endif
+    free(m);
+}
+
+#ifndef _WIN32
+static int shm_create_fd(size_t len) {
+    int fd;
+#ifdef __linux__
+    fd = memfd_create("vim-cmd-ring", MFD_CLOEXEC);
+#else
+    char name[64];
+    snprintf(name, sizeof name, "/vim-cmd-%ld-%llu", (long)getpid(), (unsigned long long)mono_ns());
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) shm_unlink(name);
+#endif
+    if (fd < 0) { perror("shm: create"); return -1; }
+    if (ftruncate(fd, (off_t)len) != 0) { perror("shm: ftruncate"); close(fd); return -1; }
+    return fd;
+}
+
+/* Send data with a descriptor attached. */
+static int sock_send_fd(int sock, const void *data, size_t len, int fd) {
+    struct msghdr msg;
+    struct iovec iov;
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(int))]; } ctl;
+    memset(&msg, 0, sizeof msg);
+    memset(&ctl, 0, sizeof ctl);
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof ctl.buf;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    ssize_t n;
+    do n = sendmsg(sock, &msg, MSG_NOSIGNAL); while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        if (errno == EPIPE || errno == ECONNRESET) return -2;
+        perror("sendmsg");
+        return -1;
+    }
+    /* the descriptor went with the first byte; the rest is plain data */
+    return (size_t)n < len ? sock_send_all(sock, (const char*)data + n, len - (size_t)n) : 0;
+}
+
+/* Offer a ring of `size` bytes. Returns 0 whether or not hostd takes it
+ * (a ring that can't be created is skipped), -1 if the connection failed. */
+static int conn_shm_offer(conn_t *c, size_t size) {
+    size_t len = SHM_HDR_SIZE + size;
+    int fd = shm_create_fd(len);
+    if (fd < 0) return 0;
+    void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    shm_map_t *m = base != MAP_FAILED ? (shm_map_t*)calloc(1, sizeof *m) : NULL;
+    if (!m) {
+        perror("shm: mmap");
+        if (base != MAP_FAILED) munmap(base, len);
+        close(fd);
+        return 0;
+    }
+    m->hdr = (shm_ring_hdr_t*)base;
+    m->data = (unsigned char*)base + SHM_HDR_SIZE;
+    m->map_len = len;
+    m->size = size;
+    m->hdr->magic = SHM_MAGIC;
+    m->hdr->version = 1;
+    m->hdr->size = size;
+
+    uint64_t t0 = mono_ns();
+    char line[80];
+    unsigned char frame[128];
+    snprintf(line, sizeof line, "shm-offer size=%zu version=1", size);
+    size_t n = cmd_wire_encode(c, c->bin ? conn_next_tag(c) : 0, line, strlen(line), frame);
+    int rc = sock_send_fd(c->fd, frame, n, fd);
+    close(fd);   /* the mapping (and hostd's copy) keep the ring alive */
+    resp_t r;
+    if (rc == 0) {
+        conn_resp_init(c, &r, discard_sink, NULL);
+        rc = resp_read(c, &r);
+    }
+    if (rc == 0 && strstr(r.line, "shm=ok")) {
+        c->shm = m;
+    } else {
+        shm_unmap(m);
+        if (rc == -2) fprintf(stderr, "server closed connection\n");
+    }
+    trace_span("shm_offer", t0, mono_ns(), "ring", c->shm ? "accepted" : "declined");
+    if (g_verbose) fprintf(stderr, "[shm] %s\n", c->shm ? "ring accepted" : "ring declined; using the socket");
+    return rc == 0 ? 0 : -1;
+}
+#endif
+
+/* Connect as configured and negotiate the wire protocol. */
+static int conn_connect_cfg(conn_t *c, const cfg_t *cfg) {
+    vc_proto_t proto = cfg->proto;
+    char spec[300];
+    int known = -1, cacheable = proto == VC_PROTO_AUTO && cfg_target_spec(cfg, spec, sizeof spec) == 0;
+    if (cacheable && (known = proto_cache_get(cfg, spec)) == 0) proto = VC_PROTO_TEXT;
+    for (;;) {
+        int fd = connect_from_cfg(cfg);
+        if (fd < 0 || conn_open(c, fd) != 0) return -1;
+        int rc = conn_negotiate(c, proto);
+        if (rc == 0) break;
+        conn_close(c);
+        if (rc < 0) return -1;
+        proto = VC_PROTO_TEXT;          /* hello went unanswered: again, without one */
+    }
+    if (cacheable && known != c->bin) proto_cache_put(cfg, spec, c->bin);
+#ifndef _WIN32
+    if (cfg->mode == VC_MODE_UNIX && cfg->shm_bytes && conn_shm_offer(c, cfg->shm_bytes) != 0) {
+        conn_close(c);
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static void trace_command(const char *line, uint64_t t0, uint64_t t_sent,
+                          const resp_t *r, uint64_t t_end) {
+    char info[32];
+    trace_span("command", t0, t_end, "cmd", line);
+    trace_span("send", t0, t_sent, NULL, NULL);
+    if (r->first_ns) {
+        trace_span("ttfb", t_sent, r->first_ns, NULL, NULL);
+        snprintf(info, sizeof info, "%llu", (unsigned long long)r->bytes);
+        trace_span("drain", r->first_ns, t_end, "bytes", info);
+    }
+}
+
+/* A request ran out of time or was cancelled. If the command went out
+ * whole and the REPL allows it, read the rest of the reply into the void
+ * so the connection stays usable; otherwise close it. */
+static void conn_abandon(conn_t *c, resp_t *r, int sent) {
+    const char *what = deadline_what();
+    int cancelled = g_cancel, drained = 0;
+    g_expired = 1;
+    g_abandoned = 1;
+    if (sent && r && g_drain_ms > 0 && r->st != RESP_LEGACY) {
+        g_cancel = 0;
+        r->sink = discard_sink; r->ctx = NULL;
+        drained = resp_read_until(c, r, mono_ns() + (uint64_t)g_drain_ms * 1000000ull) == 0;
+    }
+    fflush(stdout);
+    fprintf(stderr, "%s[%s] %s\n", cancelled ? "\n" : "", what, drained ? "reply drained; connection kept"
+                                               : "connection closed");
+    if (!drained) conn_close(c);
+}
+
+/* Client commands (upload, /mem, snapshot-sync, ...) may have several
+ * replies in flight when a deadline or Ctrl-C stops them, so unless the
+ * reply at hand was already drained or closed, the connection is closed. */
+static void client_begin(void) {
+    g_abandoned = 0;
+    g_expired = 0;
+    g_cancel = 0;
+}
+static int client_end(conn_t *c, int rc) {
+    if (rc != 0 && (rc == IO_TIMEOUT || g_cancel || g_expired) && !g_abandoned && c->fd >= 0)
+        conn_abandon(c, NULL, 0);
+    g_cancel = 0;
+    return rc;
+}
+
+/* Send one command and stream its reply payload to sink. Returns 0 on
+ * success, -1 on failure (including an error trailer), -2 if the server
+ * closed the connection, IO_TIMEOUT if the request deadline passed or the
+ * request was cancelled (the connection is then drained or closed). */
+static int send_command_to(conn_t *c, const char *line, resp_sink_fn sink, void *ctx) {
+    int own = !g_deadline_ns;           /* one-shot mode arms it before connecting */
+    if (own) deadline_arm();
+    uint64_t t0 = mono_ns();
+    int rc = conn_send_line(c, line);
+    if (rc != 0) {
+        if (own) deadline_disarm();
+        if (rc == IO_TIMEOUT) { conn_abandon(c, NULL, 0); return IO_TIMEOUT; }
+        if (rc == -2) fprintf(stderr, "server closed connection\n");
+        return rc == -2 ? -2 : -1;
+    }
+    uint64_t t_sent = TRACE_ON() ? mono_ns() : 0;
+
+    resp_t r;
+    conn_resp_init(c, &r, sink, ctx);
+    rc = resp_read(c, &r);
+    if (rc == IO_TIMEOUT) conn_abandon(c, &r, 1);
+    if (own) deadline_disarm();
+    fflush(stdout);
+    uint64_t t_end = mono_ns();
+    if (TRACE_ON()) trace_command(line, t0, t_sent, &r, t_end);
+    int failed = rc != 0 || resp_error(&r);
+    stats_record(stats_verb(line), t_end - t0, strlen(line) + 1, r.bytes, failed);
+    rec_command(line, t0, t_end, r.bytes, failed);
+    if (rc == 0 && resp_error(&r)) {
+        fprintf(stderr, "error: %s\n", resp_error(&r));
+        return -1;
+    }
+    return rc;
+}
+
+static int send_command_fd(conn_t *c, const char *line) {
+    return send_command_to(c, line, stdout_sink, stdout);
+}
+
+// ----- I/O engine -----
+/*
+ * --io=poll (the default) drives sockets with the readiness loops below:
+ * poll(), then one send() or recv() per ready socket. --io=uring, available
+ * when built with `make URING=1` on Linux, runs the batch and fan-out loops
+ * and download file writes through one io_uring instead: the sends,
+ * receives and connect polls of an iteration are queued as SQEs and
+ * submitted together with the wait for completions in a single
+ * io_uring_enter(). Receive buffers are registered with the ring and read
+ * with IORING_OP_READ_FIXED, so they are not mapped again on every call.
+ *
+ * The ring is set up with raw syscalls (no liburing). When the kernel
+ * refuses it (too old, or io_uring disabled) vim-cmd says so and stays on
+ * poll, as it always does on macOS and Windows.
+ */
+typedef enum { IO_POLL = 0, IO_URING } io_engine_t;
+
+static io_engine_t g_io = IO_POLL;
+
+#ifdef VC_HAVE_URING
+#define UR_ENTRIES     1024
+#define UR_IGNORE_UD   (~0ull)          /* timeouts and cancels */
+
+typedef struct {
+    int       fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned  tail;                     /* local SQ tail, published on enter */
+    unsigned  queued;
+    int       nbufs;                    /* registered buffers */
+    struct __kernel_timespec ts;
+} uring_t;
+
+static uring_t g_ur = { .fd = -1 };
+
+static int uring_setup(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    int fd = (int)syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+    if (fd < 0) return -1;
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && cq_len > sq_len) sq_len = cq_len;
+    unsigned char *sq = (unsigned char*)mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    unsigned char *cq = single ? sq : (unsigned char*)mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                                                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        int e = errno;
+        close(fd);   /* the mappings keep nothing alive we still use */
+        errno = e;
+        return -1;
+    }
+    g_ur.fd = fd;
+    g_ur.sq_head = (unsigned*)(sq + p.sq_off.head);
+    g_ur.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    g_ur.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    g_ur.sq_array = (unsigned*)(sq + p.sq_off.array);
+    g_ur.sq_entries = p.sq_entries;
+    g_ur.cq_head = (unsigned*)(cq + p.cq_off.head);
+    g_ur.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    g_ur.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    g_ur.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    g_ur.sqes = (struct io_uring_sqe*)sqes;
+    g_ur.tail = *g_ur.sq_tail;
+    return 0;
+}
+
+static int uring_submit(unsigned wait);
+
+/* Next free SQE, zeroed; submits what is queued if the ring is full. */
+static struct io_uring_sqe *uring_sqe(void) {
+    if (g_ur.tail - __atomic_load_n(g_ur.sq_head, __ATOMIC_ACQUIRE) >= g_ur.sq_entries)
+        uring_submit(0);
+    unsigned i = g_ur.tail & *g_ur.sq_mask;
+    struct io_uring_sqe *s = &g_ur.sqes[i];
+    memset(s, 0, sizeof *s);
+    g_ur.sq_array[i] = i;
+    g_ur.tail++;
+    g_ur.queued++;
+    return s;
+}
+
+static struct io_uring_sqe *uring_prep(int op, int fd, const void *addr, size_t len,
+                                       uint64_t off, uint64_t ud) {
+    struct io_uring_sqe *s = uring_sqe();
+    s->opcode = (uint8_t)op;
+    s->fd = fd;
+    s->addr = (uint64_t)(uintptr_t)addr;
+    s->len = (uint32_t)(len > 0x7ffff000u ? 0x7ffff000u : len);
+    s->off = off;
+    s->user_data = ud;
+    return s;
+}
+
+static void uring_cancel(uint64_t ud) {
+    struct io_uring_sqe *s = uring_prep(IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0, UR_IGNORE_UD);
+    s->addr = ud;
+}
+
+/* Publish queued SQEs and enter the kernel once, waiting for `wait`
+ * completions. Returns 0 or -1. */
+static int uring_submit(unsigned wait) {
+    __atomic_store_n(g_ur.sq_tail, g_ur.tail, __ATOMIC_RELEASE);
+    unsigned n = g_ur.queued;
+    g_ur.queued = 0;
+    for (;;) {
+        int r = (int)syscall(__NR_io_uring_enter, g_ur.fd, n, wait,
+                             wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (r >= 0 && (unsigned)r >= n) return 0;
+        if (r >= 0) { n -= (unsigned)r; continue; }
+        if (errno == EINTR) continue;
+        if (errno == EBUSY || errno == EAGAIN) { n = 0; wait = wait ? wait : 1; continue; }
+        perror("io_uring_enter");
+        return -1;
+    }
+}
+
+/* Submit and wait for at least one completion or timeout_ms (-1 = none). */
+static int uring_wait(int timeout_ms) {
+    if (timeout_ms >= 0) {
+        g_ur.ts.tv_sec = timeout_ms / 1000;
+        g_ur.ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        struct io_uring_sqe *s = uring_prep(IORING_OP_TIMEOUT, -1, &g_ur.ts, 1, 1, UR_IGNORE_UD);
+        (void)s;   /* off=1: ends as soon as any other completion arrives */
+    }
+    return uring_submit(1);
+}
+
+/* Pop one completion; returns 0 if there is none. */
+static int uring_reap(uint64_t *ud, int *res) {
+    unsigned head = *g_ur.cq_head;
+    if (head == __atomic_load_n(g_ur.cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    const struct io_uring_cqe *c = &g_ur.cqes[head & *g_ur.cq_mask];
+    *ud = c->user_data;
+    *res = c->res;
+    __atomic_store_n(g_ur.cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int uring_register_buffers(const struct iovec *iov, unsigned n) {
+    if (syscall(__NR_io_uring_register, g_ur.fd, IORING_REGISTER_BUFFERS, iov, n) != 0) {
+        if (g_verbose) perror("[io] io_uring buffer registration");
+        return -1;
+    }
+    g_ur.nbufs = (int)n;
+    return 0;
+}
+
+static void uring_unregister_buffers(void) {
+    if (!g_ur.nbufs) return;
+    syscall(__NR_io_uring_register, g_ur.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    g_ur.nbufs = 0;
+}
+
+/* Wait until every operation in `busy` (a count kept by the caller's
+ * completion handler) has completed, cancelling whatever is still queued. */
+static void uring_drain(int *busy, void (*on_cqe)(void *ctx, uint64_t ud, int res), void *ctx) {
+    uint64_t ud;
+    int res;
+    while (*busy > 0) {
+        if (uring_submit(1) != 0) break;
+        while (uring_reap(&ud, &res)) if (ud != UR_IGNORE_UD) on_cqe(ctx, ud, res);
+    }
+}
+#endif
+
+/* --io=poll|uring */
+static int io_select(const char *name) {
+    if (!strcasecmp(name, "poll")) { g_io = IO_POLL; return 0; }
+    if (strcasecmp(name, "uring")) {
+        fprintf(stderr, "invalid --io '%s' (poll or uring)\n", name);
+        return -1;
+    }
+#ifdef VC_HAVE_URING
+    if (g_ur.fd < 0 && uring_setup() != 0) {
+        fprintf(stderr, "[io] io_uring unavailable (%s); using poll\n", strerror(errno));
+        return 0;
+    }
+    g_io = IO_URING;
+#else
+    fprintf(stderr, "[io] built without io_uring (make URING=1 on Linux); using poll\n");
+#endif
+    return 0;
+}
+
+// ----- batch -----
+/*
+ * Batch mode streams a script of commands over one connection, keeping up
+ * to `window` requests in flight. Framed replies arrive in request order,
+ * so each completed reply is matched to the oldest outstanding command.
+ * With window=1 this degrades to plain send_command_fd round trips, which
+ * also works against an unframed (legacy) hostd.
+ */
+#define BATCH_DEFAULT_WINDOW  32
+#define BATCH_MAX_WINDOW      4096
+#define BATCH_TX_HIGH         (64 * 1024)   /* stop queueing above this */
+
+static int batch_next_cmd(FILE *in, char **buf, size_t *cap, long *lineno, char **cmd) {
+    for (;;) {
+        if (read_line(in, buf, cap) < 0) return 0;
+        (*lineno)++;
+        char *p = trim(*buf);
+        if (*p == 0 || *p == '#') continue;
+        *cmd = p;
+        return 1;
+    }
+}
+
+static void batch_report(unsigned long cmds, uint64_t bytes, uint64_t t0) {
+    if (TRACE_ON()) {
+        char info[32];
+        snprintf(info, sizeof info, "%lu", cmds);
+        trace_span("batch", t0, mono_ns(), "commands", info);
+    }
+    double secs = (double)(mono_ns() - t0) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+    fprintf(stderr, "[batch] %lu commands, %llu bytes in %.3f s (%.1f cmd/s, %.2f MB/s)\n",
+            cmds, (unsigned long long)bytes, secs, (double)cmds / secs,
+            (double)bytes / secs / 1e6);
+}
+
+/* One poll()-driven step: send what the socket takes, read what arrived.
+ * Returns bytes read, IO_TIMEOUT if none, 0 on EOF, -1 or -2 on error. */
+static int batch_poll_io(conn_t *c, const unsigned char *tx, size_t *tx_off, size_t tx_len) {
+    struct pollfd pfd;
+    pfd.fd = c->fd;
+    pfd.events = (short)(POLLIN | (*tx_off < tx_len ? POLLOUT : 0));
+    pfd.revents = 0;
+    if (poll(&pfd, 1, -1) < 0) {
+        if (SOCKERR() == EINTR) return IO_TIMEOUT;
+        perror("poll");
+        return -1;
+    }
+    if ((pfd.revents & POLLOUT) && *tx_off < tx_len) {
+        long n = sock_send_some(c->fd, tx + *tx_off, tx_len - *tx_off);
+        if (n < 0) return (int)n;
+        *tx_off += (size_t)n;
+    }
+    if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) return IO_TIMEOUT;
+    return conn_fill(c, 0);
+}
+
+#ifdef VC_HAVE_URING
+enum { BUR_SEND = 1, BUR_RECV = 2 };
+
+typedef struct {
+    conn_t *c;
+    int     busy;           /* operations in flight */
+    int     send_busy, recv_busy;
+    int     fixed;          /* c->rx is registered buffer 0 */
+    int     got;            /* last receive result */
+    long    sent;
+    int     err;            /* 0, -1 or -2 */
+} batch_ur_t;
+
+static void batch_ur_cqe(void *ctx, uint64_t ud, int res) {
+    batch_ur_t *u = (batch_ur_t*)ctx;
+    u->busy--;
+    if (ud == BUR_SEND) {
+        u->send_busy = 0;
+        if (res >= 0) u->sent += res;
+        else if (res == -EPIPE || res == -ECONNRESET) u->err = -2;
+        else if (res != -ECANCELED) { fprintf(stderr, "send: %s\n", strerror(-res)); u->err = -1; }
+    } else {
+        u->recv_busy = 0;
+        if (res > 0) { u->c->rx_len += (size_t)res; u->got = res; }
+        else if (res == 0) u->got = 0;
+        else if (res != -ECANCELED) { fprintf(stderr, "read: %s\n", strerror(-res)); u->err = -1; }
+    }
+}
+
+/* The same step on io_uring: keep one send and one receive in flight and
+ * submit + wait in one io_uring_enter(). The socket stays blocking, so
+ * operations wait in the kernel rather than failing with EAGAIN. */
+static int batch_uring_io(batch_ur_t *u, const unsigned char *tx, size_t *tx_off, size_t tx_len) {
+    conn_t *c = u->c;
+    if (!u->send_busy && *tx_off < tx_len) {
+        struct io_uring_sqe *s = uring_prep(IORING_OP_SEND, c->fd, tx + *tx_off, tx_len - *tx_off, 0, BUR_SEND);
+        s->msg_flags = MSG_NOSIGNAL;
+        u->send_busy = 1;
+        u->busy++;
+    }
+    if (!u->recv_busy) {
+        if (!conn_rx_room(c)) { fprintf(stderr, "protocol error: receive buffer full\n"); return -1; }
+        struct io_uring_sqe *s = uring_prep(u->fixed ? IORING_OP_READ_FIXED : IORING_OP_RECV, c->fd,
+                                            c->rx + c->rx_len, RX_BUF_SIZE - c->rx_len, 0, BUR_RECV);
+        s->buf_index = 0;
+        u->recv_busy = 1;
+        u->busy++;
+    }
+    if (uring_submit(1) != 0) return -1;
+    uint64_t ud;
+    int res;
+    u->got = IO_TIMEOUT;
+    u->sent = 0;
+    while (uring_reap(&ud, &res)) if (ud != UR_IGNORE_UD) batch_ur_cqe(u, ud, res);
+    *tx_off += (size_t)u->sent;
+    if (u->err) return u->err;
+    return u->got;
+}
+
+/* Cancel what is still in flight and wait for it, so c->rx and tx can go. */
+static void batch_uring_end(batch_ur_t *u) {
+    if (u->send_busy) uring_cancel(BUR_SEND);
+    if (u->recv_busy) uring_cancel(BUR_RECV);
+    uring_drain(&u->busy, batch_ur_cqe, u);
+    if (u->fixed) uring_unregister_buffers();
+}
+#endif
+
+static int run_batch(conn_t *c, FILE *in, int window) {
+    char *line = NULL; size_t cap = 0;
+    long lineno = 0;
+    char *cmd;
+    unsigned long done = 0;
+    uint64_t bytes = 0, t0 = mono_ns();
+    int rc = 0;
+
+    if (window <= 1) {
+        while (batch_next_cmd(in, &line, &cap, &lineno, &cmd)) {
+            resp_t r;
+            uint64_t ts = mono_ns();
+            rc = conn_send_line(c, cmd);
+            if (rc == 0) {
+                conn_resp_init(c, &r, stdout_sink, stdout);
+                rc = resp_read(c, &r);
+                bytes += r.bytes;
+                uint64_t te = mono_ns();
+                stats_record(stats_verb(cmd), te - ts, strlen(cmd) + 1, r.bytes,
+                             rc != 0 || resp_error(&r));
+                rec_command(cmd, ts, te, r.bytes, rc != 0 || resp_error(&r));
+            }
+            if (rc != 0) { fprintf(stderr, "[batch] line %ld failed\n", lineno); break; }
+            done++;
+        }
+        fflush(stdout);
+        free(line);
+        batch_report(done, bytes, t0);
+        return rc;
+    }
+
+    typedef struct {
+        long lineno; uint64_t t0; size_t sent; verb_stats_t *verb; uint16_t tag;
+        char *cmd;                          /* kept only for --record */
+    } pending_t;
+    pending_t *pending = (pending_t*)calloc((size_t)window, sizeof *pending);
+    unsigned char *tx = NULL; size_t tx_len = 0, tx_off = 0, tx_cap = 0;
+    int head = 0, inflight = 0, eof = 0;
+    resp_t r;
+    conn_resp_init(c, &r, stdout_sink, stdout);
+    if (!pending || (g_io == IO_POLL && sock_set_nonblock(c->fd, 1) != 0)) {
+        fprintf(stderr, "[batch] setup failed\n");
+        free(pending); free(line);
+        return -1;
+    }
+#ifdef VC_HAVE_URING
+    batch_ur_t ur = { c, 0, 0, 0, 0, 0, 0, 0 };
+    if (g_io == IO_URING) {
+        struct iovec iov = { c->rx, RX_BUF_SIZE };
+        ur.fixed = uring_register_buffers(&iov, 1) == 0;
+    }
+#endif
+
+    while (rc == 0) {
+        /* queue more commands while the window and tx buffer allow */
+        while (!eof && inflight < window && tx_len - tx_off < BATCH_TX_HIGH) {
+            if (!batch_next_cmd(in, &line, &cap, &lineno, &cmd)) { eof = 1; break; }
+            size_t len = strlen(cmd);
+            size_t need = cmd_wire_size(c, len);
+            if (tx_off && tx_off == tx_len) tx_off = tx_len = 0;
+#ifdef VC_HAVE_URING
+            if (ur.send_busy && tx_len + need > tx_cap) break;   /* the kernel is reading tx */
+#endif
+            if (tx_len + need > tx_cap) {
+                size_t ncap = tx_cap ? tx_cap : BATCH_TX_HIGH;
+                while (ncap < tx_len + need) ncap *= 2;
+                unsigned char *nb = (unsigned char*)realloc(tx, ncap);
+                if (!nb) { perror("malloc"); rc = -1; break; }
+                tx = nb; tx_cap = ncap;
+            }
+            pending_t *pe = &pending[(head + inflight) % window];
+            pe->tag = c->bin ? conn_next_tag(c) : 0;
+            tx_len += cmd_wire_encode(c, pe->tag, cmd, len, tx + tx_len);
+            pe->lineno = lineno;
+            pe->t0 = mono_ns();
+            pe->sent = need;
+            pe->verb = stats_verb(cmd);
+            pe->cmd = REC_ON() ? strdup(cmd) : NULL;
+            inflight++;
+        }
+        if (rc != 0 || (eof && inflight == 0)) break;
+
+        int n;
+#ifdef VC_HAVE_URING
+        if (g_io == IO_URING) n = batch_uring_io(&ur, tx, &tx_off, tx_len);
+        else
+#endif
+        n = batch_poll_io(c, tx, &tx_off, tx_len);
+        if (n == IO_TIMEOUT) continue;
+        if (n == 0) { fprintf(stderr, "server closed connection\n"); rc = -2; break; }
+        if (n < 0) { rc = n; break; }
+        while (c->rx_off < c->rx_len && inflight > 0) {
+            r.tag = pending[head].tag;
+            c->rx_off += resp_feed(&r, c->rx + c->rx_off, c->rx_len - c->rx_off);
+            if (r.st == RESP_LEGACY) {
+                fprintf(stderr, "[batch] hostd does not frame replies; pipelining needs "
+                                "framing (use -w 1)\n");
+                rc = -1; break;
+            }
+            if (r.st == RESP_ERROR) {
+                fprintf(stderr, "[batch] line %ld: malformed response frame\n", pending[head].lineno);
+                rc = -1; break;
+            }
+            if (r.st != RESP_DONE) break;
+            bytes += r.bytes;
+            uint64_t te = mono_ns();
+            stats_record(pending[head].verb, te - pending[head].t0, pending[head].sent,
+                         r.bytes, resp_error(&r) != NULL);
+            if (pending[head].cmd) {
+                rec_command(pending[head].cmd, pending[head].t0, te, r.bytes, resp_error(&r) != NULL);
+                free(pending[head].cmd);
+            }
+            if (r.sink_err) { fprintf(stderr, "[batch] output error\n"); rc = -1; break; }
+            head = (head + 1) % window;
+            inflight--;
+            done++;
+            conn_resp_init(c, &r, stdout_sink, stdout);
+        }
+    }
+    if (rc != 0 && inflight > 0)
+        fprintf(stderr, "[batch] stopped with %d command(s) outstanding, first at line %ld\n",
+                inflight, pending[head].lineno);
+
+    fflush(stdout);
+#ifdef VC_HAVE_URING
+    if (g_io == IO_URING) batch_uring_end(&ur);
+    else
+#endif
+    sock_set_nonblock(c->fd, 0);
+    for (int k = 0; k < inflight; k++) free(pending[(head + k) % window].cmd);
+    free(tx); free(pending); free(line);
+    batch_report(done, bytes, t0);
+    return rc;
+}
+
+// ----- replay -----
+/*
+ * replay <session.log> [--speed=Nx|max] [--conns=N]
+ *
+ * Re-drives a --record log against the current target. Commands are sent
+ * in recorded order at their recorded offsets from the first one, scaled
+ * by --speed (2x halves the gaps; "max" sends as fast as replies allow),
+ * spread over --conns connections with up to REPLAY_WINDOW pipelined on
+ * each. Replies are discarded. The report compares each verb's replayed
+ * latency with the recorded one and says how far sends slipped behind the
+ * schedule, so a slow replayer is not mistaken for a slow hostd.
+ */
+#define REPLAY_WINDOW    32
+#define REPLAY_MAX_CONNS 256
+
+typedef struct {
+    char     *cmd;
+    uint64_t  start_us, lat_us, bytes;   /* as recorded */
+    uint64_t  t_sent, t_done;            /* replay, mono ns */
+    uint64_t  got_bytes;
+    int       rec_failed, failed;
+    uint64_t  slip_ns;
+} replay_rec_t;
+
+typedef struct {
+    conn_t         c;
+    resp_t         r;
+    size_t         pend[REPLAY_WINDOW];  /* record indices in flight, FIFO */
+    uint16_t       tags[REPLAY_WINDOW];
+    int            head, inflight;
+    unsigned char *tx;
+    size_t         tx_len, tx_off, tx_cap;
+} replay_conn_t;
+
+static int replay_count_sink(void *ctx, const void *data, size_t len) {
+    (void)ctx; (void)data; (void)len;
+    return 0;
+}
+
+static int replay_cmp_start(const void *a, const void *b) {
+    const replay_rec_t *x = (const replay_rec_t*)a, *y = (const replay_rec_t*)b;
+    if (x->start_us != y->start_us) return x->start_us < y->start_us ? -1 : 1;
+    return x->cmd < y->cmd ? -1 : (x->cmd > y->cmd);   /* stable: cmds are in file order */
+}
+
+/* Load a session log; records are sorted by start time (several recording
+ * processes may have appended out of order). The command strings live in
+ * one block returned in *strs. */
+static replay_rec_t *replay_load(const char *path, size_t *count, char **strs_out) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) { perror(path); return NULL; }
+    unsigned char *data = NULL;
+    size_t len = 0, cap = 0;
+    for (;;) {
+        if (len == cap) {
+            size_t ncap = cap ? cap * 2 : 1 << 20;
+            unsigned char *nd = (unsigned char*)realloc(data, ncap);
+            if (!nd) { perror("malloc"); free(data); fclose(fp); return NULL; }
+            data = nd; cap = ncap;
+        }
+        size_t n = fread(data + len, 1, cap - len, fp);
+        if (!n) break;
+        len += n;
+    }
+    fclose(fp);
+    if (len < 8 || memcmp(data, REC_MAGIC, 4) || get_le32(data + 4) != REC_VERSION) {
+        fprintf(stderr, "%s: not a vim-cmd session log\n", path);
+        free(data);
+        return NULL;
+    }
+    char *strs = (char*)malloc(len);
+    replay_rec_t *v = NULL;
+    size_t n = 0, vcap = 0, off = 8, so = 0;
+    while (strs && off < len) {
+        uint64_t f[4];
+        size_t o = off + 1, k;
+        for (k = 0; k < 4; k++) {
+            size_t u = get_varint(data + o, len - o, &f[k]);
+            if (!u) break;
+            o += u;
+        }
+        if (k < 4 || f[3] > REC_CMD_MAX || f[3] > len - o) {
+            fprintf(stderr, "%s: truncated record at offset %zu; ignoring the rest\n", path, off);
+            break;
+        }
+        if (n == vcap) {
+            size_t ncap = vcap ? vcap * 2 : 1024;
+            replay_rec_t *nv = (replay_rec_t*)realloc(v, ncap * sizeof *nv);
+            if (!nv) { perror("malloc"); break; }
+            v = nv; vcap = ncap;
+        }
+        replay_rec_t *x = &v[n++];
+        memset(x, 0, sizeof *x);
+        x->rec_failed = data[off] & 1;
+        x->start_us = f[0];
+        x->lat_us = f[1];
+        x->bytes = f[2];
+        x->cmd = strs + so;
+        memcpy(x->cmd, data + o, (size_t)f[3]);
+        x->cmd[f[3]] = 0;
+        so += (size_t)f[3] + 1;
+        off = o + (size_t)f[3];
+    }
+    free(data);
+    if (!strs) perror("malloc");
+    if (!n) { if (strs) fprintf(stderr, "%s: no commands recorded\n", path); free(strs); free(v); return NULL; }
+    qsort(v, n, sizeof *v, replay_cmp_start);
+    *count = n;
+    *strs_out = strs;
+    return v;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : (x > y);
+}
+
+static uint64_t pct_sorted(const uint64_t *v, size_t n, double p) {
+    size_t i = (size_t)(p * (double)n);
+    return v[i < n ? i : n - 1];
+}
+
+static size_t verb_len(const char *s) {
+    size_t n = 0;
+    while (s[n] && !isspace((unsigned char)s[n])) n++;
+    return n;
+}
+
+static int replay_cmp_verb(const void *a, const void *b) {
+    const replay_rec_t *x = *(const replay_rec_t* const*)a, *y = *(const replay_rec_t* const*)b;
+    size_t xl = verb_len(x->cmd), yl = verb_len(y->cmd);
+    int c = strncmp(x->cmd, y->cmd, xl < yl ? xl : yl);
+    return c ? c : (xl < yl ? -1 : (xl > yl));
+}
+
+static void replay_report(replay_rec_t *v, size_t n, double secs, int conns, const char *speed) {
+    size_t errors = 0, rec_errors = 0, size_diff = 0, done = 0;
+    uint64_t slip_sum = 0, slip_max = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!v[i].t_done) continue;
+        done++;
+        errors += (size_t)v[i].failed;
+        rec_errors += (size_t)v[i].rec_failed;
+        size_diff += v[i].got_bytes != v[i].bytes;
+        slip_sum += v[i].slip_ns;
+        if (v[i].slip_ns > slip_max) slip_max = v[i].slip_ns;
+    }
+    fprintf(stderr, "[replay] %zu of %zu commands on %d connection%s in %.3f s (speed %s): "
+            "%zu errors (%zu recorded), %zu reply size changes\n",
+            done, n, conns, conns == 1 ? "" : "s", secs, speed, errors, rec_errors, size_diff);
+    if (!done) return;
+    if (strcmp(speed, "max"))
+        fprintf(stderr, "[replay] schedule slip: mean %.3f ms, max %.3f ms\n",
+                (double)slip_sum / (double)done / 1e6, (double)slip_max / 1e6);
+
+    /* per verb: recorded vs replayed latency */
+    const replay_rec_t **by = (const replay_rec_t**)malloc(done * sizeof *by);
+    uint64_t *a = (uint64_t*)malloc(done * sizeof *a), *b = (uint64_t*)malloc(done * sizeof *b);
+    if (!by || !a || !b) { free(by); free(a); free(b); return; }
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) if (v[i].t_done) by[m++] = &v[i];
+    qsort(by, m, sizeof *by, replay_cmp_verb);
+    fprintf(stderr, "%-16s %8s %10s %10s %10s %10s %10s %10s\n", "verb", "count",
+            "rec_p50", "p50", "delta", "rec_p99", "p99", "delta");
+    for (size_t i = 0; i < m; ) {
+        size_t j = i, k = 0;
+        while (j < m && !replay_cmp_verb(&by[i], &by[j])) {
+            a[k] = by[j]->lat_us;
+            b[k] = (by[j]->t_done - by[j]->t_sent) / 1000;
+            k++; j++;
+        }
+        qsort(a, k, sizeof *a, cmp_u64);
+        qsort(b, k, sizeof *b, cmp_u64);
+        double r50 = (double)pct_sorted(a, k, 0.50) / 1000.0, p50 = (double)pct_sorted(b, k, 0.50) / 1000.0;
+        double r99 = (double)pct_sorted(a, k, 0.99) / 1000.0, p99 = (double)pct_sorted(b, k, 0.99) / 1000.0;
+        int vl = (int)verb_len(by[i]->cmd);
+        fprintf(stderr, "%-16.*s %8zu %10.3f %10.3f %+10.3f %10.3f %10.3f %+10.3f\n",
+                vl > 16 ? 16 : vl, by[i]->cmd, k, r50, p50, p50 - r50, r99, p99, p99 - r99);
+        i = j;
+    }
+    fprintf(stderr, "(latencies in ms)\n");
+    free(by); free(a); free(b);
+}
+
+static int run_replay(const cfg_t *cfg_in, int argc, char **argv) {
+    const char *path = NULL, *speed_s = "1x";
+    double speed = 1.0;   /* 0 = as fast as possible */
+    int conns = 1;
+    for (int i = 1; i < argc; i++) {
+        if (!strncmp(argv[i], "--speed=", 8)) {
+            speed_s = argv[i] + 8;
+            char *end;
+            speed = !strcasecmp(speed_s, "max") ? 0 : strtod(speed_s, &end);
+            if (strcasecmp(speed_s, "max") && (end == speed_s || (*end && strcasecmp(end, "x")) || speed <= 0)) {
+                fprintf(stderr, "--speed expects a factor such as 2x, 0.5x, or max\n");
+                return -1;
+            }
+        } else if (!strncmp(argv[i], "--conns=", 8)) {
+            conns = atoi(argv[i] + 8);
+            if (conns < 1 || conns > REPLAY_MAX_CONNS) {
+                fprintf(stderr, "--conns expects 1..%d\n", REPLAY_MAX_CONNS);
+                return -1;
+            }
+        } else if (!path && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "usage: replay <session.log> [--speed=Nx|max] [--conns=N]\n");
+        return -1;
+    }
+    size_t n = 0;
+    char *strs = NULL;
+    replay_rec_t *v = replay_load(path, &n, &strs);
+    if (!v) return -1;
+
+    cfg_t cfg = *cfg_in;
+    cfg.shm_bytes = 0;   /* replies must come over the socket we poll */
+    replay_conn_t *rc_ = (replay_conn_t*)calloc((size_t)conns, sizeof *rc_);
+    struct pollfd *pfd = (struct pollfd*)calloc((size_t)conns, sizeof *pfd);
+    int rc = rc_ && pfd ? 0 : -1;
+    int opened = 0;
+    if (rc != 0) perror("malloc");
+    for (; rc == 0 && opened < conns; opened++) {
+        replay_conn_t *k = &rc_[opened];
+        if (conn_connect_cfg(&k->c, &cfg) != 0) { rc = -1; break; }
+        sock_set_nonblock(k->c.fd, 1);
+        conn_resp_init(&k->c, &k->r, replay_count_sink, NULL);
+    }
+
+    uint64_t t0 = mono_ns();
+    size_t next = 0, done = 0;
+    while (rc == 0 && done < n) {
+        uint64_t now = mono_ns();
+        int timeout = -1;
+        /* queue everything that is due, least-loaded connection first */
+        while (next < n) {
+            uint64_t due = speed > 0 ? t0 + (uint64_t)((double)(v[next].start_us - v[0].start_us) * 1000.0 / speed) : now;
+            if (due > now) { timeout = (int)((due - now) / 1000000ull) + 1; break; }
+            replay_conn_t *k = NULL;
+            for (int i = 0; i < conns; i++)
+                if (rc_[i].inflight < REPLAY_WINDOW && (!k || rc_[i].inflight < k->inflight)) k = &rc_[i];
+            if (!k) break;   /* every window is full: wait for replies */
+            size_t len = strlen(v[next].cmd), need = cmd_wire_size(&k->c, len);
+            if (k->tx_off && k->tx_off == k->tx_len) k->tx_off = k->tx_len = 0;
+            if (k->tx_len + need > k->tx_cap) {
+                size_t ncap = k->tx_cap ? k->tx_cap : 4096;
+                while (ncap < k->tx_len + need) ncap *= 2;
+                unsigned char *nb = (unsigned char*)realloc(k->tx, ncap);
+                if (!nb) { perror("malloc"); rc = -1; break; }
+                k->tx = nb; k->tx_cap = ncap;
+            }
+            int slot = (k->head + k->inflight) % REPLAY_WINDOW;
+            k->tags[slot] = k->c.bin ? conn_next_tag(&k->c) : 0;
+            k->tx_len += cmd_wire_encode(&k->c, k->tags[slot], v[next].cmd, len, k->tx + k->tx_len);
+            k->pend[slot] = next;
+            k->inflight++;
+            v[next].t_sent = now;
+            v[next].slip_ns = now - due;
+            next++;
+        }
+        if (rc != 0) break;
+
+        for (int i = 0; i < conns; i++) {
+            pfd[i].fd = rc_[i].c.fd;
+            pfd[i].events = (short)((rc_[i].inflight ? POLLIN : 0) | (rc_[i].tx_off < rc_[i].tx_len ? POLLOUT : 0));
+            pfd[i].revents = 0;
+        }
+        if (poll(pfd, (unsigned)conns, timeout) < 0) {
+            if (SOCKERR() == EINTR) continue;
+            perror("poll");
+            rc = -1;
+            break;
+        }
+        for (int i = 0; i < conns && rc == 0; i++) {
+            replay_conn_t *k = &rc_[i];
+            if ((pfd[i].revents & (POLLOUT | POLLERR | POLLHUP)) && k->tx_off < k->tx_len) {
+                long w = sock_send_some(k->c.fd, k->tx + k->tx_off, k->tx_len - k->tx_off);
+                if (w < 0) { fprintf(stderr, "[replay] send failed\n"); rc = -1; break; }
+                k->tx_off += (size_t)w;
+            }
+            if (!(pfd[i].revents & (POLLIN | POLLERR | POLLHUP))) continue;
+            int got = conn_fill(&k->c, 0);
+            if (got == IO_TIMEOUT) continue;
+            if (got <= 0) {
+                fprintf(stderr, got == 0 ? "server closed connection\n" : "[replay] read failed\n");
+                rc = got == 0 ? -2 : -1;
+                break;
+            }
+            while (k->c.rx_off < k->c.rx_len && k->inflight > 0) {
+                replay_rec_t *x = &v[k->pend[k->head]];
+                k->r.tag = k->tags[k->head];
+                k->c.rx_off += resp_feed(&k->r, k->c.rx + k->c.rx_off, k->c.rx_len - k->c.rx_off);
+                if (k->r.st == RESP_LEGACY) {
+                    fprintf(stderr, "[replay] hostd does not frame replies; replay needs framing\n");
+                    rc = -1; break;
+                }
+                if (k->r.st == RESP_ERROR) {
+                    fprintf(stderr, "[replay] malformed response frame\n");
+                    rc = -1; break;
+                }
+                if (k->r.st != RESP_DONE) break;
+                x->t_done = mono_ns();
+                x->got_bytes = k->r.bytes;
+                x->failed = resp_error(&k->r) != NULL;
+                stats_record(stats_verb(x->cmd), x->t_done - x->t_sent, strlen(x->cmd) + 1,
+                             k->r.bytes, x->failed);
+                k->head = (k->head + 1) % REPLAY_WINDOW;
+                k->inflight--;
+                done++;
+                conn_resp_init(&k->c, &k->r, replay_count_sink, NULL);
+            }
+        }
+    }
+    if (rc_ && opened == conns)
+        replay_report(v, n, (double)(mono_ns() - t0) / 1e9, conns, speed > 0 ? speed_s : "max");
+    for (int i = 0; rc_ && i < opened; i++) {
+        if (rc_[i].c.fd >= 0) conn_close(&rc_[i].c);
+        free(rc_[i].tx);
+    }
+    free(rc_); free(pfd); free(strs); free(v);
+    return rc;
+}
+
+// ----- bulk transfer -----
+/*
+ * upload [--resume] <local-file> <vm>:<target>
+ *
+ * Streams a file to hostd over the current connection:
+ *
+ *     upload <vm>:<target> offset=<off> length=<len> total=<size>
+ *
+ * is sent as an ordinary command and followed immediately by exactly <len>
+ * raw bytes (file[off .. off+len)); hostd answers with a normal reply once
+ * the data is stored. With --resume the client first asks
+ *
+ *     upload-stat <vm>:<target>
+ *
+ * and continues from the size reported in its "size=<n>" trailer (or
+ * payload), so an upload cut off by a dropped connection restarts where it
+ * stopped. On Linux the file goes to the socket with sendfile(); elsewhere it
+ * is mapped (POSIX) or read (Windows) in XFER_WINDOW pieces.
+ */
+#define XFER_WINDOW       (8u * 1024 * 1024)   /* mmap/read window */
+#define XFER_PROGRESS_MS  250
+
+typedef struct {
+    const char *what;       /* "upload" / "download" */
+    uint64_t    total;      /* bytes expected this run (0 = unknown) */
+    uint64_t    done;
+    uint64_t    t0, last;
+    int         tty;        /* redraw a progress line on stderr */
+} xfer_progress_t;
+
+static void xfer_progress_init(xfer_progress_t *p, const char *what, uint64_t total) {
+    memset(p, 0, sizeof(*p));
+    p->what = what;
+    p->total = total;
+    p->t0 = p->last = mono_ns();
+#ifdef _WIN32
+    p->tty = _isatty(_fileno(stderr));
+#else
+    p->tty = isatty(fileno(stderr));
+#endif
+}
+
+static void xfer_progress(xfer_progress_t *p, int final) {
+    uint64_t now = mono_ns();
+    if (!final && (!p->tty || now - p->last < (uint64_t)XFER_PROGRESS_MS * 1000000ull)) return;
+    p->last = now;
+    double secs = (double)(now - p->t0) / 1e9;
+    if (secs <= 0) secs = 1e-9;
+    double mb = (double)p->done / 1e6;
+    if (!final) {
+        if (p->total)
+            fprintf(stderr, "\r[%s] %.1f / %.1f MB (%d%%) %.2f MB/s   ", p->what, mb,
+                    (double)p->total / 1e6, (int)(p->done * 100 / p->total), mb / secs);
+        else
+            fprintf(stderr, "\r[%s] %.1f MB %.2f MB/s   ", p->what, mb, mb / secs);
+        return;
+    }
+    fprintf(stderr, "%s[%s] %llu bytes in %.3f s (%.2f MB/s)\n", p->tty ? "\r" : "",
+            p->what, (unsigned long long)p->done, secs, mb / secs);
+}
+
+typedef struct { char *buf; size_t cap, len; } collect_t;
+
+static int collect_sink(void *ctx, const void *data, size_t len) {
+    collect_t *k = (collect_t*)ctx;
+    size_t n = len < k->cap - 1 - k->len ? len : k->cap - 1 - k->len;
+    memcpy(k->buf + k->len, data, n);
+    k->len += n;
+    k->buf[k->len] = 0;
+    return 0;
+}
+
+/* Run a command whose (short) reply the client interprets itself. The reply
+ * payload lands in buf; the trailer is left in r->line. */
+static int conn_query(conn_t *c, const char *line, resp_t *r, char *buf, size_t cap) {
+    collect_t k = { buf, cap, 0 };
+    buf[0] = 0;
+    int rc = conn_send_line(c, line);
+    if (rc != 0) return rc;
+    conn_resp_init(c, r, collect_sink, &k);
+    return resp_read(c, r);
+}
+
+/* Find "key=<number>" in s; returns 0 and stores it, -1 if absent. */
+static int kv_num(const char *s, const char *key, int base, uint64_t *out) {
+    size_t kl = strlen(key);
+    for (const char *p = s; (p = strstr(p, key)) != NULL; p += kl) {
+        if ((p != s && !isspace((unsigned char)p[-1])) || p[kl] != '=') continue;
+        char *end;
+        unsigned long long v = strtoull(p + kl + 1, &end, base);
+        if (end == p + kl + 1) return -1;
+        *out = (uint64_t)v;
+        return 0;
+    }
+    return -1;
+}
+static int kv_u64(const char *s, const char *key, uint64_t *out) { return kv_num(s, key, 10, out); }
+static int kv_hex32(const char *s, const char *key, uint64_t *out) { return kv_num(s, key, 16, out); }
+
+/* Local file being uploaded. */
+typedef struct {
+#ifdef _WIN32
+    int            fd;
+    unsigned char *buf;        /* read window */
+#else
+    int            fd;
+    unsigned char *map;        /* mapped window */
+    size_t         map_len;
+    int            no_sendfile;
+#endif
+    uint64_t       size;
+    uint64_t       win_off;    /* file offset of the current window */
+    size_t         win_len;
+} xfer_src_t;
+
+static int xfer_src_open(xfer_src_t *s, const char *path) {
+    memset(s, 0, sizeof(*s));
+#ifdef _WIN32
+    s->fd = _open(path, _O_RDONLY | _O_BINARY);
+    if (s->fd < 0) { perror(path); return -1; }
+    struct _stati64 st;
+    if (_fstati64(s->fd, &st) != 0) { perror(path); _close(s->fd); return -1; }
+#else
+    s->fd = open(path, O_RDONLY);
+    if (s->fd < 0) { perror(path); return -1; }
+    struct stat st;
+    if (fstat(s->fd, &st) != 0) { perror(path); close(s->fd); return -1; }
+    if (!S_ISREG(st.st_mode)) { fprintf(stderr, "%s: not a regular file\n", path); close(s->fd); return -1; }
+#endif
+    s->size = (uint64_t)st.st_size;
+    return 0;
+}
+
+static void xfer_src_close(xfer_src_t *s) {
+#ifdef _WIN32
+    free(s->buf);
+    _close(s->fd);
+#else
+    if (s->map) munmap(s->map, s->map_len);
+    close(s->fd);
+#endif
+}
+
+/* Make file[off ..] available in the window. Returns 0 or -1. */
+static int xfer_src_window(xfer_src_t *s, uint64_t off) {
+    if (off >= s->win_off && off < s->win_off + s->win_len) return 0;
+#ifdef _WIN32
+    uint64_t left = s->size - off;
+    if (!s->buf && !(s->buf = (unsigned char*)malloc(XFER_WINDOW))) { perror("malloc"); return -1; }
+    if (_lseeki64(s->fd, (__int64)off, SEEK_SET) < 0) { perror("seek"); return -1; }
+    int n = _read(s->fd, s->buf, left < XFER_WINDOW ? (unsigned)left : XFER_WINDOW);
+    if (n <= 0) { fprintf(stderr, "read failed at offset %llu\n", (unsigned long long)off); return -1; }
+    s->win_off = off;
+    s->win_len = (size_t)n;
+#else
+    static long page;
+    if (!page) page = sysconf(_SC_PAGESIZE) > 0 ? sysconf(_SC_PAGESIZE) : 4096;
+    uint64_t base = off - off % (uint64_t)page;
+    size_t len = s->size - base < XFER_WINDOW ? (size_t)(s->size - base) : XFER_WINDOW;
+    if (s->map) munmap(s->map, s->map_len);
+    s->map = (unsigned char*)mmap(NULL, len, PROT_READ, MAP_SHARED, s->fd, (off_t)base);
+    if (s->map == MAP_FAILED) { s->map = NULL; perror("mmap"); return -1; }
+    posix_madvise(s->map, len, POSIX_MADV_SEQUENTIAL);
+    s->map_len = len;
+    s->win_off = base;
+    s->win_len = len;
+#endif
+    return 0;
+}
+
+/* Send up to len bytes of the file starting at off to a non-blocking socket.
+ * Returns bytes sent (0 if the socket is full), -1 on error, -2 peer gone. */
+static long xfer_src_send(xfer_src_t *s, int sock, uint64_t off, size_t len) {
+#if defined(__linux__)
+    if (!s->no_sendfile) {
+        off_t o = (off_t)off;
+        for (;;) {
+            ssize_t n = sendfile(sock, s->fd, &o, len);
+            if (n >= 0) return (long)n;
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            if (errno == EPIPE || errno == ECONNRESET) return -2;
+            if (errno != EINVAL && errno != ENOSYS) { perror("sendfile"); return -1; }
+            s->no_sendfile = 1;   /* e.g. a filesystem without sendfile support */
+            break;
+        }
+    }
+#endif
+    if (xfer_src_window(s, off) != 0) return -1;
+    size_t avail = s->win_len - (size_t)(off - s->win_off);
+#ifdef _WIN32
+    unsigned char *p = s->buf;
+#else
+    unsigned char *p = s->map;
+#endif
+    return sock_send_some(sock, p + (off - s->win_off), len < avail ? len : avail);
+}
+
+static int run_upload(conn_t *c, int argc, char **argv) {
+    int resume = 0, ai = 1;
+    if (ai < argc && !strcmp(argv[ai], "--resume")) { resume = 1; ai++; }
+    if (argc - ai != 2 || !strchr(argv[ai + 1], ':')) {
+        fprintf(stderr, "usage: upload [--resume] <local-file> <vm>:<target>\n");
+        return -1;
+    }
+    const char *path = argv[ai], *dest = argv[ai + 1];
+    xfer_src_t src;
+    if (xfer_src_open(&src, path) != 0) return -1;
+
+    char line[640], reply[256];
+    resp_t r;
+    uint64_t off = 0;
+    int rc;
+    if (resume) {
+        snprintf(line, sizeof line, "upload-stat %s", dest);
+        rc = conn_query(c, line, &r, reply, sizeof reply);
+        if (rc != 0) { xfer_src_close(&src); return rc; }
+        if (resp_error(&r)) {
+            fprintf(stderr, "error: %s\n", resp_error(&r));
+            xfer_src_close(&src);
+            return -1;
+        }
+        if (kv_u64(r.line, "size", &off) != 0 && kv_u64(reply, "size", &off) != 0) off = 0;
+        if (off > src.size) {
+            fprintf(stderr, "[upload] %s already holds %llu bytes, more than %s\n",
+                    dest, (unsigned long long)off, path);
+            xfer_src_close(&src);
+            return -1;
+        }
+        if (off) fprintf(stderr, "[upload] resuming at offset %llu\n", (unsigned long long)off);
+    }
+
+    uint64_t len = src.size - off, t0 = mono_ns();
+    snprintf(line, sizeof line, "upload %s offset=%llu length=%llu total=%llu", dest,
+             (unsigned long long)off, (unsigned long long)len, (unsigned long long)src.size);
+    rc = conn_send_line(c, line);
+    if (rc != 0) { xfer_src_close(&src); return rc; }
+
+    xfer_progress_t prog;
+    xfer_progress_init(&prog, "upload", len);
+    conn_resp_init(c, &r, stdout_sink, stdout);
+    uint64_t pos = off, end = src.size;
+    int early = 0, send_rc = 0;
+    if (sock_set_nonblock(c->fd, 1) != 0) { xfer_src_close(&src); return -1; }
+    while (pos < end) {
+        /* Ctrl-C or --deadline: stop mid-stream; the caller drops the connection */
+        if (deadline_expired()) { rc = IO_TIMEOUT; break; }
+        /* hostd may refuse before taking all the data; watch for a reply */
+        struct pollfd pfd;
+        pfd.fd = c->fd; pfd.events = POLLIN | POLLOUT; pfd.revents = 0;
+        if (poll(&pfd, 1, deadline_clip(XFER_PROGRESS_MS)) < 0) {
+            if (SOCKERR() == EINTR) continue;
+            perror("poll"); rc = -1; break;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) { early = 1; break; }
+        if (pfd.revents & POLLOUT) {
+            uint64_t want = end - pos;
+            long n = xfer_src_send(&src, c->fd, pos, want > XFER_WINDOW ? XFER_WINDOW : (size_t)want);
+            if (n < 0) { send_rc = (int)n; break; }
+            pos += (uint64_t)n;
+            prog.done = pos - off;
+        }
+        xfer_progress(&prog, 0);
+    }
+    sock_set_nonblock(c->fd, 0);
+    xfer_src_close(&src);
+
+    /* a failed send usually means hostd refused and closed; its reply,
+     * already on the way, says why */
+    if (send_rc) early = 1;
+    if (rc == 0) {
+        rc = resp_read(c, &r);
+        if (rc != 0 && send_rc) rc = send_rc;
+    }
+    fflush(stdout);
+    uint64_t t_end = mono_ns();
+    if (TRACE_ON()) {
+        char info[32];
+        snprintf(info, sizeof info, "%llu", (unsigned long long)(pos - off));
+        trace_span("upload", t0, t_end, "bytes", info);
+    }
+    int failed = rc != 0 || early || resp_error(&r);
+    stats_record(stats_verb("upload"), t_end - t0, strlen(line) + 1 + (size_t)(pos - off), r.bytes, failed);
+    xfer_progress(&prog, 1);
+
+    if (rc == 0 && resp_error(&r)) fprintf(stderr, "error: %s\n", resp_error(&r));
+    if (rc == 0 && early && !resp_error(&r))
+        fprintf(stderr, "[upload] hostd replied after %llu of %llu bytes\n",
+                (unsigned long long)(pos - off), (unsigned long long)len);
+    if (rc == IO_TIMEOUT) {
+        fprintf(stderr, "[upload] cancelled at offset %llu; rerun with --resume to continue\n",
+                (unsigned long long)pos);
+        return IO_TIMEOUT;
+    }
+    if (rc != 0 || early) {
+        /* the stream is out of step with hostd; the connection can't be reused */
+        if (rc != 0)
+            fprintf(stderr, "[upload] interrupted at offset %llu; rerun with --resume to continue\n",
+                    (unsigned long long)pos);
+        return -2;
+    }
+    return resp_error(&r) ? -1 : 0;
+}
+
+/*
+ * download <vm>:<region> <local-file>
+ *
+ * hostd answers "download <vm>:<region>" with an ordinary reply whose
+ * payload is the data and whose trailer carries "crc32=<hex>" (and
+ * optionally "size=<n>"). Chunks are gathered into an XFER_WRITE_BUF buffer
+ * and written with large writes at multiples of its size; the CRC-32 is
+ * computed on the fly. Data goes to <local-file>.part, which is renamed into
+ * place only after the checksum matches, so memory use stays bounded
+ * whatever the payload size. A reply without a crc32 (an old or unframed
+ * hostd) cannot be verified: the data is left in the .part file and the
+ * command fails.
+ */
+#define XFER_WRITE_BUF  (4u * 1024 * 1024)
+
+static uint32_t g_crc_tab[8][256];
+
+static void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0xEDB88320u & (0u - (c & 1)));
+        g_crc_tab[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            g_crc_tab[t][i] = (g_crc_tab[t-1][i] >> 8) ^ g_crc_tab[0][g_crc_tab[t-1][i] & 0xff];
+}
+
+/* CRC-32 (IEEE), slicing by 8. Start and finish with crc = 0. */
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t n) {
+    if (!g_crc_tab[0][1]) crc32_init();
+    crc = ~crc;
+    while (n >= 8) {
+        uint32_t a = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = g_crc_tab[7][a & 0xff] ^ g_crc_tab[6][(a >> 8) & 0xff] ^
+              g_crc_tab[5][(a >> 16) & 0xff] ^ g_crc_tab[4][a >> 24] ^
+              g_crc_tab[3][p[4]] ^ g_crc_tab[2][p[5]] ^ g_crc_tab[1][p[6]] ^ g_crc_tab[0][p[7]];
+        p += 8; n -= 8;
+    }
+    while (n--) crc = (crc >> 8) ^ g_crc_tab[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+typedef struct {
+    int              fd;
+    unsigned char   *buf;
+    size_t           len;       /* bytes waiting in buf */
+    uint64_t         total;     /* bytes received */
+    uint32_t         crc;
+    int              err;
+    xfer_progress_t *prog;
+    int              ur;        /* --io=uring: writes go through the ring */
+    unsigned char   *wbuf[2];   /* registered buffers; buf is one of them */
+    size_t           wlen[2];   /* bytes being written from each, 0 = free */
+    int              cur;
+    uint64_t         off;       /* file offset of the next write */
+    int              busy;
+} xfer_dst_t;
+
+static int xfer_write_all(int fd, const unsigned char *p, size_t n) {
+    while (n) {
+#ifdef _WIN32
+        int w = _write(fd, p, n > INT_MAX ? INT_MAX : (unsigned)n);
+#else
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+#endif
+        if (w <= 0) { perror("write"); return -1; }
+        p += w; n -= (size_t)w;
+    }
+    return 0;
+}
+
+#ifdef VC_HAVE_URING
+/* Write completions: ud is the buffer index. Regular files only come back
+ * short when the disk is full, which fails the download like write() does. */
+static void xfer_ur_cqe(void *ctx, uint64_t ud, int res) {
+    xfer_dst_t *d = (xfer_dst_t*)ctx;
+    int b = (int)ud;
+    d->busy--;
+    if (res < 0 || (size_t)res < d->wlen[b]) {
+        fprintf(stderr, "write: %s\n", res < 0 ? strerror(-res) : "short write");
+        d->err = 1;
+    }
+    d->wlen[b] = 0;
+}
+
+/* Queue the filled buffer as WRITE_FIXED and switch to the other one,
+ * waiting for its previous write if that is still in flight. */
+static int xfer_ur_write(xfer_dst_t *d) {
+    int b = d->cur;
+    uring_prep(IORING_OP_WRITE_FIXED, d->fd, d->buf, d->len, d->off, (uint64_t)b)->buf_index = (uint16_t)b;
+    d->wlen[b] = d->len;
+    d->off += d->len;
+    d->busy++;
+    if (uring_submit(0) != 0) { d->busy--; d->wlen[b] = 0; return -1; }
+    d->cur = b ^ 1;
+    uint64_t ud;
+    int res;
+    while (uring_reap(&ud, &res)) if (ud != UR_IGNORE_UD) xfer_ur_cqe(d, ud, res);
+    while (d->wlen[d->cur]) {
+        if (uring_submit(1) != 0) return -1;
+        while (uring_reap(&ud, &res)) if (ud != UR_IGNORE_UD) xfer_ur_cqe(d, ud, res);
+    }
+    d->buf = d->wbuf[d->cur];
+    d->len = 0;
+    return d->err ? -1 : 0;
+}
+#endif
+
+/* Write out the gathered buffer. */
+static int xfer_flush(xfer_dst_t *d) {
+#ifdef VC_HAVE_URING
+    if (d->ur) return xfer_ur_write(d);
+#endif
+    if (xfer_write_all(d->fd, d->buf, d->len) != 0) return -1;
+    d->len = 0;
+    return 0;
+}
+
+static int download_sink(void *ctx, const void *data, size_t len) {
+    xfer_dst_t *d = (xfer_dst_t*)ctx;
+    const unsigned char *p = (const unsigned char*)data;
+    d->crc = crc32_update(d->crc, p, len);
+    d->total += len;
+    d->prog->done = d->total;
+    while (len) {
+        /* whole buffers' worth with nothing pending: write straight through */
+        if (!d->ur && d->len == 0 && len >= XFER_WRITE_BUF) {
+            size_t n = len - len % XFER_WRITE_BUF;
+            if (xfer_write_all(d->fd, p, n) != 0) { d->err = 1; return -1; }
+            p += n; len -= n;
+            continue;
+        }
+        size_t n = XFER_WRITE_BUF - d->len < len ? XFER_WRITE_BUF - d->len : len;
+        memcpy(d->buf + d->len, p, n);
+        d->len += n; p += n; len -= n;
+        if (d->len == XFER_WRITE_BUF && xfer_flush(d) != 0) { d->err = 1; return -1; }
+    }
+    xfer_progress(d->prog, 0);
+    return 0;
+}
+
+static int run_download(conn_t *c, int argc, char **argv) {
+    if (argc != 3 || !strchr(argv[1], ':')) {
+        fprintf(stderr, "usage: download <vm>:<region> <local-file>\n");
+        return -1;
+    }
+    const char *src = argv[1], *path = argv[2];
+    char part[1024];
+    if (snprintf(part, sizeof part, "%s.part", path) >= (int)sizeof part) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+    xfer_dst_t d;
+    xfer_progress_t prog;
+    memset(&d, 0, sizeof d);
+    xfer_progress_init(&prog, "download", 0);
+    d.prog = &prog;
+#ifdef _WIN32
+    d.fd = _open(part, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644);
+#else
+    d.fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+    if (d.fd < 0) { perror(part); return -1; }
+    unsigned char *mem = (unsigned char*)malloc(g_io == IO_URING ? 2 * XFER_WRITE_BUF : XFER_WRITE_BUF);
+    if (!mem) { perror("malloc"); CLOSEFILE(d.fd); remove(part); return -1; }
+    d.buf = mem;
+#ifdef VC_HAVE_URING
+    if (g_io == IO_URING) {
+        /* double-buffered: one buffer fills while the ring writes the other */
+        struct iovec iov[2] = { { mem, XFER_WRITE_BUF }, { mem + XFER_WRITE_BUF, XFER_WRITE_BUF } };
+        d.wbuf[0] = mem;
+        d.wbuf[1] = mem + XFER_WRITE_BUF;
+        d.ur = uring_register_buffers(iov, 2) == 0;
+    }
+#endif
+
+    char line[600];
+    snprintf(line, sizeof line, "download %s", src);
+    uint64_t t0 = mono_ns();
+    int rc = conn_send_line(c, line);
+    resp_t r;
+    if (rc == 0) {
+        conn_resp_init(c, &r, download_sink, &d);
+        rc = resp_read(c, &r);
+    }
+    if (rc == 0 && d.len && xfer_flush(&d) != 0) { d.err = 1; rc = -1; }
+#ifdef VC_HAVE_URING
+    if (d.ur) {
+        uring_drain(&d.busy, xfer_ur_cqe, &d);
+        uring_unregister_buffers();
+        if (d.err && rc == 0) rc = -1;
+    }
+#endif
+    if (CLOSEFILE(d.fd) != 0 && rc == 0) { perror(part); rc = -1; }
+    free(mem);
+    uint64_t t_end = mono_ns();
+    if (TRACE_ON()) {
+        char info[32];
+        snprintf(info, sizeof info, "%llu", (unsigned long long)d.total);
+        trace_span("download", t0, t_end, "bytes", info);
+    }
+    xfer_progress(&prog, 1);
+
+    const char *why = NULL;
+    uint64_t want_crc, want_size;
+    if (rc != 0) why = d.err ? "write failed" : "transfer failed";
+    else if (resp_error(&r)) why = resp_error(&r);
+    else if (kv_u64(r.line, "size", &want_size) == 0 && want_size != d.total) why = "size mismatch";
+    else if (kv_hex32(r.line, "crc32", &want_crc) != 0) {
+        stats_record(stats_verb("download"), t_end - t0, strlen(line) + 1, d.total, 1);
+        fprintf(stderr, "error: hostd sent no crc32; unverified data left in %s\n", part);
+        return -1;
+    } else if ((uint32_t)want_crc != d.crc) {
+        fprintf(stderr, "[download] crc32 mismatch: expected %08x, got %08x\n",
+                (unsigned)want_crc, (unsigned)d.crc);
+        why = "checksum mismatch";
+    }
+    stats_record(stats_verb("download"), t_end - t0, strlen(line) + 1, d.total, why != NULL);
+    if (why) {
+        remove(part);
+        if (rc == 0) fprintf(stderr, "error: %s\n", why);
+        return rc ? rc : -1;
+    }
+#ifdef _WIN32
+    remove(path);
+#endif
+    if (rename(part, path) != 0) { perror(path); return -1; }
+    return 0;
+}
+
+// ----- console -----
+/*
+ * console <vm>
+ *
+ * Attaches the terminal to a guest's serial console. After the command the
+ * connection carries a byte stream both ways until detach: hostd sends
+ * console output as reply chunks, the client sends keystrokes as chunks in
+ * the same framing ("$<len>\n<bytes>", or BIN_DATA frames), and detaching
+ * sends an end marker (".\n" or BIN_END). hostd then finishes the reply
+ * with its trailer and the connection is back in command mode.
+ *
+ * The terminal is in raw mode while attached; nothing is line buffered and
+ * both directions are written as soon as poll() reports data. Ctrl-]
+ * detaches.
+ */
+#define CONSOLE_ESCAPE     0x1d    /* Ctrl-] */
+#define CONSOLE_DETACH_MS  2000    /* wait this long for hostd to finish */
+
+#ifndef _WIN32
+static struct termios g_console_tio;
+static int g_console_raw = 0;
+
+static void console_restore(void) {
+    if (!g_console_raw) return;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &g_console_tio);
+    g_console_raw = 0;
+}
+
+static int console_make_raw(void) {
+    static int registered = 0;
+    struct termios t;
+    if (tcgetattr(STDIN_FILENO, &g_console_tio) != 0) return -1;
+    t = g_console_tio;
+    t.c_iflag &= ~(tcflag_t)(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    t.c_oflag &= ~(tcflag_t)OPOST;
+    t.c_lflag &= ~(tcflag_t)(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cflag &= ~(tcflag_t)(CSIZE | PARENB);
+    t.c_cflag |= CS8;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &t) != 0) return -1;
+    g_console_raw = 1;
+    if (!registered) { atexit(console_restore); registered = 1; }
+    return 0;
+}
+
+static int fd_sink(void *ctx, const void *data, size_t len) {
+    int fd = *(const int*)ctx;
+    const char *p = (const char*)data;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n; len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Send keystrokes as one chunk, or the end marker when len == 0. */
+static int console_send(conn_t *c, const unsigned char *p, size_t len) {
+    unsigned char buf[4096 + 32];
+    size_t h;
+    if (c->bin) {
+        put_le32(buf, (uint32_t)len);
+        buf[4] = len ? BIN_DATA : BIN_END;
+        buf[5] = 0;
+        put_le16(buf + 6, c->tag);
+        h = BIN_HDR_SIZE;
+    } else {
+        h = (size_t)(len ? snprintf((char*)buf, 32, "$%zu\n", len) : snprintf((char*)buf, 32, ".\n"));
+    }
+    memcpy(buf + h, p, len);
+    return sock_send_all(c->fd, buf, h + len);
+}
+
+static int run_console(conn_t *c, int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: console <vm>\n");
+        return -1;
+    }
+    char line[300];
+    snprintf(line, sizeof line, "console %s", argv[1]);
+    int rc = conn_send_line(c, line);
+    if (rc != 0) return rc;
+
+    /* keystrokes go out unbatched while attached; the connection gets its
+     * old setting back afterwards (both calls fail harmlessly on UNIX sockets) */
+    int one = 1, out = STDOUT_FILENO, nodelay = 0;
+    socklen_t optlen = sizeof nodelay;
+    int had_opt = getsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (void*)&nodelay, &optlen) == 0;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (const void*)&one, sizeof one);
+    fflush(stdout);
+    resp_t r;
+    conn_resp_init(c, &r, fd_sink, &out);
+    int tty = isatty(STDIN_FILENO);
+    fprintf(stderr, "[console] attached to %s; Ctrl-] detaches\n", argv[1]);
+    if (tty && console_make_raw() != 0) perror("console: raw mode");
+
+    int detaching = 0, detach_timeout = 0;
+    uint64_t detach_at = 0;
+    rc = 0;
+    while (rc == 0 && r.st != RESP_DONE) {
+        struct pollfd pfd[2];
+        pfd[0].fd = c->fd;       pfd[0].events = POLLIN; pfd[0].revents = 0;
+        pfd[1].fd = STDIN_FILENO; pfd[1].events = POLLIN; pfd[1].revents = 0;
+        int timeout = -1;
+        if (detaching) {
+            uint64_t waited = (mono_ns() - detach_at) / 1000000ull;
+            if (waited >= CONSOLE_DETACH_MS) { detach_timeout = 1; break; }
+            timeout = CONSOLE_DETACH_MS - (int)waited;
+        }
+        if (poll(pfd, detaching ? 1 : 2, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll"); rc = -1; break;
+        }
+        if (!detaching && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            unsigned char in[4096];
+            ssize_t n = read(STDIN_FILENO, in, sizeof in);
+            if (n < 0 && errno == EINTR) continue;
+            size_t keep = n > 0 ? (size_t)n : 0;
+            unsigned char *esc = n > 0 ? (unsigned char*)memchr(in, CONSOLE_ESCAPE, (size_t)n) : NULL;
+            if (esc) keep = (size_t)(esc - in);
+            if (keep && (rc = console_send(c, in, keep)) != 0) break;
+            if (n <= 0 || esc) {   /* Ctrl-] or end of input */
+                if ((rc = console_send(c, NULL, 0)) != 0) break;
+                detaching = 1;
+                detach_at = mono_ns();
+            }
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            int n = conn_fill(c, 0);
+            if (n == IO_TIMEOUT) continue;
+            if (n == 0) { rc = -2; break; }
+            if (n < 0) { rc = -1; break; }
+            c->rx_off += resp_feed(&r, c->rx + c->rx_off, c->rx_len - c->rx_off);
+            if (r.st == RESP_LEGACY || r.st == RESP_ERROR) {
+                console_restore();
+                fprintf(stderr, "\n[console] hostd did not open a console stream\n");
+                rc = -2;
+            } else if (r.sink_err) {
+                rc = -1;
+            }
+        }
+    }
+    console_restore();
+    if (had_opt && !nodelay)
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (const void*)&nodelay, sizeof nodelay);
+    if (detach_timeout) {
+        /* the stream may still be open on hostd's side: the connection is unusable */
+        conn_close(c);
+        fprintf(stderr, "\n[console] hostd did not confirm detach; connection closed\n");
+        return -1;
+    }
+    if (rc == -2) fprintf(stderr, "\n[console] connection lost\n");
+    else if (rc == 0 && resp_error(&r)) fprintf(stderr, "\nerror: %s\n", resp_error(&r));
+    else if (rc == 0) fprintf(stderr, "\n[console] detached from %s\n", argv[1]);
+    if (rc == 0 && resp_error(&r)) rc = -1;
+    return rc;
+}
+#else
+static int run_console(conn_t *c, int argc, char **argv) {
+    (void)c; (void)argc; (void)argv;
+    fprintf(stderr, "console is not supported on Windows yet\n");
+    return -1;
+}
+#endif
+
+// ----- wait -----
+/*
+ * wait <vm> <condition> [--timeout <duration>]
+ *
+ * Asks hostd to hold the request until the condition holds:
+ *
+ *     wait <vm> <condition> [timeout=<ms>]
+ *
+ * hostd replies once it is met, or with ".err timeout". A hostd without the
+ * primitive (an "unknown"/"unsupported" error, or an unframed reply) is
+ * polled instead with "vm status <vm>" on the same connection: the interval
+ * starts at WAIT_POLL_MIN_MS, so short waits are caught quickly, and grows by
+ * half each round up to WAIT_POLL_MAX_MS, so long waits cost hostd little.
+ *
+ * A condition is a word ("halted"), which must be a whole whitespace-separated
+ * field of the status, or key=value ("state=halted", which also matches
+ * "state: halted"), compared case-insensitively.
+ *
+ * Without --timeout the wait is bounded by timeout= from the config, or by
+ * WAIT_DEFAULT_MS if that is unset, so a condition that never holds cannot
+ * hang a script.
+ */
+#define WAIT_POLL_MIN_MS  5
+#define WAIT_POLL_MAX_MS  250
+#define WAIT_GRACE_MS     1000   /* how long past the timeout hostd may answer */
+#define WAIT_DEFAULT_MS   600000
+
+static void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+#endif
+}
+
+static int word_char(char ch) {
+    return isalnum((unsigned char)ch) || ch == '_' || ch == '-' || ch == '.';
+}
+
+/* Does `text` contain the word `w` (length n) at p, with word boundaries? */
+static int word_at(const char *text, const char *p, const char *w, size_t n) {
+    return !strncasecmp(p, w, n) && (p == text || !word_char(p[-1])) && !word_char(p[n]);
+}
+
+static int wait_match(const char *text, const char *cond) {
+    const char *eq = strchr(cond, '=');
+    size_t kl = eq ? (size_t)(eq - cond) : strlen(cond);
+    if (!eq) {
+        for (const char *p = text; *(p += strspn(p, " \t\r\n")); ) {
+            size_t n = strcspn(p, " \t\r\n");
+            if (n == kl && !strncasecmp(p, cond, kl)) return 1;
+            p += n;
+        }
+        return 0;
+    }
+    for (const char *p = text; *p; p++) {
+        if (!word_at(text, p, cond, kl)) continue;
+        const char *v = p + kl;
+        while (*v == ' ' || *v == '\t') v++;
+        if (*v != '=' && *v != ':') continue;
+        v++;
+        while (*v == ' ' || *v == '\t') v++;
+        if (word_at(text, v, eq + 1, strlen(eq + 1))) return 1;
+    }
+    return 0;
+}
+
+static int wait_unsupported(const resp_t *r) {
+    const char *e = resp_error(r);
+    if (r->legacy) return 1;
+    return e && (!strncasecmp(e, "unknown", 7) || !strncasecmp(e, "unsupported", 11));
+}
+
+static int run_wait(conn_t *c, int argc, char **argv) {
+    long timeout_ms = -1;
+    const char *vm = NULL, *cond = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--timeout") && i + 1 < argc) {
+            timeout_ms = parse_duration_ms(argv[++i]);
+            if (timeout_ms < 0) { fprintf(stderr, "wait: invalid timeout '%s'\n", argv[i]); return -1; }
+        } else if (!strncmp(argv[i], "--timeout=", 10)) {
+            timeout_ms = parse_duration_ms(argv[i] + 10);
+            if (timeout_ms < 0) { fprintf(stderr, "wait: invalid timeout '%s'\n", argv[i] + 10); return -1; }
+        } else if (!vm) vm = argv[i];
+        else if (!cond) cond = argv[i];
+        else { vm = NULL; break; }
+    }
+    if (!vm || !cond) {
+        fprintf(stderr, "usage: wait <vm> <condition> [--timeout <duration>]\n");
+        return -1;
+    }
+    if (timeout_ms < 0) timeout_ms = g_timeout_ms > 0 ? g_timeout_ms : WAIT_DEFAULT_MS;
+
+    uint64_t t0 = mono_ns();
+    uint64_t deadline = t0 + (uint64_t)timeout_ms * 1000000ull;
+    char line[600], reply[4096];
+    resp_t r;
+    snprintf(line, sizeof line, "wait %s %s timeout=%ld", vm, cond, timeout_ms);
+
+    /* server-side wait */
+    int rc = conn_send_line(c, line);
+    if (rc != 0) return rc;
+    conn_resp_init(c, &r, NULL, NULL);   /* only the trailer matters */
+    rc = resp_read_until(c, &r, deadline + (uint64_t)WAIT_GRACE_MS * 1000000ull);
+    if (rc == IO_TIMEOUT) {
+        fprintf(stderr, "wait: hostd did not answer within the timeout\n");
+        return -2;
+    }
+    if (rc != 0) return rc;
+    const char *why = NULL;
+    if (!wait_unsupported(&r)) {
+        why = resp_error(&r);
+        goto done;
+    }
+
+    /* fallback: adaptive polling of "vm status" */
+    if (g_verbose) fprintf(stderr, "[wait] hostd has no wait; polling vm status\n");
+    snprintf(line, sizeof line, "vm status %s", vm);
+    int interval = WAIT_POLL_MIN_MS;
+    for (;;) {
+        rc = conn_query(c, line, &r, reply, sizeof reply);
+        if (rc != 0) return rc;
+        if (resp_error(&r)) { why = resp_error(&r); break; }
+        if (wait_match(reply, cond)) break;
+        uint64_t now = mono_ns();
+        if (now >= deadline) { why = "timeout"; break; }
+        if ((uint64_t)interval * 1000000ull > deadline - now)
+            interval = (int)((deadline - now) / 1000000ull) + 1;
+        sleep_ms(interval);
+        interval += interval / 2 + 1;
+        if (interval > WAIT_POLL_MAX_MS) interval = WAIT_POLL_MAX_MS;
+    }
+
+done:
+    stats_record(stats_verb("wait"), mono_ns() - t0, strlen(line) + 1, r.bytes, why != NULL);
+    if (why) {
+        if (!strcmp(why, "timeout")) fprintf(stderr, "wait: %s %s: timed out after %ld ms\n", vm, cond, timeout_ms);
+        else fprintf(stderr, "error: %s\n", why);
+        return -1;
+    }
+    if (g_verbose)
+        fprintf(stderr, "[wait] %s %s after %.3f s\n", vm, cond, (double)(mono_ns() - t0) / 1e9);
+    return 0;
+}
+
+// ----- watch -----
+/*
+ * watch [-n seconds] [-c ticks] <command ...>
+ *
+ * Re-issues a command on the open connection at a fixed interval and
+ * repaints only the lines whose content changed, so register files and
+ * counters can be followed at 20+ Hz without flicker. Each tick is built
+ * into one buffer and written at once. The bottom line shows the achieved
+ * refresh rate and the per-tick round-trip latency. Ctrl-C (or -c ticks)
+ * stops it. When stdout is not a terminal every tick's output is printed
+ * in full instead.
+ */
+#define WATCH_DEFAULT_MS   1000
+#define WATCH_MIN_MS       10
+#define WATCH_MAX_OUTPUT   (1u << 20)
+#define WATCH_RATE_TICKS   20     /* refresh rate is averaged over this many */
+
+typedef struct { char *buf; size_t len, cap; } grow_t;
+
+static int grow_append(grow_t *g, const void *data, size_t len) {
+    if (g->len + len + 1 > g->cap) {
+        size_t ncap = g->cap ? g->cap : 4096;
+        while (ncap < g->len + len + 1) ncap *= 2;
+        char *nb = (char*)realloc(g->buf, ncap);
+        if (!nb) return -1;
+        g->buf = nb; g->cap = ncap;
+    }
+    memcpy(g->buf + g->len, data, len);
+    g->len += len;
+    g->buf[g->len] = 0;
+    return 0;
+}
+
+static int grow_sink(void *ctx, const void *data, size_t len) {
+    grow_t *g = (grow_t*)ctx;
+    if (g->len + len > WATCH_MAX_OUTPUT) len = WATCH_MAX_OUTPUT - g->len;
+    return grow_append(g, data, len);
+}
+
+/* Start of line `n` of text (length len), its length in *ll; NULL if none. */
+static const char *nth_line(const char *text, size_t len, int n, size_t *ll) {
+    const char *p = text, *end = text + len;
+    for (int i = 0; i < n && p < end; i++) {
+        const char *nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+        p = nl ? nl + 1 : end;
+    }
+    if (p >= end) return NULL;
+    const char *nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+    *ll = (size_t)((nl ? nl : end) - p);
+    return p;
+}
+
+static volatile sig_atomic_t g_watch_stop = 0;
+static void watch_on_sigint(int sig) { (void)sig; g_watch_stop = 1; }
+
+static void term_size(int *rows, int *cols) {
+    *rows = 24; *cols = 80;
+#if !defined(_WIN32) && defined(TIOCGWINSZ)
+    struct winsize ws;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 2 && ws.ws_col > 0) {
+        *rows = ws.ws_row; *cols = ws.ws_col;
+    }
+#endif
+}
+
+static int run_watch(conn_t *c, int argc, char **argv) {
+    long interval_ms = WATCH_DEFAULT_MS, ticks = -1;
+    int ai = 1;
+    for (; ai < argc && argv[ai][0] == '-'; ai++) {
+        if (!strcmp(argv[ai], "-n") && ai + 1 < argc) {
+            double secs = strtod(argv[++ai], NULL);
+            interval_ms = (long)(secs * 1000.0 + 0.5);
+        } else if (!strcmp(argv[ai], "-c") && ai + 1 < argc) {
+            ticks = atol(argv[++ai]);
+        } else {
+            break;
+        }
+    }
+    if (ai >= argc || interval_ms <= 0 || ticks == 0) {
+        fprintf(stderr, "usage: watch [-n seconds] [-c ticks] <command ...>\n");
+        return -1;
+    }
+    if (interval_ms < WATCH_MIN_MS) interval_ms = WATCH_MIN_MS;
+    char cmd[1024] = "";
+    for (int i = ai; i < argc; i++) {
+        strncat(cmd, argv[i], sizeof cmd - strlen(cmd) - 2);
+        if (i + 1 < argc) strcat(cmd, " ");
+    }
+
+#ifdef _WIN32
+    int tty = _isatty(_fileno(stdout));
+#else
+    int tty = isatty(STDOUT_FILENO);
+#endif
+    grow_t out = { 0 }, prev = { 0 }, frame = { 0 };
+    uint64_t stamps[WATCH_RATE_TICKS];
+    double lat_sum = 0, lat_max = 0;
+    long n = 0;
+    int rc = 0, prev_lines = 0, rows, cols;
+    char tmp[256];
+    void (*old_int)(int) = signal(SIGINT, watch_on_sigint);
+    g_watch_stop = 0;
+
+    term_size(&rows, &cols);
+    if (tty) {
+        int k = snprintf(tmp, sizeof tmp, "\033[?25l\033[2J\033[HEvery %.2fs: %.*s",
+                         (double)interval_ms / 1000.0, cols > 20 ? cols - 20 : cols, cmd);
+        fwrite(tmp, 1, (size_t)k, stdout);
+    }
+    uint64_t next = mono_ns();
+    while (!g_watch_stop && (ticks < 0 || n < ticks)) {
+        uint64_t t0 = mono_ns();
+        out.len = 0;
+        rc = conn_send_line(c, cmd);
+        resp_t r;
+        if (rc == 0) {
+            conn_resp_init(c, &r, grow_sink, &out);
+            rc = resp_read(c, &r);
+        }
+        if (rc != 0) break;
+        if (resp_error(&r)) {
+            snprintf(tmp, sizeof tmp, "error: %s\n", resp_error(&r));
+            out.len = 0;
+            grow_append(&out, tmp, strlen(tmp));
+        }
+        uint64_t t1 = mono_ns();
+        double lat = (double)(t1 - t0) / 1e6;
+        stats_record(stats_verb(cmd), t1 - t0, strlen(cmd) + 1, r.bytes, resp_error(&r) != NULL);
+        stamps[n % WATCH_RATE_TICKS] = t1;
+        n++;
+        lat_sum += lat;
+        if (lat > lat_max) lat_max = lat;
+
+        frame.len = 0;
+        if (!tty) {
+            snprintf(tmp, sizeof tmp, "--- %ld (%.2f ms)\n", n, lat);
+            grow_append(&frame, tmp, strlen(tmp));
+            grow_append(&frame, out.buf ? out.buf : "", out.len);
+        } else {
+            /* repaint changed lines only; the last row is the status line */
+            int body = rows - 2, lines = 0;
+            for (int i = 0; i < body; i++) {
+                size_t ll = 0, pl = 0;
+                const char *l = out.buf ? nth_line(out.buf, out.len, i, &ll) : NULL;
+                const char *pv = prev.buf ? nth_line(prev.buf, prev.len, i, &pl) : NULL;
+                if (!l && i >= prev_lines) break;
+                if (l) lines = i + 1;
+                if (ll > (size_t)cols) ll = (size_t)cols;
+                if (pl > (size_t)cols) pl = (size_t)cols;
+                if (l && pv && ll == pl && !memcmp(l, pv, ll)) continue;
+                int k = snprintf(tmp, sizeof tmp, "\033[%d;1H", i + 2);
+                grow_append(&frame, tmp, (size_t)k);
+                if (l) grow_append(&frame, l, ll);
+                grow_append(&frame, "\033[K", 3);
+            }
+            prev_lines = lines;
+            int w = n < WATCH_RATE_TICKS ? (int)n - 1 : WATCH_RATE_TICKS - 1;
+            double span = w > 0 ? (double)(t1 - stamps[(n - 1 - w) % WATCH_RATE_TICKS]) / 1e9 : 0;
+            int k = snprintf(tmp, sizeof tmp,
+                             "\033[%d;1H\033[7m tick %ld  %.1f Hz  latency %.2f ms (avg %.2f, max %.2f) \033[0m\033[K",
+                             rows, n, span > 0 ? w / span : 0.0, lat, lat_sum / (double)n, lat_max);
+            grow_append(&frame, tmp, (size_t)k);
+            grow_t t = prev; prev = out; out = t;   /* keep this tick for the next diff */
+        }
+        if (frame.len) {
+            fwrite(frame.buf, 1, frame.len, stdout);
+            fflush(stdout);
+        }
+
+        next += (uint64_t)interval_ms * 1000000ull;
+        uint64_t now = mono_ns();
+        if (next < now) next = now;   /* running late: don't try to catch up */
+        else if (!g_watch_stop && (ticks < 0 || n < ticks)) sleep_ms((int)((next - now) / 1000000ull));
+    }
+    if (tty) {
+        int k = snprintf(tmp, sizeof tmp, "\033[%d;1H\033[?25h\n", rows);
+        fwrite(tmp, 1, (size_t)k, stdout);
+    }
+    fflush(stdout);
+    signal(SIGINT, old_int == SIG_ERR ? SIG_DFL : old_int);
+    free(out.buf); free(prev.buf); free(frame.buf);
+    if (rc == 0 && n)
+        fprintf(stderr, "[watch] %ld ticks, latency avg %.2f ms, max %.2f ms\n", n, lat_sum / (double)n, lat_max);
+    return rc;
+}
+
+// ----- memory viewer -----
+/*
+ * /mem <vm> <addr> [len]
+ *
+ * Hex/ASCII view of guest memory, fetched with
+ *
+ *     mem read <vm> 0x<addr> <len>        reply payload: the bytes
+ *
+ * through a fixed-size LRU cache of MEM_PAGE-byte guest pages, so scrolling
+ * back costs nothing. Missing pages are requested as contiguous runs, all
+ * runs of one screen pipelined on the connection. When the view moves to the
+ * neighbouring page, the next MEM_PREFETCH pages in that direction come along
+ * in the same batch. A short reply marks the rest of the page unreadable.
+ *
+ * Cached pages are dropped when hostd reports a write ("mem-write <vm> <addr>
+ * <len>") or that the guest resumed ("resumed"/"running" in an event about
+ * the VM); 'r' in the viewer drops everything.
+ *
+ * With len, or when stdin is not a terminal, the range is printed and /mem
+ * returns. Otherwise it is interactive: j/k or arrows scroll a line,
+ * space/b or PgDn/PgUp a screen, r reloads, q quits.
+ */
+#define MEM_PAGE          4096u
+#define MEM_CACHE_PAGES   256         /* 1 MiB of guest memory */
+#define MEM_HASH          512
+#define MEM_PREFETCH      8
+#define MEM_ROW           16
+
+typedef struct {
+    uint64_t      addr;               /* page address */
+    uint32_t      valid;              /* readable bytes at the start */
+    int           used;
+    int           prev, next;         /* LRU list, most recent at head */
+    int           hnext;              /* hash chain */
+    unsigned char data[MEM_PAGE];
+} mem_page_t;
+
+static struct {
+    char       vm[128];
+    mem_page_t pages[MEM_CACHE_PAGES];
+    int        hash[MEM_HASH];
+    int        head, tail;
+    int        inited;
+    int        dirty;                 /* something was invalidated */
+    uint64_t   last_page;             /* for sequential-access detection */
+    unsigned long hits, misses;
+} g_mem;
+
+static unsigned mem_hash(uint64_t addr) {
+    return (unsigned)((addr / MEM_PAGE) * 0x9E3779B97F4A7C15ull >> 40) % MEM_HASH;
+}
+
+static void mem_cache_flush(void) {
+    memset(g_mem.pages, 0, sizeof g_mem.pages);
+    for (int i = 0; i < MEM_HASH; i++) g_mem.hash[i] = -1;
+    /* every slot starts on the LRU list, unused ones at the tail */
+    for (int i = 0; i < MEM_CACHE_PAGES; i++) {
+        g_mem.pages[i].prev = i - 1;
+        g_mem.pages[i].next = i + 1 < MEM_CACHE_PAGES ? i + 1 : -1;
+        g_mem.pages[i].hnext = -1;
+    }
+    g_mem.head = 0;
+    g_mem.tail = MEM_CACHE_PAGES - 1;
+    g_mem.inited = 1;
+    g_mem.dirty = 1;
+}
+
+static void mem_lru_unlink(int i) {
+    mem_page_t *p = &g_mem.pages[i];
+    if (p->prev >= 0) g_mem.pages[p->prev].next = p->next; else g_mem.head = p->next;
+    if (p->next >= 0) g_mem.pages[p->next].prev = p->prev; else g_mem.tail = p->prev;
+}
+
+static void mem_lru_front(int i) {
+    mem_lru_unlink(i);
+    mem_page_t *p = &g_mem.pages[i];
+    p->prev = -1;
+    p->next = g_mem.head;
+    if (g_mem.head >= 0) g_mem.pages[g_mem.head].prev = i;
+    g_mem.head = i;
+    if (g_mem.tail < 0) g_mem.tail = i;
+}
+
+static void mem_hash_remove(int i) {
+    int *pp = &g_mem.hash[mem_hash(g_mem.pages[i].addr)];
+    while (*pp >= 0 && *pp != i) pp = &g_mem.pages[*pp].hnext;
+    if (*pp == i) *pp = g_mem.pages[i].hnext;
+    g_mem.pages[i].used = 0;
+}
+
+static mem_page_t *mem_lookup(uint64_t page) {
+    for (int i = g_mem.hash[mem_hash(page)]; i >= 0; i = g_mem.pages[i].hnext)
+        if (g_mem.pages[i].used && g_mem.pages[i].addr == page) {
+            mem_lru_front(i);
+            return &g_mem.pages[i];
+        }
+    return NULL;
+}
+
+/* Take the least recently used slot for `page`. */
+static mem_page_t *mem_insert(uint64_t page) {
+    int i = g_mem.tail;
+    if (g_mem.pages[i].used) mem_hash_remove(i);
+    mem_page_t *p = &g_mem.pages[i];
+    p->addr = page;
+    p->valid = 0;
+    p->used = 1;
+    unsigned h = mem_hash(page);
+    p->hnext = g_mem.hash[h];
+    g_mem.hash[h] = i;
+    mem_lru_front(i);
+    return p;
+}
+
+static void mem_invalidate(uint64_t addr, uint64_t len) {
+    if (!g_mem.inited) return;
+    if (len > (uint64_t)MEM_CACHE_PAGES * MEM_PAGE) { mem_cache_flush(); return; }
+    uint64_t first = addr - addr % MEM_PAGE;
+    for (uint64_t pg = first; pg < addr + len && pg >= first; pg += MEM_PAGE) {
+        mem_page_t *p = mem_lookup(pg);
+        if (p) { mem_hash_remove((int)(p - g_mem.pages)); g_mem.dirty = 1; }
+    }
+}
+
+/* Drop pages an event says are stale. */
+static void mem_cache_note_event(const char *text, size_t len) {
+    char ev[256], vm[128];
+    unsigned long long addr, n;
+    if (!g_mem.inited || !g_mem.vm[0]) return;
+    snprintf(ev, sizeof ev, "%.*s", (int)len, text);
+    if (sscanf(ev, "mem-write %127s %lli %lli", vm, &addr, &n) == 3) {
+        if (!strcmp(vm, g_mem.vm)) mem_invalidate(addr, n);
+        return;
+    }
+    /* whole words only: "vm1" is not "vm10", "running" not "not-running-yet" */
+    static const char sep[] = " \t\r\n,;:=()[]{}\"'";
+    int ours = 0, resumed = 0;
+    for (char *w = ev + strspn(ev, sep); *w; w += strspn(w, sep)) {
+        size_t n = strcspn(w, sep);
+        char end = w[n];
+        w[n] = 0;
+        if (!strcmp(w, g_mem.vm)) ours = 1;
+        else if (!strcasecmp(w, "resumed") || !strcasecmp(w, "running") || !strcasecmp(w, "resume")) resumed = 1;
+        w[n] = end;
+        w += n;
+    }
+    if (ours && resumed) mem_cache_flush();
+}
+
+typedef struct { unsigned char *buf; size_t len, cap; } mem_rx_t;
+
+static int mem_sink(void *ctx, const void *data, size_t len) {
+    mem_rx_t *m = (mem_rx_t*)ctx;
+    size_t n = len < m->cap - m->len ? len : m->cap - m->len;
+    memcpy(m->buf + m->len, data, n);
+    m->len += n;
+    return 0;
+}
+
+/* Make sure pages [first, first + count) are cached, plus prefetch. */
+static int mem_fetch(conn_t *c, uint64_t first, int count) {
+    uint64_t last = first + (uint64_t)(count - 1) * MEM_PAGE;
+    /* sequential movement: read ahead in the direction of travel */
+    if (first == g_mem.last_page + MEM_PAGE || last == g_mem.last_page + MEM_PAGE)
+        count += MEM_PREFETCH;
+    else if (first + MEM_PAGE == g_mem.last_page && first >= (uint64_t)MEM_PREFETCH * MEM_PAGE) {
+        first -= (uint64_t)MEM_PREFETCH * MEM_PAGE;
+        count += MEM_PREFETCH;
+    }
+    g_mem.last_page = last;
+    if (count > MEM_CACHE_PAGES / 2) count = MEM_CACHE_PAGES / 2;
+
+    /* group missing pages into runs and pipeline one request per run */
+    struct { uint64_t addr; int pages; uint16_t tag; } runs[MEM_CACHE_PAGES / 2];
+    int nruns = 0;
+    for (int i = 0; i < count; i++) {
+        uint64_t pg = first + (uint64_t)i * MEM_PAGE;
+        if (pg < first) break;   /* wrapped past the top of the address space */
+        if (mem_lookup(pg)) { g_mem.hits++; continue; }
+        g_mem.misses++;
+        if (nruns && runs[nruns-1].addr + (uint64_t)runs[nruns-1].pages * MEM_PAGE == pg) runs[nruns-1].pages++;
+        else { runs[nruns].addr = pg; runs[nruns].pages = 1; runs[nruns].tag = 0; nruns++; }
+    }
+    if (!nruns) return 0;
+    char line[300];
+    for (int i = 0; i < nruns; i++) {
+        snprintf(line, sizeof line, "mem read %s 0x%llx %u", g_mem.vm,
+                 (unsigned long long)runs[i].addr, (unsigned)runs[i].pages * MEM_PAGE);
+        int rc = conn_send_line(c, line);
+        if (rc != 0) return rc;
+        if (c->bin) runs[i].tag = c->tag;
+    }
+    unsigned char *buf = (unsigned char*)malloc((size_t)(MEM_CACHE_PAGES / 2) * MEM_PAGE);
+    if (!buf) { perror("malloc"); return -1; }
+    int rc = 0;
+    for (int i = 0; i < nruns; i++) {
+        int pages = runs[i].pages;
+        mem_rx_t rx = { buf, 0, (size_t)pages * MEM_PAGE };
+        resp_t r;
+        conn_resp_init(c, &r, mem_sink, &rx);
+        r.tag = runs[i].tag;
+        rc = resp_read(c, &r);
+        if (rc != 0) break;
+        if (resp_error(&r)) rx.len = 0;   /* unreadable: cache as such */
+        for (int k = 0; k < pages; k++) {
+            mem_page_t *p = mem_insert(runs[i].addr + (uint64_t)k * MEM_PAGE);
+            size_t off = (size_t)k * MEM_PAGE;
+            p->valid = rx.len > off ? (uint32_t)(rx.len - off < MEM_PAGE ? rx.len - off : MEM_PAGE) : 0;
+            memcpy(p->data, buf + off, p->valid);
+        }
+    }
+    free(buf);
+    return rc;
+}
+
+/* Render `rows` lines starting at addr (pages must be cached). */
+static void mem_render(grow_t *g, uint64_t addr, int rows, int tty) {
+    char tmp[128];
+    for (int row = 0; row < rows; row++) {
+        uint64_t a = addr + (uint64_t)row * MEM_ROW;
+        char hex[MEM_ROW * 3 + 2], asc[MEM_ROW + 1];
+        size_t h = 0;
+        for (int i = 0; i < MEM_ROW; i++) {
+            uint64_t b = a + (uint64_t)i;
+            const mem_page_t *p = mem_lookup(b - b % MEM_PAGE);
+            uint32_t off = (uint32_t)(b % MEM_PAGE);
+            if (p && off < p->valid) {
+                unsigned char ch = p->data[off];
+                h += (size_t)snprintf(hex + h, sizeof hex - h, "%02x%s", ch, i == 7 ? "  " : " ");
+                asc[i] = (ch >= 0x20 && ch < 0x7f) ? (char)ch : '.';
+            } else {
+                h += (size_t)snprintf(hex + h, sizeof hex - h, "??%s", i == 7 ? "  " : " ");
+                asc[i] = ' ';
+            }
+        }
+        asc[MEM_ROW] = 0;
+        /* the interactive view runs with OPOST off, so it needs the \r */
+        int k = snprintf(tmp, sizeof tmp, "%s%016llx  %s |%s|%s", tty ? "\033[K" : "",
+                         (unsigned long long)a, hex, asc, tty ? "\r\n" : "\n");
+        grow_append(g, tmp, (size_t)k);
+    }
+}
+
+#ifndef _WIN32
+static void mem_on_event(void *ctx, const char *text, size_t len) {
+    (void)ctx;
+    mem_cache_note_event(text, len);
+}
+
+/* Read one key; returns a character, or 'J'/'K' for arrows and 'F'/'B' for
+ * PgDn/PgUp, 0 if nothing useful. */
+static int mem_key(void) {
+    unsigned char k[8];
+    ssize_t n = read(STDIN_FILENO, k, sizeof k);
+    if (n <= 0) return 'q';
+    if (k[0] != 0x1b || n == 1) return k[0] == 0x1b ? 'q' : k[0];
+    if (n >= 3 && k[1] == '[') {
+        switch (k[2]) {
+        case 'A': return 'K';
+        case 'B': return 'J';
+        case '5': return 'B';
+        case '6': return 'F';
+        }
+    }
+    return 0;
+}
+#endif
+
+static int run_mem(conn_t *c, const char *args) {
+    char vm[128];
+    char astr[64], lstr[64] = "";
+    if (sscanf(args, "%127s %63s %63s", vm, astr, lstr) < 2) {
+        fprintf(stderr, "usage: /mem <vm> <addr> [len]\n");
+        return -1;
+    }
+    char *end;
+    uint64_t addr = strtoull(astr, &end, 0);
+    if (*end) { fprintf(stderr, "/mem: bad address '%s'\n", astr); return -1; }
+    addr -= addr % MEM_ROW;
+    if (!g_mem.inited || strcmp(vm, g_mem.vm)) {
+        mem_cache_flush();
+        snprintf(g_mem.vm, sizeof g_mem.vm, "%s", vm);
+    }
+    grow_t g = { 0 };
+    int rc = 0;
+
+#ifndef _WIN32
+    int interactive = !lstr[0] && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+#else
+    int interactive = 0;
+#endif
+    if (!interactive) {
+        long long len = lstr[0] ? parse_size(lstr) : 256;
+        if (len <= 0) { fprintf(stderr, "/mem: bad length '%s'\n", lstr); return -1; }
+        int rows = (int)((len + MEM_ROW - 1) / MEM_ROW);
+        uint64_t span = (uint64_t)rows * MEM_ROW;
+        for (uint64_t a = addr - addr % MEM_PAGE; rc == 0 && a < addr + span; a += (uint64_t)(MEM_CACHE_PAGES / 4) * MEM_PAGE) {
+            uint64_t end_a = addr + span;
+            int n = (int)((end_a - a + MEM_PAGE - 1) / MEM_PAGE);
+            if (n > MEM_CACHE_PAGES / 4) n = MEM_CACHE_PAGES / 4;
+            rc = mem_fetch(c, a, n);
+            if (rc == 0) {
+                uint64_t stop = a + (uint64_t)n * MEM_PAGE < end_a ? a + (uint64_t)n * MEM_PAGE : end_a;
+                uint64_t from = a < addr ? addr : a;
+                g.len = 0;
+                mem_render(&g, from, (int)((stop - from + MEM_ROW - 1) / MEM_ROW), 0);
+                fwrite(g.buf, 1, g.len, stdout);
+            }
+        }
+        fflush(stdout);
+        free(g.buf);
+        return rc;
+    }
+
+#ifndef _WIN32
+    int rows, cols;
+    term_size(&rows, &cols);
+    int body = rows - 1;
+    resp_event_fn saved = c->on_event;
+    c->on_event = mem_on_event;
+    if (console_make_raw() != 0) { perror("raw mode"); c->on_event = saved; return -1; }
+    fputs("\033[?25l\033[2J", stdout);
+    for (;;) {
+        uint64_t span = (uint64_t)body * MEM_ROW;
+        uint64_t first = addr - addr % MEM_PAGE;
+        int n = (int)((addr + span - first + MEM_PAGE - 1) / MEM_PAGE);
+        if ((rc = mem_fetch(c, first, n)) != 0) break;
+        g.len = 0;
+        grow_append(&g, "\033[H", 3);
+        mem_render(&g, addr, body, 1);
+        char st[160];
+        int k = snprintf(st, sizeof st, "\033[7m %s  0x%llx  cache %lu hit / %lu miss  j/k space/b r q \033[0m\033[K",
+                         g_mem.vm, (unsigned long long)addr, g_mem.hits, g_mem.misses);
+        grow_append(&g, st, (size_t)k);
+        fwrite(g.buf, 1, g.len, stdout);
+        fflush(stdout);
+        g_mem.dirty = 0;
+
+        /* wait for a key, applying pushed invalidations meanwhile */
+        int key = 0;
+        while (!key) {
+            struct pollfd pfd[2];
+            pfd[0].fd = STDIN_FILENO; pfd[0].events = POLLIN; pfd[0].revents = 0;
+            pfd[1].fd = c->fd;        pfd[1].events = POLLIN; pfd[1].revents = 0;
+            if (poll(pfd, 2, -1) < 0) { if (errno == EINTR) continue; rc = -1; break; }
+            if ((pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) && (rc = conn_take_events(c)) != 0) break;
+            if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) key = mem_key();
+            if (g_mem.dirty) break;
+        }
+        if (rc != 0 || key == 'q') break;
+        switch (key) {
+        case 'j': case 'J': addr += MEM_ROW; break;
+        case 'k': case 'K': if (addr >= MEM_ROW) addr -= MEM_ROW; break;
+        case ' ': case 'F': case 'f': addr += span; break;
+        case 'b': case 'B': addr = addr >= span ? addr - span : 0; break;
+        case 'r': mem_cache_flush(); break;
+        }
+    }
+    fputs("\033[?25h\r\n", stdout);
+    fflush(stdout);
+    console_restore();
+    c->on_event = saved;
+    free(g.buf);
+    return rc;
+#else
+    return rc;   /* not reached: Windows has no interactive view */
+#endif
+}
+
+// ----- trace capture -----
+/*
+ * trace-capture <vm> -o <file> [--ring <size>]
+ *
+ * Records an instruction trace to a compressed file. The request
+ *
+ *     trace start <vm>
+ *
+ * is answered with a reply that streams newline-terminated trace records
+ * until the trace stops (Ctrl-C sends "trace stop <vm>"). The receive path
+ * only copies records into a single-producer/single-consumer ring; a writer
+ * thread drains it in blocks of up to TRACE_BLOCK bytes, compresses them and
+ * writes each with one write(). When the disk falls behind and the ring is
+ * full, whole records are dropped and counted instead of stalling the socket.
+ * The writer sleeps on a condition variable until a full block is waiting,
+ * TRACE_FLUSH_MS pass or the capture ends; the producer only signals it when
+ * it is actually asleep, so the receive path takes no lock per record.
+ *
+ * File format (little-endian):
+ *
+ *     "VCTR" u32 version
+ *     block*:  u32 raw_len, u32 comp_len (0 = stored), u32 crc32(raw), data
+ *     end:     u32 0, u32 0, u32 0, u64 records, u64 dropped
+ *
+ * Compressed blocks use a byte-oriented LZ77 format (see lz_compress).
+ * trace-cat <file> [-g text] [--stats] decodes a file without hostd.
+ */
+#define TRACE_MAGIC       "VCTR"
+#define TRACE_VERSION     1
+#define TRACE_BLOCK       (1u << 20)
+#define TRACE_RING_DEF    (64ll << 20)
+#define TRACE_FLUSH_MS    100          /* write a partial block after this */
+#define LZ_HASH_BITS      14
+#define LZ_MIN_MATCH      4
+#define LZ_LAST_LITERALS  5
+
+/*
+ * LZ block: a sequence of
+ *   token   high nibble literal count, low nibble match length - 4;
+ *           15 means more length bytes follow (each adds up to 255)
+ *   literals
+ *   u16     match offset (1..65535), then the match is copied from output
+ * The final sequence has literals only.
+ */
+static unsigned char *lz_put_len(unsigned char *op, size_t n) {
+    while (n >= 255) { *op++ = 255; n -= 255; }
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+static uint32_t lz_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/* Returns the compressed size, or 0 if it would not be smaller than n. */
+static size_t lz_compress(const unsigned char *in, size_t n, unsigned char *out, uint32_t *table) {
+    unsigned char *op = out, *oend = out + n;   /* no gain past n bytes */
+    size_t ip = 0, anchor = 0;
+    memset(table, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+    size_t limit = n > LZ_MIN_MATCH + LZ_LAST_LITERALS ? n - LZ_MIN_MATCH - LZ_LAST_LITERALS : 0;
+    while (ip < limit) {
+        uint32_t seq = lz_read32(in + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];                   /* position + 1, 0 = empty */
+        table[h] = (uint32_t)ip + 1;
+        if (!ref || ip - (ref - 1) > 65535 || lz_read32(in + ref - 1) != seq) {
+            ip += 1 + ((ip - anchor) >> 6);      /* skip faster through noise */
+            continue;
+        }
+        ref--;
+        size_t m = LZ_MIN_MATCH;
+        while (ip + m < n - LZ_LAST_LITERALS && in[ref + m] == in[ip + m]) m++;
+        size_t lit = ip - anchor;
+        if (op + 1 + lit / 255 + 1 + lit + 2 + m / 255 + 1 > oend) return 0;
+        unsigned char *tok = op++;
+        *tok = (unsigned char)((lit < 15 ? lit : 15) << 4);
+        if (lit >= 15) op = lz_put_len(op, lit - 15);
+        memcpy(op, in + anchor, lit);
+        op += lit;
+        size_t off = ip - ref;
+        *op++ = (unsigned char)off;
+        *op++ = (unsigned char)(off >> 8);
+        size_t ml = m - LZ_MIN_MATCH;
+        *tok |= (unsigned char)(ml < 15 ? ml : 15);
+        if (ml >= 15) op = lz_put_len(op, ml - 15);
+        ip += m;
+        anchor = ip;
+    }
+    size_t lit = n - anchor;
+    if (op + 1 + lit / 255 + 1 + lit >= oend) return 0;
+    *op++ = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = lz_put_len(op, lit - 15);
+    memcpy(op, in + anchor, lit);
+    op += lit;
+    return (size_t)(op - out);
+}
+
+/* Returns 0 if exactly n bytes were produced, -1 on a corrupt block. */
+static int lz_decompress(const unsigned char *in, size_t len, unsigned char *out, size_t n) {
+    const unsigned char *ip = in, *iend = in + len;
+    size_t o = 0;
+    while (ip < iend) {
+        unsigned tok = *ip++;
+        size_t lit = tok >> 4;
+        if (lit == 15) {
+            unsigned char b;
+            do { if (ip >= iend) return -1; b = *ip++; lit += b; } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > n - o) return -1;
+        memcpy(out + o, ip, lit);
+        ip += lit; o += lit;
+        if (ip == iend) break;                   /* last sequence */
+        if (iend - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t m = (tok & 15) + LZ_MIN_MATCH;
+        if ((tok & 15) == 15) {
+            unsigned char b;
+            do { if (ip >= iend) return -1; b = *ip++; m += b; } while (b == 255);
+        }
+        if (!off || off > o || m > n - o) return -1;
+        for (size_t i = 0; i < m; i++, o++) out[o] = out[o - off];   /* may overlap */
+    }
+    return o == n ? 0 : -1;
+}
+
+#ifndef _WIN32
+typedef struct {
+    unsigned char *buf;
+    uint64_t       size;          /* power of two */
+    uint64_t       head;          /* producer: end of committed records */
+    uint64_t       tail;          /* consumer: start of unwritten data */
+    uint64_t       wpos;          /* producer: end of the record in progress */
+    int            dropping;      /* skipping the rest of a dropped record */
+    int            done;          /* producer finished; writer drains and exits */
+    int            werr;          /* writer failed */
+    uint64_t       records, dropped;
+    uint64_t       raw_bytes, file_bytes;
+    int            fd;
+    int            idle;          /* writer is waiting on cv */
+    pthread_mutex_t mu;
+    pthread_cond_t  cv;
+} trace_ring_t;
+
+/* Wake the writer if it is waiting; mu orders this against its last check. */
+static void trace_wake(trace_ring_t *t) {
+    if (!__atomic_load_n(&t->idle, __ATOMIC_SEQ_CST)) return;
+    pthread_mutex_lock(&t->mu);
+    pthread_cond_signal(&t->cv);
+    pthread_mutex_unlock(&t->mu);
+}
+
+/* Producer: called from the reply path with raw stream bytes. */
+static int trace_sink(void *ctx, const void *data, size_t len) {
+    trace_ring_t *t = (trace_ring_t*)ctx;
+    const unsigned char *p = (const unsigned char*)data;
+    if (__atomic_load_n(&t->werr, __ATOMIC_ACQUIRE)) return -1;
+    uint64_t tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+    while (len) {
+        const unsigned char *nl = (const unsigned char*)memchr(p, '\n', len);
+        size_t seg = nl ? (size_t)(nl - p) + 1 : len;
+        if (t->dropping) {
+            t->dropping = !nl;
+        } else {
+            if (t->wpos + seg - tail > t->size) tail = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+            if (t->wpos + seg - tail > t->size) {
+                t->wpos = t->head;            /* forget the partial record */
+                t->dropped++;
+                t->dropping = !nl;
+            } else {
+                size_t at = (size_t)(t->wpos & (t->size - 1));
+                size_t first = seg < t->size - at ? seg : (size_t)(t->size - at);
+                memcpy(t->buf + at, p, first);
+                memcpy(t->buf, p + first, seg - first);
+                t->wpos += seg;
+                if (nl) {
+                    t->records++;
+                    __atomic_store_n(&t->head, t->wpos, __ATOMIC_SEQ_CST);
+                    if (t->wpos - tail >= TRACE_BLOCK) trace_wake(t);
+                }
+            }
+        }
+        p += seg; len -= seg;
+    }
+    return 0;
+}
+
+/* Consumer thread: ring -> compressed blocks -> file. */
+static void *trace_writer(void *arg) {
+    trace_ring_t *t = (trace_ring_t*)arg;
+    unsigned char *raw = (unsigned char*)malloc(TRACE_BLOCK);
+    unsigned char *out = (unsigned char*)malloc(12 + TRACE_BLOCK);
+    uint32_t *table = (uint32_t*)malloc(sizeof(uint32_t) << LZ_HASH_BITS);
+    if (!raw || !out || !table) {
+        perror("malloc");
+        __atomic_store_n(&t->werr, 1, __ATOMIC_RELEASE);
+    }
+    uint64_t last_flush = mono_ns();
+    while (!__atomic_load_n(&t->werr, __ATOMIC_ACQUIRE)) {
+        int done = __atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        uint64_t avail = head - t->tail;
+        if (!avail && done) break;
+        uint64_t since = mono_ns() - last_flush;
+        if (avail < TRACE_BLOCK && !done &&
+            (!avail || since < (uint64_t)TRACE_FLUSH_MS * 1000000ull)) {
+            /* sleep until a block fills, the flush interval ends or done */
+            uint64_t ns = avail ? (uint64_t)TRACE_FLUSH_MS * 1000000ull - since
+                                : (uint64_t)TRACE_FLUSH_MS * 1000000ull;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += (long)(ns % 1000000000ull);
+            ts.tv_sec += (time_t)(ns / 1000000000ull) + ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            pthread_mutex_lock(&t->mu);
+            __atomic_store_n(&t->idle, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&t->head, __ATOMIC_SEQ_CST) - t->tail < TRACE_BLOCK &&
+                !__atomic_load_n(&t->done, __ATOMIC_SEQ_CST))
+                pthread_cond_timedwait(&t->cv, &t->mu, &ts);
+            __atomic_store_n(&t->idle, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&t->mu);
+            continue;
+        }
+        size_t n = avail < TRACE_BLOCK ? (size_t)avail : TRACE_BLOCK;
+        size_t at = (size_t)(t->tail & (t->size - 1));
+        size_t first = n < t->size - at ? n : (size_t)(t->size - at);
+        memcpy(raw, t->buf + at, first);
+        memcpy(raw + first, t->buf, n - first);
+        __atomic_store_n(&t->tail, t->tail + n, __ATOMIC_RELEASE);   /* space back to the producer */
+
+        size_t clen = lz_compress(raw, n, out + 12, table);
+        if (!clen) memcpy(out + 12, raw, n);
+        put_le32(out, (uint32_t)n);
+        put_le32(out + 4, (uint32_t)clen);
+        put_le32(out + 8, crc32_update(0, raw, n));
+        if (xfer_write_all(t->fd, out, 12 + (clen ? clen : n)) != 0) {
+            __atomic_store_n(&t->werr, 1, __ATOMIC_RELEASE);
+            break;
+        }
+        t->raw_bytes += n;
+        t->file_bytes += 12 + (clen ? clen : n);
+        last_flush = mono_ns();
+    }
+    free(raw); free(out); free(table);
+    return NULL;
+}
+
+static volatile sig_atomic_t g_trace_stop = 0;
+static void trace_on_sigint(int sig) { (void)sig; g_trace_stop = 1; }
+
+static int run_trace_capture(conn_t *c, int argc, char **argv) {
+    const char *vm = NULL, *path = NULL;
+    long long ring = TRACE_RING_DEF;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) path = argv[++i];
+        else if (!strcmp(argv[i], "--ring") && i + 1 < argc) ring = parse_size(argv[++i]);
+        else if (!vm && argv[i][0] != '-') vm = argv[i];
+        else { vm = NULL; break; }
+    }
+    if (!vm || !path || ring <= 0) {
+        fprintf(stderr, "usage: trace-capture <vm> -o <file> [--ring <size>]\n");
+        return -1;
+    }
+    trace_ring_t t;
+    memset(&t, 0, sizeof t);
+    for (t.size = 1 << 16; (long long)t.size < ring; t.size <<= 1) {}
+    t.buf = (unsigned char*)malloc((size_t)t.size);
+    if (!t.buf) { perror("malloc"); return -1; }
+    t.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (t.fd < 0) { perror(path); free(t.buf); return -1; }
+    unsigned char hdr[8];
+    memcpy(hdr, TRACE_MAGIC, 4);
+    put_le32(hdr + 4, TRACE_VERSION);
+    if (xfer_write_all(t.fd, hdr, sizeof hdr) != 0) { close(t.fd); free(t.buf); return -1; }
+    t.file_bytes = sizeof hdr;
+
+    char line[300];
+    snprintf(line, sizeof line, "trace start %s", vm);
+    int rc = conn_send_line(c, line);
+    if (rc != 0) { close(t.fd); free(t.buf); return rc; }
+    pthread_t th;
+    pthread_mutex_init(&t.mu, NULL);
+    pthread_cond_init(&t.cv, NULL);
+    if (pthread_create(&th, NULL, trace_writer, &t) != 0) {
+        fprintf(stderr, "trace-capture: cannot start writer thread\n");
+        pthread_cond_destroy(&t.cv);
+        pthread_mutex_destroy(&t.mu);
+        close(t.fd); free(t.buf);
+        return -1;
+    }
+
+    void (*old_int)(int) = signal(SIGINT, trace_on_sigint);
+    g_trace_stop = 0;
+    int tty = isatty(STDERR_FILENO), stopping = 0;
+    uint64_t t0 = mono_ns(), stop_at = 0, last_drop = 0;
+    resp_t r;
+    conn_resp_init(c, &r, trace_sink, &t);
+    for (;;) {
+        rc = resp_read_until(c, &r, mono_ns() + 250000000ull);
+        if (rc != IO_TIMEOUT) break;
+        if (g_trace_stop && !stopping) {
+            snprintf(line, sizeof line, "trace stop %s", vm);
+            if (conn_send_line(c, line) != 0) break;
+            stopping = 1;
+            stop_at = mono_ns();
+        }
+        if (stopping && mono_ns() - stop_at > 2000000000ull) {
+            fprintf(stderr, "trace-capture: hostd did not end the trace\n");
+            rc = -2;   /* the stream is still open: connection unusable */
+            break;
+        }
+        if (tty || t.dropped != last_drop) {
+            fprintf(stderr, "%s%.1fs  %llu records  %llu dropped%s", tty ? "\r" : "",
+                    (double)(mono_ns() - t0) / 1e9, (unsigned long long)t.records,
+                    (unsigned long long)t.dropped, tty ? "\033[K" : "\n");
+            last_drop = t.dropped;
+        }
+    }
+    signal(SIGINT, old_int);
+    if (tty) fputs("\r\033[K", stderr);
+    if (rc == 0 && stopping) {            /* the answer to "trace stop" */
+        resp_t s;
+        conn_resp_init(c, &s, discard_sink, NULL);
+        rc = resp_read_until(c, &s, mono_ns() + 2000000000ull);
+        if (rc == IO_TIMEOUT) rc = -2;
+    }
+
+    __atomic_store_n(&t.done, 1, __ATOMIC_SEQ_CST);
+    trace_wake(&t);
+    pthread_join(th, NULL);
+    pthread_cond_destroy(&t.cv);
+    pthread_mutex_destroy(&t.mu);
+    unsigned char end[28];
+    memset(end, 0, 12);
+    put_le32(end + 12, (uint32_t)t.records);
+    put_le32(end + 16, (uint32_t)(t.records >> 32));
+    put_le32(end + 20, (uint32_t)t.dropped);
+    put_le32(end + 24, (uint32_t)(t.dropped >> 32));
+    if (!t.werr && xfer_write_all(t.fd, end, sizeof end) == 0) t.file_bytes += sizeof end;
+    if (close(t.fd) != 0 && !t.werr) { perror(path); t.werr = 1; }
+
+    const char *why = rc == 0 ? resp_error(&r) : NULL;
+    if (why) fprintf(stderr, "trace-capture: %s\n", why);
+    fprintf(stderr, "trace-capture: %llu records, %.1f MiB -> %.1f MiB in %s, %llu dropped%s\n",
+            (unsigned long long)t.records, (double)t.raw_bytes / 1048576.0,
+            (double)t.file_bytes / 1048576.0, path, (unsigned long long)t.dropped,
+            t.dropped ? " (disk or ring too slow; try --ring)" : "");
+    free(t.buf);
+    if (rc == 0 && (why || t.werr)) rc = -1;
+    return rc;
+}
+#else
+static int run_trace_capture(conn_t *c, int argc, char **argv) {
+    (void)c; (void)argc; (void)argv;
+    fprintf(stderr, "trace-capture is not supported on Windows yet\n");
+    return -1;
+}
+#endif
+
+/* trace-cat <file> [-g text] [--stats]: decode a capture to stdout. */
+static int run_trace_cat(int argc, char **argv) {
+    const char *path = NULL, *grep = NULL;
+    int stats = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-g") && i + 1 < argc) grep = argv[++i];
+        else if (!strcmp(argv[i], "--stats")) stats = 1;
+        else if (!path) path = argv[i];
+        else { path = NULL; break; }
+    }
+    if (!path) {
+        fprintf(stderr, "usage: trace-cat <file> [-g text] [--stats]\n");
+        return -1;
+    }
+    FILE *f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!f) { perror(path); return -1; }
+    unsigned char h[16];
+    unsigned char *raw = (unsigned char*)malloc(TRACE_BLOCK), *comp = (unsigned char*)malloc(TRACE_BLOCK);
+    grow_t carry = { 0 };     /* a record split across blocks (with -g); text, NUL-terminated */
+    int rc = -1, ended = 0;
+    uint64_t blocks = 0, raw_total = 0, records = 0, dropped = 0;
+    if (!raw || !comp) { perror("malloc"); goto out; }
+    if (fread(h, 1, 8, f) != 8 || memcmp(h, TRACE_MAGIC, 4) || get_le32(h + 4) != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a trace capture\n", path);
+        goto out;
+    }
+    for (;;) {
+        if (fread(h, 1, 12, f) != 12) break;
+        uint32_t n = get_le32(h), clen = get_le32(h + 4), crc = get_le32(h + 8);
+        if (!n && !clen) {
+            if (fread(h, 1, 16, f) != 16) break;
+            records = get_le64(h);
+            dropped = get_le64(h + 8);
+            ended = 1;
+            break;
+        }
+        if (n > TRACE_BLOCK || clen >= n) { fprintf(stderr, "%s: bad block header\n", path); goto out; }
+        if (clen) {
+            if (fread(comp, 1, clen, f) != clen || lz_decompress(comp, clen, raw, n) != 0) {
+                fprintf(stderr, "%s: corrupt block %llu\n", path, (unsigned long long)blocks);
+                goto out;
+            }
+        } else if (fread(raw, 1, n, f) != n) break;
+        if (crc32_update(0, raw, n) != crc) {
+            fprintf(stderr, "%s: checksum mismatch in block %llu\n", path, (unsigned long long)blocks);
+            goto out;
+        }
+        blocks++;
+        raw_total += n;
+        if (!grep) { fwrite(raw, 1, n, stdout); continue; }
+        /* filter whole records; the block's tail waits for the next block */
+        const unsigned char *p = raw, *end = raw + n;
+        for (;;) {
+            const unsigned char *nl = (const unsigned char*)memchr(p, '\n', (size_t)(end - p));
+            if (!nl) { grow_append(&carry, p, (size_t)(end - p)); break; }
+            grow_append(&carry, p, (size_t)(nl - p) + 1);
+            if (strstr(carry.buf, grep)) fwrite(carry.buf, 1, carry.len, stdout);
+            carry.len = 0;
+            p = nl + 1;
+        }
+    }
+    if (grep && carry.len && strstr(carry.buf, grep)) fwrite(carry.buf, 1, carry.len, stdout);
+    if (!ended) fprintf(stderr, "%s: truncated capture (no end marker)\n", path);
+    if (stats)
+        fprintf(stderr, "%s: %llu blocks, %.1f MiB decoded, %llu records, %llu dropped\n", path,
+                (unsigned long long)blocks, (double)raw_total / 1048576.0,
+                (unsigned long long)records, (unsigned long long)dropped);
+    rc = ended ? 0 : -1;
+out:
+    fflush(stdout);
+    if (f != stdin) fclose(f);
+    free(raw); free(comp); free(carry.buf);
+    return rc;
+}
+
+// ----- snapshot sync -----
+/*
+ * snapshot-sync <vm> <local-file> [--block <size>]
+ *
+ * Brings a local copy of a VM snapshot up to date by moving only the blocks
+ * that changed. hostd is asked for the hash of every block:
+ *
+ *     snapshot-hashes <vm> block=<n>      payload: u64 LE xxh64 per block,
+ *                                         trailer: size=<bytes> [block=<n>]
+ *
+ * and compared with the index kept next to the copy (<local-file>.vcidx,
+ * rebuilt from the file if it is missing or the file was touched since).
+ * Runs of changed blocks are fetched with
+ *
+ *     snapshot-read <vm> <offset> <len>   payload: the bytes
+ *
+ * up to SYNC_WINDOW requests in flight, each block checked against its hash
+ * and patched into the file in place with pwrite(). The index is rewritten
+ * only after the data is on disk.
+ */
+#define SYNC_BLOCK_DEF   (64u * 1024)
+#define SYNC_BLOCK_MAX   (16u * 1024 * 1024)
+#define SYNC_RUN_MAX     (16u * 1024 * 1024)   /* bytes per snapshot-read */
+#define SYNC_WINDOW      8
+#define SYNC_IDX_MAGIC   "VCSX"
+#define SYNC_IDX_VERSION 1
+
+#define XXH_P1 11400714785074694791ull
+#define XXH_P2 14029467366897019727ull
+#define XXH_P3  1609587929392839161ull
+#define XXH_P4  9650029242287828579ull
+#define XXH_P5  2870177450012600261ull
+
+static uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+static uint64_t xxh_round(uint64_t acc, uint64_t in) { return xxh_rotl(acc + in * XXH_P2, 31) * XXH_P1; }
+static uint64_t xxh_merge(uint64_t h, uint64_t v) { return (h ^ xxh_round(0, v)) * XXH_P1 + XXH_P4; }
+
+/* XXH64 with seed 0. */
+static uint64_t xxh64(const unsigned char *p, size_t len) {
+    const unsigned char *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = 0 - XXH_P1;
+        for (; end - p >= 32; p += 32) {
+            v1 = xxh_round(v1, get_le64(p));
+            v2 = xxh_round(v2, get_le64(p + 8));
+            v3 = xxh_round(v3, get_le64(p + 16));
+            v4 = xxh_round(v4, get_le64(p + 24));
+        }
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(xxh_merge(xxh_merge(xxh_merge(h, v1), v2), v3), v4);
+    } else {
+        h = XXH_P5;
+    }
+    h += (uint64_t)len;
+    for (; end - p >= 8; p += 8) h = xxh_rotl(h ^ xxh_round(0, get_le64(p)), 27) * XXH_P1 + XXH_P4;
+    if (end - p >= 4) { h = xxh_rotl(h ^ (uint64_t)get_le32(p) * XXH_P1, 23) * XXH_P2 + XXH_P3; p += 4; }
+    for (; p < end; p++) h = xxh_rotl(h ^ *p * XXH_P5, 11) * XXH_P1;
+    h ^= h >> 33; h *= XXH_P2;
+    h ^= h >> 29; h *= XXH_P3;
+    return h ^ (h >> 32);
+}
+
+#ifndef _WIN32
+typedef struct {
+    uint32_t  block;
+    uint64_t  size;
+    uint64_t  mtime_ns;
+    uint64_t  count;
+    uint64_t *hash;
+} sync_index_t;
+
+static uint64_t stat_mtime_ns(const struct stat *st) {
+#if defined(__APPLE__)
+    return (uint64_t)st->st_mtimespec.tv_sec * 1000000000ull + (uint64_t)st->st_mtimespec.tv_nsec;
+#else
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ull + (uint64_t)st->st_mtim.tv_nsec;
+#endif
+}
+
+/* Load <path>; returns 0 only if it describes the file as it is now. */
+static int sync_index_load(const char *path, const struct stat *st, uint32_t block, sync_index_t *ix) {
+    unsigned char h[40];
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    int ok = fread(h, 1, sizeof h, f) == sizeof h && !memcmp(h, SYNC_IDX_MAGIC, 4) &&
+             get_le32(h + 4) == SYNC_IDX_VERSION && get_le32(h + 8) == block;
+    if (ok) {
+        ix->block = block;
+        ix->size = get_le64(h + 16);
+        ix->mtime_ns = get_le64(h + 24);
+        ix->count = get_le64(h + 32);
+        ok = ix->size == (uint64_t)st->st_size && ix->mtime_ns == stat_mtime_ns(st) &&
+             ix->count == (ix->size + block - 1) / block;
+    }
+    if (ok) {
+        ix->hash = (uint64_t*)malloc((size_t)(ix->count ? ix->count : 1) * 8);
+        unsigned char b[8];
+        for (uint64_t i = 0; ok && ix->hash && i < ix->count; i++) {
+            ok = fread(b, 1, 8, f) == 8;
+            ix->hash[i] = get_le64(b);
+        }
+        if (!ix->hash) ok = 0;
+    }
+    fclose(f);
+    if (!ok) { free(ix->hash); ix->hash = NULL; }
+    return ok ? 0 : -1;
+}
+
+/* Hash the local file block by block. */
+static int sync_index_build(int fd, uint64_t size, uint32_t block, sync_index_t *ix) {
+    ix->block = block;
+    ix->size = size;
+    ix->count = (size + block - 1) / block;
+    ix->hash = (uint64_t*)malloc((size_t)(ix->count ? ix->count : 1) * 8);
+    unsigned char *buf = (unsigned char*)malloc(block);
+    if (!ix->hash || !buf) { perror("malloc"); free(buf); return -1; }
+    for (uint64_t i = 0; i < ix->count; i++) {
+        size_t want = (size_t)(size - i * block < block ? size - i * block : block), got = 0;
+        while (got < want) {
+            ssize_t n = pread(fd, buf + got, want - got, (off_t)(i * block + got));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) { perror("read"); free(buf); return -1; }
+            got += (size_t)n;
+        }
+        ix->hash[i] = xxh64(buf, want);
+    }
+    free(buf);
+    return 0;
+}
+
+static int sync_index_save(const char *path, const sync_index_t *ix) {
+    char tmp[1108];
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) { perror(tmp); return -1; }
+    unsigned char h[40];
+    memcpy(h, SYNC_IDX_MAGIC, 4);
+    put_le32(h + 4, SYNC_IDX_VERSION);
+    put_le32(h + 8, ix->block);
+    put_le32(h + 12, 0);
+    put_le32(h + 16, (uint32_t)ix->size);     put_le32(h + 20, (uint32_t)(ix->size >> 32));
+    put_le32(h + 24, (uint32_t)ix->mtime_ns); put_le32(h + 28, (uint32_t)(ix->mtime_ns >> 32));
+    put_le32(h + 32, (uint32_t)ix->count);    put_le32(h + 36, (uint32_t)(ix->count >> 32));
+    int ok = fwrite(h, 1, sizeof h, f) == sizeof h;
+    for (uint64_t i = 0; ok && i < ix->count; i++) {
+        unsigned char b[8];
+        put_le32(b, (uint32_t)ix->hash[i]);
+        put_le32(b + 4, (uint32_t)(ix->hash[i] >> 32));
+        ok = fwrite(b, 1, 8, f) == 8;
+    }
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) { perror(path); remove(tmp); return -1; }
+    return 0;
+}
+
+/* Receives snapshot-read payloads; whole blocks are verified, then written. */
+typedef struct {
+    int             fd;
+    uint32_t        block;
+    uint64_t        size;
+    const uint64_t *want;         /* hostd's block hashes */
+    uint64_t        off;          /* file offset of buf[0] */
+    unsigned char  *buf;
+    size_t          fill;
+    int             bad;          /* hash mismatch or write error */
+    xfer_progress_t *prog;
+} sync_rx_t;
+
+static int sync_flush_block(sync_rx_t *s) {
+    uint64_t i = s->off / s->block;
+    if (xxh64(s->buf, s->fill) != s->want[i]) {
+        fprintf(stderr, "snapshot-sync: block %llu does not match its hash\n", (unsigned long long)i);
+        s->bad = 1;
+        return -1;
+    }
+    for (size_t done = 0; done < s->fill; ) {
+        ssize_t n = pwrite(s->fd, s->buf + done, s->fill - done, (off_t)(s->off + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { perror("pwrite"); s->bad = 1; return -1; }
+        done += (size_t)n;
+    }
+    s->off += s->fill;
+    s->fill = 0;
+    return 0;
+}
+
+static int sync_sink(void *ctx, const void *data, size_t len) {
+    sync_rx_t *s = (sync_rx_t*)ctx;
+    const unsigned char *p = (const unsigned char*)data;
+    if (s->bad) return -1;
+    while (len) {
+        uint64_t left = s->size - s->off;
+        size_t room = (size_t)(left < s->block ? left : s->block);
+        if (room == 0) { s->bad = 1; return -1; }   /* more than asked for */
+        size_t n = room - s->fill < len ? room - s->fill : len;
+        memcpy(s->buf + s->fill, p, n);
+        s->fill += n; p += n; len -= n;
+        s->prog->done += n;
+        if (s->fill == room && sync_flush_block(s) != 0) return -1;
+    }
+    xfer_progress(s->prog, 0);
+    return 0;
+}
+
+static int sync_hash_sink(void *ctx, const void *data, size_t len) {
+    return grow_append((grow_t*)ctx, data, len);
+}
+
+typedef struct { uint64_t off, len; uint16_t tag; } sync_run_t;
+
+static int run_snapshot_sync(conn_t *c, int argc, char **argv) {
+    const char *vm = NULL, *path = NULL;
+    long long block = SYNC_BLOCK_DEF;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--block") && i + 1 < argc) block = parse_size(argv[++i]);
+        else if (!vm) vm = argv[i];
+        else if (!path) path = argv[i];
+        else { vm = NULL; break; }
+    }
+    if (!vm || !path || block < 512 || block > SYNC_BLOCK_MAX) {
+        fprintf(stderr, "usage: snapshot-sync <vm> <local-file> [--block <size>]\n");
+        return -1;
+    }
+
+    /* hostd's view */
+    char line[600];
+    snprintf(line, sizeof line, "snapshot-hashes %s block=%lld", vm, block);
+    grow_t hs = { 0 };
+    resp_t r;
+    int rc = conn_send_line(c, line);
+    if (rc != 0) return rc;
+    conn_resp_init(c, &r, sync_hash_sink, &hs);
+    if ((rc = resp_read(c, &r)) != 0) { free(hs.buf); return rc; }
+    uint64_t size, b;
+    if (resp_error(&r)) {
+        fprintf(stderr, "snapshot-sync: %s\n", resp_error(&r));
+        free(hs.buf);
+        return -1;
+    }
+    if (kv_u64(r.line, "block", &b) == 0) block = (long long)b;
+    if (kv_u64(r.line, "size", &size) != 0 || block < 512 || block > SYNC_BLOCK_MAX ||
+        hs.len != (size + (uint64_t)block - 1) / (uint64_t)block * 8) {
+        fprintf(stderr, "snapshot-sync: malformed hash list from hostd\n");
+        free(hs.buf);
+        return -1;
+    }
+    uint64_t count = size / (uint64_t)block + (size % (uint64_t)block != 0);
+    uint64_t *want = (uint64_t*)malloc((size_t)(count ? count : 1) * 8);
+    if (!want) { perror("malloc"); free(hs.buf); return -1; }
+    for (uint64_t i = 0; i < count; i++) want[i] = get_le64((unsigned char*)hs.buf + i * 8);
+    free(hs.buf);
+
+    /* our view */
+    char idx_path[1100];
+    snprintf(idx_path, sizeof idx_path, "%s.vcidx", path);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) { perror(path); if (fd >= 0) close(fd); free(want); return -1; }
+    sync_index_t ix = { 0 };
+    if (sync_index_load(idx_path, &st, (uint32_t)block, &ix) != 0) {
+        if (g_verbose) fprintf(stderr, "[snapshot-sync] rebuilding index for %s\n", path);
+        if (sync_index_build(fd, (uint64_t)st.st_size, (uint32_t)block, &ix) != 0) {
+            close(fd); free(want); free(ix.hash);
+            return -1;
+        }
+    }
+
+    /* changed blocks, coalesced into runs */
+    size_t nruns = 0, cap = 0;
+    sync_run_t *runs = NULL;
+    uint64_t changed = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (i < ix.count && ix.hash[i] == want[i] &&
+            (i + 1 < count || ix.size == size)) continue;   /* a partial last block may have grown */
+        changed++;
+        uint64_t off = i * (uint64_t)block;
+        uint64_t len = size - off < (uint64_t)block ? size - off : (uint64_t)block;
+        if (nruns && runs[nruns-1].off + runs[nruns-1].len == off && runs[nruns-1].len + len <= SYNC_RUN_MAX) {
+            runs[nruns-1].len += len;
+            continue;
+        }
+        if (nruns == cap) {
+            cap = cap ? cap * 2 : 64;
+            sync_run_t *nr = (sync_run_t*)realloc(runs, cap * sizeof *runs);
+            if (!nr) { perror("malloc"); rc = -1; break; }
+            runs = nr;
+        }
+        runs[nruns].off = off;
+        runs[nruns].len = len;
+        nruns++;
+    }
+    free(ix.hash);
+    ix.hash = NULL;
+
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < nruns; i++) bytes += runs[i].len;
+    if (rc == 0 && (uint64_t)st.st_size != size && ftruncate(fd, (off_t)size) != 0) { perror(path); rc = -1; }
+
+    xfer_progress_t prog;
+    xfer_progress_init(&prog, "snapshot-sync", bytes);
+    sync_rx_t s = { fd, (uint32_t)block, size, want, 0, NULL, 0, 0, &prog };
+    s.buf = (unsigned char*)malloc((size_t)block);
+    if (!s.buf) { perror("malloc"); rc = -1; }
+
+    /* keep SYNC_WINDOW reads in flight; replies come back in order */
+    size_t sent = 0, recvd = 0;
+    int broken = 0;   /* the stream is out of step: a send or a reply was cut short */
+    while (rc == 0 && recvd < nruns) {
+        while (sent < nruns && sent - recvd < SYNC_WINDOW) {
+            snprintf(line, sizeof line, "snapshot-read %s %llu %llu", vm,
+                     (unsigned long long)runs[sent].off, (unsigned long long)runs[sent].len);
+            if ((rc = conn_send_line(c, line)) != 0) { broken = 1; break; }
+            runs[sent++].tag = c->tag;
+        }
+        if (rc != 0) break;
+        s.off = runs[recvd].off;
+        s.size = runs[recvd].off + runs[recvd].len;
+        s.fill = 0;
+        conn_resp_init(c, &r, sync_sink, &s);
+        r.tag = runs[recvd].tag;
+        rc = resp_read(c, &r);
+        if (r.st != RESP_DONE) { broken = 1; break; }
+        recvd++;
+        if (rc != 0) break;   /* the sink gave up; the reply was still read whole */
+        if (resp_error(&r)) { fprintf(stderr, "snapshot-sync: %s\n", resp_error(&r)); rc = -1; break; }
+        if (s.off != s.size) { fprintf(stderr, "snapshot-sync: short read at %llu\n", (unsigned long long)s.off); rc = -1; break; }
+    }
+    /* Stopping early leaves later reads in flight. Their replies are read
+     * into the void so the connection stays in step with hostd; if that is
+     * not possible it is closed. Timeouts and Ctrl-C are left to client_end. */
+    while (rc == -1 && !broken && recvd < sent) {
+        conn_resp_init(c, &r, discard_sink, NULL);
+        r.tag = runs[recvd].tag;
+        if (resp_read(c, &r) != 0) broken = 1;
+        else recvd++;
+    }
+    if (rc == -1 && broken && c->fd >= 0) {
+        fprintf(stderr, "snapshot-sync: connection closed\n");
+        conn_close(c);
+    }
+    if (rc == 0 && s.bad) rc = -1;
+    if (rc == 0 && fsync(fd) != 0) { perror(path); rc = -1; }   /* data first, then the index */
+    if (rc == 0 && fstat(fd, &st) != 0) { perror(path); rc = -1; }
+    if (close(fd) != 0 && rc == 0) { perror(path); rc = -1; }
+    xfer_progress(&prog, 1);
+
+    if (rc == 0) {
+        ix.block = (uint32_t)block;
+        ix.size = size;
+        ix.mtime_ns = stat_mtime_ns(&st);
+        ix.count = count;
+        ix.hash = want;
+        rc = sync_index_save(idx_path, &ix);
+        fprintf(stderr, "snapshot-sync: %llu of %llu blocks changed, %.1f MiB of %.1f MiB transferred\n",
+                (unsigned long long)changed, (unsigned long long)count,
+                (double)bytes / 1048576.0, (double)size / 1048576.0);
+    } else {
+        remove(idx_path);   /* the file may be half patched: rehash next time */
+    }
+    free(s.buf);
+    free(runs);
+    free(want);
+    return rc;
+}
+#else
+static int run_snapshot_sync(conn_t *c, int argc, char **argv) {
+    (void)c; (void)argc; (void)argv;
+    fprintf(stderr, "snapshot-sync is not supported on Windows yet\n");
+    return -1;
+}
+#endif
+
+/*
+ * Commands the client implements itself on top of the connection rather
+ * than passing straight through to hostd.
+ */
+static int is_client_command(const char *line) {
+    return !strncmp(line, "upload ", 7) || !strncmp(line, "download ", 9) ||
+           !strncmp(line, "console ", 8) || !strncmp(line, "wait ", 5) ||
+           !strncmp(line, "watch ", 6) || !strncmp(line, "trace-capture ", 14) ||
+           !strncmp(line, "snapshot-sync ", 14);
+}
+
+#define CLIENT_MAX_ARGS  16
+
+/* Split a client command line in place into words. Blanks separate words
+ * except inside "..." or '...', so local paths may contain spaces; there
+ * are no escapes, which keeps Windows paths intact. -1 on a missing quote. */
+static int client_split(char *buf, char **argv, int max) {
+    int argc = 0;
+    char *p = buf;
+    for (;;) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p || argc == max) return argc;
+        char *o = p;
+        argv[argc++] = o;
+        while (*p && *p != ' ' && *p != '\t') {
+            if (*p == '"' || *p == '\'') {
+                char q = *p++;
+                while (*p && *p != q) *o++ = *p++;
+                if (!*p) return -1;
+                p++;
+            } else {
+                *o++ = *p++;
+            }
+        }
+        if (*p) p++;
+        *o = 0;
+    }
+}
+
+/* Join command-line words into one line; with quote, words containing
+ * blanks are quoted so client_split gives them back unchanged. */
+static char *join_args(int n, char **v, int quote) {
+    size_t total = 1;
+    for (int i = 0; i < n; i++) total += strlen(v[i]) + 3;
+    char *line = (char*)malloc(total);
+    if (!line) return NULL;
+    char *o = line;
+    for (int i = 0; i < n; i++) {
+        size_t len = strlen(v[i]);
+        char q = 0;
+        if (quote && (!len || v[i][strcspn(v[i], " \t")])) q = strchr(v[i], '"') ? '\'' : '"';
+        if (i) *o++ = ' ';
+        if (q) *o++ = q;
+        memcpy(o, v[i], len);
+        o += len;
+        if (q) *o++ = q;
+    }
+    *o = 0;
+    return line;
+}
+
+static int run_command(conn_t *c, const char *line) {
+    if (!is_client_command(line)) return send_command_fd(c, line);
+    char buf[1024];
+    char *argv[CLIENT_MAX_ARGS];
+    if (snprintf(buf, sizeof buf, "%s", line) >= (int)sizeof buf) {
+        fprintf(stderr, "command too long\n");
+        return -1;
+    }
+    int argc = client_split(buf, argv, CLIENT_MAX_ARGS);
+    if (argc < 0) { fprintf(stderr, "unterminated quote\n"); return -1; }
+    if (argc == 0) return -1;
+    int rc;
+    client_begin();
+    if (!strcmp(argv[0], "upload")) rc = run_upload(c, argc, argv);
+    else if (!strcmp(argv[0], "download")) rc = run_download(c, argc, argv);
+    else if (!strcmp(argv[0], "wait")) rc = run_wait(c, argc, argv);
+    else if (!strcmp(argv[0], "watch")) rc = run_watch(c, argc, argv);
+    else if (!strcmp(argv[0], "trace-capture")) rc = run_trace_capture(c, argc, argv);
+    else if (!strcmp(argv[0], "snapshot-sync")) rc = run_snapshot_sync(c, argc, argv);
+    else rc = run_console(c, argc, argv);
+    return client_end(c, rc);
+}
+
+// ----- fan-out -----
+/*
+ * Fan-out sends one command to every target listed in a hosts file and
+ * drives all connections from a single poll() loop, so the run takes about
+ * as long as the slowest host. Each host's reply is collected and printed
+ * with a "label: " prefix on every line once that host completes.
+ *
+ * Hosts file: one target per line, `host:port`, `[v6addr]:port` or
+ * `unix:/path/to.sock`; blank lines and `#` comments are ignored.
+ *
+ * Host names are all looked up before the loop starts, several at a time,
+ * so no connection waits behind another host's DNS query. With timeout= (or
+ * --deadline) each host must answer within that long of its command going
+ * out; connect_timeout= bounds the connect as usual.
+ */
+#define FANOUT_MAX_OPEN     512   /* connections open at once */
+#define FANOUT_RESOLVE_MAX  32    /* name lookups in flight */
+
+typedef enum {
+    FAN_PENDING = 0, FAN_CONNECTING, FAN_SENDING, FAN_READING, FAN_DONE, FAN_FAILED
+} fan_state_t;
+
+typedef struct {
+    char             label[300];
+    vc_mode_t        mode;
+    char             host[128];
+    int              port;
+    char             path[256];
+    struct addrinfo *res, *ai;     /* resolved addresses, next to try */
+    conn_t           conn;
+    fan_state_t      st;
+    size_t           tx_off;
+    resp_t           r;
+    uint64_t         last_rx;      /* for unframed replies: idle detection */
+    uint64_t         deadline;     /* connect deadline, 0 = none */
+    int              slot;         /* io_uring: receive buffer in the slab */
+    int              ur_op;        /* io_uring: operation in flight, 0 = none */
+    char            *out;
+    size_t           out_len, out_cap;
+    char             err[160];
+} fan_target_t;
+
+static int fan_sink(void *ctx, const void *data, size_t len) {
+    fan_target_t *t = (fan_target_t*)ctx;
+    if (t->out_len + len > t->out_cap) {
+        size_t ncap = t->out_cap ? t->out_cap : 4096;
+        while (ncap < t->out_len + len) ncap *= 2;
+        char *nb = (char*)realloc(t->out, ncap);
+        if (!nb) return -1;
+        t->out = nb; t->out_cap = ncap;
+    }
+    memcpy(t->out + t->out_len, data, len);
+    t->out_len += len;
+    return 0;
+}
+
+static int fan_parse_target(fan_target_t *t, const char *spec) {
+    memset(t, 0, sizeof(*t));
+    t->conn.fd = -1;
+    snprintf(t->label, sizeof t->label, "%s", spec);
+    if (!strncmp(spec, "unix:", 5)) {
+#ifdef _WIN32
+        return -1;
+#else
+        t->mode = VC_MODE_UNIX;
+        return snprintf(t->path, sizeof t->path, "%s", spec + 5) < (int)sizeof t->path ? 0 : -1;
+#endif
+    }
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec) return -1;
+    const char *h = spec;
+    size_t hl = (size_t)(colon - spec);
+    if (h[0] == '[' && hl >= 2 && h[hl-1] == ']') { h++; hl -= 2; }
+    if (hl >= sizeof t->host) return -1;
+    memcpy(t->host, h, hl); t->host[hl] = 0;
+    t->port = atoi(colon + 1);
+    t->mode = VC_MODE_TCP;
+    return t->port > 0 && t->port <= 65535 ? 0 : -1;
+}
+
+static fan_target_t *fan_load(const char *path, size_t *count) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) { perror(path); return NULL; }
+    fan_target_t *v = NULL;
+    size_t n = 0, cap = 0;
+    char *line = NULL; size_t lcap = 0;
+    long lineno = 0;
+    while (read_line(fp, &line, &lcap) >= 0) {
+        lineno++;
+        char *p = trim(line);
+        if (*p == 0 || *p == '#') continue;
+        if (n == cap) {
+            size_t ncap = cap ? cap * 2 : 64;
+            fan_target_t *nv = (fan_target_t*)realloc(v, ncap * sizeof *v);
+            if (!nv) { perror("malloc"); break; }
+            v = nv; cap = ncap;
+        }
+        if (fan_parse_target(&v[n], p) != 0) {
+            fprintf(stderr, "%s:%ld: bad target '%s'\n", path, lineno, p);
+            continue;
+        }
+        n++;
+    }
+    free(line);
+    fclose(fp);
+    *count = n;
+    return v;
+}
+
+static void fan_fail(fan_target_t *t, const char *what, int e) {
+#ifdef _WIN32
+    snprintf(t->err, sizeof t->err, "%s failed, WSAErr=%d", what, e);
+#else
+    snprintf(t->err, sizeof t->err, "%s: %s", what, strerror(e));
+#endif
+    t->st = FAN_FAILED;
+}
+
+/* Start connecting to the next candidate address; FAN_FAILED if none left.
+ * e is the error from the previous attempt, reported if nothing else works. */
+static void fan_connect_next(fan_target_t *t, int e) {
+    while (t->ai) {
+        const struct addrinfo *ai = t->ai;
+        t->ai = ai->ai_next;
+        int fd = connect_addr(ai, 1);
+        if (fd >= 0 && conn_open(&t->conn, fd) == 0) { t->st = FAN_CONNECTING; return; }
+        e = SOCKERR();
+    }
+    fan_fail(t, "connect(tcp)", e);
+}
+
+static void fan_start(fan_target_t *t, int connect_timeout_ms) {
+    resp_init(&t->r, fan_sink, t);
+    if (connect_timeout_ms > 0)
+        t->deadline = mono_ns() + (uint64_t)connect_timeout_ms * 1000000ull;
+#ifndef _WIN32
+    if (t->mode == VC_MODE_UNIX) {
+        int fd = connect_unix_path(t->path, 1);
+        if (fd < 0 || conn_open(&t->conn, fd) != 0) { fan_fail(t, "connect(unix)", errno); return; }
+        t->st = FAN_CONNECTING;
+        return;
+    }
+#endif
+    if (!t->res) {   /* the caller may have resolved it already */
+        int err = tcp_resolve(t->host, t->port, &t->res);
+        if (err) {
+            snprintf(t->err, sizeof t->err, "getaddrinfo: %s", gai_strerror(err));
+            t->res = NULL;
+            t->st = FAN_FAILED;
+            return;
+        }
+    }
+    t->ai = t->res;
+    fan_connect_next(t, 0);
+}
+
+static void fan_resolve_failed(fan_target_t *t, int err) {
+    snprintf(t->err, sizeof t->err, "getaddrinfo: %s", gai_strerror(err));
+    t->res = NULL;
+    t->st = FAN_FAILED;
+}
+
+/* Resolve every TCP target up front: literal addresses inline, names on
+ * resolver threads. Targets that do not resolve are left FAN_FAILED. */
+static void fan_resolve_all(fan_target_t *t, size_t n) {
+    char port[16];
+#ifndef _WIN32
+    resolve_job_t *job[FANOUT_RESOLVE_MAX];
+    size_t who[FANOUT_RESOLVE_MAX], njobs = 0;
+#endif
+    for (size_t next = 0; ; ) {
+#ifndef _WIN32
+        while (next < n && njobs < FANOUT_RESOLVE_MAX) {
+#else
+        while (next < n) {
+#endif
+            fan_target_t *x = &t[next++];
+            if (x->mode != VC_MODE_TCP || x->res) continue;
+            snprintf(port, sizeof port, "%d", x->port);
+            struct addrinfo hints;
+            memset(&hints, 0, sizeof hints);
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            hints.ai_flags = AI_NUMERICHOST;
+            if (getaddrinfo(x->host, port, &hints, &x->res) == 0) continue;
+            x->res = NULL;
+#ifndef _WIN32
+            int err;
+            resolve_job_t *j = resolve_job_start(x->host, port, &err);
+            if (!j) { fan_resolve_failed(x, err); continue; }
+            job[njobs] = j;
+            who[njobs++] = (size_t)(x - t);
+#else
+            int err = tcp_resolve(x->host, x->port, &x->res);
+            if (err) fan_resolve_failed(x, err);
+#endif
+        }
+#ifndef _WIN32
+        if (!njobs) break;
+        sleep_ms(1);
+        for (size_t k = 0; k < njobs; ) {
+            int err;
+            fan_target_t *x = &t[who[k]];
+            if (!resolve_job_poll(job[k], &err, &x->res)) { k++; continue; }
+            if (err) fan_resolve_failed(x, err);
+            job[k] = job[--njobs];
+            who[k] = who[njobs];
+        }
+#else
+        break;
+#endif
+    }
+}
+
+static void fan_finish(fan_target_t *t, verb_stats_t *verb, uint64_t t0, size_t sent) {
+    stats_record(verb, mono_ns() - t0, t->tx_off ? sent : 0, t->r.bytes, t->st == FAN_FAILED);
+    if (t->st == FAN_FAILED) {
+        fprintf(stderr, "%s: [error] %s\n", t->label, t->err);
+    } else {
+        size_t i = 0;
+        while (i < t->out_len) {
+            const char *nl = (const char*)memchr(t->out + i, '\n', t->out_len - i);
+            size_t end = nl ? (size_t)(nl - t->out) + 1 : t->out_len;
+            fprintf(stdout, "%s: ", t->label);
+            fwrite(t->out + i, 1, end - i, stdout);
+            if (!nl) fputc('\n', stdout);
+            i = end;
+        }
+    }
+    if (t->conn.fd >= 0) conn_close(&t->conn);
+    if (t->res) freeaddrinfo(t->res);
+    t->res = t->ai = NULL;
+    free(t->out);
+    t->out = NULL; t->out_len = t->out_cap = 0;
+}
+
+/* n bytes (0 = EOF) just landed in t->conn.rx. */
+static void fan_on_data(fan_target_t *t, int n) {
+    if (n == 0) {
+        if (t->r.st == RESP_LEGACY) { t->st = FAN_DONE; return; }
+        snprintf(t->err, sizeof t->err, "server closed connection");
+        t->st = FAN_FAILED;
+        return;
+    }
+    t->last_rx = mono_ns();
+    t->conn.rx_off += resp_feed(&t->r, t->conn.rx + t->conn.rx_off,
+                                t->conn.rx_len - t->conn.rx_off);
+    if (t->r.st == RESP_DONE) {
+        t->st = t->r.sink_err ? FAN_FAILED : FAN_DONE;
+        if (t->r.sink_err) snprintf(t->err, sizeof t->err, "out of memory");
+    } else if (t->r.st == RESP_ERROR) {
+        snprintf(t->err, sizeof t->err, "malformed response frame");
+        t->st = FAN_FAILED;
+    }
+}
+
+static void fan_on_readable(fan_target_t *t) {
+    int n = conn_fill(&t->conn, 0);
+    if (n == IO_TIMEOUT) return;
+    if (n < 0) { fan_fail(t, "read", SOCKERR()); return; }
+    fan_on_data(t, n);
+}
+
+/* The command is out: wait for the reply, for read_timeout_ms at most. */
+static void fan_sent(fan_target_t *t, uint64_t now, int read_timeout_ms) {
+    t->st = FAN_READING;
+    t->last_rx = now;
+    t->deadline = read_timeout_ms > 0 ? now + (uint64_t)read_timeout_ms * 1000000ull : 0;
+}
+
+/* When the loop must look at t again without I/O on it, 0 = not before. */
+static uint64_t fan_due(const fan_target_t *t) {
+    uint64_t due = 0;
+    if (t->st == FAN_READING && t->r.st == RESP_LEGACY)
+        due = t->last_rx + (uint64_t)LEGACY_IDLE_MS * 1000000ull;
+    if ((t->st == FAN_CONNECTING || t->st == FAN_READING) && t->deadline && (!due || t->deadline < due))
+        due = t->deadline;
+    return due;
+}
+
+#ifdef VC_HAVE_URING
+/*
+ * Fan-out on io_uring: each target has at most one operation in flight
+ * (connect poll, send or receive); all of them are submitted with the wait
+ * in one io_uring_enter() per round. Receive buffers come from one slab,
+ * registered with the ring when the kernel allows it.
+ */
+enum { FUR_CONNECT = 1, FUR_SEND = 2, FUR_RECV = 3 };
+
+typedef struct {
+    fan_target_t  *t;
+    unsigned char *slab;
+    int            busy;      /* operations in flight */
+} fan_ur_t;
+
+static void fan_ur_cqe(void *ctx, uint64_t ud, int res) {
+    fan_ur_t *u = (fan_ur_t*)ctx;
+    fan_target_t *x = &u->t[ud >> 2];
+    int op = (int)(ud & 3);
+    u->busy--;
+    x->ur_op = 0;
+    if (x->st == FAN_DONE || x->st == FAN_FAILED) return;   /* cancelled */
+    if (op == FUR_CONNECT) {
+        int e = res < 0 ? -res : sock_connect_result(x->conn.fd);
+        if (e) {
+            x->conn.rx = NULL;
+            conn_close(&x->conn);
+            if (x->mode == VC_MODE_TCP) fan_connect_next(x, e);
+            else fan_fail(x, "connect(unix)", e);
+            if (x->st == FAN_CONNECTING) {
+                free(x->conn.rx);
+                x->conn.rx = u->slab + (size_t)x->slot * RX_BUF_SIZE;
+            }
+            return;
+        }
+        sock_set_nonblock(x->conn.fd, 0);   /* let the ring do the waiting */
+        x->st = FAN_SENDING;
+    } else if (op == FUR_SEND) {
+        if (res < 0) { fan_fail(x, "write", -res); return; }
+        x->tx_off += (size_t)res;
+    } else {
+        if (res < 0) { fan_fail(x, "read", -res); return; }
+        x->conn.rx_len += (size_t)res;
+        fan_on_data(x, res);
+    }
+}
+
+static void fan_ur_arm(fan_ur_t *u, size_t i, const char *cmd, size_t cmdlen, int fixed) {
+    fan_target_t *x = &u->t[i];
+    struct io_uring_sqe *s;
+    if (x->ur_op) return;
+    if (x->st == FAN_CONNECTING) {
+        s = uring_prep(IORING_OP_POLL_ADD, x->conn.fd, NULL, 0, 0, (uint64_t)i << 2 | FUR_CONNECT);
+        s->poll32_events = POLLOUT;
+        x->ur_op = FUR_CONNECT;
+    } else if (x->st == FAN_SENDING) {
+        s = uring_prep(IORING_OP_SEND, x->conn.fd, cmd + x->tx_off, cmdlen - x->tx_off, 0,
+                       (uint64_t)i << 2 | FUR_SEND);
+        s->msg_flags = MSG_NOSIGNAL;
+        x->ur_op = FUR_SEND;
+    } else if (x->st == FAN_READING) {
+        conn_t *c = &x->conn;
+        if (!conn_rx_room(c)) {
+            snprintf(x->err, sizeof x->err, "protocol error: receive buffer full");
+            x->st = FAN_FAILED;
+            return;
+        }
+        s = uring_prep(fixed ? IORING_OP_READ_FIXED : IORING_OP_RECV, c->fd, c->rx + c->rx_len,
+                       RX_BUF_SIZE - c->rx_len, 0, (uint64_t)i << 2 | FUR_RECV);
+        s->buf_index = (uint16_t)x->slot;
+        x->ur_op = FUR_RECV;
+    } else {
+        return;
+    }
+    u->busy++;
+}
+
+static void fan_loop_uring(fan_target_t *t, size_t n, const char *cmd, size_t cmdlen,
+                           int connect_timeout_ms, int read_timeout_ms, verb_stats_t *verb,
+                           uint64_t t0, size_t *ok, size_t *failed) {
+    size_t nslots = n < FANOUT_MAX_OPEN ? n : FANOUT_MAX_OPEN;
+    unsigned char *slab = (unsigned char*)malloc(nslots * RX_BUF_SIZE);
+    struct iovec *iov = (struct iovec*)calloc(nslots, sizeof *iov);
+    size_t *open_list = (size_t*)calloc(nslots, sizeof *open_list);
+    int *free_slot = (int*)calloc(nslots, sizeof *free_slot);
+    if (!slab || !iov || !open_list || !free_slot) {
+        perror("malloc");
+        free(slab); free(iov); free(open_list); free(free_slot);
+        return;
+    }
+    for (size_t k = 0; k < nslots; k++) {
+        iov[k].iov_base = slab + k * RX_BUF_SIZE;
+        iov[k].iov_len = RX_BUF_SIZE;
+        free_slot[k] = (int)(nslots - 1 - k);
+    }
+    int fixed = uring_register_buffers(iov, (unsigned)nslots) == 0;
+    size_t nfree = nslots, next = 0, active = 0;
+    fan_ur_t u = { t, slab, 0 };
+
+    for (;;) {
+        while (active < nslots && next < n) {
+            fan_target_t *x = &t[next];
+            if (x->st != FAN_FAILED) fan_start(x, connect_timeout_ms);
+            if (x->st == FAN_FAILED) { fan_finish(x, verb, t0, cmdlen); (*failed)++; next++; continue; }
+            x->slot = free_slot[--nfree];
+            free(x->conn.rx);                   /* receive into the registered slab */
+            x->conn.rx = slab + (size_t)x->slot * RX_BUF_SIZE;
+            open_list[active++] = next++;
+        }
+        if (active == 0) break;
+
+        int timeout = -1;
+        uint64_t now = mono_ns();
+        for (size_t k = 0; k < active; k++) {
+            fan_target_t *x = &t[open_list[k]];
+            fan_ur_arm(&u, open_list[k], cmd, cmdlen, fixed);
+            uint64_t due = fan_due(x);
+            if (due) {
+                int ms = due > now ? (int)((due - now) / 1000000ull) + 1 : 0;
+                if (timeout < 0 || ms < timeout) timeout = ms;
+            }
+        }
+        if (uring_wait(timeout) != 0) break;
+        uint64_t ud;
+        int res;
+        while (uring_reap(&ud, &res)) if (ud != UR_IGNORE_UD) fan_ur_cqe(&u, ud, res);
+
+        now = mono_ns();
+        for (size_t k = 0; k < active; k++) {
+            fan_target_t *x = &t[open_list[k]];
+            if (x->st == FAN_SENDING && x->tx_off == cmdlen) fan_sent(x, now, read_timeout_ms);
+            if (x->st == FAN_CONNECTING && x->deadline && now >= x->deadline) {
+                snprintf(x->err, sizeof x->err, "connect: timed out after %d ms", connect_timeout_ms);
+                x->st = FAN_FAILED;
+            } else if (x->st == FAN_READING && x->r.st == RESP_LEGACY &&
+                       now - x->last_rx >= (uint64_t)LEGACY_IDLE_MS * 1000000ull) {
+                x->st = FAN_DONE;
+            } else if (x->st == FAN_READING && x->deadline && now >= x->deadline) {
+                snprintf(x->err, sizeof x->err, "no reply within %d ms", read_timeout_ms);
+                x->st = FAN_FAILED;
+            }
+            if ((x->st == FAN_DONE || x->st == FAN_FAILED) && x->ur_op)
+                uring_cancel((uint64_t)open_list[k] << 2 | (uint64_t)x->ur_op);
+        }
+
+        /* retire finished targets whose ring operations have all completed */
+        size_t keep = 0;
+        for (size_t k = 0; k < active; k++) {
+            fan_target_t *x = &t[open_list[k]];
+            if ((x->st == FAN_DONE || x->st == FAN_FAILED) && !x->ur_op) {
+                if (x->st == FAN_DONE) (*ok)++; else (*failed)++;
+                x->conn.rx = NULL;              /* slab memory, not the conn's */
+                free_slot[nfree++] = x->slot;
+                fan_finish(x, verb, t0, cmdlen);
+            } else {
+                open_list[keep++] = open_list[k];
+            }
+        }
+        active = keep;
+    }
+    for (size_t k = 0; k < active; k++) {       /* only after a ring failure */
+        fan_target_t *x = &t[open_list[k]];
+        if (x->ur_op) uring_cancel((uint64_t)open_list[k] << 2 | (uint64_t)x->ur_op);
+        x->st = FAN_FAILED;
+    }
+    uring_drain(&u.busy, fan_ur_cqe, &u);
+    for (size_t k = 0; k < active; k++) {
+        fan_target_t *x = &t[open_list[k]];
+        snprintf(x->err, sizeof x->err, "io_uring failed");
+        x->conn.rx = NULL;
+        (*failed)++;
+        fan_finish(x, verb, t0, cmdlen);
+    }
+    if (fixed) uring_unregister_buffers();
+    free(slab); free(iov); free(open_list); free(free_slot);
+}
+#endif
+
+/* Runs line on the n targets in t, which it frees. */
+static int run_fanout(fan_target_t *t, size_t n, const char *line, int connect_timeout_ms,
+                      int read_timeout_ms) {
+    size_t cmdlen = strlen(line);
+    char *cmd = (char*)malloc(cmdlen + 2);
+    struct pollfd *pfd = (struct pollfd*)calloc(FANOUT_MAX_OPEN, sizeof *pfd);
+    size_t *idx = (size_t*)calloc(FANOUT_MAX_OPEN, sizeof *idx);
+    if (!cmd || !pfd || !idx) { perror("malloc"); free(cmd); free(pfd); free(idx); free(t); return -1; }
+    memcpy(cmd, line, cmdlen);
+    cmd[cmdlen++] = '\n';
+
+    uint64_t t0 = mono_ns();
+    verb_stats_t *verb = stats_verb(line);
+    size_t next = 0, active = 0, ok = 0, failed = 0;
+    size_t *open_list = idx;   /* indices of targets currently in flight */
+
+    uint64_t t_res = mono_ns();
+    fan_resolve_all(t, n);
+    trace_span("resolve", t_res, mono_ns(), NULL, NULL);
+
+#ifdef VC_HAVE_URING
+    if (g_io == IO_URING)
+        fan_loop_uring(t, n, cmd, cmdlen, connect_timeout_ms, read_timeout_ms, verb, t0, &ok, &failed);
+    else
+#endif
+    for (;;) {
+        while (active < FANOUT_MAX_OPEN && next < n) {
+            fan_target_t *x = &t[next];
+            if (x->st != FAN_FAILED) fan_start(x, connect_timeout_ms);
+            if (x->st == FAN_FAILED) { fan_finish(x, verb, t0, cmdlen); failed++; next++; continue; }
+            open_list[active++] = next++;
+        }
+        if (active == 0) break;
+
+        int timeout = -1;
+        uint64_t now = mono_ns();
+        for (size_t k = 0; k < active; k++) {
+            fan_target_t *x = &t[open_list[k]];
+            pfd[k].fd = x->conn.fd;
+            pfd[k].events = (short)(x->st == FAN_READING ? POLLIN : POLLOUT);
+            pfd[k].revents = 0;
+            uint64_t due = fan_due(x);
+            if (due) {
+                int ms = due > now ? (int)((due - now) / 1000000ull) + 1 : 0;
+                if (timeout < 0 || ms < timeout) timeout = ms;
+            }
+        }
+        if (poll(pfd, (unsigned)active, timeout) < 0) {
+            if (SOCKERR() == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        now = mono_ns();
+        for (size_t k = 0; k < active; k++) {
+            fan_target_t *x = &t[open_list[k]];
+            short re = pfd[k].revents;
+            if (x->st == FAN_CONNECTING && !re && x->deadline && now >= x->deadline) {
+                snprintf(x->err, sizeof x->err, "connect: timed out after %d ms", connect_timeout_ms);
+                x->st = FAN_FAILED;
+                continue;
+            }
+            if (x->st == FAN_CONNECTING && re) {
+                int e = sock_connect_result(x->conn.fd);
+                if (e) {
+                    conn_close(&x->conn);
+                    if (x->mode == VC_MODE_TCP) fan_connect_next(x, e);
+                    else fan_fail(x, "connect(unix)", e);
+                    continue;
+                }
+                x->st = FAN_SENDING;
+            }
+            if (x->st == FAN_SENDING && (re & (POLLOUT | POLLERR | POLLHUP))) {
+                long w = sock_send_some(x->conn.fd, cmd + x->tx_off, cmdlen - x->tx_off);
+                if (w < 0) { fan_fail(x, "write", SOCKERR()); continue; }
+                x->tx_off += (size_t)w;
+                if (x->tx_off == cmdlen) fan_sent(x, now, read_timeout_ms);
+            } else if (x->st == FAN_READING) {
+                if (re & (POLLIN | POLLHUP | POLLERR)) fan_on_readable(x);
+                else if (x->r.st == RESP_LEGACY &&
+                         now - x->last_rx >= (uint64_t)LEGACY_IDLE_MS * 1000000ull)
+                    x->st = FAN_DONE;
+                if (x->st == FAN_READING && x->deadline && now >= x->deadline) {
+                    snprintf(x->err, sizeof x->err, "no reply within %d ms", read_timeout_ms);
+                    x->st = FAN_FAILED;
+                }
+            }
+        }
+
+        /* retire finished targets, compacting the open list */
+        size_t keep = 0;
+        for (size_t k = 0; k < active; k++) {
+            fan_target_t *x = &t[open_list[k]];
+            if (x->st == FAN_DONE || x->st == FAN_FAILED) {
+                if (x->st == FAN_DONE) ok++; else failed++;
+                fan_finish(x, verb, t0, cmdlen);
+            } else {
+                open_list[keep++] = open_list[k];
+            }
+        }
+        active = keep;
+    }
+    fflush(stdout);
+
+    if (TRACE_ON()) {
+        char info[32];
+        snprintf(info, sizeof info, "%zu", n);
+        trace_span("fanout", t0, mono_ns(), "hosts", info);
+    }
+    fprintf(stderr, "[fanout] %zu hosts, %zu ok, %zu failed in %.3f s\n",
+            n, ok, failed, (double)(mono_ns() - t0) / 1e9);
+    free(cmd); free(pfd); free(idx); free(t);
+    return failed ? -1 : 0;
+}
+
+// ----- inventory -----
+/*
+ * The inventory names hostd targets and tags them, one per line:
+ *
+ *     # name     target              tags
+ *     z80-a1     10.0.3.11:9000      arch=z80 rack=3 role=build
+ *     m68k-b2    [fd00::12]:9000     arch=m68k rack=4
+ *     bench      unix:/tmp/hostd.sock   # a word starting with # ends the line
+ *
+ * It is read from inventory= in the config, or from "inventory" next to
+ * the config file. `-t <selector>` picks the targets of a fan-out (or of
+ * the exporter): comma-separated terms that must all hold, each
+ * `key=value`, `key=v1|v2`, or a bare name (`z80-a1|m68k-b2`); `*` is
+ * every target.
+ *
+ * The parsed inventory is a single flat blob: the target table, an
+ * open-addressing hash of every "key=value" (names are indexed as
+ * "name=<name>") pointing at a sorted list of target numbers, and the
+ * strings. It is written next to the file as <inventory>.vcidx and read
+ * back whole while the file's size and mtime still match and the body
+ * hashes to the value in its header, so a large inventory is parsed once
+ * rather than on every call. A file with rejected lines is not indexed,
+ * so its errors are reported on every call until it is fixed. A selection costs a
+ * hash probe per value and a merge of the lists, smallest first.
+ *
+ * Index layout (little endian):
+ *
+ *     "VCIV" u32 version  u64 size  u64 mtime_ns
+ *     u32 targets  u32 buckets  u32 entries  u32 postings  u32 strings  u32 0
+ *     u64 xxh64 of everything after the header
+ *     targets  × { u32 name, u32 target, u32 tags }      string offsets
+ *     buckets  × u32                                     entry + 1, 0 = empty
+ *     entries  × { u32 key, u32 hash, u32 first, u32 count }
+ *     postings × u32                                     target numbers
+ *     strings                                            NUL-terminated
+ */
+#define INV_IDX_MAGIC    "VCIV"
+#define INV_IDX_VERSION  2
+#define INV_HDR_SIZE     56
+#define INV_TARGET_SIZE  12
+#define INV_ENTRY_SIZE   16
+#define INV_MIN_BUCKETS  16
+#define INV_MAX_TAGS     256     /* per target */
+
+typedef struct {
+    unsigned char       *blob;       /* the index exactly as stored */
+    size_t               size;
+    uint32_t             ntargets, nbuckets, nentries, npost, nstr;
+    const unsigned char *targets, *buckets, *entries, *post;
+    const char          *str;
+    int                  cached;     /* read from .vcidx, not parsed */
+} inventory_t;
+
+static uint32_t inv_hash(const char *s, size_t n) {
+    return (uint32_t)xxh64((const unsigned char*)s, n);
+}
+
+static const char *inv_field(const inventory_t *iv, uint32_t i, int f) {
+    return iv->str + get_le32(iv->targets + (size_t)i * INV_TARGET_SIZE + (size_t)f * 4);
+}
+static const char *inv_name(const inventory_t *iv, uint32_t i) { return inv_field(iv, i, 0); }
+static const char *inv_spec(const inventory_t *iv, uint32_t i) { return inv_field(iv, i, 1); }
+static const char *inv_tags(const inventory_t *iv, uint32_t i) { return inv_field(iv, i, 2); }
+
+/* Targets carrying key ("k=v" or "name=<name>"): the count, with *post
+ * pointing at their numbers; 0 if none. */
+static uint32_t inv_lookup(const inventory_t *iv, const char *key, size_t klen,
+                           const unsigned char **post) {
+    uint32_t h = inv_hash(key, klen), mask = iv->nbuckets - 1;
+    for (uint32_t b = h & mask; ; b = (b + 1) & mask) {
+        uint32_t e = get_le32(iv->buckets + (size_t)b * 4);
+        if (!e) return 0;
+        const unsigned char *ent = iv->entries + (size_t)(e - 1) * INV_ENTRY_SIZE;
+        const char *k = iv->str + get_le32(ent);
+        if (get_le32(ent + 4) == h && !strncmp(k, key, klen) && k[klen] == 0) {
+            *post = iv->post + (size_t)get_le32(ent + 8) * 4;
+            return get_le32(ent + 12);
+        }
+    }
+}
+
+/* Point the tables into blob (taking ownership) after checking that every
+ * offset stays inside it; -1 if it is not a well-formed index. */
+static int inv_attach(inventory_t *iv, unsigned char *blob, size_t size) {
+    if (size < INV_HDR_SIZE || memcmp(blob, INV_IDX_MAGIC, 4) ||
+        get_le32(blob + 4) != INV_IDX_VERSION) return -1;
+    uint64_t nt = get_le32(blob + 24), nb = get_le32(blob + 28), ne = get_le32(blob + 32);
+    uint64_t np = get_le32(blob + 36), ns = get_le32(blob + 40);
+    if (INV_HDR_SIZE + nt * INV_TARGET_SIZE + nb * 4 + ne * INV_ENTRY_SIZE + np * 4 + ns != size ||
+        nb < INV_MIN_BUCKETS || (nb & (nb - 1)) || ne >= nb || !ns || blob[size - 1])
+        return -1;
+    iv->ntargets = (uint32_t)nt; iv->nbuckets = (uint32_t)nb; iv->nentries = (uint32_t)ne;
+    iv->npost = (uint32_t)np; iv->nstr = (uint32_t)ns;
+    iv->targets = blob + INV_HDR_SIZE;
+    iv->buckets = iv->targets + nt * INV_TARGET_SIZE;
+    iv->entries = iv->buckets + nb * 4;
+    iv->post = iv->entries + ne * INV_ENTRY_SIZE;
+    iv->str = (const char*)(iv->post + np * 4);
+
+    for (uint64_t i = 0; i < nt * 3; i++)
+        if (get_le32(iv->targets + i * 4) >= ns) return -1;
+    for (uint64_t i = 0; i < ne; i++) {
+        const unsigned char *ent = iv->entries + i * INV_ENTRY_SIZE;
+        if (get_le32(ent) >= ns || (uint64_t)get_le32(ent + 8) + get_le32(ent + 12) > np) return -1;
+    }
+    for (uint64_t i = 0; i < np; i++)
+        if (get_le32(iv->post + i * 4) >= nt) return -1;
+    uint64_t used = 0;
+    for (uint64_t b = 0; b < nb; b++) {
+        uint32_t e = get_le32(iv->buckets + b * 4);
+        if (e > ne) return -1;
+        used += e != 0;
+    }
+    if (used != ne) return -1;   /* probing relies on every entry having a bucket and one staying free */
+    iv->blob = blob;
+    iv->size = size;
+    return 0;
+}
+
+static void inv_close(inventory_t *iv) {
+    free(iv->blob);
+    memset(iv, 0, sizeof *iv);
+}
+
+/* ---- building the index from the text file ---- */
+typedef struct { uint32_t key, hash, n, cap; uint32_t *post; } inv_key_t;
+
+typedef struct {
+    grow_t     str;
+    uint32_t  *targets;              /* 3 string offsets per target */
+    size_t     ntargets, tcap;
+    inv_key_t *keys;
+    size_t     nkeys, kcap;
+    uint32_t  *slot;                 /* key number + 1, 0 = empty */
+    size_t     nslot;
+} inv_build_t;
+
+static long inv_intern(inv_build_t *b, const char *s, size_t n) {
+    size_t off = b->str.len;
+    if (off + n + 1 > UINT32_MAX || grow_append(&b->str, s, n) != 0 || grow_append(&b->str, "", 1) != 0)
+        return -1;
+    return (long)off;
+}
+
+/* Key number of "k=v", or -1 if absent and !create (or out of memory). */
+static long inv_build_key(inv_build_t *b, const char *key, size_t klen, int create) {
+    uint32_t h = inv_hash(key, klen);
+    if (b->nslot) {
+        for (size_t s = h & (b->nslot - 1); b->slot[s]; s = (s + 1) & (b->nslot - 1)) {
+            inv_key_t *k = &b->keys[b->slot[s] - 1];
+            const char *ks = b->str.buf + k->key;
+            if (k->hash == h && !strncmp(ks, key, klen) && ks[klen] == 0) return (long)(b->slot[s] - 1);
+        }
+    }
+    if (!create) return -1;
+    if ((b->nkeys + 1) * 2 > b->nslot) {            /* keep the table at most half full */
+        size_t ns = b->nslot ? b->nslot * 2 : 1024;
+        uint32_t *nsl = (uint32_t*)calloc(ns, sizeof *nsl);
+        if (!nsl) return -1;
+        for (size_t i = 0; i < b->nkeys; i++) {
+            size_t s = b->keys[i].hash & (ns - 1);
+            while (nsl[s]) s = (s + 1) & (ns - 1);
+            nsl[s] = (uint32_t)i + 1;
+        }
+        free(b->slot);
+        b->slot = nsl; b->nslot = ns;
+    }
+    if (b->nkeys == b->kcap) {
+        size_t nc = b->kcap ? b->kcap * 2 : 256;
+        inv_key_t *nk = (inv_key_t*)realloc(b->keys, nc * sizeof *nk);
+        if (!nk) return -1;
+        b->keys = nk; b->kcap = nc;
+    }
+    long off = inv_intern(b, key, klen);
+    if (off < 0) return -1;
+    inv_key_t *k = &b->keys[b->nkeys];
+    memset(k, 0, sizeof *k);
+    k->key = (uint32_t)off; k->hash = h;
+    size_t s = h & (b->nslot - 1);
+    while (b->slot[s]) s = (s + 1) & (b->nslot - 1);
+    b->slot[s] = (uint32_t)++b->nkeys;
+    return (long)(b->nkeys - 1);
+}
+
+static int inv_build_add(inv_build_t *b, const char *key, size_t klen, uint32_t target) {
+    long id = inv_build_key(b, key, klen, 1);
+    if (id < 0) return -1;
+    inv_key_t *k = &b->keys[id];
+    if (k->n && k->post[k->n - 1] == target) return 0;   /* tag repeated on one line */
+    if (k->n == k->cap) {
+        uint32_t nc = k->cap ? k->cap * 2 : 4;
+        uint32_t *np = (uint32_t*)realloc(k->post, nc * sizeof *np);
+        if (!np) return -1;
+        k->post = np; k->cap = nc;
+    }
+    k->post[k->n++] = target;
+    return 0;
+}
+
+static void inv_build_free(inv_build_t *b) {
+    for (size_t i = 0; i < b->nkeys; i++) free(b->keys[i].post);
+    free(b->keys); free(b->slot); free(b->targets); free(b->str.buf);
+}
+
+/* Name, tag keys and values may not contain what the selector syntax uses. */
+static int inv_word_ok(const char *s, size_t n) {
+    return n && !memchr(s, ',', n) && !memchr(s, '|', n) && !memchr(s, '=', n) && !(n == 1 && *s == '*');
+}
+
+/* Parse one "name target [key=value ...]" line into b: 0 if added, 1 if
+ * rejected (and reported), -1 on failure. */
+static int inv_parse_line(inv_build_t *b, char *p, const char *path, long lineno) {
+    char *tok[2 + INV_MAX_TAGS];
+    int nt = 0;
+    for (char *s = p; *s; ) {
+        while (*s == ' ' || *s == '\t') s++;
+        if (!*s || *s == '#') break;   /* trailing comment */
+        if (nt == (int)(sizeof tok / sizeof *tok)) {
+            fprintf(stderr, "%s:%ld: more than %d tags\n", path, lineno, INV_MAX_TAGS);
+            return 1;
+        }
+        tok[nt++] = s;
+        while (*s && *s != ' ' && *s != '\t') s++;
+        if (*s) *s++ = 0;
+    }
+    fan_target_t probe;
+    if (nt < 2) {
+        fprintf(stderr, "%s:%ld: expected '<name> <target> [key=value ...]'\n", path, lineno);
+        return 1;
+    }
+    if (!inv_word_ok(tok[0], strlen(tok[0]))) {
+        fprintf(stderr, "%s:%ld: bad name '%s'\n", path, lineno, tok[0]);
+        return 1;
+    }
+    if (fan_parse_target(&probe, tok[1]) != 0) {
+        fprintf(stderr, "%s:%ld: bad target '%s'\n", path, lineno, tok[1]);
+        return 1;
+    }
+    for (int i = 2; i < nt; i++) {
+        const char *eq = strchr(tok[i], '=');
+        if (!eq || !inv_word_ok(tok[i], (size_t)(eq - tok[i])) || !inv_word_ok(eq + 1, strlen(eq + 1)) ||
+            (eq - tok[i] == 4 && !strncmp(tok[i], "name", 4))) {
+            fprintf(stderr, "%s:%ld: bad tag '%s' (key=value; 'name' is reserved)\n", path, lineno, tok[i]);
+            return 1;
+        }
+    }
+    char kv[300];
+    int kl = snprintf(kv, sizeof kv, "name=%s", tok[0]);
+    if (kl >= (int)sizeof kv) {
+        fprintf(stderr, "%s:%ld: name too long\n", path, lineno);
+        return 1;
+    }
+    if (inv_build_key(b, kv, (size_t)kl, 0) >= 0) {
+        fprintf(stderr, "%s:%ld: duplicate name '%s'\n", path, lineno, tok[0]);
+        return 1;
+    }
+
+    if (b->ntargets == UINT32_MAX) return -1;
+    uint32_t id = (uint32_t)b->ntargets;
+    if (b->ntargets == b->tcap) {
+        size_t nc = b->tcap ? b->tcap * 2 : 1024;
+        uint32_t *nv = (uint32_t*)realloc(b->targets, nc * 3 * sizeof *nv);
+        if (!nv) return -1;
+        b->targets = nv; b->tcap = nc;
+    }
+    long name = inv_intern(b, tok[0], strlen(tok[0]));
+    long spec = inv_intern(b, tok[1], strlen(tok[1]));
+    long tags = 0;   /* offset 0 is the empty string */
+    if (nt > 2) {
+        tags = (long)b->str.len;
+        for (int i = 2; i < nt; i++)
+            if (grow_append(&b->str, tok[i], strlen(tok[i])) != 0 ||
+                grow_append(&b->str, i + 1 < nt ? " " : "", 1) != 0) return -1;
+        if (b->str.len > UINT32_MAX) return -1;
+    }
+    if (name < 0 || spec < 0) return -1;
+    b->targets[id * 3] = (uint32_t)name;
+    b->targets[id * 3 + 1] = (uint32_t)spec;
+    b->targets[id * 3 + 2] = (uint32_t)tags;
+    b->ntargets++;
+
+    if (inv_build_add(b, kv, (size_t)kl, id) != 0) return -1;
+    for (int i = 2; i < nt; i++)
+        if (inv_build_add(b, tok[i], strlen(tok[i]), id) != 0) return -1;
+    return 0;
+}
+
+/* Lay the built tables out as an index blob and attach it to iv. */
+static int inv_build_finish(inv_build_t *b, uint64_t src_size, uint64_t src_mtime, inventory_t *iv) {
+    uint64_t nb = INV_MIN_BUCKETS, np = 0;
+    while (nb < (uint64_t)b->nkeys * 2) nb *= 2;
+    for (size_t i = 0; i < b->nkeys; i++) np += b->keys[i].n;
+    uint64_t size = INV_HDR_SIZE + (uint64_t)b->ntargets * INV_TARGET_SIZE + nb * 4 +
+                    (uint64_t)b->nkeys * INV_ENTRY_SIZE + np * 4 + b->str.len;
+    if (nb > UINT32_MAX || np > UINT32_MAX || size > SIZE_MAX) {
+        fprintf(stderr, "inventory: too large\n");
+        return -1;
+    }
+    unsigned char *blob = (unsigned char*)calloc(1, (size_t)size);
+    if (!blob) { perror("malloc"); return -1; }
+    memcpy(blob, INV_IDX_MAGIC, 4);
+    put_le32(blob + 4, INV_IDX_VERSION);
+    put_le32(blob + 8, (uint32_t)src_size);   put_le32(blob + 12, (uint32_t)(src_size >> 32));
+    put_le32(blob + 16, (uint32_t)src_mtime); put_le32(blob + 20, (uint32_t)(src_mtime >> 32));
+    put_le32(blob + 24, (uint32_t)b->ntargets);
+    put_le32(blob + 28, (uint32_t)nb);
+    put_le32(blob + 32, (uint32_t)b->nkeys);
+    put_le32(blob + 36, (uint32_t)np);
+    put_le32(blob + 40, (uint32_t)b->str.len);
+    put_le32(blob + 44, 0);
+
+    unsigned char *p = blob + INV_HDR_SIZE;
+    for (size_t i = 0; i < b->ntargets * 3; i++, p += 4) put_le32(p, b->targets[i]);
+    unsigned char *buckets = p;
+    p += nb * 4;
+    uint32_t first = 0;
+    unsigned char *post = p + (size_t)b->nkeys * INV_ENTRY_SIZE;
+    for (size_t i = 0; i < b->nkeys; i++, p += INV_ENTRY_SIZE) {
+        const inv_key_t *k = &b->keys[i];
+        put_le32(p, k->key); put_le32(p + 4, k->hash);
+        put_le32(p + 8, first); put_le32(p + 12, k->n);
+        for (uint32_t j = 0; j < k->n; j++) put_le32(post + ((size_t)first + j) * 4, k->post[j]);
+        first += k->n;
+        size_t s = k->hash & (nb - 1);
+        while (get_le32(buckets + s * 4)) s = (s + 1) & (nb - 1);
+        put_le32(buckets + s * 4, (uint32_t)i + 1);
+    }
+    memcpy(post + np * 4, b->str.buf, b->str.len);
+    uint64_t h = xxh64(blob + INV_HDR_SIZE, (size_t)size - INV_HDR_SIZE);
+    put_le32(blob + 48, (uint32_t)h); put_le32(blob + 52, (uint32_t)(h >> 32));
+    if (inv_attach(iv, blob, (size_t)size) != 0) {
+        fprintf(stderr, "inventory: internal error laying out the index\n");
+        free(blob);
+        return -1;
+    }
+    return 0;
+}
+
+/* *rejected counts the lines that were reported and skipped. */
+static int inv_parse(FILE *fp, const char *path, uint64_t size, uint64_t mtime, inventory_t *iv,
+                     long *rejected) {
+    inv_build_t b;
+    memset(&b, 0, sizeof b);
+    int rc = inv_intern(&b, "", 0) == 0 ? 0 : -1;   /* offset 0: the empty string */
+    char *line = NULL; size_t lcap = 0;
+    long lineno = 0;
+    *rejected = 0;
+    while (rc == 0 && read_line(fp, &line, &lcap) >= 0) {
+        lineno++;
+        char *p = trim(line);
+        if (*p == 0 || *p == '#') continue;
+        rc = inv_parse_line(&b, p, path, lineno);
+        if (rc == 1) { (*rejected)++; rc = 0; }
+    }
+    free(line);
+    if (rc != 0) perror("inventory");
+    else rc = inv_build_finish(&b, size, mtime, iv);
+    inv_build_free(&b);
+    return rc;
+}
+
+/* ---- the cached index ---- */
+static int inv_stamp(const char *path, uint64_t *size, uint64_t *mtime_ns) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path, &st) != 0) return -1;
+    *mtime_ns = (uint64_t)st.st_mtime * 1000000000ull;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return -1;
+    *mtime_ns = stat_mtime_ns(&st);
+#endif
+    *size = (uint64_t)st.st_size;
+    return 0;
+}
+
+/* Read idx whole; 0 only if it indexes the inventory as it is now. */
+static int inv_load_index(const char *idx, uint64_t size, uint64_t mtime, inventory_t *iv) {
+    uint64_t isz, imt;
+    if (inv_stamp(idx, &isz, &imt) != 0 || isz < INV_HDR_SIZE || isz > SIZE_MAX) return -1;
+    FILE *f = fopen(idx, "rb");
+    if (!f) return -1;
+    unsigned char *blob = (unsigned char*)malloc((size_t)isz);
+    int ok = blob && fread(blob, 1, (size_t)isz, f) == (size_t)isz &&
+             get_le64(blob + 8) == size && get_le64(blob + 16) == mtime &&
+             !memcmp(blob, INV_IDX_MAGIC, 4) && get_le32(blob + 4) == INV_IDX_VERSION &&
+             get_le64(blob + 48) == xxh64(blob + INV_HDR_SIZE, (size_t)isz - INV_HDR_SIZE) &&
+             inv_attach(iv, blob, (size_t)isz) == 0;
+    fclose(f);
+    if (!ok) { free(blob); return -1; }
+    return 0;
+}
+
+static void inv_save_index(const char *idx, const inventory_t *iv) {
+    char tmp[1100];
+    snprintf(tmp, sizeof tmp, "%s.tmp", idx);
+    FILE *f = fopen(tmp, "wb");
+    int ok = f && fwrite(iv->blob, 1, iv->size, f) == iv->size;
+    if (f && fclose(f) != 0) ok = 0;
+#ifdef _WIN32
+    if (ok) remove(idx);   /* rename does not replace on Windows */
+#endif
+    if (!ok || rename(tmp, idx) != 0) {
+        /* a read-only directory only costs a re-parse next time */
+        if (g_verbose) fprintf(stderr, "[inventory] cannot write %s: %s\n", idx, strerror(errno));
+        remove(tmp);
+    }
+}
+
+/* inventory= from the config, else "inventory" next to the config file. */
+static void inv_path(const cfg_t *cfg, char *out, size_t outsz) {
+    if (cfg->inventory[0]) { snprintf(out, outsz, "%s", cfg->inventory); return; }
+    const char *slash = strrchr(cfg->cfg_path, PATH_SEP);
+#ifdef _WIN32
+    const char *fwd = strrchr(cfg->cfg_path, '/');
+    if (fwd && (!slash || fwd > slash)) slash = fwd;
+#endif
+    int dl = slash ? (int)(slash - cfg->cfg_path + 1) : 0;
+    snprintf(out, outsz, "%.*sinventory", dl, cfg->cfg_path);
+}
+
+static int inv_open(const cfg_t *cfg, inventory_t *iv) {
+    char path[1024], idx[1040];
+    uint64_t size, mtime, t0 = mono_ns();
+    memset(iv, 0, sizeof *iv);
+    inv_path(cfg, path, sizeof path);
+    if (inv_stamp(path, &size, &mtime) != 0) {
+        fprintf(stderr, "inventory: %s: %s (set inventory=<file> in the config)\n", path, strerror(errno));
+        return -1;
+    }
+    snprintf(idx, sizeof idx, "%s.vcidx", path);
+    if (inv_load_index(idx, size, mtime, iv) == 0) {
+        iv->cached = 1;
+    } else {
+        FILE *fp = fopen(path, "r");
+        if (!fp) { perror(path); return -1; }
+        long rejected;
+        int rc = inv_parse(fp, path, size, mtime, iv, &rejected);
+        fclose(fp);
+        if (rc != 0) return -1;
+        if (!rejected) inv_save_index(idx, iv);
+        else fprintf(stderr, "inventory: %s: %ld bad line%s skipped; not caching the index until fixed\n",
+                     path, rejected, rejected == 1 ? "" : "s");
+    }
+    if (g_verbose)
+        fprintf(stderr, "[inventory] %u targets from %s (%s) in %.2f ms\n", iv->ntargets,
+                iv->cached ? idx : path, iv->cached ? "cached index" : "parsed",
+                (double)(mono_ns() - t0) / 1e6);
+    return 0;
+}
+
+/* ---- selectors ---- */
+static uint32_t *inv_decode(const unsigned char *post, uint32_t n) {
+    uint32_t *v = (uint32_t*)malloc((n ? n : 1) * sizeof *v);
+    for (uint32_t i = 0; v && i < n; i++) v[i] = get_le32(post + (size_t)i * 4);
+    return v;
+}
+
+/* Union of two sorted lists into a fresh one; frees a. */
+static uint32_t *inv_union(uint32_t *a, uint32_t *na, const uint32_t *b, uint32_t nb) {
+    uint32_t *v = (uint32_t*)malloc(((size_t)*na + nb + 1) * sizeof *v);
+    if (!v) { free(a); return NULL; }
+    uint32_t i = 0, j = 0, n = 0;
+    while (i < *na || j < nb) {
+        if (j == nb || (i < *na && a[i] < b[j])) v[n++] = a[i++];
+        else if (i == *na || b[j] < a[i])        v[n++] = b[j++];
+        else { v[n++] = a[i++]; j++; }
+    }
+    free(a);
+    *na = n;
+    return v;
+}
+
+/* First position >= lo in a[0..n) holding a value >= x (galloping). */
+static uint32_t inv_seek(const uint32_t *a, uint32_t lo, uint32_t n, uint32_t x) {
+    uint32_t hi = lo, step = 1;
+    while (hi < n && a[hi] < x) { lo = hi + 1; hi = step >= n - hi ? n : hi + step; step *= 2; }
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (a[mid] < x) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+typedef struct { uint32_t *v; uint32_t n; } inv_set_t;
+
+static int inv_set_cmp(const void *a, const void *b) {
+    uint32_t x = ((const inv_set_t*)a)->n, y = ((const inv_set_t*)b)->n;
+    return x < y ? -1 : x > y;
+}
+
+/* Targets matching one term: "key=v1|v2" or "name1|name2". */
+static int inv_term(const inventory_t *iv, const char *term, size_t tlen, inv_set_t *s) {
+    const char *eq = (const char*)memchr(term, '=', tlen);
+    const char *key = eq ? term : "name";
+    size_t klen = eq ? (size_t)(eq - term) : 4;
+    const char *vals = eq ? eq + 1 : term, *end = term + tlen;
+    char *kv = (char*)malloc(klen + tlen + 2);
+    if (!kv) { perror("malloc"); return -1; }
+    if (!klen || vals == end) goto bad;
+    memcpy(kv, key, klen);
+    kv[klen] = '=';
+    s->v = NULL; s->n = 0;
+    for (const char *v = vals; v <= end; ) {
+        const char *bar = (const char*)memchr(v, '|', (size_t)(end - v));
+        size_t vlen = (size_t)((bar ? bar : end) - v);
+        if (!vlen) goto bad;
+        memcpy(kv + klen + 1, v, vlen);
+        const unsigned char *post = NULL;
+        uint32_t n = inv_lookup(iv, kv, klen + 1 + vlen, &post);
+        if (!s->v) { s->v = inv_decode(post, n); s->n = n; }
+        else if (n) {
+            uint32_t *b = inv_decode(post, n);
+            s->v = b ? inv_union(s->v, &s->n, b, n) : NULL;
+            free(b);
+        }
+        if (!s->v) { perror("malloc"); free(kv); return -1; }
+        v += vlen + 1;
+    }
+    free(kv);
+    return 0;
+bad:
+    fprintf(stderr, "selector: bad term '%.*s' (key=value, key=v1|v2 or a name)\n", (int)tlen, term);
+    free(s->v); s->v = NULL;
+    free(kv);
+    return -1;
+}
+
+/* Target numbers matching selector, in inventory order, into *out (malloc'd).
+ * Returns how many, or -1 if the selector is malformed. */
+static long inv_select(const inventory_t *iv, const char *sel, uint32_t **out) {
+    *out = NULL;
+    if (!strcmp(sel, "*")) {
+        uint32_t *v = (uint32_t*)malloc(((size_t)iv->ntargets + 1) * sizeof *v);
+        if (!v) { perror("malloc"); return -1; }
+        for (uint32_t i = 0; i < iv->ntargets; i++) v[i] = i;
+        *out = v;
+        return (long)iv->ntargets;
+    }
+    size_t nterm = 1;
+    for (const char *p = sel; *p; p++) nterm += *p == ',';
+    inv_set_t *set = (inv_set_t*)calloc(nterm, sizeof *set);
+    if (!set) { perror("malloc"); return -1; }
+    long rc = 0;
+    const char *p = sel;
+    for (size_t i = 0; i < nterm; i++) {
+        const char *comma = strchr(p, ',');
+        size_t tlen = comma ? (size_t)(comma - p) : strlen(p);
+        if (!tlen) { fprintf(stderr, "selector: empty term in '%s'\n", sel); rc = -1; break; }
+        if (inv_term(iv, p, tlen, &set[i]) != 0) { rc = -1; break; }
+        p += tlen + 1;
+    }
+    if (rc == 0) {
+        /* intersect, starting from the smallest set */
+        qsort(set, nterm, sizeof *set, inv_set_cmp);
+        uint32_t n = set[0].n;
+        for (size_t i = 1; i < nterm && n; i++) {
+            uint32_t keep = 0, j = 0;
+            for (uint32_t k = 0; k < n; k++) {
+                j = inv_seek(set[i].v, j, set[i].n, set[0].v[k]);
+                if (j == set[i].n) break;
+                if (set[i].v[j] == set[0].v[k]) set[0].v[keep++] = set[0].v[k];
+            }
+            n = keep;
+        }
+        *out = set[0].v;
+        set[0].v = NULL;
+        rc = (long)n;
+    }
+    for (size_t i = 0; i < nterm; i++) free(set[i].v);
+    free(set);
+    return rc;
+}
+
+/* Targets for fan-out and the exporter: -t picks them from the inventory,
+ * labelled by name; -T @file lists them in a hosts file. */
+static fan_target_t *load_targets(const cfg_t *cfg, const char *hostsfile, const char *selector,
+                                  size_t *count) {
+    *count = 0;
+    if (!selector) {
+        fan_target_t *t = fan_load(hostsfile, count);
+        if (t && *count == 0) { fprintf(stderr, "%s: no targets\n", hostsfile); free(t); t = NULL; }
+        return t;
+    }
+    inventory_t iv;
+    if (inv_open(cfg, &iv) != 0) return NULL;
+    uint32_t *sel = NULL;
+    long n = inv_select(&iv, selector, &sel);
+    fan_target_t *t = NULL;
+    if (n == 0) fprintf(stderr, "inventory: no targets match '%s'\n", selector);
+    if (n > 0 && !(t = (fan_target_t*)calloc((size_t)n, sizeof *t))) perror("malloc");
+    for (long i = 0; t && i < n; i++) {
+        fan_parse_target(&t[i], inv_spec(&iv, sel[i]));   /* checked when parsed */
+        snprintf(t[i].label, sizeof t[i].label, "%s", inv_name(&iv, sel[i]));
+    }
+    if (t) *count = (size_t)n;
+    free(sel);
+    inv_close(&iv);
+    return t;
+}
+
+/* vim-cmd inventory [selector]: list the targets a selector picks. */
+static int run_inventory(const cfg_t *cfg, const char *selector) {
+    inventory_t iv;
+    if (inv_open(cfg, &iv) != 0) return -1;
+    uint64_t t0 = mono_ns();
+    uint32_t *sel = NULL;
+    long n = inv_select(&iv, selector ? selector : "*", &sel);
+    double ms = (double)(mono_ns() - t0) / 1e6;
+    for (long i = 0; i < n; i++) {
+        const char *tags = inv_tags(&iv, sel[i]);
+        printf("%-16s %-24s%s%s\n", inv_name(&iv, sel[i]), inv_spec(&iv, sel[i]), *tags ? " " : "", tags);
+    }
+    fflush(stdout);
+    if (n >= 0)
+        fprintf(stderr, "[inventory] %ld of %u targets selected in %.3f ms\n", n, iv.ntargets, ms);
+    free(sel);
+    inv_close(&iv);
+    return n < 0 ? -1 : 0;
+}
+
+// ----- agent -----
+/*
+ * The agent (`vim-cmd --agent`) keeps warm connections to hostd targets and
+ * serves one-shot invocations over a local UNIX socket, so a call costs one
+ * local connect instead of resolve + TCP connect + hostd accept.
+ *
+ * Client protocol: the first line names the target in hosts-file syntax,
+ * `@target host:port` or `@target unix:/path`; every following line is a
+ * command, answered with a normal framed reply. Agent-side failures come
+ * back as `.err <message>` trailers. `@stop` shuts the agent down.
+ *
+ * Each target gets a pool of up to AGENT_POOL_SIZE upstream connections.
+ * A client is pinned to one upstream for its lifetime so its replies stay
+ * in order; requests from different clients are pipelined on the same
+ * upstream, up to AGENT_PIPELINE in flight (1 if hostd replies unframed).
+ */
+#ifndef _WIN32
+#define AGENT_MAX_CLIENTS  256
+#define AGENT_MAX_TARGETS  64
+#define AGENT_POOL_SIZE    8
+#define AGENT_PIPELINE     16
+#define AGENT_TX_HIGH      (1024 * 1024)   /* pause upstream reads above this */
+#define AGENT_LINE_MAX     (64 * 1024)
+
+typedef struct {
+    char  *p;
+    size_t off, len, cap;    /* pending bytes are p[off .. len) */
+} buf_t;
+
+static int buf_append(buf_t *b, const void *data, size_t n) {
+    if (b->off && b->off == b->len) b->off = b->len = 0;
+    if (b->len + n > b->cap) {
+        if (b->off) {
+            memmove(b->p, b->p + b->off, b->len - b->off);
+            b->len -= b->off; b->off = 0;
+        }
+        size_t ncap = b->cap ? b->cap : 4096;
+        while (ncap < b->len + n) ncap *= 2;
+        if (ncap != b->cap) {
+            char *np = (char*)realloc(b->p, ncap);
+            if (!np) return -1;
+            b->p = np; b->cap = ncap;
+        }
+    }
+    memcpy(b->p + b->len, data, n);
+    b->len += n;
+    return 0;
+}
+
+static size_t buf_pending(const buf_t *b) { return b->len - b->off; }
+
+static void buf_free(buf_t *b) { free(b->p); memset(b, 0, sizeof(*b)); }
+
+struct agent_up;
+
+typedef struct agent_client {
+    int              fd;
+    int              target;      /* -1 until "@target" received */
+    struct agent_up *up;          /* pinned upstream */
+    int              closing;     /* close once tx drains */
+    buf_t            rx, tx;
+} agent_client_t;
+
+typedef struct agent_req {
+    agent_client_t   *cl;         /* NULL if the client went away */
+    char             *cmd;        /* command line incl. '\n' */
+    size_t            len;
+    struct agent_req *next;
+} agent_req_t;
+
+typedef struct agent_up {
+    int          target;
+    conn_t       conn;
+    agent_req_t *head, *tail;     /* FIFO: sent ones first, then queued */
+    agent_req_t *unsent;          /* first request not yet written */
+    int          inflight;
+    int          legacy;          /* hostd replied unframed: no pipelining */
+    int          connecting;      /* non-blocking connect still in progress */
+    const struct addrinfo *ai;    /* next address to try if it fails */
+    uint64_t     deadline;        /* connect deadline, 0 = none */
+    size_t       tx_off;          /* progress writing unsent->cmd */
+    resp_t       r;
+    uint64_t     last_rx;
+} agent_up_t;
+
+typedef struct {
+    char         spec[300];
+    fan_target_t t;               /* parsed host/port or socket path; t.res
+                                     caches the addresses once resolved */
+} agent_target_t;
+
+static volatile sig_atomic_t g_agent_stop = 0;
+
+static void agent_on_signal(int sig) { (void)sig; g_agent_stop = 1; }
+
+static int agent_socket_path(char *out, size_t outsz) {
+    const char *rt = getenv("XDG_RUNTIME_DIR");
+    if (rt && *rt) {
+        return snprintf(out, outsz, "%s/vim-cmd-agent.sock", rt) < (int)outsz ? 0 : -1;
+    }
+    char dir[128];
+    snprintf(dir, sizeof dir, "/tmp/vim-cmd-%ld", (long)getuid());
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) return -1;
+    /* anyone can create this name first in /tmp: only use our own 0700 dir */
+    struct stat st;
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & 0777) != 0700) {
+        fprintf(stderr, "[agent] %s is not a private directory of this user; not using it\n", dir);
+        return -1;
+    }
+    return snprintf(out, outsz, "%s/agent.sock", dir) < (int)outsz ? 0 : -1;
+}
+
+/* Client side: connect to a running agent and select the configured target.
+ * Returns a socket ready for commands, or -1 (quietly) if no agent is up. */
+static int agent_connect(const cfg_t *c) {
+    char path[256], spec[300], line[320];
+    if (agent_socket_path(path, sizeof path) != 0) return -1;
+    if (cfg_target_spec(c, spec, sizeof spec) != 0) return -1;
+    int fd = connect_unix_path(path, 1);
+    if (fd < 0) return -1;
+    if (sock_wait(fd, POLLOUT, 100) <= 0 || sock_connect_result(fd) != 0 ||
+        sock_set_nonblock(fd, 0) != 0) {
+        CLOSESOCK(fd);
+        return -1;
+    }
+    int n = snprintf(line, sizeof line, "@target %s\n", spec);
+    if (sock_send_all(fd, line, (size_t)n) != 0) { CLOSESOCK(fd); return -1; }
+    return fd;
+}
+
+static int agent_stop(void) {
+    char path[256];
+    if (agent_socket_path(path, sizeof path) != 0) return -1;
+    int fd = connect_unix_path(path, 0);
+    if (fd < 0) return -1;
+    int rc = sock_send_all(fd, "@stop\n", 6);
+    CLOSESOCK(fd);
+    if (rc == 0) fprintf(stderr, "[agent] stop requested\n");
+    return rc;
+}
+
+typedef struct {
+    const cfg_t    *cfg;
+    agent_target_t  targets[AGENT_MAX_TARGETS];
+    int             ntargets;
+    agent_up_t      ups[AGENT_MAX_TARGETS * AGENT_POOL_SIZE];
+    agent_client_t *clients[AGENT_MAX_CLIENTS];
+} agent_t;
+
+static int agent_reply_err(agent_client_t *cl, const char *msg) {
+    char line[RESP_LINE_MAX];
+    int n = snprintf(line, sizeof line, ".err %s\n", msg);
+    if (n >= (int)sizeof line) { n = (int)sizeof line - 1; line[n-1] = '\n'; }
+    return buf_append(&cl->tx, line, (size_t)n);
+}
+
+/* Re-frame upstream payload for the client at the head of the queue. */
+static int agent_up_sink(void *ctx, const void *data, size_t len) {
+    agent_up_t *u = (agent_up_t*)ctx;
+    agent_client_t *cl = u->head ? u->head->cl : NULL;
+    if (!cl) return 0;
+    char hdr[32];
+    int n = snprintf(hdr, sizeof hdr, "$%zu\n", len);
+    if (buf_append(&cl->tx, hdr, (size_t)n) != 0 || buf_append(&cl->tx, data, len) != 0)
+        return -1;
+    return 0;
+}
+
+static void agent_req_pop(agent_up_t *u) {
+    agent_req_t *q = u->head;
+    u->head = q->next;
+    if (!u->head) u->tail = NULL;
+    if (u->unsent == q) u->unsent = u->head;
+    free(q->cmd);
+    free(q);
+}
+
+/* Drop an upstream connection, failing everything queued on it. */
+static void agent_up_fail(agent_t *a, agent_up_t *u, const char *why) {
+    if (u->conn.fd >= 0) {
+        fprintf(stderr, "[agent] %s: %s\n", a->targets[u->target].spec, why);
+        conn_close(&u->conn);
+    }
+    while (u->head) {
+        if (u->head->cl) agent_reply_err(u->head->cl, why);
+        agent_req_pop(u);
+    }
+    for (int i = 0; i < AGENT_MAX_CLIENTS; i++)
+        if (a->clients[i] && a->clients[i]->up == u) a->clients[i]->up = NULL;
+    u->unsent = NULL;
+    u->inflight = 0;
+    u->tx_off = 0;
+    u->legacy = 0;
+    u->connecting = 0;
+    u->ai = NULL;
+}
+
+/* Start a non-blocking connect to the next untried address of u's target. */
+static int agent_up_connect_next(agent_up_t *u) {
+    while (u->ai) {
+        const struct addrinfo *ai = u->ai;
+        u->ai = ai->ai_next;
+        int fd = connect_addr(ai, 1);
+        if (fd >= 0) return conn_open(&u->conn, fd);
+    }
+    return -1;
+}
+
+/* Open an upstream without blocking the loop: the connect completes (or
+ * moves on to the next address) when the socket polls writable, and
+ * requests queue up meanwhile. A target's addresses are resolved on its
+ * first connect and reused after that. */
+static int agent_up_open(agent_t *a, agent_up_t *u, int target) {
+    fan_target_t *t = &a->targets[target].t;
+    u->target = target;
+    u->ai = NULL;
+    if (t->mode == VC_MODE_UNIX) {
+        int fd = connect_unix_path(t->path, 1);
+        if (fd < 0 || conn_open(&u->conn, fd) != 0) return -1;
+    } else {
+        if (!t->res) {
+            int err = tcp_resolve(t->host, t->port, &t->res);
+            if (err) {
+                fprintf(stderr, "[agent] %s: getaddrinfo: %s\n", a->targets[target].spec, gai_strerror(err));
+                t->res = NULL;
+                return -1;
+            }
+        }
+        u->ai = t->res;
+        if (agent_up_connect_next(u) != 0) return -1;
+    }
+    u->connecting = 1;
+    u->deadline = a->cfg->connect_timeout_ms > 0
+                ? mono_ns() + (uint64_t)a->cfg->connect_timeout_ms * 1000000ull : 0;
+    resp_init(&u->r, agent_up_sink, u);
+    return 0;
+}
+
+/* The socket of a connecting upstream polled writable (or the connect
+ * deadline passed). */
+static void agent_up_connected(agent_t *a, agent_up_t *u, int timed_out) {
+    int e = timed_out ? ETIMEDOUT : sock_connect_result(u->conn.fd);
+    if (e == 0) { u->connecting = 0; return; }
+    if (!timed_out && u->ai) {   /* try the next address, keeping the queue */
+        conn_close(&u->conn);
+        if (agent_up_connect_next(u) == 0) return;
+    }
+    char why[96];
+    snprintf(why, sizeof why, "cannot connect to hostd: %s", strerror(e));
+    agent_up_fail(a, u, why);
+}
+
+static int agent_find_target(agent_t *a, const char *spec) {
+    for (int i = 0; i < a->ntargets; i++)
+        if (!strcmp(a->targets[i].spec, spec)) return i;
+    if (a->ntargets == AGENT_MAX_TARGETS) return -1;
+    agent_target_t *t = &a->targets[a->ntargets];
+    if (fan_parse_target(&t->t, spec) != 0) return -1;
+    snprintf(t->spec, sizeof t->spec, "%s", spec);
+    return a->ntargets++;
+}
+
+/* Pick the least-loaded pooled upstream for target, opening one if all are
+ * busy and the pool has room. */
+static agent_up_t *agent_pick_up(agent_t *a, int target) {
+    agent_up_t *pool = &a->ups[target * AGENT_POOL_SIZE];
+    agent_up_t *best = NULL, *spare = NULL;
+    for (int i = 0; i < AGENT_POOL_SIZE; i++) {
+        agent_up_t *u = &pool[i];
+        if (u->conn.fd < 0) { if (!spare) spare = u; continue; }
+        if (!best || u->inflight < best->inflight) best = u;
+    }
+    if (best && (best->inflight == 0 || !spare)) return best;
+    if (spare && agent_up_open(a, spare, target) == 0) return spare;
+    return best;
+}
+
+static void agent_client_close(agent_t *a, int slot) {
+    agent_client_t *cl = a->clients[slot];
+    for (int i = 0; i < AGENT_MAX_TARGETS * AGENT_POOL_SIZE; i++)
+        for (agent_req_t *q = a->ups[i].head; q; q = q->next)
+            if (q->cl == cl) q->cl = NULL;
+    CLOSESOCK(cl->fd);
+    buf_free(&cl->rx);
+    buf_free(&cl->tx);
+    free(cl);
+    a->clients[slot] = NULL;
+}
+
+static void agent_client_line(agent_t *a, agent_client_t *cl, char *line) {
+    if (cl->target < 0) {
+        if (!strcmp(line, "@stop")) { g_agent_stop = 1; return; }
+        if (strncmp(line, "@target ", 8) != 0) {
+            agent_reply_err(cl, "expected @target");
+            cl->closing = 1;
+            return;
+        }
+        cl->target = agent_find_target(a, trim(line + 8));
+        if (cl->target < 0) { agent_reply_err(cl, "bad or too many targets"); cl->closing = 1; }
+        return;
+    }
+    if (!cl->up) cl->up = agent_pick_up(a, cl->target);
+    if (!cl->up || cl->up->conn.fd < 0) {
+        cl->up = NULL;
+        agent_reply_err(cl, "cannot connect to hostd");
+        return;
+    }
+    agent_req_t *q = (agent_req_t*)calloc(1, sizeof *q);
+    size_t len = strlen(line);
+    if (!q || !(q->cmd = (char*)malloc(len + 1))) { free(q); agent_reply_err(cl, "out of memory"); return; }
+    memcpy(q->cmd, line, len);
+    q->cmd[len] = '\n';
+    q->len = len + 1;
+    q->cl = cl;
+    agent_up_t *u = cl->up;
+    if (u->tail) u->tail->next = q; else u->head = q;
+    u->tail = q;
+    if (!u->unsent) u->unsent = q;
+}
+
+static void agent_client_readable(agent_t *a, int slot) {
+    agent_client_t *cl = a->clients[slot];
+    char tmp[16384];
+    ssize_t n = recv(cl->fd, tmp, sizeof tmp, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0) {
+        /* half-close: keep the client until its replies are delivered */
+        cl->closing = 1;
+        return;
+    }
+    if (buf_append(&cl->rx, tmp, (size_t)n) != 0 || buf_pending(&cl->rx) > AGENT_LINE_MAX) {
+        agent_client_close(a, slot);
+        return;
+    }
+    for (;;) {
+        char *start = cl->rx.p + cl->rx.off;
+        char *nl = (char*)memchr(start, '\n', buf_pending(&cl->rx));
+        if (!nl) break;
+        *nl = 0;
+        cl->rx.off += (size_t)(nl - start) + 1;
+        char *line = trim(start);
+        if (*line) agent_client_line(a, cl, line);
+    }
+}
+
+/* Finish the reply at the head of the queue with the given trailer. */
+static void agent_up_complete(agent_up_t *u, const char *trailer) {
+    if (u->head->cl) {
+        char line[RESP_LINE_MAX + 2];
+        int m = snprintf(line, sizeof line, ".%s\n", trailer);
+        buf_append(&u->head->cl->tx, line, (size_t)m);
+    }
+    agent_req_pop(u);
+    u->inflight--;
+    resp_init(&u->r, agent_up_sink, u);
+}
+
+static void agent_up_readable(agent_t *a, agent_up_t *u) {
+    int n = conn_fill(&u->conn, 0);
+    if (n == IO_TIMEOUT) return;
+    if (n < 0) { agent_up_fail(a, u, "read error"); return; }
+    if (n > 0) u->last_rx = mono_ns();
+    while (u->inflight > 0 && u->conn.rx_off < u->conn.rx_len) {
+        u->conn.rx_off += resp_feed(&u->r, u->conn.rx + u->conn.rx_off,
+                                    u->conn.rx_len - u->conn.rx_off);
+        if (u->r.st == RESP_LEGACY) u->legacy = 1;
+        if (u->r.st == RESP_ERROR) { agent_up_fail(a, u, "malformed response frame"); return; }
+        if (u->r.st == RESP_DONE) agent_up_complete(u, u->r.line);
+    }
+    if (n == 0) {
+        if (u->inflight > 0 && u->r.st == RESP_LEGACY) agent_up_complete(u, "");
+        agent_up_fail(a, u, "server closed connection");
+    }
+}
+
+static void agent_up_writable(agent_t *a, agent_up_t *u) {
+    int window = u->legacy ? 1 : AGENT_PIPELINE;
+    while (u->unsent && u->inflight < window) {
+        agent_req_t *q = u->unsent;
+        long w = sock_send_some(u->conn.fd, q->cmd + u->tx_off, q->len - u->tx_off);
+        if (w < 0) { agent_up_fail(a, u, "write error"); return; }
+        u->tx_off += (size_t)w;
+        if (u->tx_off < q->len) return;
+        u->tx_off = 0;
+        u->unsent = q->next;
+        u->inflight++;
+        u->last_rx = mono_ns();
+    }
+}
+
+static int agent_listen(const char *path) {
+    int probe = connect_unix_path(path, 1);
+    if (probe >= 0) {
+        int live = sock_wait(probe, POLLOUT, 100) > 0 && sock_connect_result(probe) == 0;
+        CLOSESOCK(probe);
+        if (live) { fprintf(stderr, "[agent] already running on %s\n", path); return -1; }
+    }
+    unlink(path);   /* stale socket from a previous agent */
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) { perror("socket(AF_UNIX)"); return -1; }
+    struct sockaddr_un addr; memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "agent socket path too long: %s\n", path);
+        CLOSESOCK(fd);
+        return -1;
+    }
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", path);
+    mode_t old = umask(0077);
+    int rc = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(old);
+    if (rc != 0 || listen(fd, 128) != 0) { perror("bind(agent)"); CLOSESOCK(fd); return -1; }
+    sock_set_nonblock(fd, 1);
+    return fd;
+}
+
+static int run_agent(const cfg_t *cfg, int foreground) {
+    char path[256];
+    if (agent_socket_path(path, sizeof path) != 0) { fprintf(stderr, "[agent] no socket path\n"); return -1; }
+    int lfd = agent_listen(path);
+    if (lfd < 0) return -1;
+
+    agent_t *a = (agent_t*)calloc(1, sizeof *a);
+    if (!a) { perror("malloc"); CLOSESOCK(lfd); unlink(path); return -1; }
+    a->cfg = cfg;
+    for (int i = 0; i < AGENT_MAX_TARGETS * AGENT_POOL_SIZE; i++) a->ups[i].conn.fd = -1;
+
+    if (!foreground) {
+        pid_t pid = fork();
+        if (pid < 0) { perror("fork"); free(a); CLOSESOCK(lfd); unlink(path); return -1; }
+        if (pid > 0) {
+            fprintf(stderr, "[agent] listening on %s (pid %ld)\n", path, (long)pid);
+            _exit(0);
+        }
+        setsid();
+        int nul = open("/dev/null", O_RDWR);
+        if (nul >= 0) { dup2(nul, 0); dup2(nul, 1); dup2(nul, 2); if (nul > 2) close(nul); }
+    } else {
+        fprintf(stderr, "[agent] listening on %s\n", path);
+    }
+    signal(SIGTERM, agent_on_signal);
+    signal(SIGINT, agent_on_signal);
+
+    /* pre-warm the configured target */
+    char spec[300];
+    if (cfg_target_spec(cfg, spec, sizeof spec) == 0) {
+        int t = agent_find_target(a, spec);
+        if (t >= 0) agent_pick_up(a, t);
+    }
+
+    enum { NUP = AGENT_MAX_TARGETS * AGENT_POOL_SIZE, NPFD = 1 + AGENT_MAX_CLIENTS + NUP };
+    struct pollfd pfd[NPFD];
+    int idx[NPFD];     /* pfd[k] is client idx[k] (k < nclient_end) or upstream idx[k] */
+
+    while (!g_agent_stop) {
+        nfds_t n = 0, nclient_end;
+        int timeout = -1;
+        uint64_t now = mono_ns();
+        pfd[n].fd = lfd; pfd[n].events = POLLIN; idx[n++] = -1;
+        for (int i = 0; i < AGENT_MAX_CLIENTS; i++) {
+            agent_client_t *cl = a->clients[i];
+            if (!cl) continue;
+            if (cl->closing && !buf_pending(&cl->tx)) { agent_client_close(a, i); continue; }
+            pfd[n].fd = cl->fd;
+            pfd[n].events = (short)((cl->closing ? 0 : POLLIN) | (buf_pending(&cl->tx) ? POLLOUT : 0));
+            idx[n++] = i;
+        }
+        nclient_end = n;
+        for (int i = 0; i < NUP; i++) {
+            agent_up_t *u = &a->ups[i];
+            if (u->conn.fd < 0) continue;
+            if (u->connecting) {
+                if (u->deadline) {
+                    int ms = u->deadline > now ? (int)((u->deadline - now) / 1000000ull) + 1 : 0;
+                    if (timeout < 0 || ms < timeout) timeout = ms;
+                }
+                pfd[n].fd = u->conn.fd; pfd[n].events = POLLOUT; idx[n++] = i;
+                continue;
+            }
+            int window = u->legacy ? 1 : AGENT_PIPELINE;
+            short ev = 0;
+            if (u->unsent && u->inflight < window) ev |= POLLOUT;
+            /* backpressure: stop reading while the waiting client lags */
+            if (u->inflight > 0 && !(u->head->cl && buf_pending(&u->head->cl->tx) > AGENT_TX_HIGH))
+                ev |= POLLIN;
+            if (u->inflight > 0 && u->r.st == RESP_LEGACY) {
+                uint64_t due = u->last_rx + (uint64_t)LEGACY_IDLE_MS * 1000000ull;
+                int ms = due > now ? (int)((due - now) / 1000000ull) + 1 : 0;
+                if (timeout < 0 || ms < timeout) timeout = ms;
+            }
+            pfd[n].fd = u->conn.fd; pfd[n].events = ev; idx[n++] = i;
+        }
+
+        if (poll(pfd, n, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        now = mono_ns();
+
+        if (pfd[0].revents & POLLIN) {
+            int cfd;
+            while ((cfd = accept(lfd, NULL, NULL)) >= 0) {
+                int slot = -1;
+                for (int i = 0; i < AGENT_MAX_CLIENTS; i++) if (!a->clients[i]) { slot = i; break; }
+                agent_client_t *cl = slot >= 0 ? (agent_client_t*)calloc(1, sizeof *cl) : NULL;
+                if (!cl) { CLOSESOCK(cfd); continue; }
+                sock_set_nonblock(cfd, 1);
+                cl->fd = cfd;
+                cl->target = -1;
+                a->clients[slot] = cl;
+            }
+        }
+        for (nfds_t k = 1; k < nclient_end; k++) {
+            int slot = idx[k];
+            short re = pfd[k].revents;
+            if (re & (POLLIN | POLLHUP | POLLERR)) agent_client_readable(a, slot);
+            agent_client_t *cl = a->clients[slot];
+            if (cl && (re & POLLOUT) && buf_pending(&cl->tx)) {
+                long w = sock_send_some(cl->fd, cl->tx.p + cl->tx.off, buf_pending(&cl->tx));
+                if (w < 0) agent_client_close(a, slot);
+                else cl->tx.off += (size_t)w;
+            }
+        }
+        for (nfds_t k = nclient_end; k < n; k++) {
+            agent_up_t *u = &a->ups[idx[k]];
+            short re = pfd[k].revents;
+            if (u->conn.fd != pfd[k].fd) continue;   /* failed and closed this round */
+            if (u->connecting) {
+                if (re) agent_up_connected(a, u, 0);
+                else if (u->deadline && now >= u->deadline) agent_up_connected(a, u, 1);
+                continue;
+            }
+            if (re & (POLLIN | POLLHUP | POLLERR)) agent_up_readable(a, u);
+            else if (u->inflight > 0 && u->r.st == RESP_LEGACY &&
+                     now - u->last_rx >= (uint64_t)LEGACY_IDLE_MS * 1000000ull)
+                agent_up_complete(u, "");
+        }
+        /* write whatever is queued now rather than waiting a poll cycle */
+        for (int i = 0; i < NUP; i++)
+            if (a->ups[i].conn.fd >= 0 && !a->ups[i].connecting && a->ups[i].unsent)
+                agent_up_writable(a, &a->ups[i]);
+    }
+
+    for (int i = 0; i < AGENT_MAX_CLIENTS; i++) if (a->clients[i]) agent_client_close(a, i);
+    for (int i = 0; i < NUP; i++) agent_up_fail(a, &a->ups[i], "agent stopping");
+    for (int i = 0; i < a->ntargets; i++) if (a->targets[i].t.res) freeaddrinfo(a->targets[i].t.res);
+    CLOSESOCK(lfd);
+    unlink(path);
+    free(a);
+    return 0;
+}
+#endif /* !_WIN32 */
+
+// ----- response cache -----
+/*
+ * Opt-in cache for read-only queries, shared by every vim-cmd process of the
+ * user. A config line "cache.<command>=<ttl>" (e.g. "cache.vm list=5s")
+ * marks a command, and any command starting with it followed by a space,
+ * as cacheable. A one-shot invocation whose reply is still fresh is answered
+ * from the cache without connecting at all; --no-cache bypasses it. Only
+ * successful replies are stored, keyed by target and command line.
+ *
+ * The cache is a fixed-size file next to the config file, mapped shared by
+ * every process: one header page, then CACHE_SLOTS direct-mapped slots of
+ * CACHE_SLOT_SIZE bytes. Each slot is a seqlock: a writer claims it by moving
+ * seq from even to odd with a CAS (skipping the store if another writer holds
+ * it), fills it, and publishes by making seq even again; a reader copies the
+ * slot and retries if seq was odd or changed meanwhile. Nobody ever waits on
+ * a lock. While odd, seq also carries the writer's pid, so a slot left odd
+ * by a process that died mid-write, or held for over CACHE_STALE_MS, is
+ * taken over by the next writer.
+ */
+#ifndef _WIN32
+#define CACHE_MAGIC      0x32686376u          /* "vch2" */
+#define CACHE_SLOTS      256
+#define CACHE_SLOT_SIZE  (16u * 1024)
+#define CACHE_HDR_SIZE   4096u
+#define CACHE_FILE_SIZE  (CACHE_HDR_SIZE + CACHE_SLOTS * CACHE_SLOT_SIZE)
+#define CACHE_RETRIES    8
+#define CACHE_STALE_MS   10000
+
+typedef struct {
+    uint32_t magic, slots, slot_size, pad;
+    uint64_t hits, misses, stores;            /* updated atomically */
+} cache_hdr_t;
+
+typedef struct {
+    uint64_t seq;                             /* odd while being written; pid << 32 */
+    uint32_t klen, len;                       /* key, then payload, follow */
+    uint64_t hash;
+    int64_t  expires_ms;                      /* wall clock */
+    int64_t  claimed_ms;                      /* when the writer took it, 0 = idle */
+} cache_slot_t;
+
+#define CACHE_DATA_MAX  (CACHE_SLOT_SIZE - sizeof(cache_slot_t))
+
+static unsigned char *g_cache;                /* mapping, NULL = not open */
+
+static int64_t wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* TTL for a command line, 0 if it is not cacheable. */
+static int cache_ttl_ms(const cfg_t *cfg, const char *line) {
+    for (int i = 0; i < cfg->ncache; i++) {
+        size_t n = strlen(cfg->cache[i].cmd);
+        if (!strncasecmp(line, cfg->cache[i].cmd, n) && (!line[n] || line[n] == ' '))
+            return cfg->cache[i].ttl_ms;
+    }
+    return 0;
+}
+
+static void cache_path(const cfg_t *cfg, char *out, size_t outsz) {
+    char dir[512];
+    if (cfg->cfg_path[0]) snprintf(dir, sizeof dir, "%s", cfg->cfg_path);
+    else default_cfg_path(dir, sizeof dir);
+    char *p = strrchr(dir, PATH_SEP);
+    if (p) *p = 0; else snprintf(dir, sizeof dir, ".");
+    snprintf(out, outsz, "%s%ccache", dir, PATH_SEP);
+}
+
+static int cache_open(const cfg_t *cfg) {
+    if (g_cache) return 0;
+    char path[600];
+    cache_path(cfg, path, sizeof path);
+    if (ensure_parent_dir(path) != 0) return -1;
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) { if (fd >= 0) close(fd); return -1; }
+    if (st.st_size < (off_t)CACHE_FILE_SIZE && ftruncate(fd, (off_t)CACHE_FILE_SIZE) != 0) { close(fd); return -1; }
+    void *m = mmap(NULL, CACHE_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    cache_hdr_t *h = (cache_hdr_t*)m;
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != CACHE_MAGIC) {
+        /* new (zero-filled) or foreign file: a zero slot is an empty slot */
+        if (h->magic) memset((unsigned char*)m + CACHE_HDR_SIZE, 0, CACHE_SLOTS * CACHE_SLOT_SIZE);
+        h->slots = CACHE_SLOTS;
+        h->slot_size = CACHE_SLOT_SIZE;
+        __atomic_store_n(&h->magic, CACHE_MAGIC, __ATOMIC_RELEASE);
+    } else if (h->slots != CACHE_SLOTS || h->slot_size != CACHE_SLOT_SIZE) {
+        munmap(m, CACHE_FILE_SIZE);
+        return -1;
+    }
+    g_cache = (unsigned char*)m;
+    return 0;
+}
+
+static cache_slot_t *cache_slot(uint64_t hash) {
+    return (cache_slot_t*)(g_cache + CACHE_HDR_SIZE + (hash % CACHE_SLOTS) * CACHE_SLOT_SIZE);
+}
+
+static void cache_key(const cfg_t *cfg, const char *line, char *out, size_t outsz) {
+    char spec[300];
+    if (cfg_target_spec(cfg, spec, sizeof spec) != 0) spec[0] = 0;
+    snprintf(out, outsz, "%s\n%s", spec, line);
+}
+
+/* Copy a fresh entry for key into out; returns 1 on a hit. */
+static int cache_get(const char *key, grow_t *out) {
+    cache_hdr_t *h = (cache_hdr_t*)g_cache;
+    size_t klen = strlen(key);
+    uint64_t hash = xxh64((const unsigned char*)key, klen);
+    cache_slot_t *s = cache_slot(hash);
+    unsigned char *data = (unsigned char*)(s + 1);
+    for (int tries = 0; tries < CACHE_RETRIES; tries++) {
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;                 /* being written */
+        uint32_t kl = s->klen, len = s->len;
+        int ok = s->hash == hash && kl == klen && len <= CACHE_DATA_MAX - kl &&
+                 s->expires_ms > wall_ms() && !memcmp(data, key, klen);
+        out->len = 0;
+        if (ok && grow_append(out, data + kl, len) != 0) ok = 0;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq) continue;   /* torn: retry */
+        __atomic_add_fetch(ok ? &h->hits : &h->misses, 1, __ATOMIC_RELAXED);
+        return ok;
+    }
+    __atomic_add_fetch(&h->misses, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Claim s for writing; returns the odd seq now in it, 0 if a live writer
+ * has it. */
+static uint64_t cache_claim(cache_slot_t *s) {
+    uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    uint32_t lo = (uint32_t)seq;
+    if (lo & 1) {
+        pid_t pid = (pid_t)(seq >> 32);
+        int64_t at = __atomic_load_n(&s->claimed_ms, __ATOMIC_RELAXED);
+        int gone = pid > 0 && kill(pid, 0) != 0 && errno == ESRCH;
+        if (!gone && !(at && wall_ms() - at > CACHE_STALE_MS)) return 0;
+        lo += 2;
+    } else {
+        lo += 1;
+    }
+    uint64_t mine = (uint64_t)(uint32_t)getpid() << 32 | lo;
+    if (!__atomic_compare_exchange_n(&s->seq, &seq, mine, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return 0;
+    __atomic_store_n(&s->claimed_ms, wall_ms(), __ATOMIC_RELAXED);
+    return mine;
+}
+
+/* Make a claimed slot readable again, unless it was taken over meanwhile. */
+static void cache_publish(cache_slot_t *s, uint64_t mine) {
+    __atomic_store_n(&s->claimed_ms, 0, __ATOMIC_RELAXED);
+    __atomic_compare_exchange_n(&s->seq, &mine, (uint64_t)((uint32_t)mine + 1), 0,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+static void cache_put(const char *key, const void *data, size_t len, int ttl_ms) {
+    size_t klen = strlen(key);
+    if (klen + len > CACHE_DATA_MAX) return;    /* too big to cache */
+    uint64_t hash = xxh64((const unsigned char*)key, klen);
+    cache_slot_t *s = cache_slot(hash);
+    uint64_t seq = cache_claim(s);
+    if (!seq) return;                           /* another writer has it */
+    s->hash = hash;
+    s->klen = (uint32_t)klen;
+    s->len = (uint32_t)len;
+    s->expires_ms = wall_ms() + ttl_ms;
+    memcpy((unsigned char*)(s + 1), key, klen);
+    memcpy((unsigned char*)(s + 1) + klen, data, len);
+    cache_publish(s, seq);
+    __atomic_add_fetch(&((cache_hdr_t*)g_cache)->stores, 1, __ATOMIC_RELAXED);
+}
+
+/* One-shot fast path: print a fresh cached reply. Returns 1 if it did. */
+static int cache_try_print(const cfg_t *cfg, const char *line) {
+    if (!cache_ttl_ms(cfg, line) || cache_open(cfg) != 0) return 0;
+    char key[1200];
+    grow_t g = { 0 };
+    cache_key(cfg, line, key, sizeof key);
+    int hit = cache_get(key, &g);
+    if (hit) {
+        fwrite(g.buf, 1, g.len, stdout);
+        fflush(stdout);
+        if (g_verbose) fprintf(stderr, "[cache] hit: %s\n", line);
+    }
+    free(g.buf);
+    return hit;
+}
+
+typedef struct { grow_t g; int over; } cache_tee_t;
+
+static int cache_tee_sink(void *ctx, const void *data, size_t len) {
+    cache_tee_t *t = (cache_tee_t*)ctx;
+    if (!t->over && (t->g.len + len > CACHE_DATA_MAX || grow_append(&t->g, data, len) != 0)) t->over = 1;
+    return stdout_sink(stdout, data, len);
+}
+
+/* Run a cacheable command and store a successful reply. */
+static int cache_run(conn_t *c, const cfg_t *cfg, const char *line) {
+    int ttl = cache_ttl_ms(cfg, line);
+    if (!ttl || cache_open(cfg) != 0) return send_command_fd(c, line);
+    cache_tee_t t = { { 0 }, 0 };
+    int rc = send_command_to(c, line, cache_tee_sink, &t);
+    if (rc == 0 && !t.over) {
+        char key[1200];
+        cache_key(cfg, line, key, sizeof key);
+        cache_put(key, t.g.buf ? t.g.buf : "", t.g.len, ttl);
+    }
+    free(t.g.buf);
+    return rc;
+}
+
+/* /cache stats | /cache clear */
+static void cache_command(const cfg_t *cfg, const char *arg) {
+    char path[600];
+    cache_path(cfg, path, sizeof path);
+    if (cache_open(cfg) != 0) { fprintf(stderr, "cache: cannot open %s\n", path); return; }
+    cache_hdr_t *h = (cache_hdr_t*)g_cache;
+    if (!strcasecmp(arg, "clear")) {
+        for (uint64_t i = 0; i < CACHE_SLOTS; i++) {
+            cache_slot_t *s = cache_slot(i);
+            uint64_t seq = cache_claim(s);
+            if (seq) {
+                s->expires_ms = 0;
+                cache_publish(s, seq);
+            }
+        }
+        fprintf(stderr, "cache cleared\n");
+        return;
+    }
+    if (*arg && strcasecmp(arg, "stats")) { fprintf(stderr, "usage: /cache [stats|clear]\n"); return; }
+    int live = 0;
+    int64_t now = wall_ms();
+    for (uint64_t i = 0; i < CACHE_SLOTS; i++) if (cache_slot(i)->expires_ms > now) live++;
+    uint64_t hits = __atomic_load_n(&h->hits, __ATOMIC_RELAXED);
+    uint64_t misses = __atomic_load_n(&h->misses, __ATOMIC_RELAXED);
+    fprintf(stderr, "cache: %s (%u slots x %u KiB)\n", path, CACHE_SLOTS, CACHE_SLOT_SIZE / 1024);
+    fprintf(stderr, "  %d live entries, %llu hits, %llu misses (%.1f%% hit), %llu stores\n", live,
+            (unsigned long long)hits, (unsigned long long)misses,
+            hits + misses ? 100.0 * (double)hits / (double)(hits + misses) : 0.0,
+            (unsigned long long)__atomic_load_n(&h->stores, __ATOMIC_RELAXED));
+    if (!cfg->ncache) fprintf(stderr, "  no cacheable commands (add cache.<command>=<ttl> to the config)\n");
+    for (int i = 0; i < cfg->ncache; i++)
+        fprintf(stderr, "  cache.%s=%dms\n", cfg->cache[i].cmd, cfg->cache[i].ttl_ms);
+}
+#else
+static int cache_try_print(const cfg_t *cfg, const char *line) { (void)cfg; (void)line; return 0; }
+static int cache_run(conn_t *c, const cfg_t *cfg, const char *line) { (void)cfg; return send_command_fd(c, line); }
+static void cache_command(const cfg_t *cfg, const char *arg) {
+    (void)cfg; (void)arg;
+    fprintf(stderr, "the response cache is not supported on Windows yet\n");
+}
+#endif
+
+// ----- exporter -----
+/*
+ * vim-cmd [-T @hostsfile] exporter --listen [host]:port [--interval 15s]
+ *
+ * Polls the queries configured as "export.<name>=<command>" against each
+ * target (the configured hostd, or every line of the hosts file) on a fixed
+ * schedule over one persistent connection per target, and serves the
+ * latest results over HTTP in the Prometheus text format. Scrapes only read
+ * the in-memory snapshot; hostd I/O and HTTP clients share one poll() loop
+ * and every socket is non-blocking, so a slow or dead hostd never holds up
+ * /metrics.
+ *
+ * Replies are turned into samples line by line: every "key=<number>"
+ * becomes vimcmd_<name>_<key>, labelled with the target, the line's first
+ * word (item="...") when it is not itself a key=value pair, and the line's
+ * non-numeric key=value pairs. The reply trailer is read the same way.
+ * vimcmd_up and vimcmd_last_success_timestamp_seconds report each query's
+ * health; the exporter's own request latency (the /stats histograms) is
+ * exported as a summary per verb. Reply keys that would clash with the
+ * exporter's labels are exported as exported_target / exported_item, a
+ * repeated key keeps its first value, and a repeated series its first
+ * sample. A query that fails exports only its health until it succeeds.
+ *
+ * Host names are looked up on a helper thread (resolve_job_start) and the
+ * addresses are kept until a connect to all of them fails.
+ */
+#ifndef _WIN32
+#define EXP_MAX_CLIENTS     64
+#define EXP_REQ_MAX         4096
+#define EXP_CLIENT_TIMEOUT  (10ull * 1000000000ull)
+#define EXP_RESOLVE_POLL_NS (20ull * 1000000ull)
+
+typedef struct {
+    char    *samples;        /* rendered sample lines from the last good reply */
+    int      up;             /* last poll succeeded */
+    uint64_t last_ok_ms;     /* wall clock, 0 = never */
+} exp_series_t;
+
+typedef struct {
+    fan_target_t  t;         /* connection and reply state, as in fan-out */
+    exp_series_t *series;    /* one per query */
+    int           q;         /* query in flight */
+    uint64_t      q_t0;
+    uint64_t      next_round;
+    int           in_round;
+    resolve_job_t *rj;       /* host name lookup in progress */
+} exp_target_t;
+
+typedef struct {
+    int      fd;
+    char     req[EXP_REQ_MAX];
+    size_t   req_len;
+    buf_t    tx;             /* response; close once written */
+    uint64_t t0;
+} exp_client_t;
+
+typedef struct {
+    const cfg_t   *cfg;
+    exp_target_t  *targets;
+    size_t         ntargets;
+    char         **cmds;     /* "command\n" per query */
+    uint64_t       interval_ns;
+    exp_client_t  *clients[EXP_MAX_CLIENTS];
+    uint64_t       scrapes;
+} exporter_t;
+
+static volatile sig_atomic_t g_exp_stop = 0;
+
+static void exp_on_signal(int sig) { (void)sig; g_exp_stop = 1; }
+
+/* Append s to b with Prometheus label-value escaping. */
+static void exp_escape(grow_t *b, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        char c = s[i];
+        if (c == '\\' || c == '"') { grow_append(b, "\\", 1); grow_append(b, &c, 1); }
+        else if (c == '\n') grow_append(b, "\\n", 2);
+        else grow_append(b, &c, 1);
+    }
+}
+
+/* Append a metric-name fragment, mapping anything outside [A-Za-z0-9_] to '_'. */
+static void exp_name(grow_t *b, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        char c = isalnum((unsigned char)s[i]) ? (char)tolower((unsigned char)s[i]) : '_';
+        grow_append(b, &c, 1);
+    }
+}
+
+static int exp_is_number(const char *s, size_t n, double *out) {
+    char tmp[64], *end;
+    if (!n || n >= sizeof tmp) return 0;
+    memcpy(tmp, s, n); tmp[n] = 0;
+    *out = strtod(tmp, &end);
+    return *end == 0 && *out - *out == 0;   /* rejects inf and nan */
+}
+
+/* Render one reply line's key=<number> pairs as samples. */
+static void exp_parse_line(grow_t *out, const char *query, const char *target,
+                           const char *line, size_t len) {
+    enum { MAXTOK = 64 };
+    const char *tok[MAXTOK];
+    size_t tl[MAXTOK], ntok = 0;
+    for (size_t i = 0; i < len && ntok < MAXTOK; ) {
+        while (i < len && isspace((unsigned char)line[i])) i++;
+        if (i == len) break;
+        tok[ntok] = line + i;
+        while (i < len && !isspace((unsigned char)line[i])) i++;
+        tl[ntok] = (size_t)(line + i - tok[ntok]);
+        ntok++;
+    }
+    if (!ntok) return;
+    const char *item = memchr(tok[0], '=', tl[0]) ? NULL : tok[0];
+
+    grow_t labels = { 0 }, name = { 0 };
+    grow_append(&labels, "target=\"", 8);
+    exp_escape(&labels, target, strlen(target));
+    grow_append(&labels, "\"", 1);
+    if (item) {
+        grow_append(&labels, ",item=\"", 7);
+        exp_escape(&labels, item, tl[0]);
+        grow_append(&labels, "\"", 1);
+    }
+    /* keys as they come out of exp_name; a repeated one is skipped */
+    char *seen[MAXTOK] = { 0 };
+    double v;
+    for (size_t k = item ? 1 : 0; k < ntok; k++) {
+        const char *eq = (const char*)memchr(tok[k], '=', tl[k]);
+        if (!eq || eq == tok[k]) continue;
+        size_t kl = (size_t)(eq - tok[k]);
+        name.len = 0;
+        exp_name(&name, tok[k], kl);
+        grow_append(&name, "", 1);
+        int dup = 0;
+        for (size_t j = 0; j < k && !dup; j++) dup = seen[j] && !strcmp(seen[j], name.buf);
+        if (!dup) seen[k] = strdup(name.buf);
+    }
+    for (size_t k = item ? 1 : 0; k < ntok; k++) {
+        const char *eq = (const char*)memchr(tok[k], '=', tl[k]);
+        if (!seen[k]) continue;
+        size_t kl = (size_t)(eq - tok[k]), vl = tl[k] - kl - 1;
+        if (exp_is_number(eq + 1, vl, &v)) continue;
+        grow_append(&labels, ",", 1);
+        if (!strcmp(seen[k], "target") || !strcmp(seen[k], "item")) grow_append(&labels, "exported_", 9);
+        grow_append(&labels, seen[k], strlen(seen[k]));
+        grow_append(&labels, "=\"", 2);
+        exp_escape(&labels, eq + 1, vl);
+        grow_append(&labels, "\"", 1);
+    }
+    for (size_t k = item ? 1 : 0; k < ntok; k++) {
+        const char *eq = (const char*)memchr(tok[k], '=', tl[k]);
+        if (!seen[k]) continue;
+        size_t kl = (size_t)(eq - tok[k]);
+        if (!exp_is_number(eq + 1, tl[k] - kl - 1, &v)) continue;
+        char num[40];
+        int nn = snprintf(num, sizeof num, "} %.17g\n", v);
+        grow_append(out, "vimcmd_", 7);
+        exp_name(out, query, strlen(query));
+        grow_append(out, "_", 1);
+        exp_name(out, tok[k], kl);
+        grow_append(out, "{", 1);
+        grow_append(out, labels.buf, labels.len);
+        grow_append(out, num, (size_t)nn);
+    }
+    for (size_t k = 0; k < ntok; k++) free(seen[k]);
+    free(labels.buf);
+    free(name.buf);
+}
+
+/* A failed query keeps no samples: only vimcmd_up says it is down. */
+static void exp_series_down(exp_series_t *s) {
+    free(s->samples);
+    s->samples = NULL;
+    s->up = 0;
+}
+
+/* The reply for the query in flight finished (ok) or failed. */
+static void exp_query_done(exporter_t *e, exp_target_t *x, int ok) {
+    fan_target_t *t = &x->t;
+    exp_series_t *s = &x->series[x->q];
+    const char *line = e->cmds[x->q];
+    stats_record(stats_verb(line), mono_ns() - x->q_t0, strlen(line), t->r.bytes, !ok);
+    if (ok) {
+        grow_t out = { 0 };
+        const char *name = e->cfg->exports[x->q].name;
+        for (size_t i = 0; i < t->out_len; ) {
+            const char *nl = (const char*)memchr(t->out + i, '\n', t->out_len - i);
+            size_t end = nl ? (size_t)(nl - t->out) : t->out_len;
+            exp_parse_line(&out, name, t->label, t->out + i, end - i);
+            i = end + 1;
+        }
+        if (t->r.st == RESP_DONE) exp_parse_line(&out, name, t->label, t->r.line, strlen(t->r.line));
+        free(s->samples);
+        s->samples = out.buf;
+        s->up = 1;
+        s->last_ok_ms = (uint64_t)wall_ms();
+    } else {
+        exp_series_down(s);
+        if (g_verbose) fprintf(stderr, "[exporter] %s: %s: %s\n", t->label, e->cfg->exports[x->q].name, t->err);
+    }
+    t->out_len = 0;
+}
+
+/* Close the connection; with forget, also drop the resolved addresses so
+ * the next round looks the name up again. */
+static void exp_close(exp_target_t *x, int forget) {
+    fan_target_t *t = &x->t;
+    if (t->conn.fd >= 0) conn_close(&t->conn);
+    if (forget && t->res) { freeaddrinfo(t->res); t->res = NULL; }
+    if (forget && x->rj) { resolve_job_abandon(x->rj); x->rj = NULL; }
+    t->ai = NULL;
+    t->st = FAN_PENDING;
+}
+
+/* End the round early: the query in flight and the rest are down. */
+static void exp_fail_round(exporter_t *e, exp_target_t *x, int forget) {
+    if (g_verbose && x->t.err[0]) fprintf(stderr, "[exporter] %s: %s\n", x->t.label, x->t.err);
+    for (; x->q < (int)e->cfg->nexport; x->q++) exp_series_down(&x->series[x->q]);
+    exp_close(x, forget);
+    x->in_round = 0;
+}
+
+/* Send the next query of the round, reconnecting first if needed. */
+static void exp_next(exporter_t *e, exp_target_t *x, int connect_timeout_ms) {
+    fan_target_t *t = &x->t;
+    if (x->q >= (int)e->cfg->nexport) {
+        x->in_round = 0;
+        t->st = t->conn.fd >= 0 ? FAN_DONE : FAN_PENDING;
+        return;
+    }
+    x->q_t0 = mono_ns();
+    t->out_len = 0;
+    t->err[0] = 0;
+    if (t->conn.fd < 0) {
+        if (t->mode == VC_MODE_TCP && !t->res) {   /* look the name up first, off the loop */
+            char port[16];
+            int err;
+            snprintf(port, sizeof port, "%d", t->port);
+            t->st = FAN_PENDING;
+            if (!x->rj && !(x->rj = resolve_job_start(t->host, port, &err))) {
+                snprintf(t->err, sizeof t->err, "getaddrinfo: %s", gai_strerror(err));
+                exp_fail_round(e, x, 1);
+            }
+            return;
+        }
+        fan_start(t, connect_timeout_ms);
+        if (t->st == FAN_FAILED) exp_fail_round(e, x, 1);
+        return;
+    }
+    resp_init(&t->r, fan_sink, t);
+    t->tx_off = 0;
+    t->st = FAN_SENDING;
+}
+
+static void exp_on_target_event(exporter_t *e, exp_target_t *x, short re, uint64_t now,
+                                int connect_timeout_ms) {
+    fan_target_t *t = &x->t;
+    uint64_t timeout = e->interval_ns;
+    if (t->st == FAN_CONNECTING) {
+        if (re) {
+            int err = sock_connect_result(t->conn.fd);
+            if (err) {
+                conn_close(&t->conn);
+                if (t->mode == VC_MODE_TCP) fan_connect_next(t, err);
+                else fan_fail(t, "connect(unix)", err);
+            } else {
+                stats_note_connect();
+                resp_init(&t->r, fan_sink, t);
+                t->tx_off = 0;
+                t->st = FAN_SENDING;
+            }
+        } else if (t->deadline && now >= t->deadline) {
+            snprintf(t->err, sizeof t->err, "connect: timed out after %d ms", connect_timeout_ms);
+            t->st = FAN_FAILED;
+        }
+        if (t->st == FAN_FAILED) exp_fail_round(e, x, 1);
+        return;
+    }
+    const char *cmd = e->cmds[x->q];
+    size_t cmdlen = strlen(cmd);
+    if (t->st == FAN_SENDING && (re & (POLLOUT | POLLERR | POLLHUP))) {
+        long w = sock_send_some(t->conn.fd, cmd + t->tx_off, cmdlen - t->tx_off);
+        if (w < 0) fan_fail(t, "write", SOCKERR());
+        else if (w > 0 && (t->tx_off += (size_t)w) == cmdlen) { t->st = FAN_READING; t->last_rx = now; }
+    } else if (t->st == FAN_READING) {
+        if (re & (POLLIN | POLLHUP | POLLERR)) {
+            int n = conn_fill(&t->conn, 0);
+            if (n < 0 && n != IO_TIMEOUT) fan_fail(t, "read", SOCKERR());
+            else if (n >= 0) {
+                fan_on_data(t, n);
+                if (n == 0 && t->st == FAN_DONE) conn_close(&t->conn);  /* unframed: closed after reply */
+            }
+        } else if (t->r.st == RESP_LEGACY && now - t->last_rx >= (uint64_t)LEGACY_IDLE_MS * 1000000ull) {
+            t->st = FAN_DONE;
+        }
+    }
+    if ((t->st == FAN_SENDING || t->st == FAN_READING) && now - x->q_t0 >= timeout) {
+        snprintf(t->err, sizeof t->err, "no reply within %llu ms",
+                 (unsigned long long)(timeout / 1000000ull));
+        t->st = FAN_FAILED;
+    }
+    if (t->st == FAN_DONE) {
+        int ok = !resp_error(&t->r);
+        if (!ok) snprintf(t->err, sizeof t->err, "%s", resp_error(&t->r));
+        exp_query_done(e, x, ok);
+        x->q++;
+        exp_next(e, x, connect_timeout_ms);
+    } else if (t->st == FAN_FAILED) {
+        exp_query_done(e, x, 0);
+        x->q++;
+        t->err[0] = 0;   /* already reported */
+        exp_fail_round(e, x, 0);
+    }
+}
+
+/* Poll the lookup of an in-round target that has no connection yet. */
+static void exp_on_resolved(exporter_t *e, exp_target_t *x, uint64_t now, int connect_timeout_ms) {
+    fan_target_t *t = &x->t;
+    int err;
+    if (resolve_job_poll(x->rj, &err, &t->res)) {
+        x->rj = NULL;
+        if (err) {
+            t->res = NULL;
+            snprintf(t->err, sizeof t->err, "getaddrinfo: %s", gai_strerror(err));
+            exp_fail_round(e, x, 1);
+        } else {
+            exp_next(e, x, connect_timeout_ms);
+        }
+    } else if (now - x->q_t0 >= e->interval_ns) {
+        snprintf(t->err, sizeof t->err, "getaddrinfo: no answer within %llu ms",
+                 (unsigned long long)(e->interval_ns / 1000000ull));
+        exp_fail_round(e, x, 1);
+    }
+}
+
+/* Sample lines of all series, grouped by metric name with one TYPE line
+ * each and sorted by series; for a repeated series only the first sample
+ * (in target and query order) is kept. */
+typedef struct { const char *p; size_t ord; } exp_line_t;
+
+static size_t exp_series_len(const char *p) {
+    size_t n = strcspn(p, "{ ");
+    if (p[n] == '{') {   /* label values are escaped, so "} " ends the set */
+        const char *end = strstr(p + n, "} ");
+        n = end ? (size_t)(end - p) + 1 : strcspn(p, "\n");
+    }
+    return n;
+}
+
+static int exp_cmp_line(const void *a, const void *b) {
+    const exp_line_t *x = (const exp_line_t*)a, *y = (const exp_line_t*)b;
+    size_t xl = strcspn(x->p, "{ "), yl = strcspn(y->p, "{ ");
+    int c = strncmp(x->p, y->p, xl < yl ? xl : yl);
+    if (c) return c;
+    if (xl != yl) return xl < yl ? -1 : 1;
+    xl = exp_series_len(x->p); yl = exp_series_len(y->p);
+    c = strncmp(x->p, y->p, xl < yl ? xl : yl);
+    if (c) return c;
+    if (xl != yl) return xl < yl ? -1 : 1;
+    return x->ord < y->ord ? -1 : (x->ord > y->ord);
+}
+
+static void exp_render(exporter_t *e, grow_t *b) {
+    const cfg_t *cfg = e->cfg;
+    char tmp[512];
+    size_t nlines = 0, cap = 0;
+    exp_line_t *lines = NULL;
+    for (size_t i = 0; i < e->ntargets; i++)
+        for (int q = 0; q < cfg->nexport; q++)
+            for (const char *p = e->targets[i].series[q].samples; p && *p; p = strchr(p, '\n') + 1) {
+                if (nlines == cap) {
+                    size_t ncap = cap ? cap * 2 : 256;
+                    exp_line_t *nl = (exp_line_t*)realloc(lines, ncap * sizeof *nl);
+                    if (!nl) break;
+                    lines = nl; cap = ncap;
+                }
+                lines[nlines].p = p;
+                lines[nlines].ord = nlines;
+                nlines++;
+            }
+    if (nlines) qsort(lines, nlines, sizeof *lines, exp_cmp_line);
+    for (size_t i = 0; i < nlines; i++) {
+        const char *p = lines[i].p, *prev = i ? lines[i-1].p : NULL;
+        size_t sl = exp_series_len(p);
+        if (prev && sl == exp_series_len(prev) && !strncmp(p, prev, sl)) continue;
+        size_t nl = strcspn(p, "{ ");
+        if (!prev || nl != strcspn(prev, "{ ") || strncmp(p, prev, nl)) {
+            grow_append(b, "# TYPE ", 7);
+            grow_append(b, p, nl);
+            grow_append(b, " gauge\n", 7);
+        }
+        grow_append(b, p, (size_t)(strchr(p, '\n') - p) + 1);
+    }
+    free(lines);
+
+    grow_t lbl = { 0 };
+    static const char *const health[2] = { "vimcmd_up", "vimcmd_last_success_timestamp_seconds" };
+    for (int h = 0; h < 2; h++) {
+        int n = snprintf(tmp, sizeof tmp, "# HELP %s %s\n# TYPE %s gauge\n", health[h],
+                         h ? "Wall-clock time of the last successful poll."
+                           : "Whether the last poll of the query succeeded.", health[h]);
+        grow_append(b, tmp, (size_t)n);
+        for (size_t i = 0; i < e->ntargets; i++)
+            for (int q = 0; q < cfg->nexport; q++) {
+                const exp_series_t *s = &e->targets[i].series[q];
+                lbl.len = 0;
+                exp_escape(&lbl, e->targets[i].t.label, strlen(e->targets[i].t.label));
+                grow_append(b, health[h], strlen(health[h]));
+                grow_append(b, "{target=\"", 9);
+                grow_append(b, lbl.buf, lbl.len);
+                n = snprintf(tmp, sizeof tmp, "\",query=\"%s\"} ", cfg->exports[q].name);
+                grow_append(b, tmp, (size_t)n);
+                if (h) n = snprintf(tmp, sizeof tmp, "%.3f\n", (double)s->last_ok_ms / 1000.0);
+                else n = snprintf(tmp, sizeof tmp, "%d\n", s->up);
+                grow_append(b, tmp, (size_t)n);
+            }
+    }
+    free(lbl.buf);
+
+    /* the exporter's own request latency, from the /stats histograms */
+    static const double qs[3] = { 0.5, 0.99, 0.999 };
+    int n = snprintf(tmp, sizeof tmp,
+                     "# HELP vimcmd_request_duration_seconds Round trip of polled commands by verb.\n"
+                     "# TYPE vimcmd_request_duration_seconds summary\n");
+    grow_append(b, tmp, (size_t)n);
+    for (unsigned i = 0; i <= STATS_VERBS; i++) {
+        const verb_stats_t *v = &g_stats.verbs[i];
+        if (!v->count) continue;
+        for (int k = 0; k < 3; k++) {
+            n = snprintf(tmp, sizeof tmp, "vimcmd_request_duration_seconds{verb=\"%s\",quantile=\"%g\"} %.6f\n",
+                         v->verb, qs[k], (double)stats_percentile(v, qs[k]) / 1e6);
+            grow_append(b, tmp, (size_t)n);
+        }
+        n = snprintf(tmp, sizeof tmp,
+                     "vimcmd_request_duration_seconds_sum{verb=\"%s\"} %.6f\n"
+                     "vimcmd_request_duration_seconds_count{verb=\"%s\"} %llu\n",
+                     v->verb, (double)v->sum_us / 1e6, v->verb, (unsigned long long)v->count);
+        grow_append(b, tmp, (size_t)n);
+    }
+    n = snprintf(tmp, sizeof tmp, "# HELP vimcmd_request_errors_total Failed polled commands by verb.\n"
+                                  "# TYPE vimcmd_request_errors_total counter\n");
+    grow_append(b, tmp, (size_t)n);
+    for (unsigned i = 0; i <= STATS_VERBS; i++) {
+        const verb_stats_t *v = &g_stats.verbs[i];
+        if (!v->count) continue;
+        n = snprintf(tmp, sizeof tmp, "vimcmd_request_errors_total{verb=\"%s\"} %llu\n",
+                     v->verb, (unsigned long long)v->errors);
+        grow_append(b, tmp, (size_t)n);
+    }
+    n = snprintf(tmp, sizeof tmp,
+                 "# TYPE vimcmd_bytes_sent_total counter\nvimcmd_bytes_sent_total %llu\n"
+                 "# TYPE vimcmd_bytes_received_total counter\nvimcmd_bytes_received_total %llu\n"
+                 "# TYPE vimcmd_connects_total counter\nvimcmd_connects_total %llu\n"
+                 "# TYPE vimcmd_scrapes_total counter\nvimcmd_scrapes_total %llu\n",
+                 (unsigned long long)g_stats.bytes_sent, (unsigned long long)g_stats.bytes_recv,
+                 (unsigned long long)g_stats.connects, (unsigned long long)e->scrapes);
+    grow_append(b, tmp, (size_t)n);
+}
+
+static void exp_client_close(exporter_t *e, int slot) {
+    exp_client_t *cl = e->clients[slot];
+    CLOSESOCK(cl->fd);
+    buf_free(&cl->tx);
+    free(cl);
+    e->clients[slot] = NULL;
+}
+
+/* Answer a complete request head. Only GET/HEAD /metrics is served. */
+static void exp_client_request(exporter_t *e, exp_client_t *cl) {
+    char method[8] = "", path[256] = "";
+    sscanf(cl->req, "%7s %255s", method, path);
+    int head = !strcmp(method, "HEAD");
+    const char *status = "200 OK", *ctype = "text/plain; version=0.0.4; charset=utf-8";
+    grow_t body = { 0 };
+    if (strcmp(method, "GET") && !head) {
+        status = "405 Method Not Allowed"; ctype = "text/plain";
+        grow_append(&body, "GET /metrics\n", 13);
+    } else if (strcmp(path, "/metrics") && strncmp(path, "/metrics?", 9)) {
+        status = "404 Not Found"; ctype = "text/plain";
+        grow_append(&body, "metrics are at /metrics\n", 24);
+    } else {
+        e->scrapes++;
+        exp_render(e, &body);
     }
-    return fd;
+    char hdr[256];
+    int n = snprintf(hdr, sizeof hdr, "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                     "Connection: close\r\n\r\n", status, ctype, body.len);
+    if (buf_append(&cl->tx, hdr, (size_t)n) != 0 ||
+        (!head && body.len && buf_append(&cl->tx, body.buf, body.len) != 0))
+        cl->tx.off = cl->tx.len;   /* out of memory: just close */
+    free(body.buf);
 }
-#endif
 
-static int connect_tcp_host(const char *host, int port) {
-    char portstr[16]; snprintf(portstr, sizeof portstr, "%d", port);
-    struct addrinfo hints, *res=NULL;
+static int exp_listen(const char *spec) {
+    const char *orig = spec;
+    char host[128] = "";
+    const char *colon = strrchr(spec, ':');
+    if (!colon) { fprintf(stderr, "--listen expects [host]:port\n"); return -1; }
+    size_t hl = (size_t)(colon - spec);
+    if (hl >= 2 && spec[0] == '[' && spec[hl-1] == ']') { spec++; hl -= 2; }
+    if (hl >= sizeof host) { fprintf(stderr, "--listen: host too long\n"); return -1; }
+    memcpy(host, spec, hl); host[hl] = 0;
+
+    struct addrinfo hints, *res = NULL;
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
-
-    int err = getaddrinfo(host, portstr, &hints, &res);
-    if (err) { fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err)); return -1; }
-
-    socket_t fd = (socket_t)-1;
-    for (struct addrinfo *ai=res; ai; ai=ai->ai_next) {
-        fd = (socket_t)socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-        if ((int)fd < 0) continue;
-        if (connect(fd, ai->ai_addr, (int)ai->ai_addrlen) == 0) { freeaddrinfo(res); return (int)fd; }
-        CLOSESOCK(fd); fd = (socket_t)-1;
+    hints.ai_flags = AI_PASSIVE;
+    int err = getaddrinfo(hl ? host : NULL, colon + 1, &hints, &res);
+    if (err) { fprintf(stderr, "--listen: %s\n", gai_strerror(err)); return -1; }
+    int fd = -1, e = 0;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) { e = errno; continue; }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0 || listen(fd, 64) != 0) {
+            e = errno;
+            CLOSESOCK(fd);
+            fd = -1;
+        }
     }
     freeaddrinfo(res);
-#ifdef _WIN32
-    fprintf(stderr, "connect(tcp) failed, WSAErr=%d\n", SOCKERR());
-#else
-    perror("connect(tcp)");
-#endif
-    return -1;
+    if (fd < 0) { fprintf(stderr, "--listen %s: %s\n", orig, strerror(e)); return -1; }
+    sock_set_nonblock(fd, 1);
+    return fd;
 }
 
-static int connect_from_cfg(const cfg_t *c) {
-    if (c->mode == VC_MODE_TCP) {
-        if (!c->host[0] || c->port<=0) { fprintf(stderr, "tcp config incomplete\n"); return -1; }
-        return connect_tcp_host(c->host, c->port);
+static int run_exporter(const cfg_t *cfg, fan_target_t *targets, size_t ntargets, int argc, char **argv) {
+    const char *listen_on = NULL;
+    long interval_ms = 15000;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--listen") && i + 1 < argc) listen_on = argv[++i];
+        else if (!strcmp(argv[i], "--interval") && i + 1 < argc) {
+            interval_ms = parse_duration_ms(argv[++i]);
+            if (interval_ms < 100) { fprintf(stderr, "--interval: at least 100ms\n"); free(targets); return -1; }
+        } else {
+            listen_on = NULL;
+            break;
+        }
     }
-#ifndef _WIN32
-    if (c->mode == VC_MODE_UNIX) {
-        if (!c->socket_path[0]) { fprintf(stderr, "unix socket path missing\n"); return -1; }
-        return connect_unix_path(c->socket_path);
+    if (!listen_on) {
+        fprintf(stderr, "usage: exporter --listen [host]:port [--interval 15s]\n");
+        free(targets);
+        return -1;
     }
-#endif
-    fprintf(stderr, "no valid mode\n");
-    return -1;
-}
+    if (!cfg->nexport)
+        fprintf(stderr, "[exporter] no export.<name>=<command> rules in %s; serving only vim-cmd's own metrics\n",
+                cfg->cfg_path);
 
-// ----- I/O -----
-static int send_command_fd(int fd, const char *line) {
-    size_t len = strlen(line);
-#ifdef _WIN32
-    if (len==0 || line[len-1] != '\n') {
-        if (send(fd, line, (int)len, 0) < 0) return -1;
-        if (send(fd, "\n", 1, 0) < 0) return -1;
+    exporter_t e;
+    memset(&e, 0, sizeof e);
+    e.cfg = cfg;
+    e.interval_ns = (uint64_t)interval_ms * 1000000ull;
+    if (targets) {
+        e.ntargets = ntargets;
+        e.targets = (exp_target_t*)calloc(e.ntargets ? e.ntargets : 1, sizeof *e.targets);
+        for (size_t i = 0; e.targets && i < e.ntargets; i++) e.targets[i].t = targets[i];
+        free(targets);
     } else {
-        if (send(fd, line, (int)len, 0) < 0) return -1;
+        char spec[300];
+        e.ntargets = 1;
+        e.targets = (exp_target_t*)calloc(1, sizeof *e.targets);
+        if (e.targets && (cfg_target_spec(cfg, spec, sizeof spec) != 0 ||
+                          fan_parse_target(&e.targets[0].t, spec) != 0)) {
+            fprintf(stderr, "[exporter] no usable target in the config\n");
+            free(e.targets);
+            return -1;
+        }
     }
-#else
-    if (len==0 || line[len-1] != '\n') {
-        if (write(fd, line, len) < 0) return -1;
-        if (write(fd, "\n", 1) < 0) return -1;
-    } else {
-        if (write(fd, line, len) < 0) return -1;
+    e.cmds = (char**)calloc((size_t)cfg->nexport + 1, sizeof *e.cmds);
+    int rc = e.targets && e.cmds ? 0 : -1;
+    for (int q = 0; rc == 0 && q < cfg->nexport; q++) {
+        size_t n = strlen(cfg->exports[q].cmd);
+        if (!(e.cmds[q] = (char*)malloc(n + 2))) { rc = -1; break; }
+        memcpy(e.cmds[q], cfg->exports[q].cmd, n);
+        memcpy(e.cmds[q] + n, "\n", 2);
+    }
+    for (size_t i = 0; e.targets && i < e.ntargets; i++) {
+        e.targets[i].t.conn.fd = -1;
+        e.targets[i].series = (exp_series_t*)calloc((size_t)cfg->nexport + 1, sizeof(exp_series_t));
+        if (!e.targets[i].series) rc = -1;
+    }
+    if (rc != 0) perror("malloc");
+    int lfd = rc == 0 ? exp_listen(listen_on) : -1;
+    if (lfd < 0) rc = -1;
+    if (rc == 0) {
+        fprintf(stderr, "[exporter] %zu target%s, %d quer%s every %ld ms; listening on %s\n",
+                e.ntargets, e.ntargets == 1 ? "" : "s", cfg->nexport, cfg->nexport == 1 ? "y" : "ies",
+                interval_ms, listen_on);
+        signal(SIGTERM, exp_on_signal);
+        signal(SIGINT, exp_on_signal);
+    }
+
+    size_t npfd = 1 + EXP_MAX_CLIENTS + e.ntargets;
+    struct pollfd *pfd = (struct pollfd*)calloc(npfd, sizeof *pfd);
+    int *idx = (int*)calloc(npfd, sizeof *idx);
+    if (rc == 0 && (!pfd || !idx)) { perror("malloc"); rc = -1; }
+    uint64_t start = mono_ns();
+    for (size_t i = 0; i < e.ntargets; i++) e.targets[i].next_round = start;
+
+    while (rc == 0 && !g_exp_stop) {
+        uint64_t now = mono_ns();
+        int timeout = -1;
+#define EXP_DUE(t) do { uint64_t d_ = (t); int ms_ = d_ > now ? (int)((d_ - now) / 1000000ull) + 1 : 0; \
+                        if (timeout < 0 || ms_ < timeout) timeout = ms_; } while (0)
+        /* start rounds that are due */
+        for (size_t i = 0; i < e.ntargets; i++) {
+            exp_target_t *x = &e.targets[i];
+            if (!x->in_round && now >= x->next_round && cfg->nexport) {
+                while (x->next_round <= now) x->next_round += e.interval_ns;   /* skip missed rounds */
+                x->in_round = 1;
+                x->q = 0;
+                exp_next(&e, x, cfg->connect_timeout_ms);
+            }
+        }
+        nfds_t n = 0, nclient_end;
+        pfd[n].fd = lfd; pfd[n].events = POLLIN; pfd[n].revents = 0; idx[n++] = -1;
+        for (int i = 0; i < EXP_MAX_CLIENTS; i++) {
+            exp_client_t *cl = e.clients[i];
+            if (!cl) continue;
+            pfd[n].fd = cl->fd;
+            pfd[n].events = (short)(buf_pending(&cl->tx) ? POLLOUT : POLLIN);
+            pfd[n].revents = 0;
+            idx[n++] = i;
+            EXP_DUE(cl->t0 + EXP_CLIENT_TIMEOUT);
+        }
+        nclient_end = n;
+        for (size_t i = 0; i < e.ntargets; i++) {
+            exp_target_t *x = &e.targets[i];
+            fan_target_t *t = &x->t;
+            if (!x->in_round) { if (cfg->nexport) EXP_DUE(x->next_round); continue; }
+            if (x->rj) { EXP_DUE(now + EXP_RESOLVE_POLL_NS); continue; }
+            if (t->st == FAN_CONNECTING) { if (t->deadline) EXP_DUE(t->deadline); }
+            else {
+                EXP_DUE(x->q_t0 + e.interval_ns);
+                if (t->st == FAN_READING && t->r.st == RESP_LEGACY)
+                    EXP_DUE(t->last_rx + (uint64_t)LEGACY_IDLE_MS * 1000000ull);
+            }
+            pfd[n].fd = t->conn.fd;
+            pfd[n].events = (short)(t->st == FAN_READING ? POLLIN : POLLOUT);
+            pfd[n].revents = 0;
+            idx[n++] = (int)i;
+        }
+#undef EXP_DUE
+        if (poll(pfd, n, timeout) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            rc = -1;
+            break;
+        }
+        now = mono_ns();
+
+        if (pfd[0].revents & POLLIN) {
+            int cfd;
+            while ((cfd = accept(lfd, NULL, NULL)) >= 0) {
+                int slot;
+                for (slot = 0; slot < EXP_MAX_CLIENTS && e.clients[slot]; slot++) {}
+                exp_client_t *cl = slot < EXP_MAX_CLIENTS ? (exp_client_t*)calloc(1, sizeof *cl) : NULL;
+                if (!cl) { CLOSESOCK(cfd); continue; }
+                sock_set_nonblock(cfd, 1);
+                cl->fd = cfd;
+                cl->t0 = now;
+                e.clients[slot] = cl;
+            }
+        }
+        for (nfds_t k = 1; k < nclient_end; k++) {
+            exp_client_t *cl = e.clients[idx[k]];
+            short re = pfd[k].revents;
+            if (buf_pending(&cl->tx)) {
+                if (re & (POLLOUT | POLLERR | POLLHUP)) {
+                    long w = sock_send_some(cl->fd, cl->tx.p + cl->tx.off, buf_pending(&cl->tx));
+                    if (w < 0) { exp_client_close(&e, idx[k]); continue; }
+                    if (w > 0) cl->tx.off += (size_t)w;
+                    if (!buf_pending(&cl->tx)) { exp_client_close(&e, idx[k]); continue; }
+                }
+            } else if (re & (POLLIN | POLLERR | POLLHUP)) {
+                ssize_t r = recv(cl->fd, cl->req + cl->req_len, sizeof cl->req - 1 - cl->req_len, 0);
+                if (r <= 0) {
+                    if (r < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+                    exp_client_close(&e, idx[k]);
+                    continue;
+                }
+                cl->req_len += (size_t)r;
+                cl->req[cl->req_len] = 0;
+                if (strstr(cl->req, "\r\n\r\n") || strstr(cl->req, "\n\n")) {
+                    exp_client_request(&e, cl);
+                    if (!buf_pending(&cl->tx)) { exp_client_close(&e, idx[k]); continue; }
+                } else if (cl->req_len == sizeof cl->req - 1) {
+                    exp_client_close(&e, idx[k]);   /* oversized request head */
+                    continue;
+                }
+            }
+            if (now - cl->t0 >= EXP_CLIENT_TIMEOUT) exp_client_close(&e, idx[k]);
+        }
+        for (nfds_t k = nclient_end; k < n; k++)
+            exp_on_target_event(&e, &e.targets[idx[k]], pfd[k].revents, now, cfg->connect_timeout_ms);
+        for (size_t i = 0; i < e.ntargets; i++)
+            if (e.targets[i].in_round && e.targets[i].rj)
+                exp_on_resolved(&e, &e.targets[i], now, cfg->connect_timeout_ms);
+    }
+
+    if (lfd >= 0) CLOSESOCK(lfd);
+    for (int i = 0; i < EXP_MAX_CLIENTS; i++) if (e.clients[i]) exp_client_close(&e, i);
+    for (size_t i = 0; e.targets && i < e.ntargets; i++) {
+        exp_close(&e.targets[i], 1);
+        free(e.targets[i].t.out);
+        for (int q = 0; e.targets[i].series && q < cfg->nexport; q++) free(e.targets[i].series[q].samples);
+        free(e.targets[i].series);
     }
+    for (int q = 0; e.cmds && q < cfg->nexport; q++) free(e.cmds[q]);
+    free(e.cmds); free(e.targets); free(pfd); free(idx);
+    if (g_exp_stop) fprintf(stderr, "[exporter] stopped\n");
+    return rc;
+}
+#else
+static int run_exporter(const cfg_t *cfg, fan_target_t *targets, size_t ntargets, int argc, char **argv) {
+    (void)cfg; free(targets); (void)ntargets; (void)argc; (void)argv;
+    fprintf(stderr, "exporter is not supported on Windows yet\n");
+    return -1;
+}
 #endif
 
-    char buf[8192];
+// ----- REPL -----
+/*
+ * On POSIX the REPL waits on stdin and the connection together, so events
+ * hostd pushes while the user is idle are shown straight away instead of
+ * surfacing in the middle of the next command's output. Events always go to
+ * stderr as "[event] ..." lines, apart from command output on stdout.
+ */
+static int g_repl_prompt = 0;   /* the prompt is on screen, waiting for input */
+
+static void repl_print_event(void *ctx, const char *text, size_t len) {
+    (void)ctx;
+    mem_cache_note_event(text, len);
+    while (len && (text[len-1] == '\n' || text[len-1] == '\r')) len--;
+    fflush(stdout);
+    if (g_repl_prompt) {
 #ifdef _WIN32
-    int n = recv(fd, buf, (int)sizeof(buf)-1, 0);
-    if (n < 0) { fprintf(stderr, "recv failed, WSAErr=%d\n", SOCKERR()); return -1; }
+        int tty = _isatty(_fileno(stderr));
 #else
-    ssize_t n = read(fd, buf, sizeof(buf)-1);
-    if (n < 0) { perror("read"); return -1; }
+        int tty = isatty(fileno(stderr));
 #endif
-    if (n == 0) { fprintf(stderr, "server closed connection\n"); return -2; }
-    buf[n] = 0;
-    fputs(buf, stdout);
-    return 0;
+        fprintf(stderr, "%s[event] %.*s\nvim-cmd> ", tty ? "\r\033[K" : "\n", (int)len, text);
+    } else {
+        fprintf(stderr, "[event] %.*s\n", (int)len, text);
+    }
+}
+
+#ifndef _WIN32
+/* Ctrl-C cancels the command in flight (or clears the prompt) instead of
+ * ending the session. No SA_RESTART, so blocked waits return EINTR and
+ * notice g_cancel; a cancelled reply is drained for up to REPL_DRAIN_MS. */
+#define REPL_DRAIN_MS 1000
+
+static void repl_on_sigint(int sig) { (void)sig; g_cancel = 1; }
+
+static void repl_install_sigint(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = repl_on_sigint;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    g_sigint_cancels = 1;
+    g_drain_ms = REPL_DRAIN_MS;
+}
+
+typedef struct {
+    char   *buf;
+    size_t  start, len, cap;   /* unread input is buf[start .. len) */
+    int     eof;
+} repl_in_t;
+
+/* Next input line, without its newline; NULL at end of input. Events that
+ * arrive meanwhile are printed, and a connection hostd drops is closed. */
+static char *repl_read_line(repl_in_t *in, conn_t *c) {
+    for (;;) {
+        char *p = in->buf + in->start;
+        char *nl = in->len > in->start ? (char*)memchr(p, '\n', in->len - in->start) : NULL;
+        if (nl || (in->eof && in->len > in->start)) {
+            if (nl) { *nl = 0; in->start = (size_t)(nl + 1 - in->buf); }
+            else    { in->buf[in->len] = 0; in->start = in->len; }
+            return p;
+        }
+        if (in->eof) return NULL;
+        if (in->start) {
+            memmove(in->buf, p, in->len - in->start);
+            in->len -= in->start;
+            in->start = 0;
+        }
+        if (in->len + 1 >= in->cap) {
+            size_t ncap = in->cap ? in->cap * 2 : 4096;
+            char *nb = (char*)realloc(in->buf, ncap);
+            if (!nb) { perror("malloc"); return NULL; }
+            in->buf = nb; in->cap = ncap;
+        }
+
+        struct pollfd pfd[2];
+        pfd[0].fd = STDIN_FILENO; pfd[0].events = POLLIN; pfd[0].revents = 0;
+        pfd[1].fd = c->fd;        pfd[1].events = POLLIN; pfd[1].revents = 0;
+        g_repl_prompt = 1;
+        int n = poll(pfd, c->fd >= 0 ? 2 : 1, -1);
+        if (n > 0 && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) && c->fd >= 0 &&
+            conn_take_events(c) != 0) {
+            conn_close(c);
+            fprintf(stderr, "\r[info] server closed connection; you may /connect again\nvim-cmd> ");
+        }
+        g_repl_prompt = 0;
+        if (n < 0) {
+            if (errno == EINTR && g_cancel) {   /* Ctrl-C at the prompt: fresh prompt */
+                g_cancel = 0;
+                fprintf(stderr, "\nvim-cmd> ");
+            }
+            if (errno == EINTR) continue;
+            perror("poll");
+            return NULL;
+        }
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t r = read(STDIN_FILENO, in->buf + in->len, in->cap - in->len - 1);
+            if (r < 0 && errno == EINTR) { g_cancel = 0; continue; }
+            if (r <= 0) in->eof = 1;
+            else in->len += (size_t)r;
+        }
+    }
 }
+#endif
 
 // ----- CLI -----
 static void usage(const char *prog) {
@@ -387,35 +8214,70 @@ static void usage(const char *prog) {
     fprintf(stderr,
         "Usage:\n"
         "  %s [-c cfgfile] [-T host:port] [COMMAND [ARGS...]]\n"
+        "  %s [-c cfgfile] [-T host:port] -f script [-w N]\n"
         "  %s [-c cfgfile] [-T host:port] set key=value [key=value ...]\n"
+        "  %s trace-cat <file> [-g text] [--stats]\n"
+        "  %s [-c cfgfile] -t selector COMMAND [ARGS...]\n"
+        "  %s [-c cfgfile] inventory [selector]\n"
+        "  %s [-T @hostsfile | -t selector] exporter --listen [host]:port [--interval 15s]\n"
+        "  %s [-c cfgfile] [-T host:port] replay <session.log> [--speed=Nx|max] [--conns=N]\n"
         "  %s [-V|--version]\n"
         "\n"
         "Options:\n"
         "  -c cfgfile      use explicit config file\n"
         "  -T host:port    connect via TCP\n"
+        "  -T @hostsfile   send COMMAND to every target in hostsfile\n"
+        "  -t selector     send COMMAND to the inventory targets it picks (arch=z80,rack=3|4)\n"
+        "  -f file         run commands from file (- for stdin), pipelined\n"
+        "  -w N            batch window: requests in flight (default %d)\n"
+        "  --no-cache      ignore the response cache (cache.<command>=<ttl> in config)\n"
+        "  --io=ENGINE     socket I/O engine: poll (default) or uring (Linux, make URING=1)\n"
+        "  --trace=FILE    write Chrome trace-event JSON of connect/request phases\n"
+        "  --record=FILE   append every command and its latency to a session log\n"
+        "  --deadline=DUR  bound each request, connect included (500ms, 2s); exit 4 if hit\n"
+        "  --stats-on-exit print per-verb latency stats to stderr when done\n"
         "  -v, --verbose   verbose cfg output after /connect\n"
         "  -V, --version   show version and exit\n"
         "  -h, --help      show this help\n"
         "\n"
         "Config: %%APPDATA%%\\vim-cmd\\config\n",
-        prog, prog, prog);
+        prog, prog, prog, prog, prog, prog, prog, prog, prog, BATCH_DEFAULT_WINDOW);
 #else
     fprintf(stderr,
         "Usage:\n"
         "  %s [-c cfgfile] [-S socket] [-T host:port] [COMMAND [ARGS...]]\n"
+        "  %s [-c cfgfile] [-S socket] [-T host:port] -f script [-w N]\n"
         "  %s [-c cfgfile] [-S socket] [-T host:port] set key=value [key=value ...]\n"
+        "  %s trace-cat <file> [-g text] [--stats]\n"
+        "  %s [-c cfgfile] -t selector COMMAND [ARGS...]\n"
+        "  %s [-c cfgfile] inventory [selector]\n"
+        "  %s [-T @hostsfile | -t selector] exporter --listen [host]:port [--interval 15s]\n"
+        "  %s [-c cfgfile] [-T host:port] replay <session.log> [--speed=Nx|max] [--conns=N]\n"
         "  %s [-V|--version]\n"
         "\n"
         "Options:\n"
         "  -c cfgfile      use explicit config file\n"
         "  -S socket       use unix domain socket\n"
         "  -T host:port    connect via TCP\n"
+        "  -T @hostsfile   send COMMAND to every target in hostsfile\n"
+        "  -t selector     send COMMAND to the inventory targets it picks (arch=z80,rack=3|4)\n"
+        "  -f file         run commands from file (- for stdin), pipelined\n"
+        "  -w N            batch window: requests in flight (default %d)\n"
+        "  --agent         start the connection agent (--foreground to stay attached)\n"
+        "  --agent-stop    stop a running agent\n"
+        "  --no-agent      connect directly even if an agent is running\n"
+        "  --no-cache      ignore the response cache (cache.<command>=<ttl> in config)\n"
+        "  --io=ENGINE     socket I/O engine: poll (default) or uring (Linux, make URING=1)\n"
+        "  --trace=FILE    write Chrome trace-event JSON of connect/request phases\n"
+        "  --record=FILE   append every command and its latency to a session log\n"
+        "  --deadline=DUR  bound each request, connect included (500ms, 2s); exit 4 if hit\n"
+        "  --stats-on-exit print per-verb latency stats to stderr when done\n"
         "  -v, --verbose   verbose cfg output after /connect\n"
         "  -V, --version   show version and exit\n"
         "  -h, --help      show this help\n"
         "\n"
         "Config: $XDG_CONFIG_HOME/vim-cmd/config or ~/.config/vim-cmd/config\n",
-        prog, prog, prog);
+        prog, prog, prog, prog, prog, prog, prog, prog, prog, BATCH_DEFAULT_WINDOW);
 #endif
 }
 
@@ -449,6 +8311,48 @@ static int apply_kv(cfg_t *cfg, const char *k, const char *v) {
             return -1;
         }
         cfg->port = (int)p;
+    } else if (!strcasecmp(k,"connect_timeout")) {
+        long ms = parse_duration_ms(v);
+        if (ms < 0 || ms > INT_MAX) {
+            fprintf(stderr, "invalid connect_timeout '%s' (e.g. 1500ms, 2s)\n", v);
+            return -1;
+        }
+        cfg->connect_timeout_ms = (int)ms;
+    } else if (!strcasecmp(k,"timeout")) {
+        long ms = parse_duration_ms(v);
+        if (ms < 0 || ms > INT_MAX) {
+            fprintf(stderr, "invalid timeout '%s' (e.g. 500ms, 2s; 0 = none)\n", v);
+            return -1;
+        }
+        cfg->timeout_ms = (int)ms;
+        g_timeout_ms = cfg->timeout_ms;     /* a REPL /set applies to the next command */
+    } else if (!strcasecmp(k,"inventory")) {
+        if (snprintf(cfg->inventory, sizeof(cfg->inventory), "%s", v) >= (int)sizeof(cfg->inventory)) {
+            fprintf(stderr, "inventory path too long (limit %zu)\n", sizeof(cfg->inventory)-1);
+            return -1;
+        }
+    } else if (!strcasecmp(k,"proto")) {
+        if (parse_proto(v, &cfg->proto) != 0) {
+            fprintf(stderr, "invalid proto '%s' (auto, text or binary)\n", v);
+            return -1;
+        }
+    } else if (!strcasecmp(k,"shm")) {
+        long long n = !strcasecmp(v, "off") ? 0 : (!strcasecmp(v, "on") ? SHM_DEFAULT_SIZE : parse_size(v));
+        if (n < 0 || n > SHM_MAX_SIZE) {
+            fprintf(stderr, "invalid shm '%s' (on, off or a size such as 16M)\n", v);
+            return -1;
+        }
+        cfg->shm_bytes = (size_t)n;
+    } else if (!strncasecmp(k,"cache.",6)) {
+        if (cfg_set_cache_rule(cfg, k+6, v) != 0) {
+            fprintf(stderr, "invalid cache rule '%s=%s' (a TTL such as 5s, 0 removes it)\n", k, v);
+            return -1;
+        }
+    } else if (!strncasecmp(k,"export.",7)) {
+        if (cfg_set_export_rule(cfg, k+7, v) != 0) {
+            fprintf(stderr, "invalid export rule '%s=%s' (name: letters, digits, _)\n", k, v);
+            return -1;
+        }
     } else if (!strcasecmp(k,"socket")) {
         /* Don't allow socket= via /set; require editing config or using -S */
         fprintf(stderr, "socket is not configurable via /set; use -S or edit the config file manually.\n");
@@ -465,10 +8369,28 @@ int main(int argc, char **argv) {
     if (WSAStartup(MAKEWORD(2,2), &w) != 0) { fprintf(stderr, "WSAStartup failed\n"); return 1; }
 #endif
 
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);   /* responses are binary-safe */
+#else
+    signal(SIGPIPE, SIG_IGN);               /* a dead peer is reported by send() */
+#endif
+    /* Large replies go out in big writes; interactive use stays responsive
+     * because every reply ends with an explicit fflush. */
+    static char stdout_buf[RX_BUF_SIZE];
+    setvbuf(stdout, stdout_buf, _IOFBF, sizeof stdout_buf);
+
     cfg_t cfg; cfg_init_defaults(&cfg);
 
     const char *cli_cfg = NULL;
     const char *cli_tcp = NULL;
+    const char *cli_select = NULL;
+    const char *cli_batch = NULL;
+    int batch_window = BATCH_DEFAULT_WINDOW;
+    int use_cache = 1;
+    long cli_deadline = -1;
+#ifndef _WIN32
+    int agent_mode = 0, agent_fg = 0, use_agent = 1;
+#endif
 #ifndef _WIN32
     const char *cli_sock = NULL;
 #endif
@@ -504,7 +8426,26 @@ int main(int argc, char **argv) {
             argi += 2;
             continue;
         }
+
+        if (!strcmp(arg, "--agent")) { agent_mode = 1; argi++; continue; }
+        if (!strcmp(arg, "--foreground")) { agent_fg = 1; argi++; continue; }
+        if (!strcmp(arg, "--no-agent")) { use_agent = 0; argi++; continue; }
+        if (!strcmp(arg, "--agent-stop")) { return agent_stop() == 0 ? 0 : 1; }
+#endif
+
+        if (!strcmp(arg, "--no-cache")) { use_cache = 0; argi++; continue; }
+
+        if (!strncmp(arg, "--io=", 5) || (!strcmp(arg, "--io") && argi+1 < argc)) {
+            const char *v = arg[4] == '=' ? arg + 5 : argv[++argi];
+            if (io_select(v) != 0) {
+#ifdef _WIN32
+                WSACleanup();
 #endif
+                return 1;
+            }
+            argi++;
+            continue;
+        }
 
         if (!strcmp(arg, "-T") && argi+1 < argc) {
             cli_tcp = argv[argi+1];
@@ -512,6 +8453,75 @@ int main(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(arg, "-t") && argi+1 < argc) {
+            cli_select = argv[argi+1];
+            argi += 2;
+            continue;
+        }
+
+        if (!strncmp(arg, "--trace=", 8) || (!strcmp(arg, "--trace") && argi+1 < argc)) {
+            const char *path = arg[7] == '=' ? arg + 8 : argv[++argi];
+            if (trace_open(path) != 0) {
+#ifdef _WIN32
+                WSACleanup();
+#endif
+                return 1;
+            }
+            argi++;
+            continue;
+        }
+
+        if (!strncmp(arg, "--record=", 9) || (!strcmp(arg, "--record") && argi+1 < argc)) {
+            const char *path = arg[8] == '=' ? arg + 9 : argv[++argi];
+            if (rec_open(path) != 0) {
+#ifdef _WIN32
+                WSACleanup();
+#endif
+                return 1;
+            }
+            argi++;
+            continue;
+        }
+
+        if (!strncmp(arg, "--deadline=", 11) || (!strcmp(arg, "--deadline") && argi+1 < argc)) {
+            const char *v = arg[10] == '=' ? arg + 11 : argv[++argi];
+            cli_deadline = parse_duration_ms(v);
+            if (cli_deadline < 0 || cli_deadline > INT_MAX) {
+                fprintf(stderr, "invalid --deadline '%s' (e.g. 500ms, 2s; 0 = none)\n", v);
+#ifdef _WIN32
+                WSACleanup();
+#endif
+                return 1;
+            }
+            argi++;
+            continue;
+        }
+
+        if (!strcmp(arg, "--stats-on-exit")) {
+            atexit(stats_at_exit);
+            argi++;
+            continue;
+        }
+
+        if (!strcmp(arg, "-f") && argi+1 < argc) {
+            cli_batch = argv[argi+1];
+            argi += 2;
+            continue;
+        }
+
+        if (!strcmp(arg, "-w") && argi+1 < argc) {
+            batch_window = atoi(argv[argi+1]);
+            if (batch_window < 1 || batch_window > BATCH_MAX_WINDOW) {
+                fprintf(stderr, "-w expects 1..%d\n", BATCH_MAX_WINDOW);
+#ifdef _WIN32
+                WSACleanup();
+#endif
+                return 1;
+            }
+            argi += 2;
+            continue;
+        }
+
         if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) {
             usage(argv[0]);
 #ifdef _WIN32
@@ -531,6 +8541,7 @@ int main(int argc, char **argv) {
     } else {
         cfg_load_file(&cfg, cfg.cfg_path);
     }
+    g_timeout_ms = cli_deadline >= 0 ? (int)cli_deadline : cfg.timeout_ms;
 #ifndef _WIN32
     if (cli_sock) {
         cfg.mode = VC_MODE_UNIX;
@@ -539,7 +8550,16 @@ int main(int argc, char **argv) {
         }
     }
 #endif
-    if (cli_tcp) {
+    if (cli_select && cli_tcp) {
+        fprintf(stderr, "-t and -T cannot be combined\n");
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return 1;
+    }
+    if (cli_tcp && cli_tcp[0] == '@') {
+        /* fan-out: targets come from the hosts file, not from cfg */
+    } else if (cli_tcp) {
         const char *colon = strchr(cli_tcp, ':');
         if (!colon) { fprintf(stderr, "-T expects host:port\n");
 #ifdef _WIN32
@@ -568,6 +8588,24 @@ int main(int argc, char **argv) {
         return 0;
     }
 
+    /* ---- "trace-cat": decode a capture offline, no hostd ---- */
+    if (argi < argc && !strcmp(argv[argi], "trace-cat")) {
+        int rc = run_trace_cat(argc - argi, argv + argi);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return (rc==0)?0:3;
+    }
+
+    /* ---- "inventory": list the targets a selector picks, no hostd ---- */
+    if (argi < argc && !strcmp(argv[argi], "inventory")) {
+        int rc = run_inventory(&cfg, argi + 1 < argc ? argv[argi+1] : cli_select);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return (rc==0)?0:1;
+    }
+
     /* ---- One-shot "set" subcommand: write config and exit ---- */
     if (argi < argc && !strcasecmp(argv[argi], "set")) {
         if (!cfg.cfg_path[0]) { default_cfg_path(cfg.cfg_path, sizeof cfg.cfg_path); }
@@ -586,34 +8624,146 @@ int main(int argc, char **argv) {
         return 0;
     }
 
-    /* ---- One-shot command if remaining args exist (not "set"/"version") ---- */
-    if (argi < argc) {
+#ifndef _WIN32
+    /* ---- Agent: keep warm hostd connections for one-shot calls ---- */
+    if (agent_mode) return run_agent(&cfg, agent_fg) == 0 ? 0 : 1;
+#endif
+
+    /* ---- Exporter: poll hostd on a schedule, serve Prometheus metrics ---- */
+    if (argi < argc && !strcmp(argv[argi], "exporter")) {
+        fan_target_t *targets = NULL;
+        size_t ntargets = 0;
+        if (cli_select || (cli_tcp && cli_tcp[0] == '@')) {
+            targets = load_targets(&cfg, cli_tcp ? cli_tcp + 1 : NULL, cli_select, &ntargets);
+            if (!targets) {
+#ifdef _WIN32
+                WSACleanup();
+#endif
+                return 1;
+            }
+        }
+        int rc = run_exporter(&cfg, targets, ntargets, argc - argi, argv + argi);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return (rc==0)?0:1;
+    }
+
+    /* ---- Replay: re-drive a --record session log ---- */
+    if (argi < argc && !strcmp(argv[argi], "replay")) {
+        int rc = run_replay(&cfg, argc - argi, argv + argi);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return (rc==0)?0:3;
+    }
+
+    /* ---- Fan-out: -T @hostsfile COMMAND, or -t selector COMMAND ---- */
+    if ((cli_tcp && cli_tcp[0] == '@') || cli_select) {
+        if (argi >= argc || cli_batch) {
+            fprintf(stderr, "%s needs a COMMAND\n", cli_select ? "-t selector" : "-T @hostsfile");
+#ifdef _WIN32
+            WSACleanup();
+#endif
+            return 1;
+        }
         size_t total=0; for (int i=argi;i<argc;i++) total += strlen(argv[i])+1;
-        char *line = (char*)malloc(total+2); if (!line) { perror("malloc");
+        char *line = (char*)malloc(total+1); if (!line) { perror("malloc");
 #ifdef _WIN32
             WSACleanup();
 #endif
             return 1;
         }
         line[0]=0; for (int i=argi;i<argc;i++){ strcat(line, argv[i]); if (i+1<argc) strcat(line," "); }
-        int fd = connect_from_cfg(&cfg);
-        if (fd < 0) { free(line);
+        size_t ntargets = 0;
+        fan_target_t *targets = load_targets(&cfg, cli_select ? NULL : cli_tcp + 1, cli_select, &ntargets);
+        int rc = targets ? run_fanout(targets, ntargets, line, cfg.connect_timeout_ms, g_timeout_ms) : -1;
+        free(line);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return (rc==0)?0:3;
+    }
+
+    /* ---- Batch: -f script (or - for stdin), pipelined on one connection ---- */
+    if (cli_batch) {
+        FILE *in = strcmp(cli_batch, "-") ? fopen(cli_batch, "r") : stdin;
+        if (!in) { perror(cli_batch);
 #ifdef _WIN32
             WSACleanup();
 #endif
-            return 2;
+            return 1;
         }
-        int rc = send_command_fd(fd, line);
-        CLOSESOCK(fd);
-        free(line);
+        conn_t conn;
+        deadline_arm();                 /* batch: the deadline bounds the connect */
+        int crc = conn_connect_cfg(&conn, &cfg);
+        deadline_disarm();
+        if (crc != 0) {
+            if (in != stdin) fclose(in);
+#ifdef _WIN32
+            WSACleanup();
+#endif
+            return g_expired ? 4 : 2;
+        }
+        int rc = run_batch(&conn, in, batch_window);
+        conn_close(&conn);
+        if (in != stdin) fclose(in);
 #ifdef _WIN32
         WSACleanup();
 #endif
         return (rc==0)?0:3;
     }
 
+    /* ---- One-shot command if remaining args exist (not "set"/"version") ---- */
+    if (argi < argc) {
+        char *line = join_args(argc - argi, argv + argi, 0);
+        if (line && is_client_command(line)) {   /* keep paths with blanks in one word */
+            free(line);
+            line = join_args(argc - argi, argv + argi, 1);
+        }
+        if (!line) { perror("malloc");
+#ifdef _WIN32
+            WSACleanup();
+#endif
+            return 1;
+        }
+        if (is_client_command(line)) use_cache = 0;
+        if (use_cache && cache_try_print(&cfg, line)) {   /* fresh: no connection at all */
+            free(line);
+#ifdef _WIN32
+            WSACleanup();
+#endif
+            return 0;
+        }
+        int fd = -1;
+#ifndef _WIN32
+        if (use_agent && !is_client_command(line)) fd = agent_connect(&cfg);
+#endif
+        /* the deadline covers resolve and connect here, and the rest of the
+         * request for hostd commands; client commands run at their own pace */
+        conn_t conn;
+        deadline_arm();
+        int crc = fd >= 0 ? conn_open(&conn, fd) : conn_connect_cfg(&conn, &cfg);
+        if (crc != 0) { free(line);
+#ifdef _WIN32
+            WSACleanup();
+#endif
+            return g_expired ? 4 : 2;
+        }
+        if (is_client_command(line)) deadline_disarm();
+        int rc = use_cache ? cache_run(&conn, &cfg, line) : run_command(&conn, line);
+        conn_close(&conn);
+        free(line);
+#ifdef _WIN32
+        WSACleanup();
+#endif
+        return rc == 0 ? 0 : (g_expired ? 4 : 3);
+    }
+
     /* ---- Interactive REPL ---- */
-    int fd = -1;  /* no automatic connection */
+    conn_t conn = { .fd = -1 };  /* no automatic connection */
+    g_rec.each = 1;
+    char subs[256] = "";         /* event classes to (re)subscribe on connect */
 
 #if defined(_WIN32)
     char ibuf[4096];
@@ -622,11 +8772,12 @@ int main(int argc, char **argv) {
         if (!fgets(ibuf, sizeof ibuf, stdin)) { fprintf(stderr, "\n"); break; }
         char *cmd = trim(ibuf);
 #else
-    char *line = NULL; size_t cap=0;
+    repl_in_t rin = { 0 };
     for (;;) {
+        repl_install_sigint();          /* again: watch and trace-capture swap it out */
         fprintf(stderr, "vim-cmd> ");
-        ssize_t n = getline(&line, &cap, stdin);
-        if (n < 0) { fprintf(stderr, "\n"); break; }
+        char *line = repl_read_line(&rin, &conn);
+        if (!line) { fprintf(stderr, "\n"); break; }
         char *cmd = trim(line);
 #endif
         if (*cmd==0) continue;
@@ -648,8 +8799,19 @@ int main(int argc, char **argv) {
                 "  /help                            show this help\n"
                 "  /show                            show current config\n"
                 "  /set key=value [...]             write config\n"
-                "      keys: mode=tcp, host=<host>, port=<port>\n"
+                "      keys: mode=tcp, host=<host>, port=<port>,\n"
+                "            connect_timeout=<ms|s>, timeout=<ms|s>, proto=auto|text|binary\n"
                 "  /connect tcp <host> <port>\n"
+                "  upload [--resume] <file> <vm>:<target>   stream a file to hostd\n"
+                "  download <vm>:<region> <file>    stream data from hostd to a file\n"
+                "  console <vm>                     attach to a guest console (Ctrl-] detaches)\n"
+                "  wait <vm> <cond> [--timeout d]   block until e.g. state=halted\n"
+                "  watch [-n secs] [-c n] <command> repeat a command, redrawing changes\n"
+                "  /mem <vm> <addr> [len]           browse guest memory (hex/ASCII)\n"
+                "  /subscribe [classes] | /unsubscribe   receive hostd events (e.g. vm break fault)\n"
+                "  /cache [stats|clear]             response cache for one-shot queries\n"
+                "  /stats [reset]                   per-verb latency histograms\n"
+                "  /trace on [file] | /trace off     Chrome trace of request phases\n"
                 "  /quit | /exit\n"
                 "\n"
                 "Examples:\n"
@@ -662,9 +8824,23 @@ int main(int argc, char **argv) {
                 "  /help                            show this help\n"
                 "  /show                            show current config\n"
                 "  /set key=value [...]             write config\n"
-                "      keys: mode=tcp|unix, host=<host>, port=<port>\n"
+                "      keys: mode=tcp|unix, host=<host>, port=<port>,\n"
+                "            connect_timeout=<ms|s>, timeout=<ms|s>, proto=auto|text|binary\n"
+                "            shm=on|off|<size> (unix mode)\n"
                 "  /connect tcp <host> <port>\n"
                 "  /connect unix <socket>\n"
+                "  upload [--resume] <file> <vm>:<target>   stream a file to hostd\n"
+                "  download <vm>:<region> <file>    stream data from hostd to a file\n"
+                "  console <vm>                     attach to a guest console (Ctrl-] detaches)\n"
+                "  wait <vm> <cond> [--timeout d]   block until e.g. state=halted\n"
+                "  watch [-n secs] [-c n] <command> repeat a command, redrawing changes\n"
+                "  trace-capture <vm> -o <file>     record an instruction trace (Ctrl-C stops)\n"
+                "  snapshot-sync <vm> <file>        update a local snapshot copy, changed blocks only\n"
+                "  /mem <vm> <addr> [len]           browse guest memory (hex/ASCII)\n"
+                "  /subscribe [classes] | /unsubscribe   receive hostd events (e.g. vm break fault)\n"
+                "  /cache [stats|clear]             response cache for one-shot queries\n"
+                "  /stats [reset]                   per-verb latency histograms\n"
+                "  /trace on [file] | /trace off     Chrome trace of request phases\n"
                 "  /quit | /exit\n"
                 "\n"
                 "Examples:\n"
@@ -678,6 +8854,33 @@ int main(int argc, char **argv) {
 
         if (!strcasecmp(cmd,"/show")) { cfg_show(&cfg); continue; }
 
+        if (!strncasecmp(cmd,"/stats",6) && (!cmd[6] || isspace((unsigned char)cmd[6]))) {
+            const char *arg = trim(cmd+6);
+            if (!strcasecmp(arg,"reset")) { stats_reset(); fprintf(stderr, "[stats] reset\n"); }
+            else if (!*arg) stats_print(stderr);
+            else fprintf(stderr, "usage: /stats [reset]\n");
+            continue;
+        }
+
+        if (!strncasecmp(cmd,"/cache",6) && (!cmd[6] || isspace((unsigned char)cmd[6]))) {
+            cache_command(&cfg, trim(cmd+6));
+            continue;
+        }
+
+        if (!strncasecmp(cmd,"/trace",6) && (!cmd[6] || isspace((unsigned char)cmd[6]))) {
+            char onoff[8]={0}, path[512]={0};
+            int n = sscanf(cmd+6, "%7s %511s", onoff, path);
+            if (n >= 1 && !strcasecmp(onoff,"on")) {
+                trace_open(n >= 2 ? path : "vim-cmd-trace.json");
+            } else if (n >= 1 && !strcasecmp(onoff,"off")) {
+                trace_close();
+            } else {
+                fprintf(stderr, "tracing is %s; usage: /trace on [file] | /trace off\n",
+                        TRACE_ON() ? "on" : "off");
+            }
+            continue;
+        }
+
         if (!strncasecmp(cmd,"/set",4)) {
             // parse /set key=value [key=value ...]
             char *p = cmd+4;
@@ -732,12 +8935,20 @@ int main(int argc, char **argv) {
                     continue;
                 }
 
-                if (fd >= 0) { CLOSESOCK(fd); fd = -1; }
-                fd = connect_from_cfg(&cfg);
-                if (fd < 0) {
+                if (conn.fd >= 0) conn_close(&conn);
+                deadline_arm();
+                int crc = conn_connect_cfg(&conn, &cfg);
+                deadline_disarm();
+                if (crc != 0) {
                     fprintf(stderr, "unable to connect; check config or /set\n");
-                } else if (g_verbose) {
-                    cfg_show(&cfg);
+                } else {
+                    conn.on_event = repl_print_event;
+                    if (g_verbose) cfg_show(&cfg);
+                    if (subs[0]) {
+                        char sub[300];
+                        snprintf(sub, sizeof sub, "subscribe %s", subs);
+                        if (send_command_fd(&conn, sub) == -2) conn_close(&conn);
+                    }
                 }
             } else {
 #ifdef _WIN32
@@ -749,22 +8960,51 @@ int main(int argc, char **argv) {
             continue;
         }
 
-        if (fd < 0) {
+        if (conn.fd < 0) {
             fprintf(stderr, "not connected; try /connect or /set\n");
             continue;
         }
 
-        int rc = send_command_fd(fd, cmd);
+        if (!strncasecmp(cmd,"/mem",4) && (!cmd[4] || isspace((unsigned char)cmd[4]))) {
+            client_begin();
+            int rc = client_end(&conn, run_mem(&conn, cmd+4));
+            if (rc == IO_TIMEOUT && conn.fd < 0) {
+                fprintf(stderr, "[info] you may /connect again\n");
+            } else if (rc == -2) {
+                conn_close(&conn);
+                fprintf(stderr, "[info] server closed connection; you may /connect again\n");
+            }
+            continue;
+        }
+
+        char sub[300];
+        if (!strncasecmp(cmd,"/subscribe",10) && (!cmd[10] || isspace((unsigned char)cmd[10]))) {
+            const char *arg = trim(cmd+10);
+            if (!*arg) {
+                fprintf(stderr, "subscribed to: %s\n", subs[0] ? subs : "(nothing)");
+                continue;
+            }
+            snprintf(subs, sizeof subs, "%s", arg);
+            snprintf(sub, sizeof sub, "subscribe %s", subs);
+            cmd = sub;
+        } else if (!strcasecmp(cmd,"/unsubscribe")) {
+            subs[0] = 0;
+            snprintf(sub, sizeof sub, "unsubscribe");
+            cmd = sub;
+        }
+
+        int rc = run_command(&conn, cmd);
         if (rc == -2) {
-            CLOSESOCK(fd);
-            fd = -1;
+            conn_close(&conn);
             fprintf(stderr, "[info] server closed connection; you may /connect again\n");
+        } else if (rc == IO_TIMEOUT && conn.fd < 0) {
+            fprintf(stderr, "[info] you may /connect again\n");
         }
     }
 
-    if (fd >= 0) CLOSESOCK(fd);
+    if (conn.fd >= 0) conn_close(&conn);
 #ifndef _WIN32
-    free(line);
+    free(rin.buf);
 #endif
 #ifdef _WIN32
     WSACleanup();